@@ -32,8 +32,14 @@ SOFTWARE.
 #define DATAQ_ADC_CHAN_PRESSURE  3
 
 #define MAX_ADC_DATA                1200
-#define MAX_NEUTRON_PULSE           256 
+#define MAX_NEUTRON_PULSE           256       // pulse heights kept in data part1
+#define MAX_NEUTRON_PULSE_PER_SEC   20000     // pulses kept in the data part2 neutron section
 #define MAX_NEUTRON_ADC_PULSE_DATA  20
+#define MAX_NEUTRON_SNIPPET         1000      // max pulses per sec with adc_pulse_data in data part2
+#define MAX_NEUTRON_SPECTRUM_BIN    1024      // pulse height spectrum bins, over 0 - 10000 mv
+#define MAX_NEUTRON_SPECTRUM_ENTRY  (MAX_NEUTRON_SPECTRUM_BIN + 16)
+#define MAX_AUX_CHAN                7         // mccdaq channels scanned in addition to the neutron channel
+#define MAX_JPEG_BUFF_LEN           1000000
 
 #define IS_ERROR(x) ((int32_t)(x) >= ERROR_FIRST && (int32_t)(x) <= ERROR_LAST)
 #define ERROR_FIRST                   1000000 
@@ -50,9 +56,21 @@ SOFTWARE.
 #define PORT 9001
 
 #define MAGIC_DATA_PART1  0xaabbccdd55aa55aa
-#define MAGIC_DATA_PART2  0x77777777aaaaaaaa
+#define MAGIC_DATA_PART2  0x77777777aaaaaaab
+#define MAGIC_DATA_PART2_V1  0x77777777aaaaaaaa   // fixed size neutron_adc_pulse_data, no neutron section
+
+// The MAGIC_DATA_PART2_V1 data part2, written by older versions of get_data and sent
+// to displays that use version 1 of the wire protocol, has the header up to 
+// neutron_section_len, followed by int16_t neutron_adc_pulse_data[MAX_NEUTRON_PULSE]
+// [MAX_NEUTRON_ADC_PULSE_DATA] for the pulses in data part1, followed by the jpeg buff.
+#define DATA_PART2_V1_HDR_LEN         offsetof(struct data_part2_s, neutron_section_len)
+#define DATA_PART2_V1_PULSE_DATA_LEN  (MAX_NEUTRON_PULSE * MAX_NEUTRON_ADC_PULSE_DATA * sizeof(int16_t))
+
+// data_part1_s and data_part2_s are each padded to 8 byte boundary; the size of
+// data_part1_s must not change, it is the stride of the data part1s in the display 
+// program's data file and the length of part1 in the version 1 wire protocol
+#define DATA_PART1_LENGTH 576
 
-// data_part1_s and data_part2_s are each padded to 8 byte boundary
 typedef struct {
     struct data_part1_s {
         uint64_t magic;
@@ -62,9 +80,11 @@ typedef struct {
         float    current_ma;
         float    d2_pressure_mtorr;
         float    n2_pressure_mtorr;
-        int16_t  neutron_pulse_mv[MAX_NEUTRON_PULSE];  // store pulse height for each pulse, in mv
-        int32_t  max_neutron_pulse;
-        int32_t  pad1;
+        int16_t  neutron_pulse_mv[MAX_NEUTRON_PULSE];  // pulse height of the first MAX_NEUTRON_PULSE pulses, in mv
+        int32_t  max_neutron_pulse;         // number of pulses, all are in the data part2 neutron section
+        uint16_t neutron_live_permyriad;    // mccdaq samples analyzed / (analyzed + lost), in 0.01%;
+                                            //  0 if not known, or no samples were analyzed
+        uint16_t neutron_mccdaq_restarts;
 
         off_t    data_part2_offset;      // for use by display pgm
         uint32_t data_part2_length;
@@ -72,17 +92,121 @@ typedef struct {
         bool     data_part2_voltage_adc_data_valid;
         bool     data_part2_current_adc_data_valid;
         bool     data_part2_pressure_adc_data_valid;
-        int8_t   pad2[5];
+        int8_t   pad2[1];
+        int32_t  neutron_pulse_overflow;    // pulses not recorded, beyond MAX_NEUTRON_PULSE_PER_SEC
     } part1;
     struct data_part2_s {
         uint64_t magic;
         int16_t  voltage_adc_data[MAX_ADC_DATA];    // mv, 1200/sec
         int16_t  current_adc_data[MAX_ADC_DATA];    // mv, 1200/sec
         int16_t  pressure_adc_data[MAX_ADC_DATA];   // mv, 1200/sec
-        int16_t  neutron_adc_pulse_data[MAX_NEUTRON_PULSE][MAX_NEUTRON_ADC_PULSE_DATA];  
-                                                    // mv, neutron pulses, 20 samples each
-        uint8_t  jpeg_buff[0];
+        uint32_t neutron_section_len;               // length of the neutron section, multiple of 8
+        uint16_t max_neutron_snippet;               // number of pulses with adc_pulse_data
+        uint16_t max_neutron_spectrum;              // number of spectrum entries
+        uint32_t aux_chan_section_len;              // length of the aux chan section, multiple of 8
+        uint32_t max_aux_chan;                      // number of aux chan entries
+        uint32_t pulse_time_len;                    // length of the pulse time section, multiple of 8
+        uint32_t neutron_sample_rate;               // neutron channel samples per second
+        float    neutron_baseline_mv;               // neutron channel baseline at the end of the second
+        float    neutron_noise_mv;                  // neutron channel baseline noise sigma, 0 if unknown
+        uint8_t  var[0];                            // neutron, aux chan, and pulse time sections, jpeg buff
     } part2;
 } data_t;
 
+// The data part2 aux chan section contains an aux_chan_t for each additional mccdaq
+// channel that is scanned, each followed by its spectrum entries; padded to a multiple
+// of 8 bytes.
+typedef struct {
+    int16_t  chan;               // mccdaq analog input
+    uint16_t max_spectrum;       // number of spectrum entries
+    int32_t  pulses;             // pulses detected during the second
+    int32_t  samples;            // samples analyzed during the second
+    uint16_t spectrum[0][2];     // {bin, count}, as in the neutron section
+} aux_chan_t;
+
+// The data part2 neutron section contains:
+// - int16_t  pulse_mv[max_neutron_pulse]                                      mv, every pulse
+// - uint16_t snippet_idx[max_neutron_snippet]                                 index into pulse_mv
+// - int16_t  adc_pulse_data[max_neutron_snippet][MAX_NEUTRON_ADC_PULSE_DATA]  mv, 20 samples each
+// - uint16_t spectrum[max_neutron_spectrum][2]                                {bin, count}
+// padded to a multiple of 8 bytes. The aux chan section follows the neutron section.
+//
+// The snippets (adc_pulse_data) are kept for a sample of the pulses, spread evenly
+// over the second. The spectrum is the pulse height histogram for the second, including
+// overflow pulses; only non zero bins are present, in ascending bin order, and a bin 
+// whose count exceeds 65535 is split over multiple entries.
+
+#define NEUTRON_SPECTRUM_MAX_MV  10000
+#define NEUTRON_SPECTRUM_MV_TO_BIN(mv) \
+    ((mv) <= 0 ? 0 : \
+     (mv) >= NEUTRON_SPECTRUM_MAX_MV ? MAX_NEUTRON_SPECTRUM_BIN-1 : \
+     (mv) * MAX_NEUTRON_SPECTRUM_BIN / NEUTRON_SPECTRUM_MAX_MV)
+#define NEUTRON_SPECTRUM_BIN_TO_MV(bin) \
+    ((bin) * NEUTRON_SPECTRUM_MAX_MV / MAX_NEUTRON_SPECTRUM_BIN)
+
+#define NEUTRON_SECTION_LEN(n,m,s) \
+    ((((n) + (m) * (1 + MAX_NEUTRON_ADC_PULSE_DATA) + (s) * 2) * sizeof(int16_t) + 7) & ~7)
+#define NEUTRON_SECTION_PULSE_MV(dp2) \
+    ((int16_t *)(dp2)->var)
+#define NEUTRON_SECTION_SNIPPET_IDX(dp2,n) \
+    ((uint16_t *)(dp2)->var + (n))
+#define NEUTRON_SECTION_ADC_PULSE_DATA(dp2,n) \
+    ((int16_t (*)[MAX_NEUTRON_ADC_PULSE_DATA]) \
+     ((int16_t *)(dp2)->var + (n) + (dp2)->max_neutron_snippet))
+#define NEUTRON_SECTION_SPECTRUM(dp2,n) \
+    ((uint16_t (*)[2]) \
+     ((uint16_t *)(dp2)->var + (n) + (dp2)->max_neutron_snippet * (1 + MAX_NEUTRON_ADC_PULSE_DATA)))
+#define AUX_CHAN_LEN(s) \
+    (sizeof(aux_chan_t) + (s) * 2 * sizeof(uint16_t))
+#define AUX_CHAN_FIRST(dp2) \
+    ((aux_chan_t *)((dp2)->var + (dp2)->neutron_section_len))
+#define AUX_CHAN_NEXT(ac) \
+    ((aux_chan_t *)((uint8_t *)(ac) + AUX_CHAN_LEN((ac)->max_spectrum)))
+
+// The data part2 pulse time section follows the aux chan section. It contains the
+// arrival time of each of the max_neutron_pulse pulses, as the number of neutron 
+// channel samples since the start of the second (1/neutron_sample_rate secs each). 
+// The times are delta encoded, each is the difference from the prior pulse's time 
+// (the first is the difference from 0), zigzag encoded, and stored as a varint of
+// 7 bits per byte, least significant first, with the high bit set on all but the last
+// byte. The section is padded to a multiple of 8 bytes, and has length 0 when the
+// pulse times are not available.
+
+#define MAX_PULSE_TIME_LEN  (MAX_NEUTRON_PULSE_PER_SEC * 5 + 8)
+#define PULSE_TIME_SECTION(dp2) \
+    ((dp2)->var + (dp2)->neutron_section_len + (dp2)->aux_chan_section_len)
+
+#define DATA_PART2_JPEG_BUFF(dp2) \
+    ((dp2)->var + (dp2)->neutron_section_len + (dp2)->aux_chan_section_len + (dp2)->pulse_time_len)
+#define DATA_PART2_LENGTH(dp2,jpeg_buff_len) \
+    (sizeof(struct data_part2_s) + (dp2)->neutron_section_len + (dp2)->aux_chan_section_len + \
+     (dp2)->pulse_time_len + (jpeg_buff_len))
+
+#define MAX_DATA_PART2_LENGTH \
+    (sizeof(struct data_part2_s) + \
+     NEUTRON_SECTION_LEN(MAX_NEUTRON_PULSE_PER_SEC, MAX_NEUTRON_SNIPPET, MAX_NEUTRON_SPECTRUM_ENTRY) + \
+     MAX_AUX_CHAN * AUX_CHAN_LEN(MAX_NEUTRON_SPECTRUM_ENTRY) + 8 + \
+     MAX_PULSE_TIME_LEN + \
+     MAX_JPEG_BUFF_LEN)
+
+// The display program's data file contains the file_hdr_t, followed by the data 
+// part1 of each second in time order, followed at FILE_DATA_PART2_OFFSET by the 
+// data part2s, each at its part1's data_part2_offset.
+
+#define MAGIC_FILE 0x1122334455667788
+
+#define MAX_FILE_DATA_PART1   (6*3600)  // 6 hours
+
+typedef struct {
+    uint64_t magic;
+    uint64_t start_time;  // XXX not used
+    uint32_t max;
+    uint8_t  reserved[4096-20];
+} file_hdr_t;
+
+#define FILE_DATA_PART2_OFFSET \
+   ((sizeof(file_hdr_t) +  \
+     sizeof(struct data_part1_s) * MAX_FILE_DATA_PART1 + \
+     0x1000) & ~0xfffL)
+
 #endif
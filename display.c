@@ -42,12 +42,15 @@ SOFTWARE.
 #include <sys/resource.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <ifaddrs.h>
 
 #include "common.h"
 #include "util_sdl.h"
 #include "util_jpeg_decode.h"
 #include "util_cam.h"
 #include "util_misc.h"
+#include "util_proto.h"
+#include "util_shm.h"
 #include "about.h"
 
 //
@@ -58,16 +61,6 @@ SOFTWARE.
 
 #define MODE_STR(m) ((m) == LIVE ? "LIVE" : (m) == PLAYBACK ? "PLAYBACK" : "TEST")
 
-#define MAGIC_FILE 0x1122334455667788
-
-#define MAX_FILE_DATA_PART1   (6*3600)  // 6 hours
-#define MAX_DATA_PART2_LENGTH 1000000
-
-#define FILE_DATA_PART2_OFFSET \
-   ((sizeof(file_hdr_t) +  \
-     sizeof(struct data_part1_s) * MAX_FILE_DATA_PART1 + \
-     0x1000) & ~0xfffL)
-
 #define FONT0_HEIGHT (sdl_font_char_height(0))
 #define FONT0_WIDTH  (sdl_font_char_width(0))
 #define FONT1_HEIGHT (sdl_font_char_height(1))
@@ -133,13 +126,6 @@ SOFTWARE.
 
 enum mode {LIVE, PLAYBACK, TEST};
 
-typedef struct {
-    uint64_t magic;
-    uint64_t start_time;  // XXX not used
-    uint32_t max;
-    uint8_t  reserved[4096-20];
-} file_hdr_t;
-
 //
 // variables
 //
@@ -165,11 +151,18 @@ static int32_t                  file_idx_global;
 
 static int32_t                  test_file_secs;
 
-static uint8_t                  jpeg_buff[1000000];
+static uint8_t                  jpeg_buff[MAX_JPEG_BUFF_LEN];
 static int32_t                  jpeg_buff_len;
 static uint64_t                 jpeg_buff_us;
 static pthread_mutex_t          jpeg_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+static pthread_mutex_t          live_update_mutex = PTHREAD_MUTEX_INITIALIZER;
+static proto_update_t           live_update;           // the most recent partial update
+static uint64_t                 live_update_us;        // when live_update was received
+static uint32_t                 live_update_count;
+static float                    live_adc_data[PROTO_MAX_UPDATE_ADC][MAX_ADC_DATA];  // the last 
+static uint64_t                 live_adc_end_seq[PROTO_MAX_UPDATE_ADC];             //  second's values
+
 static char                     config_path[PATH_MAX];
 static const int32_t            config_version = 1;
 static config_t                 config[] = { { "image_x",                     DEFAULT_IMAGE_X                     },
@@ -199,6 +192,10 @@ static int32_t                  adc_data_graph_max_y_mv;
 static int32_t initialize(int32_t argc, char ** argv);
 static void usage(void);
 static void * get_live_data_thread(void * cx);
+static void live_update_merge(proto_update_t * u);
+static bool live_update_is_current(int32_t file_idx);
+static bool is_local_addr(struct sockaddr_in * addr);
+static int32_t tcp_read(int32_t sfd, data_t * data, uint8_t * frame, proto_update_t * update);
 static int32_t write_data_to_file(data_t * data);
 static void * cam_thread(void * cx);
 static int32_t display_handler();
@@ -213,6 +210,9 @@ static void draw_graph_common(rect_t * graph_pane, char * title_str, int32_t x_r
 static int32_t generate_test_file(void);
 static char * val2str(float val, int32_t units);
 static struct data_part2_s * read_data_part2(int32_t file_idx);
+static int16_t * read_neutron_pulse_mv(int32_t file_idx);
+static int32_t decode_pulse_time(struct data_part2_s * dp2, int32_t max_pulse, int32_t * pulse_time);
+static int32_t verify_data_part2(struct data_part1_s * dp1, struct data_part2_s * dp2, uint32_t * dp2_length);
 static float neutron_cpm(int32_t file_idx);
 
 // -----------------  MAIN  ----------------------------------------------------------
@@ -282,10 +282,12 @@ static int32_t initialize(int32_t argc, char ** argv)
     rl.rlim_max = RLIM_INFINITY;
     setrlimit(RLIMIT_CORE, &rl);
 
-    // print size of data part1 and part2, and validate sizes are multiple of 8
+    // print size of data part1 and part2, and validate sizes are multiple of 8,
+    // and that part1 is the size that is in the data files
     DEBUG("sizeof data_t=%zd part1=%zd part2=%zd\n",
           sizeof(data_t), sizeof(struct data_part1_s), sizeof(struct data_part2_s));
-    if ((sizeof(struct data_part1_s) % 8) || (sizeof(struct data_part2_s) % 8)) {
+    if ((sizeof(struct data_part1_s) % 8) || (sizeof(struct data_part2_s) % 8) ||
+        (sizeof(struct data_part1_s) != DATA_PART1_LENGTH)) {
         FATAL("sizeof data_t=%zd part1=%zd part2=%zd\n",
               sizeof(data_t), sizeof(struct data_part1_s), sizeof(struct data_part2_s));
     }
@@ -616,7 +618,7 @@ static void atexit_config_write(void)
 
 static void * get_live_data_thread(void * cx)
 {
-    int32_t               sfd, len;
+    int32_t               sfd, ret;
     struct timeval        rcvto;
     data_t              * data;
     struct data_part1_s * dp1;
@@ -624,6 +626,15 @@ static void * get_live_data_thread(void * cx)
     uint64_t              last_data_time_written_to_file;
     uint64_t              t, time_now, time_delta;
     data_t                data_novalue;
+    proto_hello_t         hello;
+    proto_backfill_t      backfill;
+    bool                  backfilling;
+    int32_t               backfill_count;
+    uint64_t              connect_time;
+    uint8_t             * frame;
+    shm_reader_t        * shm;
+    bool                  server_local;
+    static proto_update_t update;
 
     // init data_novalue
     bzero(&data_novalue, sizeof(data_novalue));
@@ -636,6 +647,8 @@ static void * get_live_data_thread(void * cx)
     dp1->d2_pressure_mtorr                        = ERROR_NO_VALUE;
     dp1->n2_pressure_mtorr                        = ERROR_NO_VALUE;
     dp1->max_neutron_pulse                        = 0;
+    dp1->neutron_live_permyriad                   = 0;
+    dp1->neutron_mccdaq_restarts                  = 0;
     dp1->data_part2_offset                        = 0;
     dp1->data_part2_length                        = sizeof(struct data_part2_s);
     dp1->data_part2_jpeg_buff_len                 = 0;
@@ -649,14 +662,41 @@ static void * get_live_data_thread(void * cx)
     // init others
     sfd = -1;
     data = calloc(1, sizeof(struct data_part1_s) + MAX_DATA_PART2_LENGTH);
-    if (data == NULL) {
+    frame = malloc(PROTO_MAX_FRAME_LEN);
+    if (data == NULL || frame == NULL) {
         FATAL("calloc\n");
     }
     dp1 = &data->part1;
     dp2 = &data->part2;
     last_data_time_written_to_file = 0;
+    backfilling = false;
+    shm = NULL;
+    server_local = is_local_addr(&server_sockaddr);
 
 try_to_connect_again:
+    // if reconnecting then the seconds that were missed are requested as a 
+    // backfill, and the records that are older than connect_time are not
+    // subject to the server time check
+    connect_time = time(NULL);
+    backfilling = false;
+    backfill_count = 0;
+
+    // if the server is on this computer, and its shared memory is current, then 
+    // read the data from shared memory instead of the socket; unless reconnecting
+    // and the shared memory ring no longer has the seconds that were missed, in 
+    // which case the server backfills them, and then shared memory is used
+    if (server_local && (shm = shm_open_reader()) != NULL) {
+        if (shm_seek(shm, last_data_time_written_to_file) == 0) {
+            INFO("using shared memory %s\n", SHM_NAME);
+            backfilling = (last_data_time_written_to_file != 0);
+            goto connected;
+        }
+        INFO("shared memory %s does not have the seconds after time %"PRId64", using tcp\n",
+             SHM_NAME, last_data_time_written_to_file);
+        shm_close_reader(shm);
+        shm = NULL;
+    }
+
     // create socket 
     sfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sfd == -1) {
@@ -681,38 +721,71 @@ try_to_connect_again:
         FATAL("setsockopt SO_RCVTIMEO, %s\n",strerror(errno));
     }
 
-    // loop getting data
-    while (true) {
-        // read data part1 from server, and
-        // verify data part1 magic, and length
-        len = do_recv(sfd, dp1, sizeof(struct data_part1_s));
-        if (len != sizeof(struct data_part1_s)) {
-            ERROR("recv dp1 len=%d exp=%zd, %s\n",
-                  len, sizeof(struct data_part1_s), strerror(errno));
+    // send hello, requesting the compressed protocol; the server continues to 
+    // send the data_t uncompressed if it does not support it, see util_proto.h
+    hello.magic    = MAGIC_PROTO_HELLO;
+    hello.version  = PROTO_VERSION;
+    hello.reserved = 0;
+    if (do_send(sfd, &hello, sizeof(hello)) != sizeof(hello)) {
+        ERROR("send hello, %s\n", strerror(errno));
+        goto connection_failed;
+    }
+
+    // if reconnecting then request the seconds that were missed; the server sends
+    // those it has, followed by a backfill frame, before resuming the live data; 
+    // an older server ignores the request
+    if (last_data_time_written_to_file != 0) {
+        backfill.magic = MAGIC_PROTO_BACKFILL;
+        backfill.time  = last_data_time_written_to_file;
+        if (do_send(sfd, &backfill, sizeof(backfill)) != sizeof(backfill)) {
+            ERROR("send backfill, %s\n", strerror(errno));
             goto connection_failed;
         }
-        if (dp1->magic != MAGIC_DATA_PART1) {
-            ERROR("recv dp1 bad magic 0x%"PRIx64"\n", 
-                  dp1->magic);
+        INFO("requesting backfill after time %"PRId64", %"PRId64" secs\n", 
+             last_data_time_written_to_file, connect_time - last_data_time_written_to_file);
+        backfilling = true;
+    }
+
+connected:
+    // loop getting data
+    while (true) {
+        // read the next record, partial update, or end of backfill
+        ret = (shm ? shm_read(shm, data, &update) : tcp_read(sfd, data, frame, &update));
+        if (ret < 0) {
             goto connection_failed;
         }
-        if (dp1->data_part2_length > MAX_DATA_PART2_LENGTH) {
-            ERROR("data_part2_length %d is too big\n", 
-                  dp1->data_part2_length);
-            goto connection_failed;
+
+        // if the backfill has ended then the records that follow are live; and if
+        // the backfill was by the server because the shared memory ring did not have
+        // the seconds that were missed, then switch to the shared memory now
+        if (ret == SHM_READ_BACKFILL_DONE) {
+            INFO("backfill complete, %d records\n", backfill_count);
+            backfilling = false;
+            if (shm == NULL && server_local && (shm = shm_open_reader()) != NULL) {
+                if (shm_seek(shm, last_data_time_written_to_file) == 0) {
+                    INFO("using shared memory %s\n", SHM_NAME);
+                    close(sfd);
+                    sfd = -1;
+                    backfilling = true;
+                } else {
+                    shm_close_reader(shm);
+                    shm = NULL;
+                }
+            }
+            continue;
         }
 
-        // read data part2 from server,
-        // verify magic
-        len = do_recv(sfd, dp2, dp1->data_part2_length);
-        if (len != dp1->data_part2_length) {
-            ERROR("recv dp2 len=%d exp=%d, %s\n",
-                  len, dp1->data_part2_length, strerror(errno));
-            goto connection_failed;
+        // if partial update, for the second in progress, then merge it into the 
+        // live update, which is displayed until the record for the second is received
+        if (ret == SHM_READ_UPDATE) {
+            live_update_merge(&update);
+            continue;
         }
-        if (dp2->magic != MAGIC_DATA_PART2) {
-            ERROR("recv dp2 bad magic 0x%"PRIx64"\n", 
-                  dp2->magic);
+
+        // verify data part2
+        if (verify_data_part2(dp1, dp2, &dp1->data_part2_length) < 0) {
+            ERROR("recv dp2 invalid, magic=0x%"PRIx64" max_neutron_pulse=%d\n", 
+                  dp2->magic, dp1->max_neutron_pulse);
             goto connection_failed;
         }
 
@@ -725,9 +798,9 @@ try_to_connect_again:
         if (dp1->data_part2_jpeg_buff_len == 0) {
             pthread_mutex_lock(&jpeg_mutex);
             if (microsec_timer() - jpeg_buff_us < 1000000) {
-                memcpy(dp2->jpeg_buff, jpeg_buff, jpeg_buff_len);
+                memcpy(DATA_PART2_JPEG_BUFF(dp2), jpeg_buff, jpeg_buff_len);
                 dp1->data_part2_jpeg_buff_len = jpeg_buff_len;
-                dp1->data_part2_length = sizeof(struct data_part2_s) + jpeg_buff_len;
+                dp1->data_part2_length = DATA_PART2_LENGTH(dp2, jpeg_buff_len);
             }
             pthread_mutex_unlock(&jpeg_mutex);
         }
@@ -735,16 +808,19 @@ try_to_connect_again:
         // if opt_no_cam then disacard camera data
         if (opt_no_cam) {
             dp1->data_part2_jpeg_buff_len = 0;
-            dp1->data_part2_length = sizeof(struct data_part2_s);
+            dp1->data_part2_length = DATA_PART2_LENGTH(dp2, 0);
         }
 
         // verify the time of received data is close to the time 
-        // on the computer running this display program
+        // on the computer running this display program; except for the 
+        // records sent by the backfill, which are older
         time_now = time(NULL);
         time_delta = (time_now > data->part1.time 
                       ? time_now - data->part1.time
                       : data->part1.time - time_now);
-        if (time_delta > 5) {
+        if (backfilling && data->part1.time <= connect_time) {
+            backfill_count++;
+        } else if (time_delta > 5) {
             ERROR("server time delta = %"PRId64"\n", time_delta);
             goto time_error;
         }
@@ -800,10 +876,10 @@ try_to_connect_again:
             if (fd < 0) {
                 ERROR("open %s, %s\n", JPEG_BUFF_SAMPLE_FILENAME, strerror(errno));
             } else {
-                int32_t len = write(fd, dp2->jpeg_buff, dp2->jpeg_buff_len);
-                if (len != dp2->jpeg_buff_len) {
+                int32_t len = write(fd, DATA_PART2_JPEG_BUFF(dp2), dp1->data_part2_jpeg_buff_len);
+                if (len != dp1->data_part2_jpeg_buff_len) {
                     ERROR("write %s len exp=%d act=%d, %s\n",
-                        JPEG_BUFF_SAMPLE_FILENAME, dp2->jpeg_buff_len, len, strerror(errno));
+                        JPEG_BUFF_SAMPLE_FILENAME, dp1->data_part2_jpeg_buff_len, len, strerror(errno));
                 }
                 close(fd);
             }
@@ -816,27 +892,22 @@ connection_failed:
     // handle connectio failed error ...
 
     // set lost_connection flag,
-    // close socket
+    // close socket or shared memory
     ERROR("connection_failed - attempting to reestablish connection\n");
     lost_connection = true;
     if (sfd != -1) {
         close(sfd);
         sfd = -1;
     }
-
-    // write no-value data to file to fill the gap
-    if (last_data_time_written_to_file != 0) {
-        time_now = time(NULL);
-        for (t = last_data_time_written_to_file+1; t < time_now; t++) {
-            WARN("writing no-value data to file for time %"PRId64"\n", t);
-            data_novalue.part1.time = t;
-            if (write_data_to_file(&data_novalue) < 0) {
-                goto file_error;
-            }
-            last_data_time_written_to_file = t;
-        }
+    if (shm != NULL) {
+        shm_close_reader(shm);
+        shm = NULL;
     }
 
+    // the gap is not filled with no-value data here; when the connection is 
+    // reestablished the server backfills the seconds it has, and the gap that 
+    // remains is filled when the next data is received
+
     // if live mode then update file_idx_global
     if (mode == LIVE) {
         file_idx_global = file_hdr->max - 1;
@@ -861,6 +932,10 @@ file_error:
         close(sfd);
         sfd = -1;
     }
+    if (shm != NULL) {
+        shm_close_reader(shm);
+        shm = NULL;
+    }
     return NULL;
 
 time_error:
@@ -876,9 +951,129 @@ time_error:
         close(sfd);
         sfd = -1;
     }
+    if (shm != NULL) {
+        shm_close_reader(shm);
+        shm = NULL;
+    }
     return NULL;
 }
 
+// returns true if addr is a loopback address, or an address of this computer
+static bool is_local_addr(struct sockaddr_in * addr)
+{
+    struct ifaddrs * ifaddr, * ifa;
+    bool             local = false;
+
+    if ((ntohl(addr->sin_addr.s_addr) >> 24) == 127) {
+        return true;
+    }
+
+    if (getifaddrs(&ifaddr) < 0) {
+        ERROR("getifaddrs, %s\n", strerror(errno));
+        return false;
+    }
+    for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+        if (ifa->ifa_addr != NULL && 
+            ifa->ifa_addr->sa_family == AF_INET &&
+            ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr.s_addr == addr->sin_addr.s_addr)
+        {
+            local = true;
+            break;
+        }
+    }
+    freeifaddrs(ifaddr);
+    return local;
+}
+
+// reads the next record, partial update, or end of backfill from the server;
+// returns SHM_READ_xxx, as shm_read does, or -1 on error
+static int32_t tcp_read(int32_t sfd, data_t * data, uint8_t * frame, proto_update_t * update)
+{
+    struct data_part1_s * dp1 = &data->part1;
+    struct data_part2_s * dp2 = &data->part2;
+    proto_frame_hdr_t     frame_hdr;
+    int32_t               len;
+
+    // read the magic that starts the next record
+    len = do_recv(sfd, &frame_hdr.magic, sizeof(frame_hdr.magic));
+    if (len != sizeof(frame_hdr.magic)) {
+        ERROR("recv magic len=%d exp=%zd, %s\n",
+              len, sizeof(frame_hdr.magic), strerror(errno));
+        return -1;
+    }
+
+    if (frame_hdr.magic == MAGIC_PROTO_FRAME || frame_hdr.magic == MAGIC_PROTO_UPDATE ||
+        frame_hdr.magic == MAGIC_PROTO_BACKFILL) 
+    {
+        // read the frame from server
+        len = do_recv(sfd, (uint8_t*)&frame_hdr + sizeof(frame_hdr.magic), 
+                      sizeof(frame_hdr) - sizeof(frame_hdr.magic));
+        if (len != sizeof(frame_hdr) - sizeof(frame_hdr.magic)) {
+            ERROR("recv frame hdr len=%d, %s\n", len, strerror(errno));
+            return -1;
+        }
+        if (frame_hdr.len > PROTO_MAX_FRAME_LEN - sizeof(frame_hdr)) {
+            ERROR("frame len %d is too big\n", frame_hdr.len);
+            return -1;
+        }
+        len = do_recv(sfd, frame, frame_hdr.len);
+        if (len != frame_hdr.len) {
+            ERROR("recv frame len=%d exp=%d, %s\n",
+                  len, frame_hdr.len, strerror(errno));
+            return -1;
+        }
+
+        // if the frame ends the backfill then return
+        if (frame_hdr.magic == MAGIC_PROTO_BACKFILL) {
+            return SHM_READ_BACKFILL_DONE;
+        }
+
+        // if the frame is a partial update then decode and return it
+        if (frame_hdr.magic == MAGIC_PROTO_UPDATE) {
+            if (proto_decode_update(&frame_hdr, frame, update) < 0) {
+                return -1;
+            }
+            return SHM_READ_UPDATE;
+        }
+
+        // decode the frame to data part1 and part2
+        if (proto_decode(&frame_hdr, frame, data) < 0) {
+            return -1;
+        }
+    } else {
+        // read the remainder of data part1 from server, and
+        // verify data part1 magic, and length
+        dp1->magic = frame_hdr.magic;
+        len = do_recv(sfd, (uint8_t*)dp1 + sizeof(dp1->magic), 
+                      sizeof(struct data_part1_s) - sizeof(dp1->magic));
+        if (len != sizeof(struct data_part1_s) - sizeof(dp1->magic)) {
+            ERROR("recv dp1 len=%d exp=%zd, %s\n",
+                  len, sizeof(struct data_part1_s) - sizeof(dp1->magic), strerror(errno));
+            return -1;
+        }
+        if (dp1->magic != MAGIC_DATA_PART1) {
+            ERROR("recv dp1 bad magic 0x%"PRIx64"\n", 
+                  dp1->magic);
+            return -1;
+        }
+        if (dp1->data_part2_length > MAX_DATA_PART2_LENGTH) {
+            ERROR("data_part2_length %d is too big\n", 
+                  dp1->data_part2_length);
+            return -1;
+        }
+
+        // read data part2 from server
+        len = do_recv(sfd, dp2, dp1->data_part2_length);
+        if (len != dp1->data_part2_length) {
+            ERROR("recv dp2 len=%d exp=%d, %s\n",
+                  len, dp1->data_part2_length, strerror(errno));
+            return -1;
+        }
+    }
+
+    return SHM_READ_RECORD;
+}
+
 static int32_t write_data_to_file(data_t * data)
 {
     int32_t         len;
@@ -922,6 +1117,58 @@ static int32_t write_data_to_file(data_t * data)
     return 0;
 }
 
+static void live_update_merge(proto_update_t * u)
+{
+    int32_t  i, j, adv, idx;
+    uint64_t end_seq;
+
+    pthread_mutex_lock(&live_update_mutex);
+
+    // the adc values are appended to the last second's values, which are
+    // shifted out; a gap in the values is filled with ERROR_NO_VALUE, and if 
+    // the sequence numbers went backward, because get_data restarted, then all
+    // the prior values are discarded
+    for (i = 0; i < PROTO_MAX_UPDATE_ADC; i++) {
+        if (u->adc[i].max_adc_data == 0) {
+            continue;
+        }
+        end_seq = u->adc[i].first_seq + u->adc[i].max_adc_data;
+        adv = (live_adc_end_seq[i] == 0 || end_seq <= live_adc_end_seq[i] || 
+               end_seq - live_adc_end_seq[i] > MAX_ADC_DATA 
+               ? MAX_ADC_DATA : end_seq - live_adc_end_seq[i]);
+        memmove(live_adc_data[i], live_adc_data[i] + adv, (MAX_ADC_DATA - adv) * sizeof(float));
+        for (j = MAX_ADC_DATA - adv; j < MAX_ADC_DATA; j++) {
+            live_adc_data[i][j] = ERROR_NO_VALUE;
+        }
+        for (j = 0; j < u->adc[i].max_adc_data; j++) {
+            idx = MAX_ADC_DATA - (end_seq - (u->adc[i].first_seq + j));
+            if (idx >= 0) {
+                live_adc_data[i][idx] = u->adc[i].adc_data[j];
+            }
+        }
+        live_adc_end_seq[i] = end_seq;
+    }
+
+    // the summary values
+    memcpy(&live_update, u, offsetof(proto_update_t, adc));
+    live_update_us = microsec_timer();
+    live_update_count++;
+
+    pthread_mutex_unlock(&live_update_mutex);
+}
+
+// The live update is displayed, in place of the values of the most recent 
+// record, when it is for the second that follows it, and it is recent. 
+// Caller must hold live_update_mutex.
+
+static bool live_update_is_current(int32_t file_idx)
+{
+    return mode == LIVE &&
+           file_idx == file_hdr->max - 1 &&
+           live_update.time > file_data_part1[file_idx].time &&
+           microsec_timer() - live_update_us < 1000000;
+}
+
 // -----------------  CAM THREAD  ----------------------------------------------------
 
 static void * cam_thread(void * cx)
@@ -986,6 +1233,7 @@ static int32_t display_handler(void)
     int32_t       file_idx;
     int32_t       event_processed_count;
     int32_t       file_max_last;
+    uint32_t      live_update_count_last;
     bool          lost_connection_msg_is_displayed;
     bool          file_error_msg_is_displayed;
     bool          time_error_msg_is_displayed;
@@ -995,6 +1243,7 @@ static int32_t display_handler(void)
     // initializae 
     quit = false;
     file_max_last = -1;
+    live_update_count_last = 0;
     lost_connection_msg_is_displayed = false;
     file_error_msg_is_displayed = false;
     time_error_msg_is_displayed = false;
@@ -1319,9 +1568,11 @@ static int32_t display_handler(void)
                 ((event->event == SDL_EVENT_NONE) &&
                  ((event_processed_count > 0) ||
                   (file_idx != file_idx_global) ||
-                  (file_hdr->max != file_max_last))))
+                  (file_hdr->max != file_max_last) ||
+                  (mode == LIVE && live_update_count != live_update_count_last))))
             {
                 file_max_last = file_hdr->max;
+                live_update_count_last = live_update_count;
                 break;
             }
 
@@ -1373,7 +1624,7 @@ static void draw_camera_image(rect_t * cam_pane, int32_t file_idx)
     // decode the jpeg buff contained in data_part2
     ret = jpeg_decode(0,  // cxid
                      JPEG_DECODE_MODE_YUY2,      
-                     data_part2->jpeg_buff, file_data_part1[file_idx].data_part2_jpeg_buff_len,
+                     DATA_PART2_JPEG_BUFF(data_part2), file_data_part1[file_idx].data_part2_jpeg_buff_len,
                      &pixel_buff, &pixel_buff_width, &pixel_buff_height);
     if (ret < 0) {
         ERROR("jpeg_decode ret %d\n", ret);
@@ -1465,20 +1716,54 @@ static void draw_data_values(rect_t * data_pane, int32_t file_idx)
 {
     struct data_part1_s * dp1;
     char str[200];
+    float voltage_kv, current_ma, d2_pressure_mtorr, n2_pressure_mtorr;
+    int32_t live_pulses = -1, live_elapsed_ms = 0, col;
 
     dp1 = &file_data_part1[file_idx];
 
+    // if the live update is current then display its values, which are the means
+    // of the last 100 ms, in place of the record's
+    voltage_kv        = dp1->voltage_kv;
+    current_ma        = dp1->current_ma;
+    d2_pressure_mtorr = dp1->d2_pressure_mtorr;
+    n2_pressure_mtorr = dp1->n2_pressure_mtorr;
+    pthread_mutex_lock(&live_update_mutex);
+    if (live_update_is_current(file_idx)) {
+        voltage_kv        = live_update.voltage_kv;
+        current_ma        = live_update.current_ma;
+        d2_pressure_mtorr = live_update.d2_pressure_mtorr;
+        n2_pressure_mtorr = live_update.n2_pressure_mtorr;
+        live_pulses       = live_update.neutron_pulses;
+        live_elapsed_ms   = live_update.elapsed_ms;
+    }
+    pthread_mutex_unlock(&live_update_mutex);
+
     sprintf(str, "%s   %s   %s   NPHT=%d MV",
-            val2str(dp1->voltage_kv, UNITS_KV),
-            val2str(dp1->current_ma, UNITS_MA),
+            val2str(voltage_kv, UNITS_KV),
+            val2str(current_ma, UNITS_MA),
             val2str(neutron_cpm(file_idx), UNITS_CPM),
             neutron_pht_mv);
     sdl_render_text(data_pane, 0, 0, 1, str, WHITE, BLACK);
 
     sprintf(str, "%s   %s",
-            val2str(dp1->d2_pressure_mtorr, UNITS_D2_MT),
-            val2str(dp1->n2_pressure_mtorr, UNITS_N2_MT));
+            val2str(d2_pressure_mtorr, UNITS_D2_MT),
+            val2str(n2_pressure_mtorr, UNITS_N2_MT));
     sdl_render_text(data_pane, 1, 0, 1, str, WHITE, BLACK);
+    col = strlen(str) + 3;
+
+    // if neutron adc samples were lost during this second then display
+    // the live time percentage; the neutron cpm is corrected for the lost samples
+    if (dp1->neutron_live_permyriad > 0 && dp1->neutron_live_permyriad < 10000) {
+        sprintf(str, "LIVE=%0.1f%%", dp1->neutron_live_permyriad / 100.);
+        sdl_render_text(data_pane, 1, col, 1, str, RED, BLACK);
+        col += strlen(str) + 3;
+    }
+
+    // if the live update is current then display the pulses so far this second
+    if (live_pulses >= 0) {
+        sprintf(str, "%d PULSES IN %d MS", live_pulses, live_elapsed_ms);
+        sdl_render_text(data_pane, 1, col, 1, str, GREEN, BLACK);
+    }
 }
 
 // - - - - - - - - -  DISPLAY HANDLER - DRAW SUMMARY GRAPH  - - - - - - - - - - - - 
@@ -1600,10 +1885,19 @@ static void draw_adc_data_graph(rect_t * graph_pane, int32_t file_idx)
 {
     struct data_part1_s * dp1;
     struct data_part2_s * dp2;
+    #define INTERARRIVAL_BIN_US  10    // 1200 bins span 12 ms
+
+    static int32_t pulse_time[MAX_NEUTRON_PULSE_PER_SEC];
+
     float adc_data[MAX_ADC_DATA];
     int32_t i, j, k, color;
     int32_t sum=0, cnt=0;
+    int32_t y_max = adc_data_graph_max_y_mv;
+    float noise_mv = 0;
+    bool live = false;
     char title_str[100];
+    char * x_info_str = "1 SECOND";
+    char * y_units_str = "MV";
 
     // init pointer to dp1, and read dp2
     dp1 = &file_data_part1[file_idx];
@@ -1617,16 +1911,29 @@ static void draw_adc_data_graph(rect_t * graph_pane, int32_t file_idx)
         adc_data[i] = ERROR_NO_VALUE;
     }
 
+    // if the live update is current then the voltage, current, and pressure graphs
+    // are of its last second of adc values, in place of the record's
+    pthread_mutex_lock(&live_update_mutex);
+    if (adc_data_graph_select >= 1 && adc_data_graph_select <= 3 && live_update_is_current(file_idx)) {
+        memcpy(adc_data, live_adc_data[adc_data_graph_select-1], sizeof(adc_data));
+        live = true;
+    }
+    pthread_mutex_unlock(&live_update_mutex);
+
     // init array of the values to graph
     switch (adc_data_graph_select) {
     case 0:
         if (dp2) {
+            int16_t * pulse_mv = NEUTRON_SECTION_PULSE_MV(dp2);
+            uint16_t * snippet_idx = NEUTRON_SECTION_SNIPPET_IDX(dp2, dp1->max_neutron_pulse);
+            int16_t (*adc_pulse_data)[MAX_NEUTRON_ADC_PULSE_DATA] = 
+                NEUTRON_SECTION_ADC_PULSE_DATA(dp2, dp1->max_neutron_pulse);
             k = 0;
-            for (i = 0; i < dp1->max_neutron_pulse; i++) {
-                if (dp1->neutron_pulse_mv[i] >= neutron_pht_mv) {
+            for (i = 0; i < dp2->max_neutron_snippet; i++) {
+                if (pulse_mv[snippet_idx[i]] >= neutron_pht_mv) {
                     // copy pulse data to adc_data array (to be plotted)
                     for (j = 0; j < MAX_NEUTRON_ADC_PULSE_DATA; j++) {
-                        adc_data[k++] = dp2->neutron_adc_pulse_data[i][j];
+                        adc_data[k++] = adc_pulse_data[i][j];
                         if (k == MAX_ADC_DATA) {
                             break;
                         }
@@ -1648,11 +1955,21 @@ static void draw_adc_data_graph(rect_t * graph_pane, int32_t file_idx)
                 }
             }
         }
+        if (dp2) {
+            noise_mv = dp2->neutron_noise_mv;
+        }
         sprintf(title_str, "NEUTRON ADC");
         color = PURPLE;
         break;
     case 1:
-        if (dp2 && dp1->data_part2_voltage_adc_data_valid) {
+        if (live) {
+            for (i = 0; i < MAX_ADC_DATA; i++) {
+                if (adc_data[i] != ERROR_NO_VALUE) {
+                    sum += adc_data[i];
+                    cnt++;
+                }
+            }
+        } else if (dp2 && dp1->data_part2_voltage_adc_data_valid) {
             for (i = 0; i < MAX_ADC_DATA; i++) {
                 adc_data[i] = dp2->voltage_adc_data[i];
                 sum += adc_data[i];
@@ -1663,7 +1980,14 @@ static void draw_adc_data_graph(rect_t * graph_pane, int32_t file_idx)
         color = RED;
         break;
     case 2:
-        if (dp2 && dp1->data_part2_current_adc_data_valid) {
+        if (live) {
+            for (i = 0; i < MAX_ADC_DATA; i++) {
+                if (adc_data[i] != ERROR_NO_VALUE) {
+                    sum += adc_data[i];
+                    cnt++;
+                }
+            }
+        } else if (dp2 && dp1->data_part2_current_adc_data_valid) {
             for (i = 0; i < MAX_ADC_DATA; i++) {
                 adc_data[i] = dp2->current_adc_data[i];
                 sum += adc_data[i];
@@ -1674,7 +1998,14 @@ static void draw_adc_data_graph(rect_t * graph_pane, int32_t file_idx)
         color = GREEN;
         break;
     case 3:
-        if (dp2 && dp1->data_part2_pressure_adc_data_valid) {
+        if (live) {
+            for (i = 0; i < MAX_ADC_DATA; i++) {
+                if (adc_data[i] != ERROR_NO_VALUE) {
+                    sum += adc_data[i];
+                    cnt++;
+                }
+            }
+        } else if (dp2 && dp1->data_part2_pressure_adc_data_valid) {
             for (i = 0; i < MAX_ADC_DATA; i++) {
                 adc_data[i] = dp2->pressure_adc_data[i];
                 sum += adc_data[i];
@@ -1684,29 +2015,67 @@ static void draw_adc_data_graph(rect_t * graph_pane, int32_t file_idx)
         sprintf(title_str, "PRESSURE ADC");
         color = BLUE;
         break;
+    case 4:
+        // histogram of the time between consecutive pulses whose height is at 
+        // least neutron_pht_mv; the Y scale is in counts, 1/100 of the MV scale
+        if (dp2 && dp2->pulse_time_len > 0 && dp2->neutron_sample_rate > 0 &&
+            decode_pulse_time(dp2, dp1->max_neutron_pulse, pulse_time) == 0)
+        {
+            int16_t * pulse_mv = NEUTRON_SECTION_PULSE_MV(dp2);
+            bool      have_prior = false;
+            int32_t   prior = 0;
+            for (i = 0; i < MAX_ADC_DATA; i++) {
+                adc_data[i] = 0;
+            }
+            for (i = 0; i < dp1->max_neutron_pulse; i++) {
+                if (pulse_mv[i] < neutron_pht_mv) {
+                    continue;
+                }
+                if (have_prior) {
+                    k = (int64_t)(pulse_time[i] - prior) * 1000000 / 
+                        dp2->neutron_sample_rate / INTERARRIVAL_BIN_US;
+                    if (k >= 0 && k < MAX_ADC_DATA) {
+                        adc_data[k]++;
+                    }
+                }
+                prior = pulse_time[i];
+                have_prior = true;
+            }
+        }
+        sprintf(title_str, "NEUTRON INTERARRIVAL");
+        x_info_str = "12 MS";
+        y_units_str = "CNT";
+        y_max = adc_data_graph_max_y_mv / 100;
+        color = PURPLE;
+        break;
     default:
         FATAL("invalid adc_data_graph_select = %d\n", adc_data_graph_select);
         break;
     }
 
     // append Y scale to title_str
-    sprintf(title_str+strlen(title_str), " : Y %d MV", adc_data_graph_max_y_mv);
+    sprintf(title_str+strlen(title_str), " : Y %d %s", y_max, y_units_str);
 
     // append average to title_str  (if applicable)
     if (cnt > 0) {
         sprintf(title_str+strlen(title_str), " : AVG %d MV", sum / cnt);
     }
 
+    // append the neutron baseline noise to title_str  (if available)
+    if (noise_mv > 0) {
+        sprintf(title_str+strlen(title_str), " : NOISE %0.1f MV", noise_mv);
+    }
+
     // draw the graph
     draw_graph_common(
         graph_pane,        // the pane
         title_str,         // title_str
         1200,              // x_range
         -8,                // str_col
-        "1 SECOND", NULL,  // x_info_str, y_info_str
+        x_info_str, NULL,  // x_info_str, y_info_str
         -1, NULL,          // cursor_pos, cursor_str
         1,                 // max_graph
-        NULL, color, (double)adc_data_graph_max_y_mv, MAX_ADC_DATA, adc_data); 
+        NULL, color, (double)y_max, MAX_ADC_DATA, adc_data); 
                            // name,color,y_max,max_values,values
 }
 
@@ -1716,7 +2085,7 @@ static void draw_adc_data_graph_control(char key)
 
     switch (key) {
     case 's':
-        adc_data_graph_select = ((adc_data_graph_select + 1) % 4);
+        adc_data_graph_select = ((adc_data_graph_select + 1) % 5);
         break;
     case '1':
         REDUCE(adc_data_graph_max_y_mv, max_y_mv_tbl);
@@ -1946,7 +2315,7 @@ static int32_t generate_test_file(void)
     uint8_t               jpeg_buff[200000];
     uint32_t              jpeg_buff_len;
     uint64_t              dp2_offset;
-    int32_t               len, idx, i, fd;
+    int32_t               len, idx, i, fd, bin;
     struct data_part1_s * dp1;
     struct data_part2_s * dp2;
 
@@ -1985,13 +2354,14 @@ static int32_t generate_test_file(void)
         dp1->current_ma = 0;
         dp1->d2_pressure_mtorr = 10;
         dp1->n2_pressure_mtorr = 13;
-        for (i = 0; i < 100; i++) {
-            dp1->neutron_pulse_mv[i] = 50 + 5 * i;   // pulse height in mv
+        dp1->max_neutron_pulse = (idx % 120) == 119 ? 600 : 100;   // exceed MAX_NEUTRON_PULSE occasionally
+        for (i = 0; i < dp1->max_neutron_pulse && i < MAX_NEUTRON_PULSE; i++) {
+            dp1->neutron_pulse_mv[i] = 50 + 5 * (i % 100);   // pulse height in mv
         }
-        dp1->max_neutron_pulse = 100;
+        dp1->neutron_live_permyriad = (idx % 60) == 59 ? 9524 : 10000;
+        dp1->neutron_mccdaq_restarts = (idx % 60) == 59 ? 1 : 0;
 
         dp1->data_part2_offset = dp2_offset;
-        dp1->data_part2_length = sizeof(struct data_part2_s) + jpeg_buff_len;
         dp1->data_part2_jpeg_buff_len = jpeg_buff_len;
         dp1->data_part2_voltage_adc_data_valid = true;
         dp1->data_part2_current_adc_data_valid = true;
@@ -2004,12 +2374,56 @@ static int32_t generate_test_file(void)
             dp2->current_adc_data[i]  =  5000 * i / MAX_ADC_DATA;
             dp2->pressure_adc_data[i] =  1000 * i / MAX_ADC_DATA;
         }
+        dp2->max_neutron_snippet = dp1->max_neutron_pulse;
+        dp2->max_neutron_spectrum = 0;
+        memset(dp2->var, 0, NEUTRON_SECTION_LEN(dp1->max_neutron_pulse,
+                                                dp2->max_neutron_snippet,
+                                                MAX_NEUTRON_SPECTRUM_ENTRY));
+        for (i = 0; i < dp1->max_neutron_pulse; i++) {
+            int16_t * pulse_mv = NEUTRON_SECTION_PULSE_MV(dp2);
+            uint16_t * snippet_idx = NEUTRON_SECTION_SNIPPET_IDX(dp2, dp1->max_neutron_pulse);
+            int16_t (*adc_pulse_data)[MAX_NEUTRON_ADC_PULSE_DATA] = 
+                NEUTRON_SECTION_ADC_PULSE_DATA(dp2, dp1->max_neutron_pulse);
+            pulse_mv[i] = 50 + 5 * (i % 100);
+            snippet_idx[i] = i;
+            adc_pulse_data[i][MAX_NEUTRON_ADC_PULSE_DATA/2+0] = pulse_mv[i];
+            adc_pulse_data[i][MAX_NEUTRON_ADC_PULSE_DATA/2+1] = pulse_mv[i] / 2;
+            adc_pulse_data[i][MAX_NEUTRON_ADC_PULSE_DATA/2+2] = pulse_mv[i] / 4;
+        }
+        for (bin = 0; bin < MAX_NEUTRON_SPECTRUM_BIN; bin++) {
+            int16_t * pulse_mv = NEUTRON_SECTION_PULSE_MV(dp2);
+            uint16_t (*spectrum)[2] = NEUTRON_SECTION_SPECTRUM(dp2, dp1->max_neutron_pulse);
+            int32_t count = 0;
+            for (i = 0; i < dp1->max_neutron_pulse; i++) {
+                count += (NEUTRON_SPECTRUM_MV_TO_BIN(pulse_mv[i]) == bin);
+            }
+            if (count > 0) {
+                spectrum[dp2->max_neutron_spectrum][0] = bin;
+                spectrum[dp2->max_neutron_spectrum][1] = count;
+                dp2->max_neutron_spectrum++;
+            }
+        }
+        dp2->neutron_section_len = NEUTRON_SECTION_LEN(dp1->max_neutron_pulse,
+                                                       dp2->max_neutron_snippet,
+                                                       dp2->max_neutron_spectrum);
+        dp2->neutron_sample_rate = 500000;
+        dp2->neutron_baseline_mv = 0;
+        dp2->neutron_noise_mv = 7.3;
+        dp2->pulse_time_len = 0;
         for (i = 0; i < dp1->max_neutron_pulse; i++) {
-            dp2->neutron_adc_pulse_data[i][MAX_NEUTRON_ADC_PULSE_DATA/2+0] = dp1->neutron_pulse_mv[i];
-            dp2->neutron_adc_pulse_data[i][MAX_NEUTRON_ADC_PULSE_DATA/2+1] = dp1->neutron_pulse_mv[i] / 2;
-            dp2->neutron_adc_pulse_data[i][MAX_NEUTRON_ADC_PULSE_DATA/2+2] = dp1->neutron_pulse_mv[i] / 4;
+            uint8_t * pt = PULSE_TIME_SECTION(dp2);
+            uint32_t  zz = (uint32_t)(500000 / dp1->max_neutron_pulse) << 1;   // evenly spaced, zigzag
+            while (zz >= 0x80) {
+                pt[dp2->pulse_time_len++] = (zz & 0x7f) | 0x80;
+                zz >>= 7;
+            }
+            pt[dp2->pulse_time_len++] = zz;
+        }
+        while (dp2->pulse_time_len & 7) {
+            PULSE_TIME_SECTION(dp2)[dp2->pulse_time_len++] = 0;
         }
-        memcpy(dp2->jpeg_buff, jpeg_buff, jpeg_buff_len);
+        memcpy(DATA_PART2_JPEG_BUFF(dp2), jpeg_buff, jpeg_buff_len);
+        dp1->data_part2_length = DATA_PART2_LENGTH(dp2, jpeg_buff_len);
 
         len = pwrite(file_fd, dp2, dp1->data_part2_length, dp2_offset);
         if (len != dp1->data_part2_length) {
@@ -2096,7 +2510,7 @@ static char * val2str(float val, int32_t units)
 
 struct data_part2_s * read_data_part2(int32_t file_idx)
 {
-    int32_t  dp2_length;
+    uint32_t dp2_length;
     off_t    dp2_offset;
     int32_t  len;
 
@@ -2119,7 +2533,8 @@ struct data_part2_s * read_data_part2(int32_t file_idx)
 
     // verify data_part2 exists for specified file_idx
     if ((dp2_length = file_data_part1[file_idx].data_part2_length) == 0 ||
-        (dp2_offset = file_data_part1[file_idx].data_part2_offset) == 0)
+        (dp2_offset = file_data_part1[file_idx].data_part2_offset) == 0 ||
+        dp2_length > MAX_DATA_PART2_LENGTH)
     {
         return NULL;
     }
@@ -2132,8 +2547,9 @@ struct data_part2_s * read_data_part2(int32_t file_idx)
         return NULL;
     }
 
-    // verify magic value in data_part2
-    if (last_read_data_part2->magic != MAGIC_DATA_PART2) {
+    // verify data_part2, and convert data_part2 written by prior 
+    // versions to the current format
+    if (verify_data_part2(&file_data_part1[file_idx], last_read_data_part2, &dp2_length) < 0) {
         FATAL("invalid data_part2 magic 0x%"PRIx64" at file_idx %d\n", 
               last_read_data_part2->magic, file_idx);
     }
@@ -2145,6 +2561,179 @@ struct data_part2_s * read_data_part2(int32_t file_idx)
     return last_read_data_part2;
 }
 
+// returns the pulse heights for file_idx; when there are more than MAX_NEUTRON_PULSE
+// pulses only the pulse heights are read from the data_part2 neutron section
+static int16_t * read_neutron_pulse_mv(int32_t file_idx)
+{
+    struct data_part1_s * dp1 = &file_data_part1[file_idx];
+    off_t                 offset;
+    int32_t               len;
+
+    static int16_t pulse_mv[MAX_NEUTRON_PULSE_PER_SEC];
+
+    // if the pulse heights are all in data part1 then return them
+    if (dp1->max_neutron_pulse <= MAX_NEUTRON_PULSE) {
+        return dp1->neutron_pulse_mv;
+    }
+
+    // read the pulse heights from the data_part2 neutron section
+    if (dp1->max_neutron_pulse > MAX_NEUTRON_PULSE_PER_SEC || dp1->data_part2_offset == 0) {
+        ERROR("invalid max_neutron_pulse %d at file_idx %d\n", dp1->max_neutron_pulse, file_idx);
+        return NULL;
+    }
+    offset = dp1->data_part2_offset + offsetof(struct data_part2_s, var);
+    len = pread(file_fd, pulse_mv, dp1->max_neutron_pulse * sizeof(int16_t), offset);
+    if (len != dp1->max_neutron_pulse * sizeof(int16_t)) {
+        ERROR("read neutron pulse_mv len=%d exp=%zd, %s\n",
+              len, dp1->max_neutron_pulse * sizeof(int16_t), strerror(errno));
+        return NULL;
+    }
+    return pulse_mv;
+}
+
+// Decodes the pulse time section of dp2, see common.h, into pulse_time; 
+// returns -1 if the section is malformed.
+static int32_t decode_pulse_time(struct data_part2_s * dp2, int32_t max_pulse, int32_t * pulse_time)
+{
+    uint8_t * p   = PULSE_TIME_SECTION(dp2);
+    uint8_t * end = p + dp2->pulse_time_len;
+    int32_t   i, shift, prior = 0;
+    uint32_t  zz;
+
+    for (i = 0; i < max_pulse; i++) {
+        zz = 0;
+        shift = 0;
+        do {
+            if (p == end || shift > 28) {
+                return -1;
+            }
+            zz |= (uint32_t)(*p & 0x7f) << shift;
+            shift += 7;
+        } while (*p++ & 0x80);
+        prior += (int32_t)(zz >> 1) ^ -(int32_t)(zz & 1);
+        pulse_time[i] = prior;
+    }
+    return 0;
+}
+
+// Verifies data_part2, whose length is *dp2_length, and converts data_part2 in the 
+// MAGIC_DATA_PART2_V1 format, written by older versions of get_data, to the current
+// format, updating *dp2_length. The V1 format has a fixed size array of MAX_NEUTRON_PULSE
+// pulse data, with the pulse heights only in data part1, instead of the neutron section;
+// and it has no aux chan or pulse time section. The converted record keeps the pulse 
+// data for up to MAX_NEUTRON_SNIPPET pulses, and its spectrum is constructed from the
+// pulse heights. The dp2 buffer must be MAX_DATA_PART2_LENGTH.
+static int32_t verify_data_part2(struct data_part1_s * dp1, struct data_part2_s * dp2, uint32_t * dp2_length)
+{
+    uint8_t  * old;
+    int16_t  * old_pulse_mv;
+    int16_t (* old_adc_pulse_data)[MAX_NEUTRON_ADC_PULSE_DATA];
+    uint8_t  * old_jpeg_buff;
+    uint16_t * snippet_idx;
+    uint16_t (*spectrum)[2];
+    uint32_t   spectrum_bin[MAX_NEUTRON_SPECTRUM_BIN];
+    aux_chan_t * ac;
+    uint8_t    * aux_chan_end;
+    int32_t    n = dp1->max_neutron_pulse;
+    int32_t    i, k, bin, max_spectrum;
+
+    // if dp2 is the current format then verify the neutron section length, 
+    // the snippet indexes, and the aux chan and pulse time sections
+    if (dp2->magic == MAGIC_DATA_PART2) {
+        if (n < 0 || n > MAX_NEUTRON_PULSE_PER_SEC ||
+            dp2->pulse_time_len > MAX_PULSE_TIME_LEN || (dp2->pulse_time_len & 7) ||
+            dp2->max_aux_chan > MAX_AUX_CHAN ||
+            dp2->aux_chan_section_len > MAX_AUX_CHAN * AUX_CHAN_LEN(MAX_NEUTRON_SPECTRUM_ENTRY) + 8 ||
+            dp2->max_neutron_snippet > n ||
+            dp2->max_neutron_snippet > MAX_NEUTRON_SNIPPET ||
+            dp2->max_neutron_spectrum > MAX_NEUTRON_SPECTRUM_ENTRY ||
+            dp2->neutron_section_len != NEUTRON_SECTION_LEN(n, dp2->max_neutron_snippet, dp2->max_neutron_spectrum) ||
+            *dp2_length != DATA_PART2_LENGTH(dp2, dp1->data_part2_jpeg_buff_len))
+        {
+            return -1;
+        }
+        snippet_idx = NEUTRON_SECTION_SNIPPET_IDX(dp2, n);
+        for (i = 0; i < dp2->max_neutron_snippet; i++) {
+            if (snippet_idx[i] >= n) {
+                return -1;
+            }
+        }
+        ac = AUX_CHAN_FIRST(dp2);
+        aux_chan_end = (uint8_t*)ac + dp2->aux_chan_section_len;
+        for (i = 0; i < dp2->max_aux_chan; i++) {
+            if ((uint8_t*)(ac + 1) > aux_chan_end || 
+                ac->max_spectrum > MAX_NEUTRON_SPECTRUM_ENTRY ||
+                (uint8_t*)AUX_CHAN_NEXT(ac) > aux_chan_end) 
+            {
+                return -1;
+            }
+            ac = AUX_CHAN_NEXT(ac);
+        }
+        return 0;
+    }
+
+    // verify the V1 dp2, and make a copy of it
+    if (dp2->magic != MAGIC_DATA_PART2_V1 ||
+        n < 0 || n > MAX_NEUTRON_PULSE ||
+        *dp2_length != DATA_PART2_V1_HDR_LEN + DATA_PART2_V1_PULSE_DATA_LEN + dp1->data_part2_jpeg_buff_len)
+    {
+        return -1;
+    }
+    old = malloc(*dp2_length);
+    if (old == NULL) {
+        FATAL("malloc\n");
+    }
+    memcpy(old, dp2, *dp2_length);
+    old_pulse_mv       = dp1->neutron_pulse_mv;
+    old_adc_pulse_data = (void*)(old + DATA_PART2_V1_HDR_LEN);
+    old_jpeg_buff      = old + DATA_PART2_V1_HDR_LEN + DATA_PART2_V1_PULSE_DATA_LEN;
+
+    // construct the pulse height spectrum
+    memset(spectrum_bin, 0, sizeof(spectrum_bin));
+    max_spectrum = 0;
+    for (i = 0; i < n; i++) {
+        bin = NEUTRON_SPECTRUM_MV_TO_BIN(old_pulse_mv[i]);
+        if (spectrum_bin[bin]++ == 0) {
+            max_spectrum++;
+        }
+    }
+
+    // construct the neutron section, keeping the pulse data of up to MAX_NEUTRON_SNIPPET
+    // pulses, spread evenly over the pulses; and append the jpeg buff
+    dp2->magic = MAGIC_DATA_PART2;
+    dp2->max_neutron_snippet = (n < MAX_NEUTRON_SNIPPET ? n : MAX_NEUTRON_SNIPPET);
+    dp2->max_neutron_spectrum = max_spectrum;
+    dp2->neutron_section_len = NEUTRON_SECTION_LEN(n, dp2->max_neutron_snippet, max_spectrum);
+    dp2->aux_chan_section_len = 0;
+    dp2->max_aux_chan = 0;
+    dp2->pulse_time_len = 0;
+    dp2->neutron_sample_rate = 0;
+    dp2->neutron_baseline_mv = 0;
+    dp2->neutron_noise_mv = 0;
+    memset(dp2->var, 0, dp2->neutron_section_len);
+    memcpy(NEUTRON_SECTION_PULSE_MV(dp2), old_pulse_mv, n * sizeof(int16_t));
+    snippet_idx = NEUTRON_SECTION_SNIPPET_IDX(dp2, n);
+    for (i = 0; i < dp2->max_neutron_snippet; i++) {
+        k = (int64_t)i * n / dp2->max_neutron_snippet;
+        snippet_idx[i] = k;
+        memcpy(NEUTRON_SECTION_ADC_PULSE_DATA(dp2,n)[i], old_adc_pulse_data[k], 
+               MAX_NEUTRON_ADC_PULSE_DATA * sizeof(int16_t));
+    }
+    spectrum = NEUTRON_SECTION_SPECTRUM(dp2, n);
+    for (bin = 0, i = 0; bin < MAX_NEUTRON_SPECTRUM_BIN; bin++) {
+        if (spectrum_bin[bin] > 0) {
+            spectrum[i][0] = bin;
+            spectrum[i][1] = spectrum_bin[bin];
+            i++;
+        }
+    }
+    memcpy(DATA_PART2_JPEG_BUFF(dp2), old_jpeg_buff, dp1->data_part2_jpeg_buff_len);
+    *dp2_length = DATA_PART2_LENGTH(dp2, dp1->data_part2_jpeg_buff_len);
+
+    free(old);
+    return 0;
+}
+
 static float neutron_cpm(int32_t file_idx)
 {
     #define AVG_SAMPLES 10
@@ -2153,7 +2742,7 @@ static float neutron_cpm(int32_t file_idx)
     int32_t file_idx_avg_end;
 
     static int32_t neutron_pht_mv_cache = -1;
-    static int32_t neutron_cps_cache[MAX_FILE_DATA_PART1];
+    static float   neutron_cps_cache[MAX_FILE_DATA_PART1];
     static float   neutron_cpm_average_cache[MAX_FILE_DATA_PART1];
 
     // init the start and end of the range to be averaged
@@ -2178,7 +2767,8 @@ static float neutron_cpm(int32_t file_idx)
     // if cached average cpm value is not available then
     // compute it
     if (neutron_cpm_average_cache[file_idx] == -1) {
-        int32_t sum = 0, n = 0, i, j, cps;
+        float   sum = 0, cps;
+        int32_t n = 0, i, j;
 
         // loop over range to average
         for (i = file_idx_avg_start; i <= file_idx_avg_end; i++) {
@@ -2195,13 +2785,23 @@ static float neutron_cpm(int32_t file_idx)
 
                 // count the number of pulses which have height greater or
                 // equal to the pulse-height-threshold
+                int16_t * pulse_mv = read_neutron_pulse_mv(i);
+                if (pulse_mv == NULL) {
+                    return ERROR_NO_VALUE;
+                }
                 cps = 0;
                 for (j = 0; j < dp1->max_neutron_pulse; j++) {
-                    if (dp1->neutron_pulse_mv[j] >= neutron_pht_mv) {
+                    if (pulse_mv[j] >= neutron_pht_mv) {
                         cps++;
                     }
                 }
 
+                // if mccdaq samples were lost during this second then correct 
+                // the count for the live time
+                if (dp1->neutron_live_permyriad > 0 && dp1->neutron_live_permyriad < 10000) {
+                    cps = cps * 10000 / dp1->neutron_live_permyriad;
+                }
+
                 // save the result in the neutron_cps_cache
                 neutron_cps_cache[i] = cps;
             }
@@ -2212,7 +2812,7 @@ static float neutron_cpm(int32_t file_idx)
         }
 
         // compute cached average cpm value
-        neutron_cpm_average_cache[file_idx] = (float)sum / n * 60;
+        neutron_cpm_average_cache[file_idx] = sum / n * 60;
     }
 
     // return the cached average cpm value
@@ -33,28 +33,65 @@ SOFTWARE.
 #include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <math.h>
 
 #include <pthread.h>
 #include <signal.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <fcntl.h>
 
 #include "common.h"
 #include "util_dataq.h"
 #include "util_mccdaq.h"
+#include "util_pulse.h"
+#include "util_capture.h"
+#include "util_journal.h"
 #include "util_cam.h"
 #include "util_misc.h"
+#include "util_proto.h"
+#include "util_shm.h"
 
 //
 // defines
 //
 
 //#define CAM_ENABLE
-//#define DEBUG_PRINT_PULSE_GRAPH
+
+#if PULSE_MAX_DATA != MAX_NEUTRON_ADC_PULSE_DATA
+#error "PULSE_MAX_DATA must equal MAX_NEUTRON_ADC_PULSE_DATA"
+#endif
 
 #define GAS_ID_D2 0
 #define GAS_ID_N2 1
 
+#define NEUTRON_SNIPPET_DEFAULT     100   // default max pulses per sec with adc_pulse_data
+#define NEUTRON_SPECTRUM_WRITE_SEC  10    // interval for writing the cumulative spectrum file
+
+#define SAMPLE_CLOCK_KP             0.1     // pll phase gain
+#define SAMPLE_CLOCK_KI             0.002   // pll frequency gain
+#define SAMPLE_CLOCK_RELOCK_US      20000   // phase error which causes the pll to relock
+#define SAMPLE_CLOCK_MAX_PPM        1000    // limit of frequency correction
+
+#define MAX_CLIENT                  8     // max connected display programs
+#define CLIENT_QUEUE_LEN            4     // max records queued to a client, power of 2
+#define CLIENT_SNDBUF               65536 // client socket send buffer size, kept small so that
+                                          //  a lagging client is seen by its queue filling
+
+#define UPDATE_HZ_DEFAULT           10    // default rate of the partial updates sent to clients
+#define MAX_UPDATE_HZ               50
+#define UPDATE_ADC_MARGIN           32    // adc values requested beyond those expected, so 
+                                          //  that values arriving meanwhile are not missed
+
+#define HISTORY_SEC_DEFAULT         600   // default secs of frames kept for backfilling clients
+#define MAX_HISTORY_SEC             3600
+
+#define LAG_POLICY_DROP_OLDEST      0     // when a client's queue is full, drop its oldest record
+#define LAG_POLICY_DISCONNECT       1     // when a client's queue is full, disconnect it
+
 #define ATOMIC_INCREMENT(x) \
     do { \
         __sync_fetch_and_add(x,1); \
@@ -69,15 +106,101 @@ SOFTWARE.
 // typedefs
 //
 
+typedef struct {
+    uint64_t         time;              // the second that ends with this window
+    int64_t          start_pos;         // detector stream position of the start of the window
+    int32_t          samples;
+    int32_t          pulses;            // all pulses, including overflow
+    int16_t          pulse_mv[MAX_NEUTRON_PULSE_PER_SEC];
+    int32_t          pulse_time[MAX_NEUTRON_PULSE_PER_SEC];
+    uint16_t         snippet_idx[MAX_NEUTRON_SNIPPET];
+    int16_t          adc_pulse_data[MAX_NEUTRON_SNIPPET][MAX_NEUTRON_ADC_PULSE_DATA];
+    uint32_t         spectrum[MAX_NEUTRON_SPECTRUM_BIN];
+    int32_t          max_pulse;
+    int32_t          max_snippet;
+    int32_t          snippet_stride;
+    int32_t          pulse_overflow;
+    float            baseline_mv;       // detector baseline and noise sigma at the end of the window
+    float            noise_mv;
+    bool             complete;          // set when the window ends, cleared when published
+} window_t;
+
+typedef struct {
+    int32_t          chan;              // mccdaq analog input
+    int32_t          threshold;         // adc units above the baseline
+    pulse_detector_t detector;
+
+    // pulses are accumulated in win[cur] until the detector has examined the samples
+    // preceding window_end_pos; win[cur] is then complete, and accumulation continues 
+    // in the other window, see chan_window_end
+    window_t         win[2];
+    int32_t          cur;
+    int64_t          window_end_pos;
+    int64_t          next_window_end_pos;
+    uint64_t         next_window_time;
+
+    // pulse height histogram since get_data started
+    uint64_t         cumulative_spectrum[MAX_NEUTRON_SPECTRUM_BIN];
+} chan_t;
+
+typedef struct {
+    int32_t          chan;
+    int32_t          pulses;
+    int32_t          samples;
+    uint32_t         spectrum[MAX_NEUTRON_SPECTRUM_BIN];
+} aux_chan_result_t;
+
+// a second's data_t, built once by the aggregate_thread, and shared by the 
+// clients it is sent to; it is not modified after it is published, and is
+// freed when the last reference is put; update and history records have only 
+// the frame, and their data and v1 are NULL
+typedef struct {
+    int32_t          refcnt;
+    int32_t          len;               // bytes of data
+    uint64_t         time;
+    bool             update;            // frame is an update frame
+    uint8_t        * frame;             // the data encoded as a version 2 frame
+    int32_t          frame_len;
+    uint8_t        * v1;                // the data encoded as a version 1 record
+    int32_t          v1_len;
+    data_t         * data;              // follows the record_t, part2 is variable length
+} record_t;
+
+typedef struct {
+    int32_t          sockfd;            // -1 if this client slot is free
+    char             name[100];
+    record_t       * queue[CLIENT_QUEUE_LEN];
+    uint32_t         queue_head;        // queue[queue_head] is the next to be sent
+    uint32_t         queue_tail;
+    record_t       * send_rec;          // the record being sent, NULL if none
+    int32_t          send_offset;       // bytes of send_rec that have been sent
+    uint32_t         send_version;      // protocol version send_rec is being sent with
+    uint32_t         version;           // protocol version, 1 until the client's hello is received
+    uint8_t          msg[sizeof(proto_hello_t)];   // message being received from the client
+    int32_t          msg_len;
+    bool             msg_invalid;       // an invalid message was received, the rest is ignored
+    bool             backfill;          // sending the history records after backfill_time
+    uint64_t         backfill_time;
+    uint64_t         sent_time;         // time of the last record sent, excluding updates
+    bool             epollout;          // waiting for the socket to be writable
+    uint64_t         dropped;
+    uint64_t         backfilled;
+} client_t;
+
 //
 // variables
 //
 
 static int32_t         active_thread_count;
 static bool            sigint_or_sigterm;
+static char            capture_filename[PATH_MAX];
+static char            dataq_stream_filename[PATH_MAX];
+static char            spectrum_filename[PATH_MAX];
+static char            journal_dirname[PATH_MAX];
+static int32_t         neutron_max_snippet = NEUTRON_SNIPPET_DEFAULT;
 
 #ifdef CAM_ENABLE
-static uint8_t         jpeg_buff[1000000];
+static uint8_t         jpeg_buff[MAX_JPEG_BUFF_LEN];
 static int32_t         jpeg_buff_len;
 static uint64_t        jpeg_buff_us;
 static pthread_mutex_t jpeg_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -85,9 +208,68 @@ static pthread_mutex_t jpeg_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static pthread_mutex_t neutron_mutex = PTHREAD_MUTEX_INITIALIZER;
 static uint64_t        neutron_time;
-static int16_t         neutron_pulse_mv[MAX_NEUTRON_PULSE];  // store pulse height for each pulse, in mv
-static int16_t         neutron_adc_pulse_data[MAX_NEUTRON_PULSE][MAX_NEUTRON_ADC_PULSE_DATA];   // mv
+static int16_t         neutron_pulse_mv[MAX_NEUTRON_PULSE_PER_SEC];  // store pulse height for each pulse, in mv
+static int32_t         neutron_pulse_time[MAX_NEUTRON_PULSE_PER_SEC];  // samples since start of second
+static uint16_t        neutron_snippet_idx[MAX_NEUTRON_SNIPPET];     // index into neutron_pulse_mv
+static int16_t         neutron_adc_pulse_data[MAX_NEUTRON_SNIPPET][MAX_NEUTRON_ADC_PULSE_DATA];   // mv
+static uint32_t        neutron_spectrum[MAX_NEUTRON_SPECTRUM_BIN];   // pulse height histogram
 static int32_t         max_neutron_pulse;
+static int32_t         max_neutron_snippet;
+static int32_t         neutron_pulse_overflow;
+static uint16_t        neutron_live_permyriad;   // see data_part1_s
+static uint16_t        neutron_mccdaq_restarts;
+static float           neutron_baseline_mv;
+static float           neutron_noise_mv;
+
+// records are built by the aggregate_thread, and passed to the server's
+// event loop through published_record, which is signalled by record_eventfd
+static pthread_mutex_t record_mutex = PTHREAD_MUTEX_INITIALIZER;
+static record_t      * published_record;
+static int32_t         record_eventfd = -1;
+
+// server event loop, the clients are accessed only by the event loop
+static client_t        client[MAX_CLIENT];
+static int32_t         epoll_fd;
+static int32_t         lag_policy = LAG_POLICY_DROP_OLDEST;
+static int32_t         server_clients;
+static uint64_t        server_dropped;        // records dropped for lagging clients
+static uint64_t        server_lag_disconnects;
+static int32_t         update_hz = UPDATE_HZ_DEFAULT;
+static int32_t         update_timerfd = -1;
+static bool            update_dataq_okay;    // the last record's adc data was valid
+static int32_t         server_record_len;     // length of the last record, version 1
+static int32_t         server_frame_len;
+static uint64_t        server_backfilled;     // records sent to clients by backfill
+
+// frames of the recent records, for backfilling clients that reconnect; history[]
+// is indexed by time modulo history_sec, and is accessed only by the event loop
+static record_t      * history[MAX_HISTORY_SEC];
+static int32_t         history_sec = HISTORY_SEC_DEFAULT;
+static uint64_t        history_last_time;
+static record_t      * backfill_done;         // the frame that ends a backfill
+
+// per mccdaq channel pulse detection, chan[0] is the neutron detector and the 
+// others are auxiliary detectors; the pulses found during the current window are
+// accessed only by the channel's mccdaq_callback, and the completed windows are 
+// published to the neutron_xxx variables above, or aux_chan_result, by 
+// mccdaq_batch_callback
+static chan_t          chan[MCCDAQ_MAX_CHAN];
+static int32_t         max_chan = 1;
+static int32_t         chan_idx[MCCDAQ_MAX_CHAN];   // mccdaq analog input to chan index
+static uint64_t        cumulative_spectrum_start;
+
+static aux_chan_result_t aux_chan_result[MAX_AUX_CHAN];
+static int32_t         max_aux_chan_result;
+
+// sample clock, maps the detector stream position to CLOCK_REALTIME; 
+// accessed only by mccdaq_batch_callback
+static bool            sample_clock_locked;
+static double          sample_clock_ref_pos;     // stream position at sample_clock_ref_us
+static uint64_t        sample_clock_ref_us;
+static double          sample_clock_freq;        // samples per second
+static double          sample_clock_nominal_freq;
+static double          sample_clock_phase_err;   // samples, at the last update
+static int32_t         sample_clock_relocks;
 
 //
 // prototypes
@@ -99,21 +281,149 @@ static void server(void);
 static void * cam_thread(void * cx);
 #endif
 static void signal_handler(int sig);
-static void * server_thread(void * cx);
+static void * aggregate_thread(void * cx);
+static record_t * record_alloc(bool with_data);
+static record_t * update_build(void);
+static void record_get(record_t * rec);
+static void record_put(record_t * rec);
+static void server_accept(int32_t listen_sockfd);
+static void server_publish(record_t * rec);
+static void history_add(record_t * rec);
+static record_t * history_next(uint64_t time);
+static void client_send(client_t * c);
+static void client_recv(client_t * c);
+static void client_backfill(client_t * c, uint64_t time);
+static void client_close(client_t * c, char * reason);
 static void init_data_struct(data_t * data, time_t time_now);
 static float convert_adc_voltage(float adc_volts);
 static float convert_adc_current(float adc_volts);
 static float convert_adc_pressure(float adc_volts, int32_t gas_id);
-static int32_t mccdaq_callback(uint16_t * data, int32_t max_data);
-#ifdef DEBUG_PRINT_PULSE_GRAPH
-static void print_plot_str(int32_t value, int32_t baseline);
-#endif
+static int32_t mccdaq_callback(int32_t chan, uint16_t * data, int32_t max_data);
+static int32_t mccdaq_batch_callback(void);
+static void chan_window_end(chan_t * c);
+static void sample_clock_init(int64_t pos, uint64_t real_us, double freq);
+static void sample_clock_update(int64_t pos, uint64_t real_us);
+static int64_t sample_clock_pos(uint64_t real_us);
+static uint64_t sample_clock_real_us(int64_t pos);
+static void neutron_pulse_callback(void * cx, pulse_t * pulse);
+static int32_t encode_spectrum(uint32_t * spectrum, uint16_t (*entry)[2]);
+static int32_t encode_pulse_time(int32_t * pulse_time, int32_t max_pulse_time, uint8_t * buff);
+static void write_cumulative_spectrum(void);
+static int32_t parse_int_list(char * str, int32_t * list, int32_t max_list);
 
 // -----------------  MAIN & TOP LEVEL ROUTINES  -------------------------------------
 
 int32_t main(int32_t argc, char **argv)
 {
-    int32_t wait_ms;
+    int32_t wait_ms, i, n;
+    int32_t list[MCCDAQ_MAX_CHAN];
+
+    // init the channels, by default only the neutron channel, mccdaq input 0
+    for (i = 0; i < MCCDAQ_MAX_CHAN; i++) {
+        chan[i].chan = i;
+        chan[i].threshold = PULSE_DEFAULT_THRESHOLD;
+    }
+
+    // parse options
+    // -c filename : capture the raw mccdaq samples to filename
+    // -m filename : periodically write the cumulative pulse height spectrum to filename
+    // -s snippets : max pulses per second that include adc_pulse_data, 0 disables
+    // -i inputs   : comma seperated list of mccdaq analog inputs to scan, the first is 
+    //               the neutron detector, the others are auxiliary detectors; default 0
+    // -t thresh   : comma seperated list of pulse thresholds, in adc units, for each input
+    // -a filename : write the full rate dataq voltage, current and pressure samples to filename
+    // -p policy   : when a client falls behind by more than CLIENT_QUEUE_LEN records, 
+    //               'drop' its oldest records (default), or 'disconnect' it
+    // -u hz       : rate of the partial updates sent to the clients between the 
+    //               records, 0 disables, default 10
+    // -H secs     : secs of records kept for backfilling the clients that reconnect,
+    //               0 disables, default 600
+    // -j dirname  : write each second's record to a rotating journal in dirname, 
+    //               see util_journal.h and journal_merge
+    while (true) {
+        char opt_char = getopt(argc, argv, "c:m:s:i:t:a:p:u:H:j:");
+        if (opt_char == -1) {
+            break;
+        }
+        switch (opt_char) {
+        case 'c':
+            strncpy(capture_filename, optarg, sizeof(capture_filename)-1);
+            break;
+        case 'm':
+            strncpy(spectrum_filename, optarg, sizeof(spectrum_filename)-1);
+            break;
+        case 's':
+            if (sscanf(optarg, "%d", &neutron_max_snippet) != 1 ||
+                neutron_max_snippet < 0 || neutron_max_snippet > MAX_NEUTRON_SNIPPET) 
+            {
+                ERROR("invalid snippets '%s', range 0 - %d\n", optarg, MAX_NEUTRON_SNIPPET);
+                return 1;
+            }
+            break;
+        case 'i':
+            n = parse_int_list(optarg, list, MCCDAQ_MAX_CHAN);
+            if (n <= 0) {
+                ERROR("invalid inputs '%s'\n", optarg);
+                return 1;
+            }
+            for (i = 0; i < n; i++) {
+                if (list[i] < 0 || list[i] >= MCCDAQ_MAX_CHAN || (i > 0 && list[i] <= list[i-1])) {
+                    ERROR("invalid inputs '%s', must be ascending, range 0 - %d\n", 
+                          optarg, MCCDAQ_MAX_CHAN-1);
+                    return 1;
+                }
+                chan[i].chan = list[i];
+            }
+            max_chan = n;
+            break;
+        case 't':
+            n = parse_int_list(optarg, list, MCCDAQ_MAX_CHAN);
+            if (n <= 0) {
+                ERROR("invalid thresholds '%s'\n", optarg);
+                return 1;
+            }
+            for (i = 0; i < n; i++) {
+                if (list[i] <= 0 || list[i] > 4095) {
+                    ERROR("invalid thresholds '%s', range 1 - 4095\n", optarg);
+                    return 1;
+                }
+                chan[i].threshold = list[i];
+            }
+            break;
+        case 'a':
+            strncpy(dataq_stream_filename, optarg, sizeof(dataq_stream_filename)-1);
+            break;
+        case 'j':
+            strncpy(journal_dirname, optarg, sizeof(journal_dirname)-1);
+            break;
+        case 'p':
+            if (strcmp(optarg, "drop") == 0) {
+                lag_policy = LAG_POLICY_DROP_OLDEST;
+            } else if (strcmp(optarg, "disconnect") == 0) {
+                lag_policy = LAG_POLICY_DISCONNECT;
+            } else {
+                ERROR("invalid policy '%s', must be 'drop' or 'disconnect'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'u':
+            if (sscanf(optarg, "%d", &update_hz) != 1 || update_hz < 0 || update_hz > MAX_UPDATE_HZ) {
+                ERROR("invalid update rate '%s', range 0 - %d\n", optarg, MAX_UPDATE_HZ);
+                return 1;
+            }
+            break;
+        case 'H':
+            if (sscanf(optarg, "%d", &history_sec) != 1 || history_sec < 0 || history_sec > MAX_HISTORY_SEC ||
+                (history_sec > 0 && history_sec < CLIENT_QUEUE_LEN))
+            {
+                ERROR("invalid history '%s', 0 or range %d - %d\n", optarg, CLIENT_QUEUE_LEN, MAX_HISTORY_SEC);
+                return 1;
+            }
+            break;
+        default:
+            return 1;
+        }
+    }
 
     // init
     init();
@@ -122,12 +432,15 @@ int32_t main(int32_t argc, char **argv)
     server();
 
     // terminate
+    capture_stop();
+    journal_stop();
     for (wait_ms = 0; active_thread_count > 0 && wait_ms < 5000; wait_ms++) {
         usleep(1000);
     }
     if (active_thread_count > 0) {
         ERROR("all threads did not terminate, active_thread_count=%d\n", active_thread_count);
     }
+    shm_stop();
     INFO("terminating\n");
     return 0;
 }
@@ -136,6 +449,8 @@ static void init(void)
 {
     struct rlimit rl;
     struct sigaction action;
+    uint32_t chan_mask = 0;
+    int32_t i;
 
     // use line bufferring
     setlinebuf(stdout);
@@ -173,30 +488,72 @@ static void init(void)
 #endif
 
     // init dataq device used to acquire chamber voltage, current and pressure readings
-    dataq_init(0.5,   // averaging duration in secs
-               1200,  // scan rate  (samples per second)
-               3,     // number of adc channels
+    // the device scans at its maximum rate, and the adc values are filtered and 
+    // resampled to MAX_ADC_DATA samples per second
+    dataq_init(0.5,                   // averaging duration in secs
+               DATAQ_MAX_SCAN_HZ(3),  // scan rate  (scans per second)
+               MAX_ADC_DATA,          // resampled rate (samples per second)
+               3,                     // number of adc channels
                DATAQ_ADC_CHAN_VOLTAGE,
                DATAQ_ADC_CHAN_CURRENT,
                DATAQ_ADC_CHAN_PRESSURE);
+    if (dataq_stream_filename[0] != '\0') {
+        if (dataq_stream_start(dataq_stream_filename) != 0) {
+            FATAL("failed to start dataq stream to %s\n", dataq_stream_filename);
+        }
+    }
 
     // init mccdaq device, used to acquire 500000 samples per second from the
-    // ludlum 2929 amplifier output
+    // ludlum 2929 amplifier output; the samples are shared evenly by the channels, 
+    // each of which has its own pulse detector; the capture file, if enabled, 
+    // contains the neutron channel samples
+    cumulative_spectrum_start = time(NULL);
+    for (i = 0; i < max_chan; i++) {
+        chan_idx[chan[i].chan] = i;
+        chan[i].win[0].snippet_stride = 1;
+        chan[i].window_end_pos = INT64_MAX - PULSE_LOOKAHEAD;  // set when the sample clock starts
+        pulse_detector_init(&chan[i].detector, chan[i].threshold, PULSE_DEFAULT_MAX_WIDTH,
+                            neutron_pulse_callback, &chan[i]);
+        chan_mask |= (1 << chan[i].chan);
+        INFO("mccdaq input %d: %s, threshold %d\n", 
+             chan[i].chan, i == 0 ? "neutron" : "aux", chan[i].threshold);
+    }
+    if (capture_filename[0] != '\0') {
+        if (capture_start(capture_filename, 500000 / max_chan) != 0) {
+            FATAL("failed to start capture to %s\n", capture_filename);
+        }
+    }
+    if (journal_dirname[0] != '\0') {
+        if (journal_start(journal_dirname) != 0) {
+            FATAL("failed to start journal in %s\n", journal_dirname);
+        }
+    }
     mccdaq_init();
-    mccdaq_start(mccdaq_callback);
+    mccdaq_start(chan_mask, mccdaq_callback, mccdaq_batch_callback);
 }
 
+// The server is an event loop, on the main thread, that accepts connections from
+// the display programs, and sends each second's record to all of them using 
+// non-blocking sockets. Each client has a queue of references to the records
+// waiting to be sent to it; when a slow client's queue is full then, depending
+// on lag_policy, its oldest unsent record is dropped or it is disconnected. 
+// So a slow client doesn't delay the others, and no thread blocks in send.
+// The records and updates are also published to shared memory, for a display
+// program on this computer, see util_shm.h.
+
 static void server(void)
 {
     struct sockaddr_in server_address;
+    struct epoll_event ev, events[MAX_CLIENT+3];
     int32_t            listen_sockfd;
-    int32_t            ret;
-    pthread_t          thread;
-    pthread_attr_t     attr;
+    int32_t            ret, i, n;
     int32_t            optval;
+    pthread_t          thread;
+    uint64_t           cnt;
+    record_t         * rec;
 
     // create socket
-    listen_sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    listen_sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (listen_sockfd == -1) {
         FATAL("socket, %s\n", strerror(errno));
     }
@@ -221,41 +578,140 @@ static void server(void)
     }
 
     // listen 
-    ret = listen(listen_sockfd, 50);
+    ret = listen(listen_sockfd, MAX_CLIENT);
     if (ret == -1) {
         FATAL("listen, %s\n", strerror(errno));
     }
 
-    // init thread attributes to make thread detached
-    if (pthread_attr_init(&attr) != 0) {
-        FATAL("pthread_attr_init, %s\n", strerror(errno));
+    // create the shared memory, which is used by a display program on this 
+    // computer instead of a connection; if this fails the displays use TCP
+    shm_start();
+
+    // create the epoll instance, and add the listen socket and the eventfd
+    // that signals a record has been published
+    for (i = 0; i < MAX_CLIENT; i++) {
+        client[i].sockfd = -1;
+    }
+    record_eventfd = eventfd(0, EFD_NONBLOCK);
+    epoll_fd = epoll_create1(0);
+    if (record_eventfd == -1 || epoll_fd == -1) {
+        FATAL("eventfd or epoll_create1, %s\n", strerror(errno));
     }
-    if (pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0) {
-        FATAL("pthread_attr_setdetachstate, %s\n", strerror(errno));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listen_sockfd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_sockfd, &ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &record_eventfd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, record_eventfd, &ev);
+
+    // if enabled, create the timer that paces the partial updates
+    if (update_hz > 0) {
+        struct itimerspec its;
+        update_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if (update_timerfd == -1) {
+            FATAL("timerfd_create, %s\n", strerror(errno));
+        }
+        its.it_interval.tv_sec  = 0;
+        its.it_interval.tv_nsec = 1000000000 / update_hz;
+        its.it_value            = its.it_interval;
+        timerfd_settime(update_timerfd, 0, &its, NULL);
+        ev.events = EPOLLIN;
+        ev.data.ptr = &update_timerfd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, update_timerfd, &ev);
     }
 
-    // loop, accepting connection, and create thread to service the client
-    INFO("server: accepting connections\n");
-    while (1) {
-        int                sockfd;
-        socklen_t          len;
-        struct sockaddr_in address;
+    // create the frame that ends a backfill; a reference is held, so it is not freed
+    backfill_done = record_alloc(false);
+    backfill_done->frame_len = sizeof(proto_frame_hdr_t);
+    backfill_done->frame = calloc(1, sizeof(proto_frame_hdr_t));
+    if (backfill_done->frame == NULL) {
+        FATAL("alloc backfill frame failed\n");
+    }
+    ((proto_frame_hdr_t*)backfill_done->frame)->magic = MAGIC_PROTO_BACKFILL;
+    ((proto_frame_hdr_t*)backfill_done->frame)->version = PROTO_VERSION;
 
-        // accept connection
-        len = sizeof(address);
-        sockfd = accept(listen_sockfd, (struct sockaddr *) &address, &len);
-        if (sockfd == -1) {
-            if (sigint_or_sigterm) {
-                break;
+    // create the thread that builds each second's record
+    if (pthread_create(&thread, NULL, aggregate_thread, NULL) != 0) {
+        FATAL("pthread_create aggregate_thread, %s\n", strerror(errno));
+    }
+    pthread_detach(thread);
+
+    // event loop
+    INFO("server: accepting connections, max %d, lag policy %s, updates %d/sec, history %d secs\n", 
+         MAX_CLIENT, lag_policy == LAG_POLICY_DROP_OLDEST ? "drop oldest" : "disconnect",
+         update_hz, history_sec);
+    while (true) {
+        n = epoll_wait(epoll_fd, events, MAX_CLIENT+3, -1);
+        if (sigint_or_sigterm) {
+            break;
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
             }
-            FATAL("accept, %s\n", strerror(errno));
+            FATAL("epoll_wait, %s\n", strerror(errno));
         }
 
-        // create thread
-        if (pthread_create(&thread, &attr, server_thread, (void*)(uintptr_t)sockfd) != 0) {
-            FATAL("pthread_create server_thread, %s\n", strerror(errno));
+        for (i = 0; i < n; i++) {
+            // if a connection is pending then accept it
+            if (events[i].data.ptr == &listen_sockfd) {
+                server_accept(listen_sockfd);
+                continue;
+            }
+
+            // if a record has been published then queue it to the clients
+            if (events[i].data.ptr == &record_eventfd) {
+                read(record_eventfd, &cnt, sizeof(cnt));
+                pthread_mutex_lock(&record_mutex);
+                rec = published_record;
+                published_record = NULL;
+                pthread_mutex_unlock(&record_mutex);
+                if (rec) {
+                    server_publish(rec);
+                    record_put(rec);
+                }
+                continue;
+            }
+
+            // if it is time for a partial update then build it, and send it to 
+            // the clients that are not behind, and to the shared memory readers
+            if (events[i].data.ptr == &update_timerfd) {
+                read(update_timerfd, &cnt, sizeof(cnt));
+                if (server_clients > 0 || shm_reader_active()) {
+                    rec = update_build();
+                    server_publish(rec);
+                    record_put(rec);
+                }
+                continue;
+            }
+
+            // client event:
+            // - receive the client's hello; and if the client closed its connection, 
+            //   or it errored, then close it
+            // - if the socket is writable then continue sending
+            client_t * c = events[i].data.ptr;
+            if (c->sockfd == -1) {
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                client_recv(c);
+                if (c->sockfd == -1) {
+                    continue;
+                }
+            }
+            if (events[i].events & EPOLLOUT) {
+                client_send(c);
+            }
+        }
+    }
+
+    // close all clients
+    for (i = 0; i < MAX_CLIENT; i++) {
+        if (client[i].sockfd != -1) {
+            client_close(&client[i], NULL);
         }
     }
+    close(listen_sockfd);
 }
 
 #ifdef CAM_ENABLE
@@ -302,76 +758,556 @@ static void signal_handler(int sig)
     sigint_or_sigterm = true;
 }
 
-// -----------------  SERVER_THREAD  -------------------------------------------------
+// -----------------  SERVER  --------------------------------------------------------
 
-static void * server_thread(void * cx)
+static void server_accept(int32_t listen_sockfd)
 {
-    int32_t   sockfd = (uintptr_t)cx;
-    time_t    time_now, time_last;
-    ssize_t   len;
-    data_t  * data;
+    struct sockaddr_in address;
+    struct epoll_event ev;
+    socklen_t          len;
+    client_t         * c = NULL;
+    int32_t            sockfd, i, optval;
+    char               s[100];
 
-    ATOMIC_INCREMENT(&active_thread_count);
+    while (true) {
+        // accept connection
+        len = sizeof(address);
+        sockfd = accept(listen_sockfd, (struct sockaddr *) &address, &len);
+        if (sockfd == -1) {
+            if (errno != EAGAIN && errno != EINTR) {
+                ERROR("accept, %s\n", strerror(errno));
+            }
+            return;
+        }
+        fcntl(sockfd, F_SETFL, O_NONBLOCK);
+        optval = CLIENT_SNDBUF;
+        setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &optval, sizeof(optval));
+
+        // find a free client slot, if none then reject the connection
+        for (i = 0; i < MAX_CLIENT; i++) {
+            if (client[i].sockfd == -1) {
+                c = &client[i];
+                break;
+            }
+        }
+        if (i == MAX_CLIENT) {
+            WARN("rejected connection from %s, max clients %d\n", 
+                 sock_addr_to_str(s, sizeof(s), (struct sockaddr *)&address), MAX_CLIENT);
+            close(sockfd);
+            continue;
+        }
 
-    INFO("accepted connection, sockfd=%d\n", sockfd);
+        // init the client, and add it to the epoll instance; the client is sent
+        // protocol version 1 until its hello is received
+        bzero(c, sizeof(client_t));
+        c->sockfd = sockfd;
+        c->version = 1;
+        sock_addr_to_str(c->name, sizeof(c->name), (struct sockaddr *)&address);
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = c;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sockfd, &ev);
+        server_clients++;
+        INFO("accepted connection from %s, sockfd=%d, clients=%d\n", c->name, sockfd, server_clients);
+    }
+}
 
-    time_last = time(NULL);
-    data = malloc(sizeof(data_t) + 1000000);
+static void server_publish(record_t * rec)
+{
+    client_t * c;
+    uint32_t   qlen, i;
 
+    // keep the record's frame for backfilling
+    if (!rec->update) {
+        history_add(rec);
+    }
+
+    for (c = client; c < &client[MAX_CLIENT]; c++) {
+        if (c->sockfd == -1) {
+            continue;
+        }
+
+        // a client that is being backfilled is sent this record by the backfill
+        if (c->backfill) {
+            continue;
+        }
+
+        // updates are sent only to clients that support them, and that have sent
+        // everything queued, so they never delay a record
+        if (rec->update && (c->version < 3 || c->send_rec != NULL || c->queue_head != c->queue_tail)) {
+            continue;
+        }
+
+        // if the client's queue is full then it is lagging:
+        // - LAG_POLICY_DISCONNECT: disconnect it
+        // - LAG_POLICY_DROP_OLDEST: drop its oldest queued record
+        qlen = c->queue_tail - c->queue_head;
+        if (qlen == CLIENT_QUEUE_LEN) {
+            if (lag_policy == LAG_POLICY_DISCONNECT) {
+                server_lag_disconnects++;
+                client_close(c, "lagging");
+                continue;
+            }
+            i = c->queue_head++;
+            record_put(c->queue[i % CLIENT_QUEUE_LEN]);
+            c->dropped++;
+            server_dropped++;
+        }
+
+        // queue a reference to the record, and send
+        record_get(rec);
+        c->queue[c->queue_tail++ % CLIENT_QUEUE_LEN] = rec;
+        client_send(c);
+    }
+}
+
+static void history_add(record_t * rec)
+{
+    record_t * h;
+    int32_t    idx;
+
+    if (history_sec == 0) {
+        return;
+    }
+
+    // the history holds a copy of the frame, so that the record's data is freed 
+    // when its clients have been sent it
+    h = record_alloc(false);
+    h->time = rec->time;
+    h->frame_len = rec->frame_len;
+    h->frame = malloc(rec->frame_len);
+    if (h->frame == NULL) {
+        FATAL("alloc history frame failed\n");
+    }
+    memcpy(h->frame, rec->frame, rec->frame_len);
+
+    // replace the record that is history_sec older
+    idx = rec->time % history_sec;
+    if (history[idx]) {
+        record_put(history[idx]);
+    }
+    history[idx] = h;
+    history_last_time = rec->time;
+}
+
+// returns the history record with the lowest time after time, or NULL if none
+static record_t * history_next(uint64_t time)
+{
+    record_t * h;
+    uint64_t   t;
+
+    if (history_sec == 0 || time >= history_last_time) {
+        return NULL;
+    }
+
+    // the times are searched because seconds are missing from the history if 
+    // get_data was not building records, or the clock was stepped
+    t = (history_last_time - time > history_sec ? history_last_time - history_sec : time) + 1;
+    for (; t <= history_last_time; t++) {
+        h = history[t % history_sec];
+        if (h && h->time == t) {
+            return h;
+        }
+    }
+    return NULL;
+}
+
+static void client_send(client_t * c)
+{
+    struct epoll_event ev;
+    record_t * rec;
+    uint8_t  * buff;
+    int32_t    buff_len;
+    ssize_t    len;
+    bool       more;
+
+    // send until the socket would block, or there is nothing more to send
     while (true) {
-        // wait for time_now to change (should be an increase by 1 second from time_last)
-        while (true) {
-            time_now = time(NULL);
-            if (time_now != time_last) {
+        // if no record is being sent then start the next: while backfilling, the next
+        // history record, or when there are none the backfill_done frame; otherwise the
+        // oldest queued record; a change of the client's protocol version takes effect 
+        // at the start of a record
+        if (c->send_rec == NULL) {
+            if (c->backfill) {
+                rec = history_next(c->backfill_time);
+                if (rec) {
+                    c->backfill_time = rec->time;
+                    c->backfilled++;
+                    server_backfilled++;
+                } else {
+                    INFO("client %s backfill complete, records=%"PRId64"\n", c->name, c->backfilled);
+                    rec = backfill_done;
+                    c->backfill = false;
+                }
+                record_get(rec);
+            } else if (c->queue_head != c->queue_tail) {
+                rec = c->queue[c->queue_head++ % CLIENT_QUEUE_LEN];
+                if (!rec->update) {
+                    c->sent_time = rec->time;
+                }
+            } else {
                 break;
             }
-            usleep(1000);  // 1 ms
-            if (sigint_or_sigterm) {
-                goto exit_thread;
+            c->send_rec = rec;
+            c->send_offset = 0;
+            c->send_version = c->version;
+        }
+
+        // send the record
+        rec = c->send_rec;
+        if (c->send_version >= 2) {
+            buff = rec->frame;
+            buff_len = rec->frame_len;
+        } else {
+            buff = rec->v1;
+            buff_len = rec->v1_len;
+        }
+        len = send(c->sockfd, buff + c->send_offset, buff_len - c->send_offset, 
+                   MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                break;
             }
+            client_close(c, strerror(errno));
+            return;
+        }
+        c->send_offset += len;
+        if (c->send_offset == buff_len) {
+            record_put(rec);
+            c->send_rec = NULL;
         }
+    }
 
-        // sanity check time_now, should be time_last+1
-        if (time_now < time_last) {
-            ERROR("terminating connection - time has gone backwards\n");
-            break;
+    // wait for the socket to be writable only while there is more to send
+    more = (c->send_rec != NULL || c->backfill || c->queue_head != c->queue_tail);
+    if (c->epollout != more) {
+        c->epollout = more;
+        ev.events = EPOLLIN | EPOLLRDHUP | (c->epollout ? EPOLLOUT : 0);
+        ev.data.ptr = c;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->sockfd, &ev);
+    }
+}
+
+static void client_recv(client_t * c)
+{
+    proto_hello_t    * hello = (proto_hello_t *)c->msg;
+    proto_backfill_t * backfill = (proto_backfill_t *)c->msg;
+    uint8_t            buff[100];
+    ssize_t            len;
+
+    // the client sends a hello, optionally followed by a backfill request, and 
+    // older clients send nothing; if the client closed its connection, or it 
+    // errored, then close it
+    while (true) {
+        if (!c->msg_invalid) {
+            len = recv(c->sockfd, c->msg + c->msg_len, sizeof(c->msg) - c->msg_len, MSG_DONTWAIT);
+        } else {
+            len = recv(c->sockfd, buff, sizeof(buff), MSG_DONTWAIT);
         }
-        if (time_now != time_last+1) {
-            WARN("time_now - time_last = %ld\n", time_now-time_last);
+        if (len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR)) {
+            client_close(c, len == 0 ? "closed by client" : strerror(errno));
+            return;
+        }
+        if (len < 0) {
+            return;
         }
+        if (c->msg_invalid) {
+            continue;
+        }
+        c->msg_len += len;
+        if (c->msg_len < sizeof(c->msg)) {
+            continue;
+        }
+        c->msg_len = 0;
 
-        // init data struct
-        init_data_struct(data, time_now);
+        // hello: set the client's protocol version to the lower of the client's 
+        // and this program's
+        if (hello->magic == MAGIC_PROTO_HELLO && hello->version >= 1) {
+            c->version = (hello->version < PROTO_VERSION ? hello->version : PROTO_VERSION);
+            INFO("client %s protocol version %d\n", c->name, c->version);
+            continue;
+        }
 
-        // send data struct
-        len = do_send(sockfd, data, sizeof(data_t)+data->part1.data_part2_jpeg_buff_len);
-        if (len != sizeof(data_t)+data->part1.data_part2_jpeg_buff_len) {
-            if (len == -1 && (errno == ECONNRESET || errno == EPIPE)) {
-                INFO("terminating connection\n");
-            } else {
-                ERROR("terminating connection - send failed, len=%zd, %s, \n", len, strerror(errno));
+        // backfill request: send the history records after the time requested
+        if (backfill->magic == MAGIC_PROTO_BACKFILL && c->version >= 4) {
+            client_backfill(c, backfill->time);
+            if (c->sockfd == -1) {
+                return;
             }
+            continue;
+        }
+
+        WARN("invalid message from %s, magic=0x%"PRIx64"\n", c->name, hello->magic);
+        c->msg_invalid = true;
+    }
+}
+
+static void client_backfill(client_t * c, uint64_t time)
+{
+    record_t * first;
+
+    // a second backfill request is ignored
+    if (c->backfill || c->backfilled > 0) {
+        WARN("client %s repeated backfill request\n", c->name);
+        return;
+    }
+
+    // the records already sent are not sent again, so that the seconds arrive 
+    // in order; this happens only if a record was published before the request
+    // was received
+    if (time < c->sent_time) {
+        time = c->sent_time;
+    }
+
+    // the queued records are in the history, so they are released and sent by 
+    // the backfill; the record being sent is completed first
+    first = history_next(time);
+    INFO("client %s backfill after %"PRId64", %s %"PRId64" - %"PRId64"\n", 
+         c->name, time, first ? "history" : "none in history", 
+         first ? first->time : 0, first ? history_last_time : 0);
+    if (history_sec > 0) {
+        while (c->queue_head != c->queue_tail) {
+            record_put(c->queue[c->queue_head++ % CLIENT_QUEUE_LEN]);
+        }
+    }
+    c->backfill = true;
+    c->backfill_time = time;
+    client_send(c);
+}
+
+static void client_close(client_t * c, char * reason)
+{
+    // release the record being sent, and the queued records
+    if (c->send_rec) {
+        record_put(c->send_rec);
+        c->send_rec = NULL;
+    }
+    while (c->queue_head != c->queue_tail) {
+        record_put(c->queue[c->queue_head++ % CLIENT_QUEUE_LEN]);
+    }
+
+    // close the connection, which also removes it from the epoll instance
+    close(c->sockfd);
+    c->sockfd = -1;
+    server_clients--;
+    if (reason) {
+        INFO("terminating connection to %s, %s, dropped=%"PRId64", backfilled=%"PRId64", clients=%d\n", 
+             c->name, reason, c->dropped, c->backfilled, server_clients);
+    }
+}
+
+// -----------------  AGGREGATE THREAD  ----------------------------------------------
+
+// Builds each second's record once, shortly after the second begins, and 
+// publishes it to the server's event loop.
+
+static void * aggregate_thread(void * cx)
+{
+    struct timespec ts;
+    record_t * rec, * old;
+    time_t     time_now, time_last;
+    uint64_t   one = 1;
+    static uint8_t frame[PROTO_MAX_FRAME_LEN];
+
+    ATOMIC_INCREMENT(&active_thread_count);
+
+    time_last = time(NULL);
+
+    while (true) {
+        // sleep until the next second begins 
+        clock_gettime(CLOCK_REALTIME, &ts);
+        usleep((1000000000 - ts.tv_nsec) / 1000 + 1000);
+        if (sigint_or_sigterm) {
             break;
         }
+        time_now = time(NULL);
+        if (time_now == time_last) {
+            continue;
+        }
 
-        // save time_last
+        // sanity check time_now, should be time_last+1
+        if (time_now != time_last+1) {
+            WARN("time_now - time_last = %ld\n", time_now-time_last);
+        }
         time_last = time_now;
+
+        // build the record
+        rec = record_alloc(true);
+        init_data_struct(rec->data, time_now);
+        rec->time = time_now;
+        rec->len = sizeof(struct data_part1_s) + rec->data->part1.data_part2_length;
+        rec->frame_len = proto_encode(rec->data, frame);
+        rec->frame = malloc(rec->frame_len);
+        if (rec->frame == NULL) {
+            FATAL("alloc record frame failed\n");
+        }
+        memcpy(rec->frame, frame, rec->frame_len);
+        rec->v1_len = proto_encode_v1(rec->data, frame);   // PROTO_MAX_V1_LEN is smaller
+        rec->v1 = malloc(rec->v1_len);
+        if (rec->v1 == NULL) {
+            FATAL("alloc record v1 failed\n");
+        }
+        memcpy(rec->v1, frame, rec->v1_len);
+        journal_write(rec->time, rec->frame, rec->frame_len);
+        shm_publish_record(rec->data, rec->len);
+        __atomic_store_n(&server_record_len, rec->v1_len, __ATOMIC_RELAXED);
+        __atomic_store_n(&server_frame_len, rec->frame_len, __ATOMIC_RELAXED);
+        __atomic_store_n(&update_dataq_okay, rec->data->part1.data_part2_voltage_adc_data_valid, 
+                         __ATOMIC_RELAXED);
+
+        // publish the record, and wake the event loop; if the event loop has not 
+        // taken the prior record then it is replaced
+        pthread_mutex_lock(&record_mutex);
+        old = published_record;
+        published_record = rec;
+        pthread_mutex_unlock(&record_mutex);
+        if (old) {
+            WARN("record for time %"PRId64" was not sent\n", old->time);
+            record_put(old);
+        }
+        write(record_eventfd, &one, sizeof(one));
     }
 
-exit_thread:
-    // terminate connection with client, and 
-    // terminate thread
-    close(sockfd);
     ATOMIC_DECREMENT(&active_thread_count);
     return NULL;
 }
 
+static record_t * record_alloc(bool with_data)
+{
+    record_t * rec;
+
+    rec = malloc(sizeof(record_t) + (with_data ? sizeof(struct data_part1_s) + MAX_DATA_PART2_LENGTH : 0));
+    if (rec == NULL) {
+        FATAL("alloc record failed\n");
+    }
+    rec->refcnt = 1;
+    rec->len = 0;
+    rec->time = 0;
+    rec->update = false;
+    rec->frame = NULL;
+    rec->frame_len = 0;
+    rec->v1 = NULL;
+    rec->v1_len = 0;
+    rec->data = (with_data ? (data_t*)(rec + 1) : NULL);
+    return rec;
+}
+
+static void record_get(record_t * rec)
+{
+    __atomic_fetch_add(&rec->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+static void record_put(record_t * rec)
+{
+    if (__atomic_sub_fetch(&rec->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(rec->frame);
+        free(rec->v1);
+        free(rec);
+    }
+}
+
+// -----------------  UPDATE  --------------------------------------------------------
+
+// Builds a partial update, which is sent between the records, so that the display 
+// can show the second that is in progress. It contains the means of the last 100 ms,
+// the pulses detected so far, and the adc values since the prior update. Called on
+// the event loop.
+
+static record_t * update_build(void)
+{
+    static proto_update_t u;
+    static uint8_t        frame[PROTO_MAX_UPDATE_FRAME_LEN];
+    static uint64_t       adc_end_seq[PROTO_MAX_UPDATE_ADC];
+    static int32_t        adc_chan[PROTO_MAX_UPDATE_ADC] = { DATAQ_ADC_CHAN_VOLTAGE, 
+                                                             DATAQ_ADC_CHAN_CURRENT,
+                                                             DATAQ_ADC_CHAN_PRESSURE };
+    dataq_adc_stats_t stats;
+    record_t * rec;
+    window_t * w;
+    uint64_t   real_us, first_seq;
+    int32_t    i, count, skip;
+
+    // the second in progress is completed by the record for the following second
+    real_us = get_real_time_us();
+    u.time = real_us / 1000000 + 1;
+    u.elapsed_ms = (real_us % 1000000) / 1000;
+
+    // the neutron pulses so far; the window is being updated by the neutron 
+    // channel's thread, so these are approximate
+    w = &chan[0].win[__atomic_load_n(&chan[0].cur, __ATOMIC_RELAXED)];
+    if (__atomic_load_n(&w->time, __ATOMIC_RELAXED) == u.time) {
+        u.neutron_pulses  = __atomic_load_n(&w->pulses, __ATOMIC_RELAXED);
+        u.neutron_samples = __atomic_load_n(&w->samples, __ATOMIC_RELAXED);
+    } else {
+        u.neutron_pulses  = 0;
+        u.neutron_samples = 0;
+    }
+
+    // the means of the last 100 ms, and the adc values since the prior update;
+    // the values are read from a little before the prior update's end, and those
+    // already sent are skipped; while the dataq is not working, which is logged 
+    // when the records are built, the adc values are not available
+    u.voltage_kv        = ERROR_NO_VALUE;
+    u.current_ma        = ERROR_NO_VALUE;
+    u.d2_pressure_mtorr = ERROR_NO_VALUE;
+    u.n2_pressure_mtorr = ERROR_NO_VALUE;
+    for (i = 0; i < PROTO_MAX_UPDATE_ADC; i++) {
+        u.adc[i].max_adc_data = 0;
+        if (!__atomic_load_n(&update_dataq_okay, __ATOMIC_RELAXED) ||
+            dataq_get_adc_window(adc_chan[i], DATAQ_WIN_100MS, &stats) != 0) 
+        {
+            continue;
+        }
+        if (i == PROTO_UPDATE_ADC_VOLTAGE) {
+            u.voltage_kv = convert_adc_voltage(stats.mean_mv/1000.);
+        } else if (i == PROTO_UPDATE_ADC_CURRENT) {
+            u.current_ma = convert_adc_current(stats.mean_mv/1000.);
+        } else {
+            u.d2_pressure_mtorr = convert_adc_pressure(stats.mean_mv/1000., GAS_ID_D2);
+            u.n2_pressure_mtorr = convert_adc_pressure(stats.mean_mv/1000., GAS_ID_N2);
+        }
+
+        count = stats.end_seq - adc_end_seq[i] + UPDATE_ADC_MARGIN;
+        if (stats.end_seq < adc_end_seq[i] || count > MAX_ADC_DATA) {
+            count = MAX_ADC_DATA;
+        }
+        if (count > stats.end_seq) {
+            count = stats.end_seq;
+        }
+        if (dataq_get_adc_data(adc_chan[i], u.adc[i].adc_data, count, &first_seq) != 0) {
+            continue;
+        }
+        skip = (first_seq < adc_end_seq[i] ? adc_end_seq[i] - first_seq : 0);
+        if (skip >= count) {
+            continue;
+        }
+        memmove(u.adc[i].adc_data, u.adc[i].adc_data + skip, (count - skip) * sizeof(int16_t));
+        u.adc[i].first_seq = first_seq + skip;
+        u.adc[i].max_adc_data = count - skip;
+        adc_end_seq[i] = first_seq + count;
+    }
+
+    // publish the update to the shared memory readers, and encode the update frame
+    shm_publish_update(&u);
+    rec = record_alloc(false);
+    rec->update = true;
+    rec->time = u.time;
+    rec->frame_len = proto_encode_update(&u, frame);
+    rec->frame = malloc(rec->frame_len);
+    if (rec->frame == NULL) {
+        FATAL("alloc update frame failed\n");
+    }
+    memcpy(rec->frame, frame, rec->frame_len);
+    return rec;
+}
+
 // -----------------  INIT_DATA_STRUCT  ----------------------------------------------
 
 static void init_data_struct(data_t * data, time_t time_now)
 {
     int16_t mean_mv;
-    int32_t ret, wait_ms;
+    int32_t ret, wait_ms, i;
+    aux_chan_t * ac;
+    uint8_t * spectrum_end;
 
     // zero data struct;  
     bzero(data, sizeof(data_t));
@@ -411,15 +1347,15 @@ static void init_data_struct(data_t * data, time_t time_now)
     // data part2: voltage, current, and pressure adc_data
     ret = dataq_get_adc_data(DATAQ_ADC_CHAN_VOLTAGE, 
                              data->part2.voltage_adc_data,
-                             MAX_ADC_DATA);
+                             MAX_ADC_DATA, NULL);
     data->part1.data_part2_voltage_adc_data_valid  = (ret == 0);
     ret = dataq_get_adc_data(DATAQ_ADC_CHAN_CURRENT, 
                              data->part2.current_adc_data,
-                             MAX_ADC_DATA);
+                             MAX_ADC_DATA, NULL);
     data->part1.data_part2_current_adc_data_valid  = (ret == 0);
     ret = dataq_get_adc_data(DATAQ_ADC_CHAN_PRESSURE, 
                              data->part2.pressure_adc_data,
-                             MAX_ADC_DATA);
+                             MAX_ADC_DATA, NULL);
     data->part1.data_part2_pressure_adc_data_valid = (ret == 0);
 
     // wait for up to 250 ms for neutron data to be available for time_now;  
@@ -430,22 +1366,68 @@ static void init_data_struct(data_t * data, time_t time_now)
     pthread_mutex_lock(&neutron_mutex);
     if (neutron_time == time_now) {
         memcpy(data->part1.neutron_pulse_mv, 
+               neutron_pulse_mv, 
+               (max_neutron_pulse < MAX_NEUTRON_PULSE ? max_neutron_pulse : MAX_NEUTRON_PULSE) *
+                   sizeof(neutron_pulse_mv[0]));
+        memcpy(NEUTRON_SECTION_PULSE_MV(&data->part2),
                neutron_pulse_mv, 
                max_neutron_pulse*sizeof(neutron_pulse_mv[0]));
-        memcpy(data->part2.neutron_adc_pulse_data, 
+        data->part2.max_neutron_snippet = max_neutron_snippet;
+        memcpy(NEUTRON_SECTION_SNIPPET_IDX(&data->part2,max_neutron_pulse),
+               neutron_snippet_idx, 
+               max_neutron_snippet*sizeof(neutron_snippet_idx[0]));
+        memcpy(NEUTRON_SECTION_ADC_PULSE_DATA(&data->part2,max_neutron_pulse),
                neutron_adc_pulse_data, 
-               max_neutron_pulse*sizeof(neutron_adc_pulse_data[0]));
+               max_neutron_snippet*sizeof(neutron_adc_pulse_data[0]));
+        data->part2.max_neutron_spectrum = 
+            encode_spectrum(neutron_spectrum, NEUTRON_SECTION_SPECTRUM(&data->part2,max_neutron_pulse));
         data->part1.max_neutron_pulse = max_neutron_pulse;
+        data->part1.neutron_pulse_overflow = neutron_pulse_overflow;
+        data->part1.neutron_live_permyriad = neutron_live_permyriad;
+        data->part1.neutron_mccdaq_restarts = neutron_mccdaq_restarts;
+        data->part2.neutron_baseline_mv = neutron_baseline_mv;
+        data->part2.neutron_noise_mv = neutron_noise_mv;
     } else {
         data->part1.max_neutron_pulse = 0;
+        data->part2.max_neutron_snippet = 0;
+        data->part2.max_neutron_spectrum = 0;
+    }
+
+    // data part2: neutron section length, sized to the number of pulses, snippets, 
+    // and spectrum entries
+    data->part2.neutron_section_len = NEUTRON_SECTION_LEN(data->part1.max_neutron_pulse,
+                                                          data->part2.max_neutron_snippet,
+                                                          data->part2.max_neutron_spectrum);
+    spectrum_end = (uint8_t*)(NEUTRON_SECTION_SPECTRUM(&data->part2,data->part1.max_neutron_pulse) + 
+                              data->part2.max_neutron_spectrum);
+    memset(spectrum_end, 0, (uint8_t*)AUX_CHAN_FIRST(&data->part2) - spectrum_end);
+
+    // data part2: aux chan section, which follows the neutron section
+    ac = AUX_CHAN_FIRST(&data->part2);
+    data->part2.max_aux_chan = 0;
+    for (i = 0; neutron_time == time_now && i < max_aux_chan_result; i++) {
+        ac->chan         = aux_chan_result[i].chan;
+        ac->pulses       = aux_chan_result[i].pulses;
+        ac->samples      = aux_chan_result[i].samples;
+        ac->max_spectrum = encode_spectrum(aux_chan_result[i].spectrum, ac->spectrum);
+        ac = AUX_CHAN_NEXT(ac);
+        data->part2.max_aux_chan++;
     }
+    data->part2.aux_chan_section_len = 
+        ((uint8_t*)ac - (uint8_t*)AUX_CHAN_FIRST(&data->part2) + 7) & ~7;
+    memset(ac, 0, (uint8_t*)AUX_CHAN_FIRST(&data->part2) + data->part2.aux_chan_section_len - (uint8_t*)ac);
+
+    // data part2: pulse time section, which follows the aux chan section
+    data->part2.pulse_time_len = encode_pulse_time(neutron_pulse_time, data->part1.max_neutron_pulse,
+                                                   PULSE_TIME_SECTION(&data->part2));
+    data->part2.neutron_sample_rate = mccdaq_get_sample_rate();
     pthread_mutex_unlock(&neutron_mutex);
 
 #ifdef CAM_ENABLE
     // data part2: jpeg_buff
     pthread_mutex_lock(&jpeg_mutex);
     if (microsec_timer() - jpeg_buff_us < 1000000) {
-        memcpy(data->part2.jpeg_buff, jpeg_buff, jpeg_buff_len);
+        memcpy(DATA_PART2_JPEG_BUFF(&data->part2), jpeg_buff, jpeg_buff_len);
         data->part1.data_part2_jpeg_buff_len = jpeg_buff_len;
     }
     pthread_mutex_unlock(&jpeg_mutex);
@@ -455,7 +1437,7 @@ static void init_data_struct(data_t * data, time_t time_now)
 
     // data part1: data_part_offset, and data_part2_length
     data->part1.data_part2_offset  = 0;   // for use by the display pgm
-    data->part1.data_part2_length  = sizeof(struct data_part2_s) + data->part1.data_part2_jpeg_buff_len;
+    data->part1.data_part2_length  = DATA_PART2_LENGTH(&data->part2, data->part1.data_part2_jpeg_buff_len);
 }
 
 // -----------------  CONVERT ADC HV VOLTAGE & CURRENT  ------------------------------
@@ -625,301 +1607,508 @@ static float convert_adc_pressure(float adc_volts, int32_t gas_id)
 
 // -----------------  MCCDAQ CALLBACK - NEUTRON DETECTOR PULSES  ---------------------
 
-static int32_t mccdaq_callback(uint16_t * d, int32_t max_d)
+static int32_t mccdaq_callback(int32_t mccdaq_chan, uint16_t * d, int32_t max_d)
 {
-    #define MAX_DATA 1000000
-
-    #define MAX_PC1SH 15000
-    static int16_t  data[MAX_DATA];
-    static int32_t  max_data;
-    static int32_t  idx;
-    static int32_t  baseline;
-    static int16_t  local_neutron_adc_pulse_data[MAX_NEUTRON_PULSE][MAX_NEUTRON_ADC_PULSE_DATA];
-    static int16_t  local_neutron_pulse_mv[MAX_NEUTRON_PULSE];
-    static int32_t  local_max_neutron_pulse;
+    chan_t * c = &chan[chan_idx[mccdaq_chan]];
+    int64_t  n;
+
+    // the data is split at the end of the window; the window ends when the detector
+    // has examined the samples preceding window_end_pos, which requires that it has
+    // also been given the PULSE_LOOKAHEAD samples that follow
+    while (max_d > 0) {
+        n = c->window_end_pos + PULSE_LOOKAHEAD - c->detector.end;
+        if (n > max_d) {
+            n = max_d;
+        }
 
-    #define TUNE_PULSE_THRESHOLD  10
+        // if enabled, pass the neutron channel data to the capture writer
+        if (c == &chan[0]) {
+            capture_write(d, n);
+        }
 
-    #define RESET_FOR_NEXT_SEC \
-        do { \
-            max_data = 0; \
-            idx = 0; \
-            local_max_neutron_pulse = 0; \
-        } while (0)
+        // search for pulses in the data
+        c->win[c->cur].samples += n;
+        pulse_detector_process(&c->detector, d, n);
+        d += n;
+        max_d -= n;
 
-    // if max_data too big then 
-    //   print an error 
-    //   reset 
-    // endif
-    if (max_data + max_d > MAX_DATA) {
-        ERROR("max_data %d or max_d %d are too large\n", max_data, max_d);
-        RESET_FOR_NEXT_SEC;
-        return 0;
+        // if the window has ended then start the next window
+        if (c->detector.end == c->window_end_pos + PULSE_LOOKAHEAD) {
+            chan_window_end(c);
+        }
     }
 
-    // copy caller supplied data to static data buffer
-    memcpy(data+max_data, d, max_d*sizeof(int16_t));
-    max_data += max_d;
+    // return 'continue-scanning' 
+    return 0;
+}
 
-    // if we have too little data just return, 
-    // until additional data is received
-    if (max_data < 100) {
-        return 0;
+static void chan_window_end(chan_t * c)
+{
+    window_t * w    = &c->win[c->cur];
+    window_t * next = &c->win[c->cur ^ 1];
+    float      baseline, sigma;
+
+    // the captured samples for this window are complete
+    if (c == &chan[0]) {
+        capture_end_second(w->time);
     }
 
-    // search for pulses in the data
-    int32_t pulse_start_idx = -1;
-    int32_t pulse_end_idx   = -1;
-    while (true) {
-        // terminate this loop when 
-        // - not in-a-pulse and near the end of data OR
-        // - at the end of data
-        if ((pulse_start_idx == -1 && idx >= max_data-20) || 
-            (idx == max_data))
-        {
-            break;
-        }
+    // the window is complete, and will be published by mccdaq_batch_callback;
+    // the prior window should already have been published
+    pulse_detector_get_baseline(&c->detector, &baseline, &sigma);
+    w->baseline_mv = (baseline - 2048) * 10000 / 2048;
+    w->noise_mv    = sigma * 10000 / 2048;
+    if (next->complete) {
+        WARN("input %d window for time %"PRId64" was not published\n", c->chan, next->time);
+    }
+    w->complete = true;
+
+    // start the next window; the end of the window that follows it is provisionally 
+    // one nominal second later, mccdaq_batch_callback replaces this using the sample clock
+    next->time           = c->next_window_time;
+    next->start_pos      = c->window_end_pos;
+    next->samples        = 0;
+    next->pulses         = 0;
+    next->max_pulse      = 0;
+    next->max_snippet    = 0;
+    next->snippet_stride = 1;
+    next->pulse_overflow = 0;
+    next->complete       = false;
+    memset(next->spectrum, 0, sizeof(next->spectrum));
+    c->cur ^= 1;
+
+    c->window_end_pos       = c->next_window_end_pos;
+    c->next_window_time    += 1;
+    c->next_window_end_pos += mccdaq_get_sample_rate();
+}
 
-        // print warning if data out of range
-        if (data[idx] > 4095) {
-            WARN("data[%d] = %u, is out of range\n", idx, data[idx]);
-            data[idx] = 2048;
-        }
-
-        // update baseline ...
-        // if data[idx] is close to baseline then
-        //   baseline is okay
-        // else if data[idx+10] is close to baseline then
-        //   baseline is okay
-        // else if data[idx] and the preceding 3 data values are almost the same then
-        //   set baseline to data[idx]
-        // endif
-        if (pulse_start_idx == -1) {
-            if (data[idx] >= baseline-1 && data[idx] <= baseline+1) {
-                ;  // okay
-            } else if (idx+10 < max_data && data[idx+10] >= baseline-1 && data[idx+10] <= baseline+1) {
-                ;  // okay
-            } else if ((idx >= 3) &&
-                       (data[idx-1] >= data[idx]-1 && data[idx-1] <= data[idx]+1) &&
-                       (data[idx-2] >= data[idx]-1 && data[idx-2] <= data[idx]+1) &&
-                       (data[idx-3] >= data[idx]-1 && data[idx-3] <= data[idx]+1))
-            {
-                baseline = data[idx];
-            }
+static int32_t mccdaq_batch_callback(void)
+{
+    static mccdaq_stats_t last_stats;
+    static uint64_t last_window_time;
+    static int32_t slips;
+    char voltage_str[100], current_str[100], d2_pressure_str[100], n2_pressure_str[100];
+    int16_t mean_mv;
+    mccdaq_stats_t stats;
+    dataq_stats_t dataq_stats;
+    int32_t lost_samples, restarts, i;
+    uint64_t window_time, next_time;
+    int64_t next_end;
+    chan_t * nc = &chan[0];
+    window_t * nw = &nc->win[nc->cur ^ 1];
+
+    // if the sample clock has not been started then
+    //   start it, using the stream position and time of the first data received;
+    //   the current window, which is partial, ends at the next second boundary
+    //   return
+    // endif
+    if (!sample_clock_locked) {
+        uint64_t real_us = get_real_time_us();
+        sample_clock_init(nc->detector.end, real_us, mccdaq_get_sample_rate());
+        window_time = real_us / 1000000 + 1;
+        for (i = 0; i < max_chan; i++) {
+            chan_t * c = &chan[i];
+            c->win[c->cur].time    = window_time;
+            c->window_end_pos      = sample_clock_pos(window_time * 1000000);
+            c->next_window_time    = window_time + 1;
+            c->next_window_end_pos = sample_clock_pos((window_time + 1) * 1000000);
         }
+        return 0;
+    }
 
-        // if baseline has not yet determined then continue
-        if (baseline == 0) {
-            idx++;
-            continue;
+    // if any channel's window has not ended then return; the windows end at the same
+    // stream position on all channels, so normally they all end during the same batch
+    for (i = 0; i < max_chan; i++) {
+        if (!chan[i].win[chan[i].cur ^ 1].complete) {
+            return 0;
         }
+    }
+    window_time = nw->time;
+
+    // discipline the sample clock; and set the end of the window that follows the
+    // current window, which is the first second boundary that is at least a half 
+    // second beyond the end of the current window
+    sample_clock_update(nc->detector.end, get_real_time_us());
+    next_time = sample_clock_real_us(nc->window_end_pos + llround(sample_clock_freq / 2)) / 1000000 + 1;
+    next_end = sample_clock_pos(next_time * 1000000);
+    for (i = 0; i < max_chan; i++) {
+        chan[i].next_window_time    = next_time;
+        chan[i].next_window_end_pos = next_end;
+    }
 
-        // determine the pulse_start_idx and pulse_end_idx
-        if (data[idx] >= (baseline + TUNE_PULSE_THRESHOLD) && pulse_start_idx == -1) {
-            pulse_start_idx = idx;
-        } else if (pulse_start_idx != -1) {
-            if (data[idx] < (baseline + TUNE_PULSE_THRESHOLD)) {
-                pulse_end_idx = idx - 1;
-            } else if (idx - pulse_start_idx >= 10) {
-                WARN("discarding a possible pulse because it's too long, pulse_start_idx=%d\n",
-                     pulse_start_idx);
-                pulse_start_idx = -1;
-                pulse_end_idx = -1;
-            }
-        }
-
-        // if a pulse has been located ...
-        // - determine the pulse_height, in mv
-        // - save the pulse height in local_neutron_pulse_mv[]
-        // - save pulse data in local_neutron_adc_pulse_data
-        // - print the pulse to the log file
-        // endif
-        if (pulse_end_idx != -1) {
-            int32_t pulse_height, i, k;
-            int32_t pulse_start_idx_extended, pulse_end_idx_extended;
-
-            // scan from start to end of pulse to determine pulse_height,
-            // where pulse_height is the height above the baseline
-            pulse_height = -1;
-            for (i = pulse_start_idx; i <= pulse_end_idx; i++) {
-                if (data[i] - baseline > pulse_height) {
-                    pulse_height = data[i] - baseline;
-                }
-            }
-            pulse_height = pulse_height * 10000 / 2048;  // convert to mv
-
-            // if there is room to store another neutron pulse then
-            // - store the pulse height
-            // - store the pulse data
-            // endif
-            if (max_neutron_pulse < MAX_NEUTRON_PULSE) {
-                // store pulse height
-                local_neutron_pulse_mv[local_max_neutron_pulse] = pulse_height;
-
-                // store pulse data
-                pulse_start_idx_extended = pulse_start_idx - (MAX_NEUTRON_ADC_PULSE_DATA/2);
-                if (pulse_start_idx_extended < 0) {
-                    pulse_start_idx_extended = 0;
-                }
-                pulse_end_idx_extended = pulse_start_idx_extended + (MAX_NEUTRON_ADC_PULSE_DATA-1);
-                if (pulse_end_idx_extended >= max_data) {
-                    pulse_end_idx_extended = max_data - 1;
-                    pulse_start_idx_extended = pulse_end_idx_extended - (MAX_NEUTRON_ADC_PULSE_DATA-1);
-                }
-                for (k = 0, i = pulse_start_idx_extended; i <= pulse_end_idx_extended; i++) {
-                    local_neutron_adc_pulse_data[local_max_neutron_pulse][k++] =
-                        (data[i] - baseline) * 10000 / 2048;    // mv above baseline
-                }
-
-                // increment local_max_neutron_pulse
-                local_max_neutron_pulse++;
-            }
+    // a slip is a window whose time does not follow the prior window's time, this 
+    // happens when the windows are realigned following a large loss of samples
+    if (last_window_time != 0 && window_time != last_window_time + 1) {
+        WARN("window time slipped by %"PRId64" secs\n", window_time - (last_window_time + 1));
+        slips++;
+    }
+    last_window_time = window_time;
 
-#ifdef DEBUG_PRINT_PULSE_GRAPH
-            // plot the pulse 
-            pulse_start_idx_extended = pulse_start_idx - 1;
-            pulse_end_idx_extended = pulse_end_idx + 4;
-            if (pulse_start_idx_extended < 0) {
-                pulse_start_idx_extended = 0;
-            }
-            if (pulse_end_idx_extended >= max_data) {
-                pulse_end_idx_extended = max_data-1;
-            }
-            printf("PULSE:  height_mv = %d   baseline_mv = %d   (%d,%d,%d)\n",
-                   pulse_height, (baseline-2048)*10000/2048,
-                   pulse_start_idx_extended, pulse_end_idx_extended, max_data);
-            for (i = pulse_start_idx_extended; i <= pulse_end_idx_extended; i++) {
-                print_plot_str((data[i]-2048)*10000/2048, (baseline-2048)*10000/2048); 
-            }
-            printf("\n");
-#endif
+    // determine the number of neutron channel samples lost, and the number of 
+    // mccdaq restarts, since the last second
+    mccdaq_get_stats(&stats);
+    lost_samples = ((stats.dropped - last_stats.dropped) + 
+                    (stats.restart_gap_samples - last_stats.restart_gap_samples)) / max_chan;
+    restarts = stats.restarts - last_stats.restarts;
+    last_stats = stats;
 
-            // done with this pulse
-            pulse_start_idx = -1;
-            pulse_end_idx = -1;
-        }
+    // publish the completed neutron and aux chan windows
+    pthread_mutex_lock(&neutron_mutex);
+    neutron_time = window_time;
+    memcpy(neutron_pulse_mv, 
+           nw->pulse_mv, 
+           nw->max_pulse*sizeof(neutron_pulse_mv[0]));
+    memcpy(neutron_pulse_time, 
+           nw->pulse_time, 
+           nw->max_pulse*sizeof(neutron_pulse_time[0]));
+    memcpy(neutron_snippet_idx, 
+           nw->snippet_idx, 
+           nw->max_snippet*sizeof(neutron_snippet_idx[0]));
+    memcpy(neutron_adc_pulse_data, 
+           nw->adc_pulse_data, 
+           nw->max_snippet*sizeof(neutron_adc_pulse_data[0]));
+    memcpy(neutron_spectrum, nw->spectrum, sizeof(neutron_spectrum));
+    max_neutron_pulse = nw->max_pulse;
+    max_neutron_snippet = nw->max_snippet;
+    neutron_pulse_overflow = nw->pulse_overflow;
+    neutron_live_permyriad = 
+        (nw->samples == 0 ? 0 : 
+         lost_samples <= 0 ? 10000 : 
+         (int64_t)nw->samples * 10000 / ((int64_t)nw->samples + lost_samples));
+    if (nw->samples > 0 && neutron_live_permyriad == 0) {
+        neutron_live_permyriad = 1;
+    }
+    neutron_mccdaq_restarts = (restarts > 65535 ? 65535 : restarts);
+    neutron_baseline_mv = nw->baseline_mv;
+    neutron_noise_mv = nw->noise_mv;
+    for (i = 1; i < max_chan; i++) {
+        aux_chan_result_t * r = &aux_chan_result[i-1];
+        window_t * w = &chan[i].win[chan[i].cur ^ 1];
+        r->chan    = chan[i].chan;
+        r->pulses  = w->pulses;
+        r->samples = w->samples;
+        memcpy(r->spectrum, w->spectrum, sizeof(r->spectrum));
+    }
+    max_aux_chan_result = max_chan - 1;
+    pthread_mutex_unlock(&neutron_mutex);
 
-        // move to next data 
-        idx++;
+    // if enabled, periodically write the cumulative spectrum file
+    if (spectrum_filename[0] != '\0' && (window_time % NEUTRON_SPECTRUM_WRITE_SEC) == 0) {
+        write_cumulative_spectrum();
     }
 
-    // if time has incremented then
-    //   - publish new neutron data
-    //   - print to log file
-    //   - reset variables for the next second 
-    // endif
-    uint64_t time_now = time(NULL);
-    if (time_now > neutron_time) {    
-        char voltage_str[100], current_str[100], d2_pressure_str[100], n2_pressure_str[100];
-        int16_t mean_mv;
-
-        // publish new neutron data
-        pthread_mutex_lock(&neutron_mutex);
-        neutron_time = time_now;
-        memcpy(neutron_pulse_mv, 
-               local_neutron_pulse_mv, 
-               local_max_neutron_pulse*sizeof(neutron_pulse_mv[0]));
-        memcpy(neutron_adc_pulse_data, 
-               local_neutron_adc_pulse_data, 
-               local_max_neutron_pulse*sizeof(neutron_adc_pulse_data[0]));
-        max_neutron_pulse = local_max_neutron_pulse;
-        pthread_mutex_unlock(&neutron_mutex);
-
-        // get voltage, current, and pressure values so they can be printed below
-        if (dataq_get_adc(DATAQ_ADC_CHAN_VOLTAGE, NULL, &mean_mv, NULL, NULL, NULL) == 0) {  
-            sprintf(voltage_str, "%0.1f KV", convert_adc_voltage(mean_mv/1000.));
+    // get voltage, current, and pressure values so they can be printed below
+    if (dataq_get_adc(DATAQ_ADC_CHAN_VOLTAGE, NULL, &mean_mv, NULL, NULL, NULL) == 0) {  
+        sprintf(voltage_str, "%0.1f KV", convert_adc_voltage(mean_mv/1000.));
+    } else {
+        sprintf(voltage_str, "NO_VALUE");
+    }
+    if (dataq_get_adc(DATAQ_ADC_CHAN_CURRENT, NULL, &mean_mv, NULL, NULL, NULL) == 0) {
+        sprintf(current_str, "%0.1f MA", convert_adc_current(mean_mv/1000.));
+    } else {
+        sprintf(current_str, "NO_VALUE");
+    }
+    if (dataq_get_adc(DATAQ_ADC_CHAN_PRESSURE, NULL, &mean_mv, NULL, NULL, NULL) == 0) {
+        float d2_pressure_mtorr = convert_adc_pressure(mean_mv/1000., GAS_ID_D2);
+        float n2_pressure_mtorr = convert_adc_pressure(mean_mv/1000., GAS_ID_N2);
+        if (IS_ERROR(d2_pressure_mtorr)) {
+            sprintf(d2_pressure_str, "%s", ERROR_TEXT(d2_pressure_mtorr));
+        } else if (d2_pressure_mtorr < 1000) {
+            sprintf(d2_pressure_str, "%0.1f mTorr", d2_pressure_mtorr);
         } else {
-            sprintf(voltage_str, "NO_VALUE");
+            sprintf(d2_pressure_str, "%0.0f Torr", d2_pressure_mtorr/1000);
         }
-        if (dataq_get_adc(DATAQ_ADC_CHAN_CURRENT, NULL, &mean_mv, NULL, NULL, NULL) == 0) {
-            sprintf(current_str, "%0.1f MA", convert_adc_current(mean_mv/1000.));
-        } else {
-            sprintf(current_str, "NO_VALUE");
-        }
-        if (dataq_get_adc(DATAQ_ADC_CHAN_PRESSURE, NULL, &mean_mv, NULL, NULL, NULL) == 0) {
-            float d2_pressure_mtorr = convert_adc_pressure(mean_mv/1000., GAS_ID_D2);
-            float n2_pressure_mtorr = convert_adc_pressure(mean_mv/1000., GAS_ID_N2);
-            if (IS_ERROR(d2_pressure_mtorr)) {
-                sprintf(d2_pressure_str, "%s", ERROR_TEXT(d2_pressure_mtorr));
-            } else if (d2_pressure_mtorr < 1000) {
-                sprintf(d2_pressure_str, "%0.1f mTorr", d2_pressure_mtorr);
-            } else {
-                sprintf(d2_pressure_str, "%0.0f Torr", d2_pressure_mtorr/1000);
-            }
-            if (IS_ERROR(n2_pressure_mtorr)) {
-                sprintf(n2_pressure_str, "%s", ERROR_TEXT(n2_pressure_mtorr));
-            } else if (n2_pressure_mtorr < 1000) {
-                sprintf(n2_pressure_str, "%0.1f mTorr", n2_pressure_mtorr);
-            } else {
-                sprintf(n2_pressure_str, "%0.0f Torr", n2_pressure_mtorr/1000);
-            }
+        if (IS_ERROR(n2_pressure_mtorr)) {
+            sprintf(n2_pressure_str, "%s", ERROR_TEXT(n2_pressure_mtorr));
+        } else if (n2_pressure_mtorr < 1000) {
+            sprintf(n2_pressure_str, "%0.1f mTorr", n2_pressure_mtorr);
         } else {
-            sprintf(d2_pressure_str, "NO_VALUE");
-            sprintf(n2_pressure_str, "NO_VALUE");
+            sprintf(n2_pressure_str, "%0.0f Torr", n2_pressure_mtorr/1000);
         }
+    } else {
+        sprintf(d2_pressure_str, "NO_VALUE");
+        sprintf(n2_pressure_str, "NO_VALUE");
+    }
 
-        // print info, and seperator line,
-        // note that the seperator line is intended to mark the begining of the next second
-        printf("NEUTRON:  samples=%d   mccdaq_restarts=%d\n",
-               max_data, mccdaq_get_restart_count());
-        printf("SUMMARY:  neutron_pulse = %d /sec   voltage = %s   current = %s   d2_pressure = %s   n2_pressure = %s\n",
-               local_max_neutron_pulse, voltage_str, current_str, d2_pressure_str, n2_pressure_str);
-        printf("\n");
-        INFO("=========================================================================\n");
-        printf("\n");
-
-        // reset for the next second
-        RESET_FOR_NEXT_SEC;
+    // print info, and seperator line,
+    // note that the seperator line is intended to mark the begining of the next second
+    printf("NEUTRON:  samples=%d   lost_samples=%d   mccdaq_restarts=%d   producer_wraps=%"PRId64"   pulse_overflow=%d   snippets=%d   baseline=%0.1f mV   noise=%0.2f mV\n",
+           nw->samples, lost_samples, restarts, stats.producer_wraps, nw->pulse_overflow,
+           nw->max_snippet, nw->baseline_mv, nw->noise_mv);
+    printf("CLOCK:    freq=%0.1f   ppm=%+0.1f   phase_err_us=%+0.0f   relocks=%d   slips=%d\n",
+           sample_clock_freq, 
+           (sample_clock_freq - sample_clock_nominal_freq) * 1000000 / sample_clock_nominal_freq,
+           sample_clock_phase_err * 1000000 / sample_clock_freq,
+           sample_clock_relocks, slips);
+    dataq_get_stats(&dataq_stats);
+    printf("DATAQ:    scans=%"PRId64"   bytes=%"PRId64"   resyncs=%"PRId64"   skipped_bytes=%"PRId64
+           "   disconnects=%"PRId64"   reconnects=%"PRId64"   recovery_ms=%"PRId64"\n",
+           dataq_stats.scans, dataq_stats.bytes, dataq_stats.resyncs, dataq_stats.skipped_bytes,
+           dataq_stats.disconnects, dataq_stats.reconnects, dataq_stats.recovery_ms);
+    for (i = 1; i < max_chan; i++) {
+        window_t * w = &chan[i].win[chan[i].cur ^ 1];
+        printf("AUX_CHAN: input=%d   samples=%d   pulses=%d   baseline=%0.1f mV   noise=%0.2f mV\n",
+               chan[i].chan, w->samples, w->pulses, w->baseline_mv, w->noise_mv);
+    }
+    printf("SERVER:   clients=%d   dropped=%"PRId64"   lag_disconnects=%"PRId64"   backfilled=%"PRId64
+           "   v1_record_len=%d   v2_frame_len=%d\n",
+           __atomic_load_n(&server_clients, __ATOMIC_RELAXED),
+           __atomic_load_n(&server_dropped, __ATOMIC_RELAXED),
+           __atomic_load_n(&server_lag_disconnects, __ATOMIC_RELAXED),
+           __atomic_load_n(&server_backfilled, __ATOMIC_RELAXED),
+           __atomic_load_n(&server_record_len, __ATOMIC_RELAXED),
+           __atomic_load_n(&server_frame_len, __ATOMIC_RELAXED));
+    if (capture_filename[0] != '\0') {
+        capture_stats_t cs;
+        capture_get_stats(&cs);
+        printf("CAPTURE:  samples=%"PRId64"   dropped=%"PRId64"   chunks=%"PRId64"   bytes=%"PRId64"   ratio=%0.2f\n",
+               cs.samples, cs.dropped, cs.chunks, cs.bytes,
+               cs.bytes ? (double)cs.samples * 2 / cs.bytes : 0);
+    }
+    if (journal_dirname[0] != '\0') {
+        journal_stats_t js;
+        journal_get_stats(&js);
+        printf("JOURNAL:  records=%"PRId64"   dropped=%"PRId64"   segments=%"PRId64"   bytes=%"PRId64"\n",
+               js.records, js.dropped, js.segments, js.bytes);
+    }
+    printf("SUMMARY:  neutron_pulse = %d /sec   voltage = %s   current = %s   d2_pressure = %s   n2_pressure = %s\n",
+           nw->pulses, voltage_str, current_str, d2_pressure_str, n2_pressure_str);
+    printf("\n");
+    INFO("=========================================================================\n");
+    printf("\n");
+
+    // the published windows may now be reused
+    for (i = 0; i < max_chan; i++) {
+        chan[i].win[chan[i].cur ^ 1].complete = false;
     }
 
     // return 'continue-scanning' 
     return 0;
 }
 
-#ifdef DEBUG_PRINT_PULSE_GRAPH
-static void print_plot_str(int32_t value, int32_t baseline)
-{
-    char    str[110];
-    int32_t idx, i;
-
-    // args are in mv units
+// -----------------  NEUTRON PULSE CALLBACK  ----------------------------------------
 
-    // value               : expected range 0 - 9995 mv
-    // baseline            : expected range 0 - 9995 mv
-    // idx = value / 100   : range  0 - 99            
+static void neutron_pulse_callback(void * cx, pulse_t * pulse)
+{
+    chan_t   * c = cx;
+    window_t * w = &c->win[c->cur];
+    int32_t    bin, idx, i;
+
+    // add the pulse to the per second and cumulative pulse height spectrums;
+    // this includes the overflow pulses
+    bin = NEUTRON_SPECTRUM_MV_TO_BIN(pulse->height_mv);
+    w->spectrum[bin]++;
+    c->cumulative_spectrum[bin]++;
+    w->pulses++;
+
+    // the pulse heights and data are kept only for the neutron channel
+    if (c != &chan[0]) {
+        return;
+    }
 
-    if (value > 9995) {
-        printf("%5d: value is out of range\n", value);
+    // if there is no room to store another neutron pulse then
+    //   count the pulse as overflow, and return
+    // endif
+    if (w->max_pulse >= MAX_NEUTRON_PULSE_PER_SEC) {
+        w->pulse_overflow++;
         return;
     }
-    if (baseline < 0 || baseline > 9995) {
-        printf("%5d: baseline is out of range\n", baseline);
+
+    // store the pulse height, and arrival time; the arrival time is the number of 
+    // samples since the start of the window, and may be slightly negative for a 
+    // pulse that began before the end of the prior window, but was detected after it
+    idx = w->max_pulse++;
+    w->pulse_mv[idx] = pulse->height_mv;
+    w->pulse_time[idx] = pulse->start_pos - w->start_pos;
+
+    // the pulse data (snippet) is stored for every stride'th pulse; when the snippet 
+    // array fills, every other snippet is discarded and the stride is doubled, so that 
+    // the snippets kept are spread evenly over the second
+    if (neutron_max_snippet == 0 || (idx & (w->snippet_stride-1)) != 0) {
         return;
     }
+    if (w->max_snippet == neutron_max_snippet) {
+        for (i = 0; 2*i < w->max_snippet; i++) {
+            w->snippet_idx[i] = w->snippet_idx[2*i];
+            memcpy(w->adc_pulse_data[i], w->adc_pulse_data[2*i], sizeof(w->adc_pulse_data[0]));
+        }
+        w->max_snippet = i;
+        w->snippet_stride *= 2;
+        if ((idx & (w->snippet_stride-1)) != 0) {
+            return;
+        }
+    }
+    w->snippet_idx[w->max_snippet] = idx;
+    memcpy(w->adc_pulse_data[w->max_snippet], pulse->data_mv, sizeof(w->adc_pulse_data[0]));
+    w->max_snippet++;
+}
 
-    if (value < 0) {
-        value = 0;
+// -----------------  SAMPLE CLOCK  --------------------------------------------------
+
+// The sample clock determines the detector stream positions at which each second's
+// window starts and ends. The mccdaq sample rate is derived from the device's crystal, 
+// and so differs slightly from the nominal rate; and samples are lost when the mccdaq 
+// is restarted. So the mapping of stream position to CLOCK_REALTIME is disciplined, 
+// once per window, by a phase locked loop. The observation used by the pll is the 
+// stream position following the last sample received, and the time it was received;
+// thus the usb transfer latency becomes part of the phase.
+
+static void sample_clock_init(int64_t pos, uint64_t real_us, double freq)
+{
+    sample_clock_ref_pos      = pos;
+    sample_clock_ref_us       = real_us;
+    sample_clock_freq         = freq;
+    sample_clock_nominal_freq = freq;
+    sample_clock_phase_err    = 0;
+    sample_clock_locked       = true;
+}
+
+static void sample_clock_update(int64_t pos, uint64_t real_us)
+{
+    double predicted_pos, err, max_dev;
+
+    // the phase error is the observed stream position less the position predicted
+    // for the time of the observation
+    predicted_pos = sample_clock_ref_pos + 
+                    (int64_t)(real_us - sample_clock_ref_us) * sample_clock_freq / 1000000;
+    err = pos - predicted_pos;
+    sample_clock_phase_err = err;
+
+    // if the phase error is large, such as following a mccdaq restart, then
+    //   relock the phase to the observation
+    // else
+    //   correct the phase and frequency by a fraction of the error
+    // endif
+    if (fabs(err) * 1000000 / sample_clock_freq > SAMPLE_CLOCK_RELOCK_US) {
+        sample_clock_ref_pos = pos;
+        sample_clock_relocks++;
+    } else {
+        sample_clock_ref_pos = predicted_pos + SAMPLE_CLOCK_KP * err;
+        sample_clock_freq += SAMPLE_CLOCK_KI * err;
+    }
+    sample_clock_ref_us = real_us;
+
+    // limit the frequency correction
+    max_dev = sample_clock_nominal_freq * SAMPLE_CLOCK_MAX_PPM / 1000000;
+    if (sample_clock_freq > sample_clock_nominal_freq + max_dev) {
+        sample_clock_freq = sample_clock_nominal_freq + max_dev;
+    } else if (sample_clock_freq < sample_clock_nominal_freq - max_dev) {
+        sample_clock_freq = sample_clock_nominal_freq - max_dev;
     }
+}
 
-    bzero(str, sizeof(str));
+static int64_t sample_clock_pos(uint64_t real_us)
+{
+    return llround(sample_clock_ref_pos + 
+                   (int64_t)(real_us - sample_clock_ref_us) * sample_clock_freq / 1000000);
+}
 
-    idx = value / 100;
-    for (i = 0; i <= idx; i++) {
-        str[i] = '*';
+static uint64_t sample_clock_real_us(int64_t pos)
+{
+    return sample_clock_ref_us + 
+           llround((pos - sample_clock_ref_pos) * 1000000 / sample_clock_freq);
+}
+
+// -----------------  ENCODE SPECTRUM  -----------------------------------------------
+
+static int32_t encode_spectrum(uint32_t * spectrum, uint16_t (*entry)[2])
+{
+    int32_t bin, max_entry = 0;
+
+    // encode the non zero bins as {bin, count} entries, see common.h
+    for (bin = 0; bin < MAX_NEUTRON_SPECTRUM_BIN; bin++) {
+        uint32_t count = spectrum[bin];
+        while (count > 0 && max_entry < MAX_NEUTRON_SPECTRUM_ENTRY) {
+            entry[max_entry][0] = bin;
+            entry[max_entry][1] = (count > 65535 ? 65535 : count);
+            count -= entry[max_entry][1];
+            max_entry++;
+        }
     }
+    return max_entry;
+}
 
-    idx = baseline / 100;
-    if (str[idx] == '*') {
-        str[idx] = '+';
-    } else {
-        str[idx] = '|';
-        for (i = 0; i < idx; i++) {
-            if (str[i] == '\0') {
-                str[i] = ' ';
-            }
+// -----------------  ENCODE PULSE TIME  ---------------------------------------------
+
+static int32_t encode_pulse_time(int32_t * pulse_time, int32_t max_pulse_time, uint8_t * buff)
+{
+    int32_t  i, len = 0, prior = 0;
+    uint32_t zz;
+
+    // encode the difference of each pulse time from the prior, as a zigzag 
+    // varint, see common.h; and pad to a multiple of 8
+    for (i = 0; i < max_pulse_time; i++) {
+        int32_t delta = pulse_time[i] - prior;
+        prior = pulse_time[i];
+        zz = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+        while (zz >= 0x80) {
+            buff[len++] = (zz & 0x7f) | 0x80;
+            zz >>= 7;
         }
+        buff[len++] = zz;
+    }
+    while (len & 7) {
+        buff[len++] = 0;
+    }
+    return len;
+}
+
+// -----------------  WRITE CUMULATIVE SPECTRUM  -------------------------------------
+
+static void write_cumulative_spectrum(void)
+{
+    char     tmp_filename[PATH_MAX+10];
+    FILE   * fp;
+    uint64_t total = 0;
+    int32_t  bin;
+
+    // the file is written to a temp file and renamed, so that a reader
+    // never sees a partially written spectrum
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", spectrum_filename);
+    fp = fopen(tmp_filename, "w");
+    if (fp == NULL) {
+        ERROR("failed to create %s, %s\n", tmp_filename, strerror(errno));
+        return;
+    }
+
+    for (bin = 0; bin < MAX_NEUTRON_SPECTRUM_BIN; bin++) {
+        total += chan[0].cumulative_spectrum[bin];
+    }
+    fprintf(fp, "# cumulative neutron pulse height spectrum\n");
+    fprintf(fp, "# start=%"PRId64"   end=%"PRId64"   pulses=%"PRId64"   bins=%d   bin_width_mv=%0.3f\n",
+            cumulative_spectrum_start, (uint64_t)time(NULL), total,
+            MAX_NEUTRON_SPECTRUM_BIN, (double)NEUTRON_SPECTRUM_MAX_MV / MAX_NEUTRON_SPECTRUM_BIN);
+    fprintf(fp, "# bin_start_mv count\n");
+    for (bin = 0; bin < MAX_NEUTRON_SPECTRUM_BIN; bin++) {
+        fprintf(fp, "%d %"PRId64"\n", NEUTRON_SPECTRUM_BIN_TO_MV(bin), chan[0].cumulative_spectrum[bin]);
     }
 
-    printf("%5d: %s\n", value, str);
+    if (fclose(fp) != 0 || rename(tmp_filename, spectrum_filename) != 0) {
+        ERROR("failed to write %s, %s\n", spectrum_filename, strerror(errno));
+    }
+}
+
+// -----------------  PARSE INT LIST  ------------------------------------------------
+
+static int32_t parse_int_list(char * str, int32_t * list, int32_t max_list)
+{
+    char    * s = str, * end;
+    int32_t   n = 0;
+
+    // parse a comma seperated list of integers, return the number of 
+    // integers, or -1 on error
+    while (true) {
+        if (n == max_list) {
+            return -1;
+        }
+        list[n++] = strtol(s, &end, 10);
+        if (end == s || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+        if (*end == '\0') {
+            break;
+        }
+        s = end + 1;
+    }
+    return n;
 }
-#endif
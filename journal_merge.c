@@ -0,0 +1,318 @@
+/*
+Copyright (c) 2016 Steven Haid
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+
+// Merges get_data's journal (see util_journal.h and 'get_data -j') into a display
+// program data file, to recover the seconds that the display program did not 
+// receive because its computer or its connection to get_data failed.
+//
+// Each second in the journal that is NO_VALUE in the data file, or is after the 
+// end of the data file, is written to the data file; the gaps that remain after 
+// the end are written as NO_VALUE, as the display program does. Seconds before 
+// the start of the data file can not be added. If the data file does not exist
+// then it is created. The data file must not be in use by the display program.
+//
+// usage: journal_merge [-n] <journal_dirname> <display_filename>
+//   -n : report what would be merged, without changing the data file
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "util_journal.h"
+#include "util_proto.h"
+#include "util_misc.h"
+
+//
+// defines
+//
+
+#define IS_NO_VALUE(dp1) \
+    ((dp1)->voltage_kv == ERROR_NO_VALUE && \
+     (dp1)->neutron_live_permyriad == 0 && \
+     (dp1)->max_neutron_pulse == 0 && \
+     !(dp1)->data_part2_voltage_adc_data_valid)
+
+//
+// variables
+//
+
+static bool                  dry_run;
+static int32_t               file_fd = -1;
+static file_hdr_t          * file_hdr;
+static struct data_part1_s * file_data_part1;
+static uint32_t              file_max;            // file_hdr->max, including when dry_run
+static uint64_t              file_first_time;     // time of the first second, if file_max > 0
+static off_t                 data_part2_offset;
+
+//
+// prototypes
+//
+
+static int32_t file_open(char * filename);
+static int32_t file_write(uint32_t idx, data_t * data);
+
+// -----------------  MAIN  ----------------------------------------------------------
+
+int32_t main(int32_t argc, char **argv)
+{
+    journal_reader_t  * jr;
+    proto_frame_hdr_t * frame_hdr;
+    uint8_t           * frame;
+    data_t            * data;
+    data_t              data_novalue;
+    uint64_t            time, first_time;
+    int32_t             len;
+    uint32_t            idx;
+    uint64_t            entries = 0, replaced = 0, appended = 0, novalue = 0, present = 0;
+    uint64_t            before_start = 0, after_max = 0, invalid = 0;
+
+    // parse options
+    while (true) {
+        char opt_char = getopt(argc, argv, "n");
+        if (opt_char == -1) {
+            break;
+        }
+        switch (opt_char) {
+        case 'n':
+            dry_run = true;
+            break;
+        default:
+            return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        FATAL("usage: journal_merge [-n] <journal_dirname> <display_filename>\n");
+    }
+
+    // open the journal and the data file, and allocate buffers
+    jr = journal_open(argv[optind]);
+    if (jr == NULL) {
+        return 1;
+    }
+    if (file_open(argv[optind+1]) < 0) {
+        return 1;
+    }
+    frame = malloc(PROTO_MAX_FRAME_LEN);
+    data = calloc(1, sizeof(struct data_part1_s) + MAX_DATA_PART2_LENGTH);
+    if (frame == NULL || data == NULL) {
+        FATAL("malloc failed\n");
+    }
+
+    // init data_novalue, as the display program does
+    bzero(&data_novalue, sizeof(data_novalue));
+    data_novalue.part1.magic             = MAGIC_DATA_PART1;
+    data_novalue.part1.voltage_kv        = ERROR_NO_VALUE;
+    data_novalue.part1.current_ma        = ERROR_NO_VALUE;
+    data_novalue.part1.d2_pressure_mtorr = ERROR_NO_VALUE;
+    data_novalue.part1.n2_pressure_mtorr = ERROR_NO_VALUE;
+    data_novalue.part1.data_part2_length = sizeof(struct data_part2_s);
+    data_novalue.part2.magic             = MAGIC_DATA_PART2;
+
+    // loop over the journal entries
+    while ((len = journal_read(jr, &time, frame, PROTO_MAX_FRAME_LEN)) > 0) {
+        entries++;
+
+        // decode the entry's frame
+        frame_hdr = (proto_frame_hdr_t *)frame;
+        if (len < sizeof(proto_frame_hdr_t) ||
+            frame_hdr->magic != MAGIC_PROTO_FRAME ||
+            frame_hdr->len != len - sizeof(proto_frame_hdr_t) ||
+            proto_decode(frame_hdr, frame + sizeof(proto_frame_hdr_t), data) < 0 ||
+            data->part1.time != time)
+        {
+            ERROR("journal entry for time %"PRId64" is invalid\n", time);
+            invalid++;
+            continue;
+        }
+
+        // determine the second's index in the data file, which starts with the
+        // first journal entry if the data file is empty
+        first_time = (file_max > 0 ? file_first_time : time);
+        if (time < first_time) {
+            before_start++;
+            continue;
+        }
+        if (time - first_time >= MAX_FILE_DATA_PART1) {
+            after_max++;
+            continue;
+        }
+        idx = time - first_time;
+
+        // if the second is in the data file then 
+        //   replace it if it is NO_VALUE
+        // else
+        //   write NO_VALUE for the gap after the end of the data file, and
+        //   append the second
+        // endif
+        if (idx < file_max) {
+            if (file_data_part1[idx].time != time || !IS_NO_VALUE(&file_data_part1[idx])) {
+                present++;
+                continue;
+            }
+            if (file_write(idx, data) < 0) {
+                return 1;
+            }
+            replaced++;
+        } else {
+            while (file_max < idx) {
+                data_novalue.part1.time = first_time + file_max;
+                if (file_write(file_max, &data_novalue) < 0) {
+                    return 1;
+                }
+                novalue++;
+            }
+            if (file_write(idx, data) < 0) {
+                return 1;
+            }
+            appended++;
+        }
+    }
+    if (len < 0) {
+        return 1;
+    }
+
+    // sync the data file
+    if (!dry_run && (msync(file_hdr, sizeof(file_hdr_t), MS_SYNC) < 0 ||
+                     msync(file_data_part1, sizeof(struct data_part1_s) * MAX_FILE_DATA_PART1, MS_SYNC) < 0 ||
+                     fsync(file_fd) < 0))
+    {
+        ERROR("sync %s, %s\n", argv[optind+1], strerror(errno));
+        return 1;
+    }
+
+    INFO("%sjournal entries=%"PRId64" corrupt=%"PRId64" invalid=%"PRId64"\n", 
+         dry_run ? "DRY RUN: " : "", entries, jr->corrupt, invalid);
+    INFO("%sreplaced=%"PRId64" appended=%"PRId64" no_value_appended=%"PRId64
+         " already_present=%"PRId64" before_start=%"PRId64" beyond_max=%"PRId64"\n",
+         dry_run ? "DRY RUN: " : "", replaced, appended, novalue, present, before_start, after_max);
+    journal_close(jr);
+    return 0;
+}
+
+// -----------------  DATA FILE  -----------------------------------------------------
+
+static int32_t file_open(char * filename)
+{
+    struct stat stat_buf;
+    file_hdr_t  hdr;
+    int32_t     prot = (dry_run ? PROT_READ : PROT_READ|PROT_WRITE);
+
+    // if the file does not exist then create and init it, as the display program does
+    if (stat(filename, &stat_buf) < 0) {
+        if (dry_run) {
+            INFO("%s does not exist, it would be created\n", filename);
+            file_hdr = calloc(1, sizeof(file_hdr_t));
+            file_data_part1 = calloc(MAX_FILE_DATA_PART1, sizeof(struct data_part1_s));
+            if (file_hdr == NULL || file_data_part1 == NULL) {
+                FATAL("calloc failed\n");
+            }
+            data_part2_offset = FILE_DATA_PART2_OFFSET;
+            return 0;
+        }
+        file_fd = open(filename, O_CREAT|O_EXCL|O_RDWR, 0666);
+        if (file_fd < 0) {
+            ERROR("failed to create %s, %s\n", filename, strerror(errno));
+            return -1;
+        }
+        bzero(&hdr, sizeof(hdr));
+        hdr.magic = MAGIC_FILE;
+        if (write(file_fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+            ftruncate(file_fd, FILE_DATA_PART2_OFFSET) < 0) 
+        {
+            ERROR("failed to init %s, %s\n", filename, strerror(errno));
+            return -1;
+        }
+        close(file_fd);
+        INFO("created %s\n", filename);
+    }
+
+    // open and map the file
+    file_fd = open(filename, dry_run ? O_RDONLY : O_RDWR);
+    if (file_fd < 0 || fstat(file_fd, &stat_buf) < 0) {
+        ERROR("failed to open %s, %s\n", filename, strerror(errno));
+        return -1;
+    }
+    file_hdr = mmap(NULL, sizeof(file_hdr_t), prot, MAP_SHARED, file_fd, 0);
+    file_data_part1 = mmap(NULL, sizeof(struct data_part1_s) * MAX_FILE_DATA_PART1, prot, MAP_SHARED,
+                           file_fd, sizeof(file_hdr_t));
+    if (file_hdr == MAP_FAILED || file_data_part1 == MAP_FAILED) {
+        ERROR("failed to map %s, %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    // verify the file header
+    if (file_hdr->magic != MAGIC_FILE || file_hdr->max > MAX_FILE_DATA_PART1) {
+        ERROR("invalid file %s, magic=0x%"PRIx64" max=%d\n", 
+              filename, file_hdr->magic, file_hdr->max);
+        return -1;
+    }
+
+    // the data part2s are appended
+    file_max = file_hdr->max;
+    file_first_time = (file_max > 0 ? file_data_part1[0].time : 0);
+    data_part2_offset = (stat_buf.st_size > FILE_DATA_PART2_OFFSET ? stat_buf.st_size : FILE_DATA_PART2_OFFSET);
+    return 0;
+}
+
+static int32_t file_write(uint32_t idx, data_t * data)
+{
+    int32_t len;
+
+    // write data part2, and then data part1 which refers to it
+    data->part1.data_part2_offset = data_part2_offset;
+    if (!dry_run) {
+        len = pwrite(file_fd, &data->part2, data->part1.data_part2_length, data_part2_offset);
+        if (len != data->part1.data_part2_length) {
+            ERROR("write data part2, %s\n", len < 0 ? strerror(errno) : "short write");
+            return -1;
+        }
+        file_data_part1[idx] = data->part1;
+    }
+    data_part2_offset += data->part1.data_part2_length;
+
+    // if appended then update the file header
+    if (file_max == 0) {
+        file_first_time = data->part1.time;
+    }
+    if (idx == file_max) {
+        file_max++;
+        if (!dry_run) {
+            file_hdr->max = file_max;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,249 @@
+/*
+Copyright (c) 2016 Steven Haid
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+// Replays mccdaq samples through the util_pulse detector, faster than real time, 
+// and reports throughput, pulses found, and the processing latency per block.
+// The detector runs twice over the samples, with the block prefilter disabled 
+// and then enabled.
+//
+// usage: pulse_bench [options] <filename|sim>
+//   filename : raw little endian uint16 samples, at 500000 samples/sec
+//   sim      : generate 10 secs of samples, baseline noise with pulses
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "util_pulse.h"
+#include "util_misc.h"
+
+//
+// defines
+//
+
+#define SAMPLES_PER_SEC   500000
+#define SIM_SECS          10
+#define DEFAULT_BLOCK     10000
+
+//
+// variables
+//
+
+static int32_t  opt_block     = DEFAULT_BLOCK;
+static int32_t  opt_threshold = PULSE_DEFAULT_THRESHOLD;
+static int32_t  opt_max_width = PULSE_DEFAULT_MAX_WIDTH;
+static int32_t  opt_sim_rate  = 1000;
+
+//
+// prototypes
+//
+
+static uint16_t * read_samples(char * filename, int32_t * max_data);
+static uint16_t * sim_samples(int32_t * max_data);
+static void run(uint16_t * data, int32_t max_data, bool prefilter);
+static int compare_u32(const void * a, const void * b);
+
+// -----------------  MAIN  ----------------------------------------------------------
+
+int32_t main(int32_t argc, char **argv)
+{
+    uint16_t * data;
+    int32_t    max_data;
+
+    // parse options
+    // -b samples : samples per block passed to the detector, default 10000
+    // -t adc     : pulse threshold above baseline, default 10
+    // -w samples : maximum pulse width, default 10
+    // -r rate    : sim pulses per second, default 1000
+    while (true) {
+        char opt_char = getopt(argc, argv, "b:t:w:r:");
+        if (opt_char == -1) {
+            break;
+        }
+        switch (opt_char) {
+        case 'b':
+            if (sscanf(optarg, "%d", &opt_block) != 1 || opt_block < 1) {
+                FATAL("invalid '-b %s'\n", optarg);
+            }
+            break;
+        case 't':
+            if (sscanf(optarg, "%d", &opt_threshold) != 1 || opt_threshold < 1) {
+                FATAL("invalid '-t %s'\n", optarg);
+            }
+            break;
+        case 'w':
+            if (sscanf(optarg, "%d", &opt_max_width) != 1 || opt_max_width < 1 || opt_max_width > PULSE_MAX_MAX_WIDTH) {
+                FATAL("invalid '-w %s'\n", optarg);
+            }
+            break;
+        case 'r':
+            if (sscanf(optarg, "%d", &opt_sim_rate) != 1 || opt_sim_rate < 1 || opt_sim_rate > 50000) {
+                FATAL("invalid '-r %s'\n", optarg);
+            }
+            break;
+        default:
+            return 1;
+        }
+    }
+    if (argc - optind != 1) {
+        FATAL("usage: pulse_bench [-b block] [-t threshold] [-w max_width] [-r sim_rate] <filename|sim>\n");
+    }
+
+    // get the samples
+    if (strcmp(argv[optind], "sim") == 0) {
+        data = sim_samples(&max_data);
+    } else {
+        data = read_samples(argv[optind], &max_data);
+    }
+    INFO("samples=%d (%0.1f secs)  block=%d  threshold=%d  max_width=%d\n",
+         max_data, (double)max_data / SAMPLES_PER_SEC, opt_block, opt_threshold, opt_max_width);
+
+    // run the detector over the samples, without and with the prefilter
+    run(data, max_data, false);
+    run(data, max_data, true);
+
+    // done
+    free(data);
+    return 0;
+}
+
+// -----------------  RUN THE DETECTOR  ----------------------------------------------
+
+static void run(uint16_t * data, int32_t max_data, bool prefilter)
+{
+    pulse_detector_t pd;
+    uint32_t       * latency_ns;
+    int32_t          max_latency, i, cnt;
+    uint64_t         total_ns;
+    struct timespec  ts0, ts1;
+
+    latency_ns = malloc((max_data / opt_block + 1) * sizeof(uint32_t));
+    if (latency_ns == NULL) {
+        FATAL("malloc failed\n");
+    }
+
+    pulse_detector_init(&pd, opt_threshold, opt_max_width, NULL, NULL);
+    pd.prefilter = prefilter;
+
+    // pass the samples to the detector in blocks, timing each call
+    total_ns = 0;
+    max_latency = 0;
+    for (i = 0; i < max_data; i += cnt) {
+        cnt = (max_data - i < opt_block ? max_data - i : opt_block);
+        clock_gettime(CLOCK_MONOTONIC, &ts0);
+        pulse_detector_process(&pd, data+i, cnt);
+        clock_gettime(CLOCK_MONOTONIC, &ts1);
+        latency_ns[max_latency] = (ts1.tv_sec - ts0.tv_sec) * 1000000000 + (ts1.tv_nsec - ts0.tv_nsec);
+        total_ns += latency_ns[max_latency];
+        max_latency++;
+    }
+
+    // print results
+    qsort(latency_ns, max_latency, sizeof(uint32_t), compare_u32);
+    INFO("prefilter=%-3s  pulses=%"PRId64"  discarded=%"PRId64"  rate=%0.1f Msamples/sec  realtime_x=%0.0f\n",
+         prefilter ? "on" : "off", pd.pulses, pd.discarded,
+         (double)max_data * 1000 / total_ns,
+         (double)max_data * 1e9 / total_ns / SAMPLES_PER_SEC);
+    INFO("               block_latency_us: avg=%0.1f  p50=%0.1f  p99=%0.1f  max=%0.1f\n",
+         total_ns / 1000. / max_latency,
+         latency_ns[max_latency/2] / 1000.,
+         latency_ns[(int64_t)max_latency*99/100] / 1000.,
+         latency_ns[max_latency-1] / 1000.);
+
+    free(latency_ns);
+}
+
+static int compare_u32(const void * a, const void * b)
+{
+    uint32_t x = *(uint32_t*)a, y = *(uint32_t*)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// -----------------  GET SAMPLES  ---------------------------------------------------
+
+static uint16_t * read_samples(char * filename, int32_t * max_data)
+{
+    struct stat statbuf;
+    uint16_t  * data;
+    int32_t     fd;
+    ssize_t     len;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &statbuf) < 0) {
+        FATAL("open %s, %s\n", filename, strerror(errno));
+    }
+    *max_data = statbuf.st_size / sizeof(uint16_t);
+    data = malloc(*max_data * sizeof(uint16_t));
+    if (data == NULL) {
+        FATAL("malloc failed\n");
+    }
+    len = read(fd, data, *max_data * sizeof(uint16_t));
+    if (len != *max_data * sizeof(uint16_t)) {
+        FATAL("read %s, len=%zd, %s\n", filename, len, strerror(errno));
+    }
+    close(fd);
+
+    return data;
+}
+
+static uint16_t * sim_samples(int32_t * max_data)
+{
+    uint16_t * data;
+    int32_t    i, interval;
+
+    // baseline of 2048 with +/- 1 noise
+    *max_data = SIM_SECS * SAMPLES_PER_SEC;
+    data = malloc(*max_data * sizeof(uint16_t));
+    if (data == NULL) {
+        FATAL("malloc failed\n");
+    }
+    srandom(1);
+    for (i = 0; i < *max_data; i++) {
+        data[i] = 2048 + (random() % 3) - 1;
+    }
+
+    // add pulses, at random intervals averaging opt_sim_rate per second,
+    // with random heights up to 500 adc units
+    interval = SAMPLES_PER_SEC / opt_sim_rate;
+    for (i = 1000; i < *max_data - 10; i += interval/2 + random() % interval + 1) {
+        int32_t height = 20 + random() % 500;
+        data[i+0] += height / 2;
+        data[i+1] += height;
+        data[i+2] += height / 2;
+        data[i+3] += height / 4;
+    }
+
+    return data;
+}
@@ -0,0 +1,381 @@
+/*
+Copyright (c) 2016 Steven Haid
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+// Reruns the neutron pulse detector over a raw sample capture file (see 
+// util_capture.h and 'get_data -c'), for each combination of the swept 
+// detector parameters, and prints the pulse count for each second and the 
+// pulse height spectrum for each parameter set.
+//
+// The capture is split by second (chunk) across threads. Each chunk is 
+// preceded by the end of the prior chunk, so that the baseline is established, 
+// and followed by the start of the next chunk, so that pulses near the end of 
+// the chunk are completed; only pulses that start in the chunk are counted.
+//
+// usage: pulse_redetect [options] <capture_filename>
+//   -t list : pulse thresholds, adc units above baseline, default 10
+//   -b list : baseline clip distances, adc units, default 3
+//   -w list : max pulse widths, samples, default 10
+//   -j num  : number of threads, default number of cpus
+//   -s mv   : spectrum bin width, default 100 mv
+// where list is comma seperated, for example '-t 6,8,10,12'
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+
+#include <pthread.h>
+
+#include "util_pulse.h"
+#include "util_capture.h"
+#include "util_misc.h"
+
+//
+// defines
+//
+
+#define MAX_PARAM_VALUES  16
+#define MAX_SET           256
+#define MAX_THREAD        64
+#define MAX_HEIGHT_MV     10000
+#define EDGE_SAMPLES      1000   // samples taken from the adjacent chunks
+
+//
+// typedefs
+//
+
+typedef struct {
+    int32_t threshold;
+    int32_t baseline_clip;
+    int32_t max_width;
+} param_set_t;
+
+typedef struct {
+    int64_t    lo, hi;           // pulses starting in [lo,hi) are counted
+    int32_t    count;
+    uint64_t * spectrum;
+} pulse_cx_t;
+
+//
+// variables
+//
+
+static capture_file_t * cf;
+static param_set_t      set[MAX_SET];
+static int32_t          max_set;
+static int32_t          bin_mv = 100;
+static int32_t          max_bin;
+static int32_t        * counts;          // [chunk][set]
+static uint64_t       * spectrum;        // [set][bin]
+static int32_t          next_chunk;
+static pthread_mutex_t  spectrum_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// prototypes
+//
+
+static int32_t parse_list(char * str, int32_t * values);
+static void * worker_thread(void * cx);
+static void pulse_callback(void * cx, pulse_t * pulse);
+
+// -----------------  MAIN  ----------------------------------------------------------
+
+int32_t main(int32_t argc, char **argv)
+{
+    int32_t   threshold[MAX_PARAM_VALUES]  = {PULSE_DEFAULT_THRESHOLD};
+    int32_t   clip[MAX_PARAM_VALUES]       = {PULSE_DEFAULT_BASELINE_CLIP};
+    int32_t   max_width[MAX_PARAM_VALUES]  = {PULSE_DEFAULT_MAX_WIDTH};
+    int32_t   max_threshold = 1, max_clip = 1, max_max_width = 1;
+    int32_t   max_thread = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t thread[MAX_THREAD];
+    int32_t   i, j, k, s, b;
+    uint64_t  start_us;
+
+    // parse options
+    while (true) {
+        char opt_char = getopt(argc, argv, "t:b:w:j:s:");
+        if (opt_char == -1) {
+            break;
+        }
+        switch (opt_char) {
+        case 't':
+            max_threshold = parse_list(optarg, threshold);
+            break;
+        case 'b':
+            max_clip = parse_list(optarg, clip);
+            break;
+        case 'w':
+            max_max_width = parse_list(optarg, max_width);
+            break;
+        case 'j':
+            if (sscanf(optarg, "%d", &max_thread) != 1) {
+                max_thread = 0;
+            }
+            break;
+        case 's':
+            if (sscanf(optarg, "%d", &bin_mv) != 1 || bin_mv < 1) {
+                FATAL("invalid '-s %s'\n", optarg);
+            }
+            break;
+        default:
+            return 1;
+        }
+    }
+    if (argc - optind != 1) {
+        FATAL("usage: pulse_redetect [-t list] [-b list] [-w list] [-j threads] [-s bin_mv] <capture_filename>\n");
+    }
+    if (max_threshold <= 0 || max_clip <= 0 || max_max_width <= 0) {
+        FATAL("invalid parameter list\n");
+    }
+    for (i = 0; i < max_max_width; i++) {
+        if (max_width[i] < 1 || max_width[i] > PULSE_MAX_MAX_WIDTH) {
+            FATAL("invalid max_width %d, range 1 - %d\n", max_width[i], PULSE_MAX_MAX_WIDTH);
+        }
+    }
+    if (max_thread < 1 || max_thread > MAX_THREAD) {
+        max_thread = (max_thread < 1 ? 1 : MAX_THREAD);
+    }
+
+    // create the parameter sets
+    for (i = 0; i < max_threshold; i++) {
+        for (j = 0; j < max_clip; j++) {
+            for (k = 0; k < max_max_width; k++) {
+                if (max_set == MAX_SET) {
+                    FATAL("too many parameter sets, max %d\n", MAX_SET);
+                }
+                set[max_set].threshold          = threshold[i];
+                set[max_set].baseline_clip      = clip[j];
+                set[max_set].max_width          = max_width[k];
+                max_set++;
+            }
+        }
+    }
+
+    // open the capture file, and allocate the results
+    cf = capture_open(argv[optind]);
+    if (cf == NULL) {
+        return 1;
+    }
+    max_bin = MAX_HEIGHT_MV / bin_mv + 1;
+    counts = calloc((size_t)cf->max_chunk * max_set, sizeof(int32_t));
+    spectrum = calloc((size_t)max_set * max_bin, sizeof(uint64_t));
+    if (counts == NULL || spectrum == NULL) {
+        FATAL("calloc failed\n");
+    }
+
+    // run the worker threads, and wait for them to complete
+    start_us = microsec_timer();
+    for (i = 0; i < max_thread; i++) {
+        if (pthread_create(&thread[i], NULL, worker_thread, NULL) != 0) {
+            FATAL("pthread_create worker_thread, %s\n", strerror(errno));
+        }
+    }
+    for (i = 0; i < max_thread; i++) {
+        pthread_join(thread[i], NULL);
+    }
+    INFO("processed %d chunks, %d parameter sets, %d threads, in %0.3f secs\n",
+         cf->max_chunk, max_set, max_thread, (microsec_timer() - start_us) / 1000000.);
+
+    // print the parameter sets
+    printf("\n# parameter sets\n");
+    for (s = 0; s < max_set; s++) {
+        printf("# set%d: threshold=%d baseline_clip=%d max_width=%d\n",
+               s, set[s].threshold, set[s].baseline_clip, set[s].max_width);
+    }
+
+    // print the pulse counts for each second; a second that was captured in
+    // more than one chunk (because samples were dropped) is combined
+    printf("\n# pulse counts\n");
+    printf("%-10s %9s", "time", "samples");
+    for (s = 0; s < max_set; s++) {
+        printf(" %7s%d", "set", s);
+    }
+    printf("\n");
+    for (i = 0; i < cf->max_chunk; i = j) {
+        int64_t samples = 0;
+        for (j = i; j < cf->max_chunk && cf->chunk[j].time == cf->chunk[i].time; j++) {
+            samples += cf->chunk[j].max_samples;
+        }
+        printf("%-10"PRId64" %9"PRId64, cf->chunk[i].time, samples);
+        for (s = 0; s < max_set; s++) {
+            int32_t cnt = 0;
+            for (k = i; k < j; k++) {
+                cnt += counts[(size_t)k * max_set + s];
+            }
+            printf(" %8d", cnt);
+        }
+        printf("\n");
+    }
+
+    // print the pulse height spectra
+    printf("\n# pulse height spectra, %d mv bins\n", bin_mv);
+    printf("%-10s", "mv");
+    for (s = 0; s < max_set; s++) {
+        printf(" %7s%d", "set", s);
+    }
+    printf("\n");
+    for (b = 0; b < max_bin; b++) {
+        bool nonzero = false;
+        for (s = 0; s < max_set; s++) {
+            nonzero |= (spectrum[(size_t)s * max_bin + b] != 0);
+        }
+        if (!nonzero) {
+            continue;
+        }
+        printf("%-10d", b * bin_mv);
+        for (s = 0; s < max_set; s++) {
+            printf(" %8"PRId64, spectrum[(size_t)s * max_bin + b]);
+        }
+        printf("\n");
+    }
+
+    // done
+    capture_close(cf);
+    free(counts);
+    free(spectrum);
+    return 0;
+}
+
+static int32_t parse_list(char * str, int32_t * values)
+{
+    char  * saveptr, * tok;
+    int32_t cnt = 0;
+
+    for (tok = strtok_r(str, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+        if (cnt == MAX_PARAM_VALUES || sscanf(tok, "%d", &values[cnt]) != 1 || values[cnt] < 0) {
+            return -1;
+        }
+        cnt++;
+    }
+    return cnt;
+}
+
+// -----------------  WORKER THREAD  -------------------------------------------------
+
+static void * worker_thread(void * cx)
+{
+    uint16_t * buff = NULL, * tmp = NULL;
+    int32_t    max_buff = 0, idx, s, n, pre, post;
+    uint64_t * local_spectrum;
+
+    local_spectrum = calloc((size_t)max_set * max_bin, sizeof(uint64_t));
+    if (local_spectrum == NULL) {
+        FATAL("calloc failed\n");
+    }
+
+    while ((idx = __atomic_fetch_add(&next_chunk, 1, __ATOMIC_RELAXED)) < cf->max_chunk) {
+        capture_chunk_t * c    = &cf->chunk[idx];
+        capture_chunk_t * prev = (idx > 0 ? &cf->chunk[idx-1] : NULL);
+        capture_chunk_t * next = (idx+1 < cf->max_chunk ? &cf->chunk[idx+1] : NULL);
+        int32_t           max_needed;
+
+        // allocate buffers large enough for this chunk and the adjacent chunks
+        max_needed = c->max_samples;
+        if (prev && prev->max_samples > max_needed) max_needed = prev->max_samples;
+        if (next && next->max_samples > max_needed) max_needed = next->max_samples;
+        if (max_needed + 2 * EDGE_SAMPLES > max_buff) {
+            max_buff = max_needed + 2 * EDGE_SAMPLES;
+            free(buff);
+            free(tmp);
+            buff = malloc(max_buff * sizeof(uint16_t));
+            tmp = malloc(max_buff * sizeof(uint16_t));
+            if (buff == NULL || tmp == NULL) {
+                FATAL("malloc failed\n");
+            }
+        }
+
+        // construct buff: the end of the prior chunk, if contiguous; 
+        // this chunk; and the start of the next chunk, if contiguous
+        pre = 0;
+        if (prev && prev->first_pos + prev->max_samples == c->first_pos &&
+            capture_read_chunk(cf, idx-1, tmp) > 0)
+        {
+            pre = (prev->max_samples < EDGE_SAMPLES ? prev->max_samples : EDGE_SAMPLES);
+            memcpy(buff, tmp + prev->max_samples - pre, pre * sizeof(uint16_t));
+        }
+        if (capture_read_chunk(cf, idx, buff+pre) < 0) {
+            continue;
+        }
+        post = 0;
+        if (next && c->first_pos + c->max_samples == next->first_pos &&
+            capture_read_chunk(cf, idx+1, tmp) > 0)
+        {
+            post = (next->max_samples < EDGE_SAMPLES ? next->max_samples : EDGE_SAMPLES);
+            memcpy(buff + pre + c->max_samples, tmp, post * sizeof(uint16_t));
+        }
+        n = pre + c->max_samples + post;
+
+        // run the detector over buff for each parameter set
+        for (s = 0; s < max_set; s++) {
+            pulse_detector_t pd;
+            pulse_cx_t       pcx;
+
+            pcx.lo       = pre;
+            pcx.hi       = pre + c->max_samples;
+            pcx.count    = 0;
+            pcx.spectrum = &local_spectrum[(size_t)s * max_bin];
+
+            pulse_detector_init(&pd, set[s].threshold, set[s].max_width, pulse_callback, &pcx);
+            pd.baseline_clip = set[s].baseline_clip;
+            pd.log_warnings = false;
+            pulse_detector_process(&pd, buff, n);
+
+            counts[(size_t)idx * max_set + s] = pcx.count;
+        }
+    }
+
+    // add this thread's spectra to the totals
+    pthread_mutex_lock(&spectrum_mutex);
+    for (s = 0; s < max_set * max_bin; s++) {
+        spectrum[s] += local_spectrum[s];
+    }
+    pthread_mutex_unlock(&spectrum_mutex);
+
+    free(buff);
+    free(tmp);
+    free(local_spectrum);
+    return NULL;
+}
+
+static void pulse_callback(void * cx, pulse_t * pulse)
+{
+    pulse_cx_t * pcx = cx;
+    int32_t      bin;
+
+    if (pulse->start_pos < pcx->lo || pulse->start_pos >= pcx->hi) {
+        return;
+    }
+
+    pcx->count++;
+    bin = pulse->height_mv / bin_mv;
+    if (bin < 0) bin = 0;
+    if (bin >= max_bin) bin = max_bin - 1;
+    pcx->spectrum[bin]++;
+}
@@ -0,0 +1,616 @@
+/*
+Copyright (c) 2016 Steven Haid
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "util_capture.h"
+#include "util_misc.h"
+
+//
+// defines
+//
+
+#define FILE_MAGIC     "FUSCAP01"
+#define FILE_VERSION   1
+#define CHUNK_MAGIC    0x4b4e4843   // 'CHNK'
+#define INDEX_MAGIC    0x58444e49   // 'INDX'
+#define TRAILER_MAGIC  0x524c5254   // 'TRLR'
+
+#define RING_SECS      4
+#define MAX_SEG        8     // max chunks per second
+#define MAX_QUEUE      8     // max seconds waiting for the writer
+#define CODEC_BLOCK    64    // samples per bit-pack block
+
+// the maximum encoded length of n samples; a block contains the bit width
+// byte followed by up to 17 bits per sample
+#define MAX_ENCODED_LEN(n)  (((n) + CODEC_BLOCK - 1) / CODEC_BLOCK * (1 + CODEC_BLOCK * 17 / 8))
+
+#define STATS_ADD(field,n)  __atomic_fetch_add(&g_stats.field, (n), __ATOMIC_RELAXED)
+
+//
+// typedefs
+//
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    int32_t  sample_rate;
+    uint64_t start_time_us;
+    uint64_t reserved;
+} file_hdr_t;
+
+typedef struct {
+    uint32_t magic;
+    int32_t  max_samples;
+    int32_t  len;
+    uint32_t reserved;
+    uint64_t time;
+    int64_t  first_pos;
+} chunk_hdr_t;
+
+typedef struct {
+    uint32_t magic;
+    int32_t  max_chunk;
+} index_hdr_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t index_offset;
+} trailer_t;
+
+typedef struct {
+    int64_t  first_pos;
+    int64_t  ring_start;
+    int32_t  max_samples;
+} seg_t;
+
+typedef struct {
+    uint64_t time;
+    int32_t  max_seg;
+    seg_t    seg[MAX_SEG];
+} second_t;
+
+//
+// variables
+//
+
+static bool             g_active;
+static int32_t          g_fd = -1;
+static uint64_t         g_file_offset;
+static bool             g_write_error;
+static capture_stats_t  g_stats;
+
+static uint16_t       * g_ring;
+static int64_t          g_ring_size;
+static int64_t          g_ring_head;       // samples stored, updated by capture_write
+static int64_t          g_ring_tail;       // samples released by the writer thread
+static int64_t          g_stream_pos;      // samples passed to capture_write
+
+static second_t         g_cur;             // the second being accumulated
+static bool             g_seg_open;
+
+static second_t         g_queue[MAX_QUEUE];
+static int32_t          g_queue_head;
+static int32_t          g_queue_tail;
+static bool             g_stopping;
+static pthread_mutex_t  g_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   g_cond  = PTHREAD_COND_INITIALIZER;
+static pthread_t        g_writer_thread;
+
+static capture_chunk_t* g_index;
+static int32_t          g_max_index;
+
+//
+// prototypes
+//
+
+static void * capture_writer_thread(void * cx);
+static void capture_write_chunk(uint64_t time, seg_t * seg, uint16_t * samples, uint8_t * encoded);
+static void capture_write_index(void);
+static void capture_write_buff(void * buff, size_t len);
+static int32_t capture_encode(uint16_t * d, int32_t n, uint8_t * out);
+static int32_t capture_decode(uint8_t * in, int32_t len, uint16_t * d, int32_t n);
+
+// -----------------  WRITING  -------------------------------------------------------
+
+int32_t capture_start(char * filename, int32_t sample_rate)
+{
+    file_hdr_t hdr;
+
+    // open the file
+    g_fd = open(filename, O_CREAT|O_TRUNC|O_WRONLY, 0666);
+    if (g_fd < 0) {
+        ERROR("open %s, %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    // allocate the ring, which holds RING_SECS secs of samples
+    g_ring_size = (int64_t)sample_rate * RING_SECS;
+    g_ring = malloc(g_ring_size * sizeof(uint16_t));
+    if (g_ring == NULL) {
+        FATAL("malloc failed\n");
+    }
+
+    // write the file header
+    bzero(&hdr, sizeof(hdr));
+    memcpy(hdr.magic, FILE_MAGIC, sizeof(hdr.magic));
+    hdr.version = FILE_VERSION;
+    hdr.sample_rate = sample_rate;
+    hdr.start_time_us = get_real_time_us();
+    capture_write_buff(&hdr, sizeof(hdr));
+
+    // create the writer thread
+    if (pthread_create(&g_writer_thread, NULL, capture_writer_thread, NULL) != 0) {
+        FATAL("pthread_create capture_writer_thread, %s\n", strerror(errno));
+    }
+
+    // capture is active
+    INFO("capturing to %s\n", filename);
+    g_active = true;
+    return 0;
+}
+
+// called from the mccdaq callback, must not block
+void capture_write(uint16_t * d, int32_t max_d)
+{
+    int64_t idx;
+    int32_t len;
+
+    if (!g_active) {
+        return;
+    }
+
+    // if there is no room in the ring, or there are already MAX_SEG chunks 
+    // for this second, then drop the samples
+    if ((g_ring_head + max_d - __atomic_load_n(&g_ring_tail, __ATOMIC_ACQUIRE) > g_ring_size) ||
+        (!g_seg_open && g_cur.max_seg == MAX_SEG))
+    {
+        STATS_ADD(dropped, max_d);
+        g_stream_pos += max_d;
+        g_seg_open = false;
+        return;
+    }
+
+    // if needed, start a new chunk
+    if (!g_seg_open) {
+        seg_t * seg = &g_cur.seg[g_cur.max_seg++];
+        seg->first_pos   = g_stream_pos;
+        seg->ring_start  = g_ring_head;
+        seg->max_samples = 0;
+        g_seg_open = true;
+    }
+
+    // copy the samples to the ring
+    idx = g_ring_head % g_ring_size;
+    len = (idx + max_d <= g_ring_size ? max_d : g_ring_size - idx);
+    memcpy(g_ring+idx, d, len*sizeof(uint16_t));
+    memcpy(g_ring, d+len, (max_d-len)*sizeof(uint16_t));
+
+    g_ring_head += max_d;
+    g_cur.seg[g_cur.max_seg-1].max_samples += max_d;
+    g_stream_pos += max_d;
+}
+
+// called from the mccdaq callback when the samples for time have been published
+void capture_end_second(uint64_t time)
+{
+    if (!g_active || g_cur.max_seg == 0) {
+        return;
+    }
+
+    // queue this second's chunks for the writer thread
+    pthread_mutex_lock(&g_mutex);
+    if (g_queue_head - g_queue_tail < MAX_QUEUE) {
+        g_cur.time = time;
+        g_queue[g_queue_head % MAX_QUEUE] = g_cur;
+        g_queue_head++;
+        pthread_cond_signal(&g_cond);
+    } else {
+        int32_t i;
+        for (i = 0; i < g_cur.max_seg; i++) {
+            STATS_ADD(dropped, g_cur.seg[i].max_samples);
+        }
+    }
+    pthread_mutex_unlock(&g_mutex);
+
+    // start the next second
+    g_cur.max_seg = 0;
+    g_seg_open = false;
+}
+
+void capture_stop(void)
+{
+    if (!g_active) {
+        return;
+    }
+    g_active = false;
+
+    // tell the writer thread to finish the queued seconds, and wait for it
+    pthread_mutex_lock(&g_mutex);
+    g_stopping = true;
+    pthread_cond_signal(&g_cond);
+    pthread_mutex_unlock(&g_mutex);
+    pthread_join(g_writer_thread, NULL);
+}
+
+void capture_get_stats(capture_stats_t * stats)
+{
+    stats->samples = __atomic_load_n(&g_stats.samples, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&g_stats.dropped, __ATOMIC_RELAXED);
+    stats->chunks  = __atomic_load_n(&g_stats.chunks, __ATOMIC_RELAXED);
+    stats->bytes   = __atomic_load_n(&g_stats.bytes, __ATOMIC_RELAXED);
+}
+
+static void * capture_writer_thread(void * cx)
+{
+    uint16_t * samples;
+    uint8_t  * encoded;
+    second_t   sec;
+    int32_t    i;
+
+    // allocate buffers for a chunk, which can be a full ring of samples
+    samples = malloc(g_ring_size * sizeof(uint16_t));
+    encoded = malloc(MAX_ENCODED_LEN(g_ring_size));
+    if (samples == NULL || encoded == NULL) {
+        FATAL("malloc failed\n");
+    }
+
+    while (true) {
+        // wait for a queued second, or stopping
+        pthread_mutex_lock(&g_mutex);
+        while (g_queue_head == g_queue_tail && !g_stopping) {
+            pthread_cond_wait(&g_cond, &g_mutex);
+        }
+        if (g_queue_head == g_queue_tail) {
+            pthread_mutex_unlock(&g_mutex);
+            break;
+        }
+        sec = g_queue[g_queue_tail % MAX_QUEUE];
+        g_queue_tail++;
+        pthread_mutex_unlock(&g_mutex);
+
+        // write a chunk for each contiguous span of samples in this second,
+        // and release the ring space
+        for (i = 0; i < sec.max_seg; i++) {
+            capture_write_chunk(sec.time, &sec.seg[i], samples, encoded);
+            __atomic_store_n(&g_ring_tail, sec.seg[i].ring_start + sec.seg[i].max_samples, __ATOMIC_RELEASE);
+        }
+    }
+
+    // write the index and trailer, and close
+    capture_write_index();
+    close(g_fd);
+    g_fd = -1;
+    INFO("capture closed, chunks=%"PRId64" samples=%"PRId64" dropped=%"PRId64" bytes=%"PRId64"\n",
+         g_stats.chunks, g_stats.samples, g_stats.dropped, g_stats.bytes);
+
+    free(samples);
+    free(encoded);
+    return NULL;
+}
+
+static void capture_write_chunk(uint64_t time, seg_t * seg, uint16_t * samples, uint8_t * encoded)
+{
+    chunk_hdr_t hdr;
+    int64_t     idx;
+    int32_t     len;
+
+    // copy the samples out of the ring
+    idx = seg->ring_start % g_ring_size;
+    len = (idx + seg->max_samples <= g_ring_size ? seg->max_samples : g_ring_size - idx);
+    memcpy(samples, g_ring+idx, len*sizeof(uint16_t));
+    memcpy(samples+len, g_ring, (seg->max_samples-len)*sizeof(uint16_t));
+
+    // compress
+    len = capture_encode(samples, seg->max_samples, encoded);
+
+    // add to the index
+    if ((g_max_index & 1023) == 0) {
+        g_index = realloc(g_index, (g_max_index + 1024) * sizeof(capture_chunk_t));
+        if (g_index == NULL) {
+            FATAL("realloc failed\n");
+        }
+    }
+    g_index[g_max_index].time        = time;
+    g_index[g_max_index].first_pos   = seg->first_pos;
+    g_index[g_max_index].max_samples = seg->max_samples;
+    g_index[g_max_index].len         = len;
+    g_index[g_max_index].offset      = g_file_offset + sizeof(chunk_hdr_t);
+    g_max_index++;
+
+    // write the chunk header and compressed samples
+    bzero(&hdr, sizeof(hdr));
+    hdr.magic       = CHUNK_MAGIC;
+    hdr.max_samples = seg->max_samples;
+    hdr.len         = len;
+    hdr.time        = time;
+    hdr.first_pos   = seg->first_pos;
+    capture_write_buff(&hdr, sizeof(hdr));
+    capture_write_buff(encoded, len);
+
+    STATS_ADD(chunks, 1);
+    STATS_ADD(samples, seg->max_samples);
+}
+
+static void capture_write_index(void)
+{
+    index_hdr_t index_hdr;
+    trailer_t   trailer;
+    uint64_t    index_offset = g_file_offset;
+
+    index_hdr.magic = INDEX_MAGIC;
+    index_hdr.max_chunk = g_max_index;
+    capture_write_buff(&index_hdr, sizeof(index_hdr));
+    capture_write_buff(g_index, g_max_index * sizeof(capture_chunk_t));
+
+    bzero(&trailer, sizeof(trailer));
+    trailer.magic = TRAILER_MAGIC;
+    trailer.index_offset = index_offset;
+    capture_write_buff(&trailer, sizeof(trailer));
+
+    free(g_index);
+    g_index = NULL;
+    g_max_index = 0;
+}
+
+static void capture_write_buff(void * buff, size_t len)
+{
+    ssize_t ret;
+
+    // after a write error, such as the disk being full, the remaining 
+    // samples are discarded so that the ring continues to be released
+    if (g_write_error) {
+        return;
+    }
+
+    ret = write(g_fd, buff, len);
+    if (ret != len) {
+        ERROR("capture write failed, %s\n", ret < 0 ? strerror(errno) : "short write");
+        g_write_error = true;
+        return;
+    }
+    g_file_offset += len;
+    STATS_ADD(bytes, len);
+}
+
+// -----------------  READING  -------------------------------------------------------
+
+capture_file_t * capture_open(char * filename)
+{
+    capture_file_t * cf;
+    file_hdr_t       hdr;
+    trailer_t        trailer;
+    index_hdr_t      index_hdr;
+    struct stat      statbuf;
+    uint64_t         offset;
+
+    // allocate the capture_file_t, open the file, and read the header
+    cf = calloc(1, sizeof(capture_file_t));
+    if (cf == NULL) {
+        FATAL("calloc failed\n");
+    }
+    cf->fd = open(filename, O_RDONLY);
+    if (cf->fd < 0) {
+        ERROR("open %s, %s\n", filename, strerror(errno));
+        goto error;
+    }
+    if (fstat(cf->fd, &statbuf) < 0 ||
+        pread(cf->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        memcmp(hdr.magic, FILE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != FILE_VERSION)
+    {
+        ERROR("%s is not a capture file\n", filename);
+        goto error;
+    }
+    cf->sample_rate = hdr.sample_rate;
+    cf->start_time_us = hdr.start_time_us;
+
+    // if the file has a trailer then read the index
+    if (statbuf.st_size >= sizeof(hdr) + sizeof(trailer) &&
+        pread(cf->fd, &trailer, sizeof(trailer), statbuf.st_size - sizeof(trailer)) == sizeof(trailer) &&
+        trailer.magic == TRAILER_MAGIC &&
+        pread(cf->fd, &index_hdr, sizeof(index_hdr), trailer.index_offset) == sizeof(index_hdr) &&
+        index_hdr.magic == INDEX_MAGIC)
+    {
+        size_t len = index_hdr.max_chunk * sizeof(capture_chunk_t);
+        cf->chunk = malloc(len + 1);
+        if (cf->chunk == NULL) {
+            FATAL("malloc failed\n");
+        }
+        if (pread(cf->fd, cf->chunk, len, trailer.index_offset + sizeof(index_hdr)) != len) {
+            ERROR("%s read index failed\n", filename);
+            goto error;
+        }
+        cf->max_chunk = index_hdr.max_chunk;
+        return cf;
+    }
+
+    // the file was not closed, rebuild the index from the chunk headers;
+    // a partially written last chunk is ignored
+    WARN("%s has no index, rebuilding\n", filename);
+    offset = sizeof(hdr);
+    while (true) {
+        chunk_hdr_t chunk_hdr;
+
+        if (pread(cf->fd, &chunk_hdr, sizeof(chunk_hdr), offset) != sizeof(chunk_hdr) ||
+            chunk_hdr.magic != CHUNK_MAGIC ||
+            offset + sizeof(chunk_hdr) + chunk_hdr.len > statbuf.st_size)
+        {
+            break;
+        }
+        if ((cf->max_chunk & 1023) == 0) {
+            cf->chunk = realloc(cf->chunk, (cf->max_chunk + 1024) * sizeof(capture_chunk_t));
+            if (cf->chunk == NULL) {
+                FATAL("realloc failed\n");
+            }
+        }
+        cf->chunk[cf->max_chunk].time        = chunk_hdr.time;
+        cf->chunk[cf->max_chunk].first_pos   = chunk_hdr.first_pos;
+        cf->chunk[cf->max_chunk].max_samples = chunk_hdr.max_samples;
+        cf->chunk[cf->max_chunk].len         = chunk_hdr.len;
+        cf->chunk[cf->max_chunk].offset      = offset + sizeof(chunk_hdr);
+        cf->max_chunk++;
+        offset += sizeof(chunk_hdr) + chunk_hdr.len;
+    }
+    return cf;
+
+error:
+    capture_close(cf);
+    return NULL;
+}
+
+// d must have room for the chunk's max_samples; 
+// returns the number of samples, or -1 on error
+int32_t capture_read_chunk(capture_file_t * cf, int32_t idx, uint16_t * d)
+{
+    capture_chunk_t * c = &cf->chunk[idx];
+    uint8_t         * encoded;
+    int32_t           ret;
+
+    encoded = malloc(c->len);
+    if (encoded == NULL) {
+        FATAL("malloc failed\n");
+    }
+    if (pread(cf->fd, encoded, c->len, c->offset) != c->len) {
+        ERROR("read chunk %d failed, %s\n", idx, strerror(errno));
+        free(encoded);
+        return -1;
+    }
+    ret = capture_decode(encoded, c->len, d, c->max_samples);
+    free(encoded);
+    if (ret != 0) {
+        ERROR("decode chunk %d failed\n", idx);
+        return -1;
+    }
+    return c->max_samples;
+}
+
+void capture_close(capture_file_t * cf)
+{
+    if (cf->fd >= 0) {
+        close(cf->fd);
+    }
+    free(cf->chunk);
+    free(cf);
+}
+
+// -----------------  CODEC  ---------------------------------------------------------
+
+// The samples are delta encoded, and the zigzag encoded deltas are bit-packed 
+// in blocks of CODEC_BLOCK samples. Each block starts with a byte containing
+// the bit width of the largest zigzag delta in the block. Baseline noise of 
+// +/- 1 adc unit packs to 3 bits per sample.
+
+#define ZIGZAG(x)    (((uint32_t)(x) << 1) ^ (uint32_t)((x) >> 31))
+#define UNZIGZAG(x)  ((int32_t)((x) >> 1) ^ -(int32_t)((x) & 1))
+
+static int32_t capture_encode(uint16_t * d, int32_t n, uint8_t * out)
+{
+    uint32_t zz[CODEC_BLOCK], or;
+    uint64_t acc;
+    int32_t  i, j, cnt, bits, acc_bits, prev = 0;
+    uint8_t *p = out;
+
+    for (i = 0; i < n; i += CODEC_BLOCK) {
+        // zigzag encode the deltas of this block, and determine the bit width
+        cnt = (n - i < CODEC_BLOCK ? n - i : CODEC_BLOCK);
+        or = 0;
+        for (j = 0; j < cnt; j++) {
+            zz[j] = ZIGZAG((int32_t)d[i+j] - prev);
+            prev = d[i+j];
+            or |= zz[j];
+        }
+        bits = (or == 0 ? 0 : 32 - __builtin_clz(or));
+        *p++ = bits;
+
+        // pack
+        acc = 0;
+        acc_bits = 0;
+        for (j = 0; j < cnt; j++) {
+            acc |= (uint64_t)zz[j] << acc_bits;
+            acc_bits += bits;
+            while (acc_bits >= 8) {
+                *p++ = acc;
+                acc >>= 8;
+                acc_bits -= 8;
+            }
+        }
+        if (acc_bits > 0) {
+            *p++ = acc;
+        }
+    }
+
+    return p - out;
+}
+
+static int32_t capture_decode(uint8_t * in, int32_t len, uint16_t * d, int32_t n)
+{
+    uint8_t *p = in, *end = in + len;
+    uint64_t acc;
+    uint32_t mask;
+    int32_t  i, j, cnt, bits, acc_bits, prev = 0;
+
+    for (i = 0; i < n; i += CODEC_BLOCK) {
+        // get the bit width of this block, and check the block is complete
+        cnt = (n - i < CODEC_BLOCK ? n - i : CODEC_BLOCK);
+        if (p >= end) {
+            return -1;
+        }
+        bits = *p++;
+        if (bits > 17 || p + (cnt * bits + 7) / 8 > end) {
+            return -1;
+        }
+        mask = (1u << bits) - 1;
+
+        // unpack
+        acc = 0;
+        acc_bits = 0;
+        for (j = 0; j < cnt; j++) {
+            while (acc_bits < bits) {
+                acc |= (uint64_t)*p++ << acc_bits;
+                acc_bits += 8;
+            }
+            prev += UNZIGZAG((uint32_t)acc & mask);
+            d[i+j] = prev;
+            acc >>= bits;
+            acc_bits -= bits;
+        }
+    }
+
+    return p == end ? 0 : -1;
+}
@@ -0,0 +1,73 @@
+/*
+Copyright (c) 2016 Steven Haid
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef __UTIL_CAPTURE_H__
+#define __UTIL_CAPTURE_H__
+
+// Raw mccdaq sample capture file.
+//
+// The file contains a header, followed by one chunk per second of samples,
+// followed by an index of the chunks and a trailer. Each chunk contains the 
+// samples that were published in the data_t for its time, compressed using 
+// delta + bit-pack. When samples are dropped a second may contain more than 
+// one chunk; the chunk's first_pos identifies the stream position of its 
+// first sample, so gaps are visible to the reader. If the file was not closed
+// (for example due to a crash) the index is rebuilt from the chunk headers.
+
+// -----------------  WRITING  -------------------------------------------------------
+
+typedef struct {
+    uint64_t samples;          // samples written to the file
+    uint64_t dropped;          // samples dropped because the writer fell behind
+    uint64_t chunks;           // chunks written
+    uint64_t bytes;            // bytes written, including headers
+} capture_stats_t;
+
+int32_t capture_start(char * filename, int32_t sample_rate);
+void capture_write(uint16_t * d, int32_t max_d);
+void capture_end_second(uint64_t time);
+void capture_stop(void);
+void capture_get_stats(capture_stats_t * stats);
+
+// -----------------  READING  -------------------------------------------------------
+
+typedef struct {
+    uint64_t time;             // the data_t time that these samples were published in
+    int64_t  first_pos;        // stream position of the first sample
+    int32_t  max_samples;
+    int32_t  len;              // compressed length
+    uint64_t offset;           // file offset of the compressed samples
+} capture_chunk_t;
+
+typedef struct {
+    int32_t           fd;
+    int32_t           sample_rate;
+    uint64_t          start_time_us;
+    int32_t           max_chunk;
+    capture_chunk_t * chunk;
+} capture_file_t;
+
+capture_file_t * capture_open(char * filename);
+int32_t capture_read_chunk(capture_file_t * cf, int32_t idx, uint16_t * d);
+void capture_close(capture_file_t * cf);
+
+#endif
@@ -35,6 +35,8 @@ SOFTWARE.
 #include <termios.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
+#include <poll.h>
 #include <math.h>
 
 #include "util_dataq.h"
@@ -47,20 +49,52 @@ SOFTWARE.
 //#define ENABLE_TEST_THREAD
 
 #define DATAQ_DEVICE   "/dev/serial/by-id/usb-0683_1490-if00"
-#define STTY_SETTINGS  "4:0:14b2:0:3:1c:7f:15:1:0:1:0:11:13:1a:0:12:f:17:16:0:0:0:0:0:0:0:0:0:0:0:0:0:0:0:0"
 #define MAX_RESP       100
 #define MAX_ADC_CHAN   9            // channels 1 .. 8
-#define MAX_VAL        10000
+#define MAX_VAL        16384        // adc values saved per channel, must be a power of 2
+#define MAX_WIN        (DATAQ_MAX_WIN+1)
+#define AVG_WIN        DATAQ_MAX_WIN  // the averaging_duration window, used by dataq_get_adc
+#define RING_SIZE      4096         // receive ring, bytes, must be a power of 2
+#define CLOCK_HZ       750000       // srate divides this to give the scan rate
+
+#define FILTER_TAPS_PER_PHASE  64   // resampling filter length, in input samples
+#define FILTER_MAX_PHASE       64   // limit of the resampling interpolation factor
+#define FILTER_CUTOFF          0.45 // filter cutoff, as a fraction of the lower rate
+
+#define CMD_TIMEOUT_MS         1000 // deadline for a command's response
+#define STOP_TIMEOUT_MS        1000 // deadline for the response to stop, when draining scans
+#define READ_TIMEOUT_MS        500  // no adc data for this long means the device is lost
+#define POLL_MS                100  // receive thread poll interval, to check exitting
+#define RECONNECT_MS           100  // interval between attempts to reopen the device
+#define MONITOR_PER_SEC        4    // times per second the scan rate is checked
+
+#define DATAQ_STREAM_MAGIC     0x5354524d41544144  // "DATAQSTR" little endian
+
+#define RING(i)        ring[(i) & (RING_SIZE-1)]
+#define VAL(x,seq)     ((x)->val[(seq) & (MAX_VAL-1)])
 
 //
 // typedefs
 //
 
 typedef struct {
-    int16_t * val;   // millivolts
-    int64_t   sum;
-    int64_t   sum_squares;
-    int32_t   idx;
+    int64_t    sum;
+    int64_t    sum_squares;
+    uint32_t * min_dq;       // low 32 bits of the seq of the values that may become 
+                             //  the min, in ascending order of value
+    uint32_t * max_dq;       // likewise for the max, in descending order of value
+    uint32_t   min_head, min_tail;
+    uint32_t   max_head, max_tail;
+} adc_win_t;
+
+typedef struct {
+    int16_t * val;   // millivolts, the value with sequence number seq is at VAL(x,seq)
+    uint64_t  seq;   // number of values saved
+    uint32_t  lock;  // seqlock for the window statistics, odd while they are updated
+    adc_win_t win[MAX_WIN];
+    float     hist[2*FILTER_TAPS_PER_PHASE];  // resampling filter input history
+    int32_t   hist_idx;
+    int32_t   phase;
 } adc_t;
 
 //
@@ -69,34 +103,63 @@ typedef struct {
 
 static int      dataq_fd = -1;
 static adc_t    adc[MAX_ADC_CHAN];
-static int32_t  max_averaging_val;
+static int32_t  win_len[MAX_WIN];  // number of values in each window
+static uint32_t win_dq_mask[MAX_WIN];
+static float    win_duration_sec[DATAQ_MAX_WIN] = { 0.1, 0.5, 1, 10 };
 static int64_t  scan_count;
 static bool     scan_okay;
 static int32_t  scan_hz;
+static double   actual_scan_hz;
+static int32_t  out_hz;
 static int32_t  max_slist_idx; 
 static int32_t  slist_idx_to_adc_chan[8];
 static bool     exitting;
+static bool     initialized;
+static pthread_t recv_thread_id;
+
+static uint64_t disconnect_us;      // when the device was lost, 0 if connected
+static uint64_t reconnect_us;       // when the device was reopened following a loss
+
+static uint8_t  ring[RING_SIZE];    // accessed only by dataq_recv_data_thread
+static uint64_t ring_head;          // bytes received
+static uint64_t ring_tail;          // bytes decoded or skipped
+static bool     synced;
+static dataq_stats_t stats;
+
+static int32_t  filter_l;           // resample by filter_l / filter_m
+static int32_t  filter_m;
+static float  * filter_taps;        // [filter_l][FILTER_TAPS_PER_PHASE]
+
+static FILE   * stream_fp;
+static pthread_mutex_t stream_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 //
 // prototypes
 //
 
 static void dataq_exit_handler(void);
+static int32_t dataq_connect(void);
+static void dataq_disconnect(char * reason);
 static int32_t dataq_issue_cmd(char * cmd, char * resp);
+static int32_t dataq_write(char * buff, int32_t len);
+static int32_t dataq_read_until(char * buff, int32_t max, int32_t chunk, char * term, int32_t timeout_ms);
 static void * dataq_recv_data_thread(void * cx);
+static void dataq_parse(void);
+static bool dataq_scan_synced(uint64_t pos);
 static void dataq_process_adc_raw(int32_t slist_idx, int32_t new_val);
+static void dataq_save_adc_val(adc_t * x, int32_t new_mv);
+static int32_t dataq_get_adc_win(int32_t adc_chan, int32_t win, dataq_adc_stats_t * st);
+static int32_t dataq_filter_init(int32_t srate);
 static void * dataq_monitor_thread(void * cx);
 
 // -----------------  DATAQ API ROUTINES  -----------------------------------------------
 
-int32_t dataq_init(float averaging_duration_sec, int32_t scan_hz_arg, int32_t max_adc_chan, ...)
+int32_t dataq_init(float averaging_duration_sec, int32_t scan_hz_arg, int32_t out_hz_arg,
+                   int32_t max_adc_chan, ...)
 {
-    char      cmd_str[100];
-    char      resp[MAX_RESP];
-    int32_t   i, cnt, len, total_len, duration, ret, best_scan_hz;
+    int32_t   i, j, cnt, best_scan_hz;
     char      adc_channels_str[100];
     char    * p;
-    char      stop_buff[10000];
     pthread_t thread_id;
     va_list   ap;
 
@@ -119,12 +182,17 @@ int32_t dataq_init(float averaging_duration_sec, int32_t scan_hz_arg, int32_t ma
 
     // determine the best adc scan rate and 
     // verify the requested rate is less <= best
-    best_scan_hz = 10000 / max_slist_idx;
+    best_scan_hz = DATAQ_MAX_SCAN_HZ(max_slist_idx);
     if (scan_hz_arg > best_scan_hz) {   
         ERROR("scan_hz_arg %d is too big, max is %d\n", scan_hz_arg, best_scan_hz);
         goto error;
     }
+    if (out_hz_arg <= 0 || out_hz_arg > scan_hz_arg) {
+        ERROR("out_hz_arg %d is invalid, range 1 - %d\n", out_hz_arg, scan_hz_arg);
+        goto error;
+    }
     scan_hz = scan_hz_arg;
+    out_hz = out_hz_arg;
 
     // debug print args
     p = adc_channels_str;
@@ -132,136 +200,66 @@ int32_t dataq_init(float averaging_duration_sec, int32_t scan_hz_arg, int32_t ma
         cnt = sprintf(p, "%d ",  slist_idx_to_adc_chan[i]);
         p += cnt;
     }
-    INFO("averaging_duration_sec=%4.2f channels=%s scan_hz=%d\n",
-         averaging_duration_sec, adc_channels_str, scan_hz_arg);
-
-    // setup serial port
-    // - LATER perhaps use termios tcsetattr instead
-    // - I first ran this program on Fedora20, and had no problem
-    //   communicating to the dataq. When first run on RaspberryPi the
-    //   comm to dataq failed. To resolve this I captured the stty settings
-    //   on Fedora (stty -g) and apply them here.
-    sprintf(cmd_str, "stty -F %s %s\n", DATAQ_DEVICE, STTY_SETTINGS);
-    system(cmd_str);
-
-    // open the dataq virtual com port
-    dataq_fd = open(DATAQ_DEVICE, O_RDWR);
-    if (dataq_fd < 0) {
-        ERROR("failed to open %s, %s\n", DATAQ_DEVICE, strerror(errno));
-        goto error;
-    }
-
-    // cleanup from prior run:
-    // - issue 'stop' scanning command
-    // - set non blocking
-    // - read until get the response to the stop command
-    // - clear non blocking
-    len = write(dataq_fd, "stop\r", 5);
-    if (len != 5) {
-        ERROR("failed to write stop cmd, %s\n", strerror(errno));
-        goto error;
-    }
+    INFO("averaging_duration_sec=%4.2f channels=%s scan_hz=%d out_hz=%d\n",
+         averaging_duration_sec, adc_channels_str, scan_hz_arg, out_hz_arg);
 
-    ret = fcntl(dataq_fd, F_SETFL, O_NONBLOCK);
-    if (ret < 0) {
-        ERROR("failed to set non blocking, %s\n", strerror(errno));
+    // design the filter that resamples the adc values from the scan rate to out_hz
+    if (dataq_filter_init(CLOCK_HZ / scan_hz) < 0) {
         goto error;
     }
 
-    total_len = 0;
-    duration = 0;
-    while (true) {
-        usleep(100000);
-        len = read(dataq_fd, stop_buff+total_len, sizeof(stop_buff)-total_len);
-        if (len > 0) {
-            total_len += len;
-            if (total_len >= 5 && strcmp(&stop_buff[total_len-5], "stop\r") == 0) {
-                break;
-            }
-        }
-        duration += 100000;
-        if (duration >= 1000000) {
-            ERROR("did not receive response to stop scanning cmd");
+    // determine the number of adc values in each window, and the size of the 
+    // window's min and max deques (a power of 2 that can hold all of its values)
+    for (i = 0; i < MAX_WIN; i++) {
+        float duration = (i == AVG_WIN ? averaging_duration_sec : win_duration_sec[i]);
+        win_len[i] = out_hz * duration;
+        if (win_len[i] <= 0 || win_len[i] > MAX_VAL-5) {
+            ERROR("window duration %.3f is invalid\n", duration);
             goto error;
         }
-    }        
-
-    ret = fcntl(dataq_fd, F_SETFL, 0);
-    if (ret < 0) {
-        ERROR("failed to clear non blocking, %s\n", strerror(errno));
-        goto error;
+        for (win_dq_mask[i] = 1; win_dq_mask[i] < win_len[i]; win_dq_mask[i] <<= 1) ;
+        win_dq_mask[i]--;
     }
+    INFO("MAX_VAL=%d  averaging win_len=%d\n", MAX_VAL, win_len[AVG_WIN]);
 
-    // issue 'info 0' command, 
-    // this is just a dataq communication sanity check
-    if (dataq_issue_cmd("info 0", resp) < 0) {
-        goto error;
-    }
-
-    // configure scanning of the desired adc channels
-    if (dataq_issue_cmd("asc", resp) < 0) {
-        goto error;
-    }
-    for (i = 0; i < max_slist_idx; i++) {
-        sprintf(cmd_str, "slist %d x%4.4x", i, slist_idx_to_adc_chan[i]-1);
-        if (dataq_issue_cmd(cmd_str, resp) < 0) {
-            goto error;
-        }
-    }
-
-    // set the scan rate; 
-    sprintf(cmd_str, "srate x%4.4x", 750000 / scan_hz);
-    if (dataq_issue_cmd(cmd_str, resp) < 0) {
-        goto error;
-    }
-
-    // determine the number of adc values that are needed for the averaging_duration,
-    max_averaging_val = scan_hz * averaging_duration_sec;
-    INFO("MAX_VAL=%d  max_averaging_val=%d\n", MAX_VAL, max_averaging_val);
-    if (max_averaging_val > MAX_VAL) {
-        ERROR("averaging_duration_sec %.3f is too large\n", averaging_duration_sec);
-        goto error;
-    }
-
-    // allocate memory for adc values
+    // allocate memory for adc values, and the windows' deques
     for (i = 0; i < max_slist_idx; i++) {
         int32_t adc_chan = slist_idx_to_adc_chan[i];
-        adc[adc_chan].val = calloc(MAX_VAL, sizeof(int16_t));
-        if (adc[adc_chan].val == NULL) {
+        adc_t * x = &adc[adc_chan];
+        x->val = calloc(MAX_VAL, sizeof(int16_t));
+        if (x->val == NULL) {
             FATAL("alloc adc[%d].val failed, MAX_VAL=%d\n", adc_chan, MAX_VAL);
         }
+        for (j = 0; j < MAX_WIN; j++) {
+            x->win[j].min_dq = calloc(win_dq_mask[j]+1, sizeof(uint32_t));
+            x->win[j].max_dq = calloc(win_dq_mask[j]+1, sizeof(uint32_t));
+            if (x->win[j].min_dq == NULL || x->win[j].max_dq == NULL) {
+                FATAL("alloc adc[%d].win[%d] failed\n", adc_chan, j);
+            }
+        }
     }
     
-    // configure binary output
-    if (dataq_issue_cmd("bin", resp) < 0) {
-        goto error;
-    }
-
-    // start scan
-    write(dataq_fd, "start\r", 6);
-
     // stop scanning atexit
     atexit(dataq_exit_handler);
 
     // create threads 
-    // - receive data from the adc
+    // - receive data from the adc; this thread connects to the dataq device,
+    //   and reconnects when the device is lost
     // - monitor health of the dataq_recv_data_thread
-    pthread_create(&thread_id, NULL, dataq_recv_data_thread, NULL);
+    initialized = true;
+    pthread_create(&recv_thread_id, NULL, dataq_recv_data_thread, NULL);
     pthread_create(&thread_id, NULL, dataq_monitor_thread, NULL);
 
     // delay to allow adc data to be available
     usleep(averaging_duration_sec*1000000 + 250000);
 
-    // return success,
-    INFO("success\n");
+    // return success, the device may not yet be connected, in which case 
+    // the dataq_get routines return an error until it is
+    INFO("success, %s\n", dataq_fd >= 0 ? "connected" : "not connected");
     return 0;
 
 error:
     // return error
-    if (dataq_fd > 0) {
-        close(dataq_fd);
-        dataq_fd = -1;
-    }
     return -1;
 }
 
@@ -269,11 +267,41 @@ int32_t dataq_get_adc(int32_t adc_chan,
                       int16_t * rms_mv,
                       int16_t * mean_mv, int16_t * sdev_mv,
                       int16_t * min_mv, int16_t * max_mv)
+{
+    dataq_adc_stats_t st;
+
+    if (dataq_get_adc_win(adc_chan, AVG_WIN, &st) < 0) {
+        return -1;
+    }
+
+    if (rms_mv)  *rms_mv  = st.rms_mv;
+    if (mean_mv) *mean_mv = st.mean_mv;
+    if (sdev_mv) *sdev_mv = st.sdev_mv;
+    if (min_mv)  *min_mv  = st.min_mv;
+    if (max_mv)  *max_mv  = st.max_mv;
+    return 0;
+}
+
+int32_t dataq_get_adc_window(int32_t adc_chan, int32_t win, dataq_adc_stats_t * st)
+{
+    // validate win
+    if (win < 0 || win >= DATAQ_MAX_WIN) {
+        ERROR("win %d is not valid\n", win);
+        return -1;
+    }
+
+    return dataq_get_adc_win(adc_chan, win, st);
+}
+
+int32_t dataq_get_adc_data(int32_t adc_chan, int16_t * samples_mv, int32_t count,
+                           uint64_t * first_seq)
 {
     adc_t * x;
+    uint64_t seq, end_seq;
+    int32_t j;
 
     // if not inititialized then return error
-    if (dataq_fd < 0) {
+    if (!initialized) {
         return -1;
     }
 
@@ -290,185 +318,352 @@ int32_t dataq_get_adc(int32_t adc_chan,
         return -1;
     }
 
-    // calculate rms 
-    if (rms_mv) {
-        *rms_mv = sqrtf((float)x->sum_squares / max_averaging_val);
-    }
-
-    // calculate mean voltage
-    if (mean_mv) {
-        *mean_mv = x->sum / max_averaging_val;
-    }
-
-    // calculate standad deviation voltage
-    if (sdev_mv) {
-        float u = (float)x->sum / max_averaging_val;
-        *sdev_mv = sqrtf(((float)x->sum_squares / max_averaging_val) - (u * u));
+    // if count is invalid then return error
+    if (count <= 0 || count > MAX_VAL-5) {
+        ERROR("count %d too big, max count is %d\n", count, MAX_VAL-5);
+        return -1;
     }
 
-    // calculate min and max voltages
-    // note - idx refers to invalid/oldest entry in circ buffer
-    if (min_mv || max_mv) {
-        int32_t i, j;
-        int16_t min = +32767;
-        int16_t max = -32767;
-
-        i = x->idx - max_averaging_val;
-        if (i < 0) i += MAX_VAL;
-        for (j = 0; j < max_averaging_val; j++) {
-            if (x->val[i] < min) min = x->val[i];
-            if (x->val[i] > max) max = x->val[i];
-            if (++i == MAX_VAL) {
-                i = 0;
-            }
-        }
-
-        if (min_mv) {
-            *min_mv = min;
+    // fill samples_mv return buffer with the most recent count values;
+    // the receive thread is not blocked, instead if it overwrote the values 
+    // being copied, which it does only after MAX_VAL-count values are saved
+    // during the copy, then the copy is retried
+    do {
+        end_seq = __atomic_load_n(&x->seq, __ATOMIC_ACQUIRE);
+        if (end_seq < count) {
+            ERROR("adc data not available, %"PRId64" values saved\n", end_seq);
+            return -1;
         }
-        if (max_mv) {
-            *max_mv = max;
+        seq = end_seq - count;
+        for (j = 0; j < count; j++) {
+            samples_mv[j] = VAL(x, seq+j);
         }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&x->seq, __ATOMIC_RELAXED) - seq >= MAX_VAL);
+
+    // return the sequence number of the first value, 
+    // the values are first_seq to first_seq+count-1
+    if (first_seq) {
+        *first_seq = seq;
     }
 
     // return success
     return 0;
 }
 
-int32_t dataq_get_adc_data(int32_t adc_chan, int16_t * samples_mv, int32_t count)
+int32_t dataq_stream_start(char * filename)
 {
-    adc_t * x;
-    int32_t i, j;
+    dataq_stream_hdr_t hdr;
+    FILE * fp;
+    int32_t i;
 
     // if not inititialized then return error
-    if (dataq_fd < 0) {
+    if (!initialized) {
         return -1;
     }
 
-    // validate adc_chan
-    if (adc_chan < 1 || adc_chan >= MAX_ADC_CHAN || adc[adc_chan].val == NULL) {
-        ERROR("adc_chan %d is not valid\n", adc_chan);
+    // create the stream file, and write its header
+    fp = fopen(filename, "w");
+    if (fp == NULL) {
+        ERROR("failed to create %s, %s\n", filename, strerror(errno));
         return -1;
     }
-    x = &adc[adc_chan];
-
-    // if dataq scan is not working then return error
-    if (!scan_okay) {
-        ERROR("adc data not available\n");
-        return -1;
+    bzero(&hdr, sizeof(hdr));
+    hdr.magic = DATAQ_STREAM_MAGIC;
+    hdr.scan_hz = actual_scan_hz;
+    hdr.start_us = get_real_time_us();
+    hdr.max_chan = max_slist_idx;
+    for (i = 0; i < max_slist_idx; i++) {
+        hdr.chan[i] = slist_idx_to_adc_chan[i];
     }
-
-    // if count is invalid then return error
-    if (count <= 0 || count > MAX_VAL-5) {
-        ERROR("count %d too big, max count is %d\n", count, MAX_VAL-5);
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+        ERROR("failed to write %s, %s\n", filename, strerror(errno));
+        fclose(fp);
         return -1;
     }
 
-    // fill samples_mv return buffer
-    i = x->idx - count;
-    if (i < 0) i += MAX_VAL;
-    for (j = 0; j < count; j++) {
-        samples_mv[j] = x->val[i];
-        if (++i == MAX_VAL) {
-            i = 0;
-        }
-    }
-
-    // return success
+    // the receive thread writes each scan to the stream file from now on
+    pthread_mutex_lock(&stream_mutex);
+    stream_fp = fp;
+    pthread_mutex_unlock(&stream_mutex);
+    INFO("streaming %0.1f scans/sec to %s\n", actual_scan_hz, filename);
     return 0;
 }
 
+void dataq_get_stats(dataq_stats_t * stats_arg)
+{
+    stats_arg->scans         = __atomic_load_n(&stats.scans, __ATOMIC_RELAXED);
+    stats_arg->bytes         = __atomic_load_n(&stats.bytes, __ATOMIC_RELAXED);
+    stats_arg->resyncs       = __atomic_load_n(&stats.resyncs, __ATOMIC_RELAXED);
+    stats_arg->skipped_bytes = __atomic_load_n(&stats.skipped_bytes, __ATOMIC_RELAXED);
+    stats_arg->disconnects   = __atomic_load_n(&stats.disconnects, __ATOMIC_RELAXED);
+    stats_arg->reconnects    = __atomic_load_n(&stats.reconnects, __ATOMIC_RELAXED);
+    stats_arg->recovery_ms   = __atomic_load_n(&stats.recovery_ms, __ATOMIC_RELAXED);
+    stats_arg->outage_ms     = __atomic_load_n(&stats.outage_ms, __ATOMIC_RELAXED);
+}
+
 // -----------------  PRIVATE ROUTINES  -------------------------------------------------
 
 static void dataq_exit_handler()
 {
-    int32_t len;
-
     // if not inititialized then return 
-    if (dataq_fd < 0) {
+    if (!initialized) {
         return;
     }
 
-    // let the threads know program is exitting
+    // let the threads know program is exitting, and wait for the receive
+    // thread to stop the dataq and close it
     exitting = true;
-    
-    // at program exit, stop the dataq
-    len = write(dataq_fd, "stop\r", 5);
-    if (len != 5) {
-        ERROR("issuing stop cmd\n");
+    pthread_join(recv_thread_id, NULL);
+
+    // close the stream file
+    pthread_mutex_lock(&stream_mutex);
+    if (stream_fp) {
+        fclose(stream_fp);
+        stream_fp = NULL;
     }
+    pthread_mutex_unlock(&stream_mutex);
+}
 
-    // give some time to allow the stop cmd to be sent, and
-    // the threads to exit
-    usleep(100000);
+// The receive thread is a state machine with 2 states:
+// - not connected: every RECONNECT_MS try to open and configure the device, 
+//   and start scanning
+// - connected: read and process the adc data; when the device is unplugged,
+//   or no data is received for READ_TIMEOUT_MS, close it, and return to the 
+//   not connected state
+// The time to recover, from reopening the device to receiving its first scan,
+// and the duration of the outage, are logged and are in dataq_stats_t.
 
-    // close
-    close(dataq_fd);
+static void * dataq_recv_data_thread(void * cx)
+{
+    struct pollfd pfd;
+    uint64_t last_data_us = 0, scans, now;
+    int32_t len, max_len, ret;
+
+    while (true) {
+        // if program is exitting then stop the dataq, and terminate this thread
+        if (exitting) {
+            if (dataq_fd >= 0) {
+                dataq_write("stop\r", 5);
+                dataq_disconnect(NULL);
+            }
+            return NULL;
+        }
+
+        // if not connected then 
+        //   try to connect, and start scanning
+        //   continue
+        // endif
+        if (dataq_fd < 0) {
+            if (dataq_connect() < 0) {
+                usleep(RECONNECT_MS * 1000);
+                continue;
+            }
+            last_data_us = microsec_timer();
+            continue;
+        }
+
+        // wait for adc data
+        pfd.fd = dataq_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        ret = poll(&pfd, 1, POLL_MS);
+        if (ret < 0 && errno != EINTR) {
+            FATAL("poll failed, %s\n", strerror(errno));
+        }
+        now = microsec_timer();
+        if (ret <= 0) {
+            if (now - last_data_us > READ_TIMEOUT_MS * 1000) {
+                dataq_disconnect("no data received");
+            }
+            continue;
+        }
+
+        // read adc data from dataq device into the free space of the ring,
+        // up to the end of the ring; an error or end of file means the device 
+        // was unplugged
+        max_len = RING_SIZE - (ring_head - ring_tail);
+        if (max_len > RING_SIZE - (ring_head & (RING_SIZE-1))) {
+            max_len = RING_SIZE - (ring_head & (RING_SIZE-1));
+        }
+        len = read(dataq_fd, &RING(ring_head), max_len);
+        if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+            continue;
+        }
+        if (len <= 0) {
+            dataq_disconnect(len == 0 ? "end of file" : strerror(errno));
+            continue;
+        }
+        ring_head += len;
+        last_data_us = now;
+        __atomic_fetch_add(&stats.bytes, len, __ATOMIC_RELAXED);
+
+        // extract the adc values of all the complete scans received
+        scans = stats.scans;
+        dataq_parse();
+
+        // if the first scan following a reconnect has been received then 
+        // the recovery is complete
+        if (reconnect_us != 0 && stats.scans != scans) {
+            __atomic_store_n(&stats.recovery_ms, (now - reconnect_us) / 1000, __ATOMIC_RELAXED);
+            __atomic_store_n(&stats.outage_ms, (now - disconnect_us) / 1000, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&stats.reconnects, 1, __ATOMIC_RELAXED);
+            INFO("dataq recovered, outage %"PRId64" ms, recovery %"PRId64" ms\n",
+                 stats.outage_ms, stats.recovery_ms);
+            reconnect_us = 0;
+            disconnect_us = 0;
+        }
+    }
+
+    return NULL;
 }
 
-static int32_t dataq_issue_cmd(char * cmd, char * resp)
+// Open the dataq device, configure it, and start scanning. The serial port is
+// configured raw, 115200 baud, 8 bits, no parity; these are equivalent to the
+// stty settings that were found to work on both Fedora and the Raspberry Pi.
+
+static int32_t dataq_connect(void)
 {
-    char cmd2[100];
-    int32_t len, ret, total_len, i;
-    char *p;
-    bool resp_recvd;
+    static bool    logged;
+    struct termios tio;
+    char           cmd_str[100];
+    char           resp[MAX_RESP];
+    char           stop_buff[10000];
+    int32_t        i, fd;
+
+    // open the dataq virtual com port; while the device is not present this 
+    // fails, and the error is logged only once
+    fd = open(DATAQ_DEVICE, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) {
+        if (!logged) {
+            ERROR("failed to open %s, %s\n", DATAQ_DEVICE, strerror(errno));
+            logged = true;
+        }
+        return -1;
+    }
+    logged = false;
+    dataq_fd = fd;
+    if (disconnect_us != 0) {
+        reconnect_us = microsec_timer();
+    }
 
-    // terminate command with <cr>
-    strcpy(cmd2, cmd);
-    strcat(cmd2, "\r");
+    // configure the serial port
+    if (tcgetattr(fd, &tio) < 0) {
+        ERROR("tcgetattr failed, %s\n", strerror(errno));
+        goto error;
+    }
+    cfmakeraw(&tio);
+    tio.c_iflag = IGNPAR;
+    tio.c_cflag = CS8 | CREAD | HUPCL;
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    cfsetispeed(&tio, B115200);
+    cfsetospeed(&tio, B115200);
+    if (tcsetattr(fd, TCSANOW, &tio) < 0) {
+        ERROR("tcsetattr failed, %s\n", strerror(errno));
+        goto error;
+    }
+    tcflush(fd, TCIOFLUSH);
 
-    // write command
-    len = write(dataq_fd, cmd2, strlen(cmd2));
-    if (len != strlen(cmd2)) {
-        ERROR("failed write cmd '%s', %s\n", cmd, strerror(errno));
-        return -1;
+    // cleanup from prior run:
+    // - issue 'stop' scanning command
+    // - read until get the response to the stop command
+    if (dataq_write("stop\r", 5) < 0) {
+        goto error;
+    }
+    if (dataq_read_until(stop_buff, sizeof(stop_buff), sizeof(stop_buff)/2, "stop\r", 
+                         STOP_TIMEOUT_MS) < 0) 
+    {
+        ERROR("did not receive response to stop scanning cmd\n");
+        goto error;
     }
 
-    // set non blocking
-    ret = fcntl(dataq_fd, F_SETFL, O_NONBLOCK);
-    if (ret < 0) {
-        ERROR("failed to set non blocking, %s\n", strerror(errno));
-        return -1;
+    // issue 'info 0' command, 
+    // this is just a dataq communication sanity check
+    if (dataq_issue_cmd("info 0", resp) < 0) {
+        goto error;
     }
 
-    // read response, must terminate with <cr>, with 1 sec tout
-    p = resp;
-    total_len = 0;
-    resp_recvd = false;
-    for (i = 0; i < 200; i++) {
-        len = read(dataq_fd, p, MAX_RESP-total_len);
-        if (len > 0) {
-            total_len += len;
-            p += len;
-            if (resp[total_len-1] == '\r') {
-                resp[total_len-1] = '\0';   // remove <cr>, and null term
-                total_len--;
-                resp_recvd = true;
-                break;
-            }
-        } else if (len == -1 && errno == EWOULDBLOCK) {
-            // nothing to do here
-        } else if (len == 0) {
-            // nothing to do here
-        } else {
-            ERROR("failed read, len=%d, %s\n", len, strerror(errno));
-            return -1;
+    // configure scanning of the desired adc channels
+    if (dataq_issue_cmd("asc", resp) < 0) {
+        goto error;
+    }
+    for (i = 0; i < max_slist_idx; i++) {
+        sprintf(cmd_str, "slist %d x%4.4x", i, slist_idx_to_adc_chan[i]-1);
+        if (dataq_issue_cmd(cmd_str, resp) < 0) {
+            goto error;
+        }
+    }
+
+    // set the scan rate; 
+    sprintf(cmd_str, "srate x%4.4x", CLOCK_HZ / scan_hz);
+    if (dataq_issue_cmd(cmd_str, resp) < 0) {
+        goto error;
+    }
+
+    // configure binary output
+    if (dataq_issue_cmd("bin", resp) < 0) {
+        goto error;
+    }
+
+    // start scan, and verify start response received; the response is read
+    // a byte at a time so that the adc data that follows it is not consumed
+    if (dataq_write("start\r", 6) < 0) {
+        goto error;
+    }
+    if (dataq_read_until(resp, MAX_RESP, 1, "start\r", CMD_TIMEOUT_MS) < 0) {
+        ERROR("failed receive response to start\n");
+        goto error;
+    }
+
+    // the adc data follows
+    ring_head = ring_tail = 0;
+    synced = false;
+    INFO("dataq connected, scanning\n");
+    return 0;
+
+error:
+    // close the device, it will be retried
+    close(fd);
+    dataq_fd = -1;
+    return -1;
+}
+
+static void dataq_disconnect(char * reason)
+{
+    // close the device
+    close(dataq_fd);
+    dataq_fd = -1;
+
+    // if this is a loss of the device then count it
+    if (reason) {
+        ERROR("dataq lost, %s\n", reason);
+        __atomic_fetch_add(&stats.disconnects, 1, __ATOMIC_RELAXED);
+        if (disconnect_us == 0) {
+            disconnect_us = microsec_timer();
         }
-        usleep(5000);
+        reconnect_us = 0;
     }
+}
 
-    // clear non blocking
-    ret = fcntl(dataq_fd, F_SETFL, 0);
-    if (ret < 0) {
-        ERROR("failed to clear non blocking, %s\n", strerror(errno));
+static int32_t dataq_issue_cmd(char * cmd, char * resp)
+{
+    char cmd2[100];
+
+    // terminate command with <cr>, and write command
+    strcpy(cmd2, cmd);
+    strcat(cmd2, "\r");
+    if (dataq_write(cmd2, strlen(cmd2)) < 0) {
+        ERROR("failed write cmd '%s'\n", cmd);
         return -1;
     }
 
-    // check for failure to read response
-    if (!resp_recvd) {
+    // read response, must terminate with <cr>
+    if (dataq_read_until(resp, MAX_RESP, 1, "\r", CMD_TIMEOUT_MS) < 0) {
         ERROR("response to cmd '%s' was not received\n", cmd);
         return -1;
     }
+    resp[strlen(resp)-1] = '\0';   // remove <cr>
 
     // check that response received was correct, it should match the cmd
     if (strncmp(cmd, resp, strlen(cmd)) != 0) {
@@ -481,130 +676,419 @@ static int32_t dataq_issue_cmd(char * cmd, char * resp)
     return 0;
 }
 
-static void * dataq_recv_data_thread(void * cx)
+static int32_t dataq_write(char * buff, int32_t len)
 {
-    uint8_t buff[1000];
-    uint8_t *p;
-    int32_t len, buff_len, slist_idx; 
+    struct pollfd pfd;
+    int32_t ret;
+
+    while (len > 0) {
+        ret = write(dataq_fd, buff, len);
+        if (ret < 0 && errno == EAGAIN) {
+            pfd.fd = dataq_fd;
+            pfd.events = POLLOUT;
+            if (poll(&pfd, 1, CMD_TIMEOUT_MS) <= 0) {
+                ERROR("write timed out\n");
+                return -1;
+            }
+            continue;
+        }
+        if (ret < 0) {
+            ERROR("write failed, %s\n", strerror(errno));
+            return -1;
+        }
+        buff += ret;
+        len -= ret;
+    }
+    return 0;
+}
 
-    // init
-    bzero(buff, sizeof(buff));
-    buff_len = 0;
+// Read into buff, in reads of up to chunk bytes, until buff ends with term,
+// or timeout_ms elapses. When buff is full the bytes preceding the possible 
+// partial term are discarded. On success buff is null terminated.
 
-    // verify start response received
-    len = read(dataq_fd, buff, 6);
-    if (len != 6 || memcmp(buff, "start\r", 6) != 0) {
-        ERROR("failed receive response to start, len=%d, %s\n", len, strerror(errno));
-        return NULL;
-    }
+static int32_t dataq_read_until(char * buff, int32_t max, int32_t chunk, char * term, int32_t timeout_ms)
+{
+    struct pollfd pfd;
+    uint64_t deadline_us = microsec_timer() + timeout_ms * 1000;
+    int32_t  total_len = 0, term_len = strlen(term), len, ms, keep;
 
-    // loop, read and process adc data
     while (true) {
-        // read adc data from dataq device into buff
-        len = read(dataq_fd, buff+buff_len, sizeof(buff)-buff_len);
-        if (len < 0) {
-            ERROR("failed to read adc data, %s\n", strerror(errno));
-            return NULL;
+        // if buff is full then keep just the bytes that could begin the term
+        if (total_len + chunk > max - 1) {
+            keep = (total_len < term_len - 1 ? total_len : term_len - 1);
+            memmove(buff, buff+total_len-keep, keep);
+            total_len = keep;
         }
-        buff_len += len;
 
-        // if program is exitting then terminate this thread
-        if (exitting) {
-            return NULL;
+        // wait for data, until the deadline
+        ms = ((int64_t)deadline_us - (int64_t)microsec_timer()) / 1000;
+        if (ms <= 0) {
+            return -1;
+        }
+        pfd.fd = dataq_fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, ms) <= 0) {
+            continue;
         }
 
-        // while there is enough data read for all sensors being scanned,
-        // and to validate sync then extract adc values
-        while (buff_len >= max_slist_idx*2+1) {
-            // if not sychronized then abort for now
-            // LATER improve this to resync, if needed
-            if (((buff[0] & 1) != 0) || ((buff[max_slist_idx*2] & 1) != 0)) {
-                ERROR("not synced\n");
-                return NULL;
+        // read, and if buff now ends with term then return success
+        len = read(dataq_fd, buff+total_len, chunk);
+        if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+            continue;
+        }
+        if (len <= 0) {
+            ERROR("read failed, len=%d, %s\n", len, len < 0 ? strerror(errno) : "end of file");
+            return -1;
+        }
+        total_len += len;
+        if (total_len >= term_len && memcmp(buff+total_len-term_len, term, term_len) == 0) {
+            buff[total_len] = '\0';
+            return 0;
+        }
+    }
+}
+
+// The DI-149 binary scan contains 2 bytes for each adc channel in the scan list.
+// The low bit of each byte is a sync bit, which is 0 in the first byte of the scan
+// and 1 in all other bytes. A scan is decoded only when its sync bits, and the sync
+// bit of the first byte of the following scan, are correct. When they are not, bytes
+// are skipped until they are; so sync is regained within one scan.
+
+static void dataq_parse(void)
+{
+    int32_t scan_len = max_slist_idx * 2;
+    int32_t slist_idx, new_val;
+    int16_t scan_mv[8];
+    uint64_t p;
+
+    while (ring_head - ring_tail >= scan_len + 1) {
+        // if the scan at ring_tail is not synced then
+        //   skip a byte, and count a resync event if this is the first byte skipped
+        //   continue
+        // endif
+        if (!dataq_scan_synced(ring_tail)) {
+            if (synced) {
+                WARN("dataq not synced, resynchronizing\n");
+                __atomic_fetch_add(&stats.resyncs, 1, __ATOMIC_RELAXED);
+                synced = false;
+            }
+            __atomic_fetch_add(&stats.skipped_bytes, 1, __ATOMIC_RELAXED);
+            ring_tail++;
+            continue;
+        }
+        synced = true;
+
+        // extract adc values from the scan
+        p = ring_tail;
+        for (slist_idx = 0; slist_idx < max_slist_idx; slist_idx++) {
+            new_val = ((RING(p+1) & 0xfe) << 4) | (RING(p) >> 3);
+            new_val ^= 0x800;
+            if (new_val & 0x800) {
+                new_val |= 0xfffff000;
             }
 
-            // extract adc values from buff
-            p = buff;
-            for (slist_idx = 0; slist_idx < max_slist_idx; slist_idx++) {
-                int32_t new_val;
-    
-                new_val = ((p[1] & 0xfe) << 4) | (p[0] >> 3);
-                new_val ^= 0x800;
-                if (new_val & 0x800) {
-                    new_val |= 0xfffff000;
-                }
+            dataq_process_adc_raw(slist_idx, new_val);
+            scan_mv[slist_idx] = new_val * 10000 / 2048;
 
-                dataq_process_adc_raw(slist_idx, new_val);
+            p += 2;
+        }
+        ring_tail += scan_len;
 
-                p += 2;
+        // if streaming then write the scan's full rate adc values to the stream file
+        if (stream_fp) {
+            pthread_mutex_lock(&stream_mutex);
+            if (stream_fp) {
+                fwrite(scan_mv, sizeof(int16_t), max_slist_idx, stream_fp);
             }
+            pthread_mutex_unlock(&stream_mutex);
+        }
 
-            // shift buff, and adjust buff_len
-            memmove(buff, buff+(max_slist_idx*2), buff_len-(max_slist_idx*2));
-            buff_len -= (max_slist_idx*2);
+        // bump up scan_count, which is used by the dataq_monitor_thread to
+        // determine if scanning is working 
+        scan_count++;
+        __atomic_fetch_add(&stats.scans, 1, __ATOMIC_RELAXED);
+    }
+}
 
-            // bump up scan_count, which is used by the dataq_monitor_thread to
-            // determine if scanning is working 
-            scan_count++;
+static bool dataq_scan_synced(uint64_t pos)
+{
+    int32_t scan_len = max_slist_idx * 2;
+    int32_t i;
+
+    if ((RING(pos) & 1) != 0 || (RING(pos+scan_len) & 1) != 0) {
+        return false;
+    }
+    for (i = 1; i < scan_len; i++) {
+        if ((RING(pos+i) & 1) == 0) {
+            return false;
         }
     }
-
-    return NULL;
+    return true;
 }
 
+// The adc values are scanned at scan_hz, and resampled to out_hz by a polyphase 
+// FIR filter, which also removes the content above out_hz/2 that would otherwise
+// alias; for example the harmonics of the mains ripple. The resampled values
+// are saved for dataq_get_adc and dataq_get_adc_data.
+//
+// Output n is at time n*filter_m/filter_l input samples. After each input sample
+// is added to the history, the outputs that fall before the next input are
+// computed using the filter phase that corresponds to their fractional position.
+
 static void dataq_process_adc_raw(int32_t slist_idx, int32_t new_val)
 {
-    int32_t new_mv, old_mv;
     int32_t adc_chan = slist_idx_to_adc_chan[slist_idx];
-    int32_t tmp;
     adc_t * x = &adc[adc_chan];
-    
-    // convert new_val from raw to new_mv
+    float   * h, * v, sum;
+    int32_t k;
+
+    // convert new_val from raw to mv
     // note: a raw value of 2048 is equivalent to 10 v or 10000 mv
-    new_mv = new_val * 10000 / 2048;
+    int32_t new_mv = new_val * 10000 / 2048;
+
+    // if not resampling then save the value, and return
+    if (filter_taps == NULL) {
+        dataq_save_adc_val(x, new_mv);
+        return;
+    }
+
+    // add the value to the filter history; the history is stored twice so 
+    // that the most recent FILTER_TAPS_PER_PHASE values are contiguous,
+    // ending at v[FILTER_TAPS_PER_PHASE-1]
+    x->hist[x->hist_idx] = new_mv;
+    x->hist[x->hist_idx+FILTER_TAPS_PER_PHASE] = new_mv;
+    x->hist_idx = (x->hist_idx + 1) % FILTER_TAPS_PER_PHASE;
+    v = &x->hist[x->hist_idx];
+
+    // compute and save the outputs that fall between this input and the next
+    while (x->phase < filter_l) {
+        h = &filter_taps[x->phase * FILTER_TAPS_PER_PHASE];
+        sum = 0;
+        for (k = 0; k < FILTER_TAPS_PER_PHASE; k++) {
+            sum += h[k] * v[FILTER_TAPS_PER_PHASE-1-k];
+        }
+        dataq_save_adc_val(x, lrintf(sum));
+        x->phase += filter_m;
+    }
+    x->phase -= filter_l;
+}
+
+// The statistics of each window are maintained as each value is saved, so that 
+// they are available in constant time. The window's sum and sum of squares are 
+// updated by adding the new value and subtracting the value leaving the window. 
+// The min is the head of a deque of the values that could yet become the min;
+// values are removed from its tail when the new value is less or equal, because 
+// they can't be the min while the new value is in the window, and from its head 
+// when they leave the window. Likewise for the max.
 
+static void dataq_save_adc_val(adc_t * x, int32_t new_mv)
+{
+    uint64_t seq = x->seq;
+    int32_t  w, old_mv;
+
+    // the window statistics are updated while x->lock is odd; readers retry
+    // when they see it odd, or changed, so that they don't use a partial update
+    __atomic_store_n(&x->lock, x->lock+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    
     // save adc value in circular buffer
-    tmp = x->idx - max_averaging_val;
-    if (tmp < 0) {
-        tmp += MAX_VAL;
-    }
-    old_mv = x->val[tmp];
-    x->val[x->idx] = new_mv;
-    x->idx = (x->idx + 1) % MAX_VAL;
-
-    // update the sum of saved values, and
-    // the sum^2 of saved values
-    x->sum += (new_mv - old_mv);
-    x->sum_squares += (new_mv*new_mv - old_mv*old_mv);
+    VAL(x, seq) = new_mv;
+
+    // update each window
+    for (w = 0; w < MAX_WIN; w++) {
+        adc_win_t * xw = &x->win[w];
+        uint32_t    mask = win_dq_mask[w];
+
+        // update the sum and sum^2 of the values in the window; 
+        // before the window is full no value leaves it
+        old_mv = (seq >= win_len[w] ? VAL(x, seq - win_len[w]) : 0);
+        xw->sum += (new_mv - old_mv);
+        xw->sum_squares += (new_mv*new_mv - old_mv*old_mv);
+
+        // update the min deque
+        if (xw->min_tail != xw->min_head && 
+            (uint32_t)seq - xw->min_dq[xw->min_head & mask] >= win_len[w]) 
+        {
+            xw->min_head++;
+        }
+        while (xw->min_tail != xw->min_head && 
+               VAL(x, xw->min_dq[(xw->min_tail-1) & mask]) >= new_mv) 
+        {
+            xw->min_tail--;
+        }
+        xw->min_dq[xw->min_tail++ & mask] = seq;
+
+        // update the max deque
+        if (xw->max_tail != xw->max_head && 
+            (uint32_t)seq - xw->max_dq[xw->max_head & mask] >= win_len[w]) 
+        {
+            xw->max_head++;
+        }
+        while (xw->max_tail != xw->max_head && 
+               VAL(x, xw->max_dq[(xw->max_tail-1) & mask]) <= new_mv) 
+        {
+            xw->max_tail--;
+        }
+        xw->max_dq[xw->max_tail++ & mask] = seq;
+    }
+
+    // publish the value, and end the update of the window statistics
+    __atomic_store_n(&x->seq, seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&x->lock, x->lock+1, __ATOMIC_RELEASE);
+}
+
+static int32_t dataq_get_adc_win(int32_t adc_chan, int32_t win, dataq_adc_stats_t * st)
+{
+    adc_t     * x;
+    adc_win_t * xw;
+    uint32_t    lock;
+    uint64_t    seq;
+    int64_t     sum, sum_squares;
+    int32_t     n;
+    float       u;
+
+    // if not inititialized then return error
+    if (!initialized) {
+        return -1;
+    }
+
+    // validate adc_chan
+    if (adc_chan < 1 || adc_chan >= MAX_ADC_CHAN || adc[adc_chan].val == NULL) {
+        ERROR("adc_chan %d is not valid\n", adc_chan);
+        return -1;
+    }
+    x = &adc[adc_chan];
+    xw = &x->win[win];
+
+    // if dataq scan is not working then return error
+    if (!scan_okay || x->seq == 0) {
+        ERROR("adc data not available\n");
+        return -1;
+    }
+
+    // take a consistent snapshot of the window statistics, retrying if 
+    // they are being updated; the min and max are at the head of the deques
+    do {
+        while ((lock = __atomic_load_n(&x->lock, __ATOMIC_ACQUIRE)) & 1) {
+            sched_yield();
+        }
+        seq         = x->seq;
+        sum         = xw->sum;
+        sum_squares = xw->sum_squares;
+        st->min_mv  = VAL(x, xw->min_dq[xw->min_head & win_dq_mask[win]]);
+        st->max_mv  = VAL(x, xw->max_dq[xw->max_head & win_dq_mask[win]]);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&x->lock, __ATOMIC_RELAXED) != lock);
+
+    // the number of values in the window, which is less than the window
+    // length until enough values have been saved
+    n = (seq < win_len[win] ? seq : win_len[win]);
+    st->first_seq = seq - n;
+    st->end_seq   = seq;
+
+    // calculate rms, mean, and standard deviation
+    u = (float)sum / n;
+    st->rms_mv  = sqrtf((float)sum_squares / n);
+    st->mean_mv = sum / n;
+    st->sdev_mv = sqrtf(fmaxf(((float)sum_squares / n) - (u * u), 0));
+
+    // return success
+    return 0;
+}
+
+// The resampling filter is a windowed sinc lowpass designed at the interpolated 
+// rate, actual_scan_hz * filter_l, with its cutoff at FILTER_CUTOFF of the lower of 
+// the scan and output rates. Its taps are reordered by phase, and scaled by filter_l
+// so that each phase has unity gain.
+
+static int32_t dataq_filter_init(int32_t srate)
+{
+    int64_t num, den, a, b, t;
+    int32_t n, i, p, k;
+    double * h, fc, sum, x;
+
+    // the actual scan rate is CLOCK_HZ / srate, so the resample ratio 
+    // out_hz / actual_scan_hz is (out_hz * srate) / CLOCK_HZ, reduced
+    actual_scan_hz = (double)CLOCK_HZ / srate;
+    num = (int64_t)out_hz * srate;
+    den = CLOCK_HZ;
+    for (a = num, b = den; b != 0; t = a % b, a = b, b = t) ;
+    filter_l = num / a;
+    filter_m = den / a;
+    INFO("actual_scan_hz=%0.3f resample=%d/%d\n", actual_scan_hz, filter_l, filter_m);
+
+    // if the scan rate is the output rate then no filter is needed
+    if (filter_l == filter_m) {
+        filter_taps = NULL;
+        return 0;
+    }
+
+    // validate the interpolation factor
+    if (filter_l > FILTER_MAX_PHASE) {
+        ERROR("resample ratio %d/%d is not supported, choose a scan_hz that divides %d\n",
+              filter_l, filter_m, CLOCK_HZ);
+        return -1;
+    }
+
+    // design the prototype filter, and normalize its dc gain to filter_l
+    n = filter_l * FILTER_TAPS_PER_PHASE;
+    h = calloc(n, sizeof(double));
+    filter_taps = calloc(n, sizeof(float));
+    if (h == NULL || filter_taps == NULL) {
+        FATAL("alloc filter failed, n=%d\n", n);
+    }
+    fc = FILTER_CUTOFF * (filter_l < filter_m ? 1. : (double)filter_m / filter_l) / filter_m;
+    sum = 0;
+    for (i = 0; i < n; i++) {
+        x = i - (n - 1) / 2.;
+        h[i] = (x == 0 ? 2 * fc : sin(2 * M_PI * fc * x) / (M_PI * x)) *
+               (0.42 - 0.5 * cos(2 * M_PI * i / (n - 1)) + 0.08 * cos(4 * M_PI * i / (n - 1)));
+        sum += h[i];
+    }
+
+    // reorder the taps by phase
+    for (p = 0; p < filter_l; p++) {
+        for (k = 0; k < FILTER_TAPS_PER_PHASE; k++) {
+            filter_taps[p * FILTER_TAPS_PER_PHASE + k] = h[p + k * filter_l] * filter_l / sum;
+        }
+    }
+    free(h);
+    return 0;
 }
 
 static void * dataq_monitor_thread(void * cx)
 {
-    uint64_t last_scan_count;
+    uint64_t scan_count_hist[MONITOR_PER_SEC];
     uint64_t curr_scan_count;
     uint64_t delta_scan_count;
     int32_t  min_scan_hz;
     int32_t  max_scan_hz;
+    int32_t  idx = 0;
 
-    last_scan_count = scan_count;
+    for (idx = 0; idx < MONITOR_PER_SEC; idx++) {
+        scan_count_hist[idx] = scan_count;
+    }
     min_scan_hz = scan_hz - scan_hz / 10;
     max_scan_hz = scan_hz + scan_hz / 10;
     DEBUG("min max scan hz %d %d\n", min_scan_hz, max_scan_hz);
 
     // loop forever
     while (true) {
-        // sleep 1 second
-        sleep(1);
+        // sleep for a fraction of a second, so that the scan rate over the last 
+        // second is checked several times a second, and scan_okay is restored 
+        // soon after the device is reconnected
+        usleep(1000000 / MONITOR_PER_SEC);
 
         // if program is exitting then terminate this thread
         if (exitting) {
             return NULL;
         }
 
-        // determine the amount scan_count has changed during the 1 sec sleep
+        // determine the amount scan_count has changed during the last second
         curr_scan_count = scan_count;
-        delta_scan_count = curr_scan_count - last_scan_count;
-        last_scan_count = curr_scan_count;
+        idx = (idx + 1) % MONITOR_PER_SEC;
+        delta_scan_count = curr_scan_count - scan_count_hist[idx];
+        scan_count_hist[idx] = curr_scan_count;
 
         // set scan_okay flag to true if delta_scan_count is within expected range,
         // and set to false otherwise
@@ -23,13 +23,68 @@ SOFTWARE.
 #ifndef __UTIL_DATAQ_H__
 #define __UTIL_DATAQ_H__
 
-int32_t dataq_init(float averaging_duration_sec, int32_t scan_hz, int32_t max_adc_chan, ...);
+#define DATAQ_MAX_SCAN_HZ(max_adc_chan)  (10000 / (max_adc_chan))
+
+typedef struct {
+    uint64_t scans;           // scans decoded
+    uint64_t bytes;           // bytes received
+    uint64_t resyncs;         // times the scan sync was lost
+    uint64_t skipped_bytes;   // bytes discarded while resynchronizing
+    uint64_t disconnects;     // times the device was lost
+    uint64_t reconnects;      // times scanning resumed after the device was lost
+    uint64_t recovery_ms;     // last reconnect, time from reopening the device to its first scan
+    uint64_t outage_ms;       // last reconnect, time from losing the device to its first scan
+} dataq_stats_t;
+
+// The adc channels are scanned at scan_hz, and resampled to out_hz; 
+// dataq_get_adc and dataq_get_adc_data return the resampled values.
+int32_t dataq_init(float averaging_duration_sec, int32_t scan_hz, int32_t out_hz,
+                   int32_t max_adc_chan, ...);
 
 int32_t dataq_get_adc(int32_t adc_chan,
                       int16_t * rms_mv,
                       int16_t * mean_mv, int16_t * sdev_mv,
                       int16_t * min_mv, int16_t * max_mv);
 
-int32_t dataq_get_adc_data(int32_t adc_chan, int16_t * samples_mv, int32_t count);
+// windows for dataq_get_adc_window, the statistics of all windows are 
+// maintained as the adc values are received
+#define DATAQ_WIN_100MS   0
+#define DATAQ_WIN_500MS   1
+#define DATAQ_WIN_1SEC    2
+#define DATAQ_WIN_10SEC   3
+#define DATAQ_MAX_WIN     4
+
+typedef struct {
+    uint64_t first_seq;   // sequence numbers of the values in the window are
+    uint64_t end_seq;     //  first_seq to end_seq-1
+    int16_t  rms_mv;
+    int16_t  mean_mv;
+    int16_t  sdev_mv;
+    int16_t  min_mv;
+    int16_t  max_mv;
+} dataq_adc_stats_t;
+
+int32_t dataq_get_adc_window(int32_t adc_chan, int32_t win, dataq_adc_stats_t * stats);
+
+// Returns the most recent count adc values; if first_seq is not NULL it is 
+// set to the sequence number of samples_mv[0]. The values of each channel are
+// numbered consecutively from 0 at the resampled rate.
+int32_t dataq_get_adc_data(int32_t adc_chan, int16_t * samples_mv, int32_t count,
+                           uint64_t * first_seq);
+
+void dataq_get_stats(dataq_stats_t * stats);
+
+// The stream file contains the header, followed by the full rate adc values,
+// in mv, of each scan; one int16_t for each channel, in the order of chan[].
+typedef struct {
+    uint64_t magic;
+    double   scan_hz;
+    uint64_t start_us;        // real time when the stream started
+    int32_t  max_chan;
+    int32_t  chan[8];
+    int32_t  reserved;
+} dataq_stream_hdr_t;
+
+int32_t dataq_stream_start(char * filename);
 
 #endif
@@ -0,0 +1,535 @@
+/*
+Copyright (c) 2016 Steven Haid
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "util_journal.h"
+#include "util_misc.h"
+
+//
+// defines
+//
+
+#define SEGMENT_MAGIC  "FUSJRN01"
+#define ENTRY_MAGIC    0x59544e45   // 'ENTY'
+
+#define MAX_QUEUE      16           // max records waiting for the writer
+#define ZERO_BUFF_LEN  (1024*1024)  // used to preallocate the segments
+
+#define STATS_ADD(field,n)  __atomic_fetch_add(&g_stats.field, (n), __ATOMIC_RELAXED)
+
+//
+// typedefs
+//
+
+typedef struct {
+    char     magic[8];
+    uint64_t seq;
+    uint64_t start_time_us;
+    uint64_t reserved;
+} segment_hdr_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t len;                // frame bytes that follow
+    uint64_t time;
+    uint64_t seq;                // the segment's seq, entries from its prior use differ
+    uint32_t crc;                // of this header, with crc 0, and the frame
+    uint32_t reserved;
+} entry_hdr_t;
+
+typedef struct {
+    uint64_t  time;
+    uint8_t * frame;
+    int32_t   frame_len;
+} queue_entry_t;
+
+//
+// variables
+//
+
+static bool             g_active;
+static char             g_dirname[PATH_MAX];
+static int32_t          g_fd = -1;
+static uint64_t         g_seq;             // the segment being written
+static uint64_t         g_oldest_seq;
+static uint64_t         g_offset;          // of the next entry in the segment
+static bool             g_write_error;
+static journal_stats_t  g_stats;
+
+static queue_entry_t    g_queue[MAX_QUEUE];
+static int32_t          g_queue_head;
+static int32_t          g_queue_tail;
+static bool             g_stopping;
+static pthread_mutex_t  g_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   g_cond  = PTHREAD_COND_INITIALIZER;
+static pthread_t        g_writer_thread;
+
+static uint32_t         g_crc_table[256];
+
+//
+// prototypes
+//
+
+static void * journal_writer_thread(void * cx);
+static void journal_write_entry(queue_entry_t * e);
+static int32_t journal_segment_start(void);
+static void journal_segment_name(char * name, char * dirname, uint64_t seq);
+static int32_t journal_scan(char * dirname, uint64_t ** seq_ret);
+static int compare_seq(const void * a, const void * b);
+static void crc_init(void);
+static uint32_t crc_update(uint32_t crc, void * buff, size_t len);
+
+// -----------------  WRITING  -------------------------------------------------------
+
+int32_t journal_start(char * dirname)
+{
+    uint64_t * seq;
+    int32_t    max_seq;
+
+    crc_init();
+
+    // create the directory, if needed, and find the existing segments; the
+    // journal continues with a new segment
+    if (mkdir(dirname, 0777) < 0 && errno != EEXIST) {
+        ERROR("mkdir %s, %s\n", dirname, strerror(errno));
+        return -1;
+    }
+    max_seq = journal_scan(dirname, &seq);
+    if (max_seq < 0) {
+        return -1;
+    }
+    strncpy(g_dirname, dirname, sizeof(g_dirname)-1);
+    g_seq = (max_seq > 0 ? seq[max_seq-1] : 0);
+    g_oldest_seq = (max_seq > 0 ? seq[0] : 1);
+    free(seq);
+
+    // start the first segment
+    if (journal_segment_start() < 0) {
+        return -1;
+    }
+
+    // create the writer thread
+    if (pthread_create(&g_writer_thread, NULL, journal_writer_thread, NULL) != 0) {
+        FATAL("pthread_create journal_writer_thread, %s\n", strerror(errno));
+    }
+
+    // journal is active
+    INFO("journal to %s, segment %"PRId64", %d segments of %d MB\n",
+         dirname, g_seq, JOURNAL_MAX_SEGMENT, JOURNAL_SEGMENT_SIZE/(1024*1024));
+    g_active = true;
+    return 0;
+}
+
+// called once per second by get_data's aggregate_thread, must not block
+void journal_write(uint64_t time, uint8_t * frame, int32_t frame_len)
+{
+    uint8_t * copy;
+
+    if (!g_active) {
+        return;
+    }
+
+    // copy the frame, and queue it for the writer thread; if the writer has 
+    // fallen behind then drop it
+    copy = malloc(frame_len);
+    if (copy == NULL) {
+        FATAL("malloc failed\n");
+    }
+    memcpy(copy, frame, frame_len);
+
+    pthread_mutex_lock(&g_mutex);
+    if (g_queue_head - g_queue_tail < MAX_QUEUE) {
+        g_queue[g_queue_head % MAX_QUEUE] = (queue_entry_t){time, copy, frame_len};
+        g_queue_head++;
+        pthread_cond_signal(&g_cond);
+        copy = NULL;
+    }
+    pthread_mutex_unlock(&g_mutex);
+
+    if (copy) {
+        STATS_ADD(dropped, 1);
+        free(copy);
+    }
+}
+
+void journal_stop(void)
+{
+    if (!g_active) {
+        return;
+    }
+    g_active = false;
+
+    // tell the writer thread to finish the queued records, and wait for it
+    pthread_mutex_lock(&g_mutex);
+    g_stopping = true;
+    pthread_cond_signal(&g_cond);
+    pthread_mutex_unlock(&g_mutex);
+    pthread_join(g_writer_thread, NULL);
+}
+
+void journal_get_stats(journal_stats_t * stats)
+{
+    stats->records  = __atomic_load_n(&g_stats.records, __ATOMIC_RELAXED);
+    stats->dropped  = __atomic_load_n(&g_stats.dropped, __ATOMIC_RELAXED);
+    stats->segments = __atomic_load_n(&g_stats.segments, __ATOMIC_RELAXED);
+    stats->bytes    = __atomic_load_n(&g_stats.bytes, __ATOMIC_RELAXED);
+}
+
+static void * journal_writer_thread(void * cx)
+{
+    queue_entry_t e;
+
+    while (true) {
+        // wait for a queued record, or stopping
+        pthread_mutex_lock(&g_mutex);
+        while (g_queue_head == g_queue_tail && !g_stopping) {
+            pthread_cond_wait(&g_cond, &g_mutex);
+        }
+        if (g_queue_head == g_queue_tail) {
+            pthread_mutex_unlock(&g_mutex);
+            break;
+        }
+        e = g_queue[g_queue_tail % MAX_QUEUE];
+        g_queue_tail++;
+        pthread_mutex_unlock(&g_mutex);
+
+        // write it
+        journal_write_entry(&e);
+        free(e.frame);
+    }
+
+    close(g_fd);
+    g_fd = -1;
+    INFO("journal closed, segment %"PRId64", records=%"PRId64" dropped=%"PRId64" bytes=%"PRId64"\n",
+         g_seq, g_stats.records, g_stats.dropped, g_stats.bytes);
+    return NULL;
+}
+
+static void journal_write_entry(queue_entry_t * e)
+{
+    entry_hdr_t  hdr;
+    struct iovec iov[2];
+    size_t       len = sizeof(hdr) + e->frame_len;
+    ssize_t      ret;
+
+    // after a write error, such as the disk being full, the remaining 
+    // records are discarded
+    if (g_write_error) {
+        STATS_ADD(dropped, 1);
+        return;
+    }
+
+    // if the entry does not fit in this segment then start the next
+    if (g_offset + len > JOURNAL_SEGMENT_SIZE && journal_segment_start() < 0) {
+        g_write_error = true;
+        STATS_ADD(dropped, 1);
+        return;
+    }
+
+    // write the entry header and frame, and sync them; the segment was
+    // preallocated, so only the data is written
+    bzero(&hdr, sizeof(hdr));
+    hdr.magic = ENTRY_MAGIC;
+    hdr.len   = e->frame_len;
+    hdr.time  = e->time;
+    hdr.seq   = g_seq;
+    hdr.crc   = crc_update(crc_update(0, &hdr, sizeof(hdr)), e->frame, e->frame_len);
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len  = sizeof(hdr);
+    iov[1].iov_base = e->frame;
+    iov[1].iov_len  = e->frame_len;
+    ret = pwritev(g_fd, iov, 2, g_offset);
+    if (ret != len || fdatasync(g_fd) < 0) {
+        ERROR("journal write failed, %s\n", ret >= 0 && ret != len ? "short write" : strerror(errno));
+        g_write_error = true;
+        STATS_ADD(dropped, 1);
+        return;
+    }
+    g_offset += len;
+    STATS_ADD(records, 1);
+    STATS_ADD(bytes, len);
+}
+
+static int32_t journal_segment_start(void)
+{
+    static uint8_t * zero_buff;
+    segment_hdr_t    hdr;
+    char             name[PATH_MAX+32], old_name[PATH_MAX+32];
+    bool             reused = false;
+    int32_t          fd;
+    uint64_t         offset;
+
+    // close the current segment
+    if (g_fd >= 0) {
+        close(g_fd);
+        g_fd = -1;
+    }
+
+    // if there are JOURNAL_MAX_SEGMENT segments then reuse the oldest, which
+    // is already allocated
+    g_seq++;
+    journal_segment_name(name, g_dirname, g_seq);
+    while (g_seq - g_oldest_seq >= JOURNAL_MAX_SEGMENT) {
+        journal_segment_name(old_name, g_dirname, g_oldest_seq++);
+        if (rename(old_name, name) == 0) {
+            reused = true;
+            break;
+        }
+        if (errno != ENOENT) {
+            ERROR("rename %s to %s, %s\n", old_name, name, strerror(errno));
+            return -1;
+        }
+    }
+    g_fd = open(name, O_CREAT|O_WRONLY, 0666);
+    if (g_fd < 0) {
+        ERROR("open %s, %s\n", name, strerror(errno));
+        return -1;
+    }
+
+    // a new segment is preallocated by filling it with zeros, rather than using
+    // fallocate, so that the entries are written to blocks that are already 
+    // initialized, and syncing an entry does not also sync the file's metadata
+    if (!reused) {
+        if (zero_buff == NULL && (zero_buff = calloc(1, ZERO_BUFF_LEN)) == NULL) {
+            FATAL("calloc failed\n");
+        }
+        for (offset = 0; offset < JOURNAL_SEGMENT_SIZE; offset += ZERO_BUFF_LEN) {
+            if (pwrite(g_fd, zero_buff, ZERO_BUFF_LEN, offset) != ZERO_BUFF_LEN) {
+                ERROR("preallocate %s, %s\n", name, strerror(errno));
+                return -1;
+            }
+        }
+    }
+
+    // write the segment header, after the segment is preallocated, so that the 
+    // reader ignores a segment whose preallocation did not complete; and sync 
+    // the segment and the directory
+    bzero(&hdr, sizeof(hdr));
+    memcpy(hdr.magic, SEGMENT_MAGIC, sizeof(hdr.magic));
+    hdr.seq = g_seq;
+    hdr.start_time_us = get_real_time_us();
+    if (pwrite(g_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fdatasync(g_fd) < 0) {
+        ERROR("write %s header, %s\n", name, strerror(errno));
+        return -1;
+    }
+    fd = open(g_dirname, O_RDONLY|O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+
+    g_offset = sizeof(hdr);
+    STATS_ADD(segments, 1);
+    return 0;
+}
+
+// -----------------  READING  -------------------------------------------------------
+
+journal_reader_t * journal_open(char * dirname)
+{
+    journal_reader_t * jr;
+
+    crc_init();
+
+    jr = calloc(1, sizeof(journal_reader_t));
+    if (jr == NULL || (jr->dirname = strdup(dirname)) == NULL) {
+        FATAL("calloc failed\n");
+    }
+    jr->fd = -1;
+    jr->max_seq = journal_scan(dirname, &jr->seq);
+    if (jr->max_seq < 0) {
+        journal_close(jr);
+        return NULL;
+    }
+    return jr;
+}
+
+// returns the frame length, 0 when there are no more entries, or -1 on error
+int32_t journal_read(journal_reader_t * jr, uint64_t * time, uint8_t * frame, int32_t max_frame_len)
+{
+    segment_hdr_t segment_hdr;
+    entry_hdr_t   hdr;
+    char          name[PATH_MAX+32];
+    uint64_t      seq;
+    uint32_t      crc;
+
+    while (true) {
+        // if no segment is being read then open the next, and verify its header
+        if (jr->fd < 0) {
+            if (jr->seq_idx == jr->max_seq) {
+                return 0;
+            }
+            journal_segment_name(name, jr->dirname, jr->seq[jr->seq_idx++]);
+            jr->fd = open(name, O_RDONLY);
+            if (jr->fd < 0) {
+                ERROR("open %s, %s\n", name, strerror(errno));
+                return -1;
+            }
+            if (pread(jr->fd, &segment_hdr, sizeof(segment_hdr), 0) != sizeof(segment_hdr) ||
+                memcmp(segment_hdr.magic, SEGMENT_MAGIC, sizeof(segment_hdr.magic)) != 0 ||
+                segment_hdr.seq != jr->seq[jr->seq_idx-1])
+            {
+                WARN("%s is not a journal segment, or was not completed\n", name);
+                close(jr->fd);
+                jr->fd = -1;
+                continue;
+            }
+            jr->offset = sizeof(segment_hdr);
+        }
+        seq = jr->seq[jr->seq_idx-1];
+
+        // read the next entry header; the segment ends at an entry that was not 
+        // written, or that is from the segment's prior use
+        if (pread(jr->fd, &hdr, sizeof(hdr), jr->offset) != sizeof(hdr) ||
+            hdr.magic != ENTRY_MAGIC || hdr.seq != seq) 
+        {
+            close(jr->fd);
+            jr->fd = -1;
+            continue;
+        }
+
+        // read the frame, and verify the checksum; a torn entry is expected
+        // to be the last of the segment written at the time of a crash
+        crc = hdr.crc;
+        hdr.crc = 0;
+        if (hdr.len > max_frame_len ||
+            jr->offset + sizeof(hdr) + hdr.len > JOURNAL_SEGMENT_SIZE ||
+            pread(jr->fd, frame, hdr.len, jr->offset + sizeof(hdr)) != hdr.len ||
+            crc_update(crc_update(0, &hdr, sizeof(hdr)), frame, hdr.len) != crc)
+        {
+            WARN("journal segment %"PRId64" offset %"PRId64" entry is corrupt\n", seq, jr->offset);
+            jr->corrupt++;
+            close(jr->fd);
+            jr->fd = -1;
+            continue;
+        }
+        jr->offset += sizeof(hdr) + hdr.len;
+        *time = hdr.time;
+        return hdr.len;
+    }
+}
+
+void journal_close(journal_reader_t * jr)
+{
+    if (jr->fd >= 0) {
+        close(jr->fd);
+    }
+    free(jr->seq);
+    free(jr->dirname);
+    free(jr);
+}
+
+// -----------------  SEGMENT FILES  -------------------------------------------------
+
+static void journal_segment_name(char * name, char * dirname, uint64_t seq)
+{
+    sprintf(name, "%s/journal.%08"PRId64, dirname, seq);
+}
+
+// returns the number of segments, and their seqs in ascending order
+static int32_t journal_scan(char * dirname, uint64_t ** seq_ret)
+{
+    DIR           * dir;
+    struct dirent * de;
+    uint64_t      * seq = NULL;
+    int32_t         max_seq = 0, n;
+
+    *seq_ret = NULL;
+    dir = opendir(dirname);
+    if (dir == NULL) {
+        ERROR("opendir %s, %s\n", dirname, strerror(errno));
+        return -1;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        uint64_t s;
+        if (sscanf(de->d_name, "journal.%"SCNu64"%n", &s, &n) != 1 || de->d_name[n] != '\0') {
+            continue;
+        }
+        if ((max_seq & 63) == 0) {
+            seq = realloc(seq, (max_seq + 64) * sizeof(uint64_t));
+            if (seq == NULL) {
+                FATAL("realloc failed\n");
+            }
+        }
+        seq[max_seq++] = s;
+    }
+    closedir(dir);
+
+    if (max_seq > 0) {
+        qsort(seq, max_seq, sizeof(uint64_t), compare_seq);
+    }
+    *seq_ret = seq;
+    return max_seq;
+}
+
+static int compare_seq(const void * a, const void * b)
+{
+    uint64_t x = *(uint64_t*)a, y = *(uint64_t*)b;
+
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// -----------------  CRC32  ---------------------------------------------------------
+
+static void crc_init(void)
+{
+    uint32_t c;
+    int32_t  i, j;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++) {
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+        g_crc_table[i] = c;
+    }
+}
+
+static uint32_t crc_update(uint32_t crc, void * buff, size_t len)
+{
+    uint8_t * p = buff;
+
+    crc = ~crc;
+    while (len--) {
+        crc = g_crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
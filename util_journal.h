@@ -0,0 +1,72 @@
+/*
+Copyright (c) 2016 Steven Haid
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef __UTIL_JOURNAL_H__
+#define __UTIL_JOURNAL_H__
+
+// Local journal of the records built by get_data, so that a copy of the run is 
+// kept on the data Pi even if the display program's computer or the network fails.
+//
+// The journal is a directory of segment files, journal.<seq>, each preallocated 
+// to JOURNAL_SEGMENT_SIZE. A segment contains a header followed by one entry per 
+// second, each an entry header and the record encoded as a util_proto.h frame. 
+// The entries are written by a dedicated thread, and each is synced before the 
+// next is written, so a crash loses at most the entries queued. When a segment is
+// full the next is started; when there are JOURNAL_MAX_SEGMENT segments the oldest
+// is reused. The reader ends a segment at the first entry that is not complete and
+// intact, or that was left from the segment's prior use.
+
+#define JOURNAL_SEGMENT_SIZE  (16*1024*1024)
+#define JOURNAL_MAX_SEGMENT   32
+
+// -----------------  WRITING  -------------------------------------------------------
+
+typedef struct {
+    uint64_t records;          // records written
+    uint64_t dropped;          // records dropped because the writer fell behind, or errored
+    uint64_t segments;         // segments started
+    uint64_t bytes;            // bytes written, including headers
+} journal_stats_t;
+
+int32_t journal_start(char * dirname);
+void journal_write(uint64_t time, uint8_t * frame, int32_t frame_len);
+void journal_stop(void);
+void journal_get_stats(journal_stats_t * stats);
+
+// -----------------  READING  -------------------------------------------------------
+
+typedef struct {
+    int32_t    fd;             // the segment being read, -1 if none
+    uint64_t * seq;            // the segments, ascending
+    int32_t    max_seq;
+    int32_t    seq_idx;
+    uint64_t   offset;         // of the next entry in the segment being read
+    char     * dirname;
+    uint64_t   corrupt;        // entries that were incomplete or failed the checksum
+} journal_reader_t;
+
+journal_reader_t * journal_open(char * dirname);
+int32_t journal_read(journal_reader_t * jr, uint64_t * time, uint8_t * frame, int32_t max_frame_len);
+void journal_close(journal_reader_t * jr);
+
+#endif
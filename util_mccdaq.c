@@ -21,6 +21,7 @@ SOFTWARE.
 */
 
 //#define MCCDAQ_TEST
+//#define CONSUMER_POLL_WAIT
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -37,6 +38,9 @@ SOFTWARE.
 #include <termios.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/eventfd.h>
 
 #include "util_mccdaq.h"
 #include "util_misc.h"
@@ -52,11 +56,33 @@ enum libusb_error {
   LIBUSB_ERROR_OVERFLOW = -8, LIBUSB_ERROR_PIPE = -9, LIBUSB_ERROR_INTERRUPTED = -10, LIBUSB_ERROR_NO_MEM = -11, 
   LIBUSB_ERROR_NOT_SUPPORTED = -12, LIBUSB_ERROR_OTHER = -99 };
 enum libusb_endpoint_direction { LIBUSB_ENDPOINT_IN = 0x80, LIBUSB_ENDPOINT_OUT = 0x00 };
+enum libusb_transfer_status {
+  LIBUSB_TRANSFER_COMPLETED, LIBUSB_TRANSFER_ERROR, LIBUSB_TRANSFER_TIMED_OUT, LIBUSB_TRANSFER_CANCELLED,
+  LIBUSB_TRANSFER_STALL, LIBUSB_TRANSFER_NO_DEVICE, LIBUSB_TRANSFER_OVERFLOW };
+typedef struct libusb_context libusb_context;
 typedef struct libusb_device_handle libusb_device_handle;
-int libusb_init (void ** cx);
+struct libusb_transfer;
+typedef void (*libusb_transfer_cb_fn)(struct libusb_transfer *transfer);
+struct libusb_transfer {
+  libusb_device_handle *dev_handle; unsigned char endpoint; unsigned int timeout;
+  enum libusb_transfer_status status; int length; int actual_length;
+  libusb_transfer_cb_fn callback; void *user_data; unsigned char *buffer; };
+static inline void libusb_fill_bulk_transfer (struct libusb_transfer *transfer, libusb_device_handle *dev_handle,
+       unsigned char endpoint, unsigned char *buffer, int length, libusb_transfer_cb_fn callback,
+       void *user_data, unsigned int timeout)
+{
+  transfer->dev_handle = dev_handle; transfer->endpoint = endpoint; transfer->timeout = timeout;
+  transfer->buffer = buffer; transfer->length = length; transfer->callback = callback; transfer->user_data = user_data;
+}
+int libusb_init (libusb_context ** cx);
 int libusb_bulk_transfer (struct libusb_device_handle *dev_handle, unsigned char endpoint, 
        unsigned char *data, int length, int *transferred, unsigned int timeout);
 int libusb_clear_halt (libusb_device_handle *dev, unsigned char endpoint);
+struct libusb_transfer * libusb_alloc_transfer (int iso_packets);
+void libusb_free_transfer (struct libusb_transfer *transfer);
+int libusb_submit_transfer (struct libusb_transfer *transfer);
+int libusb_cancel_transfer (struct libusb_transfer *transfer);
+int libusb_handle_events_timeout (libusb_context *ctx, struct timeval *tv);
 // from mccdaq library ...
 #define NCHAN_USB20X      8  // max number of A/D channels in the device
 #define USB204_PID   (0x0114)
@@ -78,9 +104,34 @@ void usbAInScanClearFIFO_USB20X(libusb_device_handle *udev);
 // defines
 //
 
-#define CHANNEL    0
-#define FREQUENCY  499999         // samples per second
+#define FREQUENCY  499999         // samples per second, all channels
 #define MAX_DATA   (20*500000)    // 20 secs of data
+#define MAX_BATCH  500000         // the consumer discards data when further behind than this
+
+// the device scan rate is specified per channel
+#define SCAN_FREQUENCY  ((double)FREQUENCY / g_max_chan)
+
+// number of usb bulk transfers kept in flight by the producer thread, 
+// each transfer is XFER_LENGTH bytes (20 ms of data); this can be 
+// overridden at build time, for example 'make MAX_XFER=4'
+#ifndef MAX_XFER
+#define MAX_XFER   8
+#endif
+#define XFER_LENGTH  20000
+
+// the device status is read on this interval, and when a transfer fails
+#define STATUS_POLL_INTERVAL_US  1000000
+
+// the consumer thread waits on g_event_fd for new data; when CONSUMER_POLL_WAIT
+// is defined it instead polls g_produced every millisecond, as was originally done,
+// which is useful for comparing the consumer wakeup statistics
+#define CONSUMER_WAIT_TOUT_MS    100
+#define CONSUMER_STATS_SECS      10
+
+#define STATS_ADD(field, n) \
+    do { \
+        __atomic_fetch_add(&g_stats.field, (n), __ATOMIC_RELAXED); \
+    } while (0)
 
 #define STATE_CHANGE(new_state) \
     do { \
@@ -109,11 +160,46 @@ static float                  g_cal_tbl[NCHAN_USB20X][2];
 static uint16_t             * g_data;
 static uint64_t               g_produced;
 static mccdaq_callback_t      g_cb;
+static mccdaq_batch_callback_t g_batch_cb;
+static uint32_t               g_chan_mask;
 static enum state             g_state;
 static bool                   g_producer_thread_running;
 static bool                   g_consumer_thread_running;
 static int32_t                g_restart_count;
 static int32_t                g_usb_max_packet_size;
+static int32_t                g_event_fd = -1;
+
+static struct libusb_transfer * g_xfer[MAX_XFER];
+static bool                   g_xfer_done[MAX_XFER];
+static int32_t                g_xfer_head;
+static uint64_t               g_submitted;
+static uint64_t               g_scan_start_us;
+static uint64_t               g_scan_start_produced;
+
+static mccdaq_stats_t         g_stats;
+
+// when more than one channel is scanned, each channel has a thread that 
+// demultiplexes its samples from the batch and calls g_cb; the consumer 
+// thread posts a batch by incrementing g_batch_seq, and waits for 
+// g_batch_pending to reach 0
+typedef struct {
+    int32_t    chan;          // analog input channel
+    int32_t    idx;           // position of the channel in the scan
+    uint16_t * buff;          // demultiplexed samples of the batch
+    pthread_t  thread;
+} chan_t;
+
+static chan_t                 g_chan[MCCDAQ_MAX_CHAN];
+static int32_t                g_max_chan;
+static pthread_mutex_t        g_batch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t         g_batch_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t         g_batch_done_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t               g_batch_seq;
+static uint64_t               g_batch_pos;       // stream position of the batch
+static int64_t                g_batch_count;     // samples in the batch, all channels
+static int32_t                g_batch_pending;   // channel threads that have not finished the batch
+static int32_t                g_batch_ret;       // non zero if a callback requested stop
+static bool                   g_batch_exit;
 
 //
 // protoytpes
@@ -121,7 +207,19 @@ static int32_t                g_usb_max_packet_size;
 
 static void mccdaq_exit(void);
 static void * mccdaq_producer_thread(void * cx);
+static void mccdaq_xfer_callback(struct libusb_transfer * transfer);
+static int32_t mccdaq_xfer_submit(int32_t x);
+static void mccdaq_xfer_cancel_all(void);
+static void mccdaq_scan_restart(int32_t status);
+static void mccdaq_produced_add(uint64_t count);
+static void mccdaq_consumer_wake(void);
+#ifdef MCCDAQ_TEST
+static void mccdaq_sim_report(void);
+#endif
 static void * mccdaq_consumer_thread(void * cx);
+static void * mccdaq_chan_thread(void * cx);
+static int32_t mccdaq_chan_batch(uint64_t pos, int64_t count);
+static int32_t mccdaq_demux(chan_t * c, uint64_t pos, int64_t count);
 
 // -----------------  PUBLIC ROUTINES  ----------------------------------
 
@@ -167,6 +265,12 @@ int32_t mccdaq_init(void)
     }
     g_produced = 0;
 
+    // create the eventfd used by the producer to wake the consumer
+    g_event_fd = eventfd(0, EFD_CLOEXEC);
+    if (g_event_fd < 0) {
+        FATAL("eventfd, %s\n", strerror(errno));
+    }
+
     // set state to stopped
     STATE_CHANGE(STOPPED);
 
@@ -178,9 +282,10 @@ int32_t mccdaq_init(void)
     return 0;
 }
 
-int32_t  mccdaq_start(mccdaq_callback_t cb)
+int32_t  mccdaq_start(uint32_t chan_mask, mccdaq_callback_t cb, mccdaq_batch_callback_t batch_cb)
 {
     pthread_t thread;
+    int32_t   chan;
 
     // if not initialized then return error
     if (g_state == NOT_INITIALIZED) {
@@ -207,12 +312,41 @@ int32_t  mccdaq_start(mccdaq_callback_t cb)
         FATAL("state should be STOPPED, but is %d\n", g_state);
     }
 
+    // validate chan_mask
+    if (chan_mask == 0 || chan_mask >= (1 << MCCDAQ_MAX_CHAN)) {
+        ERROR("invalid chan_mask 0x%x\n", chan_mask);
+        return -1;
+    }
+
+    // build the list of channels, in scan order; and when more than one channel
+    // allocate the buffers that the samples are demultiplexed into
+    g_chan_mask = chan_mask;
+    g_max_chan = 0;
+    for (chan = 0; chan < MCCDAQ_MAX_CHAN; chan++) {
+        if (chan_mask & (1 << chan)) {
+            g_chan[g_max_chan].chan = chan;
+            g_chan[g_max_chan].idx = g_max_chan;
+            g_max_chan++;
+        }
+    }
+    for (chan = 0; g_max_chan > 1 && chan < g_max_chan; chan++) {
+        if (g_chan[chan].buff == NULL) {
+            g_chan[chan].buff = calloc(MAX_BATCH/2+1, sizeof(uint16_t));
+            if (g_chan[chan].buff == NULL) {
+                FATAL("calloc size %zd", (MAX_BATCH/2+1)*sizeof(uint16_t));
+            }
+        }
+    }
+    INFO("scanning %d channels, mask 0x%x, %d samples/sec each\n", 
+         g_max_chan, g_chan_mask, mccdaq_get_sample_rate());
+
     // clear data
     memset(g_data, -1, MAX_DATA*sizeof(uint16_t));
     g_produced = 0;
 
-    // store callback
+    // store callbacks
     g_cb = cb;
+    g_batch_cb = batch_cb;
 
     // set state
     STATE_CHANGE(RUNNING);
@@ -237,8 +371,9 @@ int32_t mccdaq_stop(void)
         return -1;
     }
 
-    // set state to STOPPING
+    // set state to STOPPING, and wake the consumer thread
     STATE_CHANGE(STOPPING);
+    mccdaq_consumer_wake();
 
     // wait for threads to be not running
     while (g_producer_thread_running || g_consumer_thread_running) {
@@ -252,6 +387,12 @@ int32_t mccdaq_stop(void)
     return 0;
 }
 
+int32_t mccdaq_get_sample_rate(void)
+{
+    // samples per second, of each channel
+    return g_max_chan ? (FREQUENCY + 1) / g_max_chan : 0;
+}
+
 int32_t mccdaq_get_restart_count(void) 
 {
     int32_t val = g_restart_count;
@@ -259,6 +400,18 @@ int32_t mccdaq_get_restart_count(void)
     return val;
 }
 
+void mccdaq_get_stats(mccdaq_stats_t * stats)
+{
+    stats->produced            = __atomic_load_n(&g_stats.produced, __ATOMIC_RELAXED);
+    stats->consumed            = __atomic_load_n(&g_stats.consumed, __ATOMIC_RELAXED);
+    stats->dropped             = __atomic_load_n(&g_stats.dropped, __ATOMIC_RELAXED);
+    stats->producer_wraps      = __atomic_load_n(&g_stats.producer_wraps, __ATOMIC_RELAXED);
+    stats->restarts            = __atomic_load_n(&g_stats.restarts, __ATOMIC_RELAXED);
+    stats->restart_gap_samples = __atomic_load_n(&g_stats.restart_gap_samples, __ATOMIC_RELAXED);
+    stats->consumer_wakeups    = __atomic_load_n(&g_stats.consumer_wakeups, __ATOMIC_RELAXED);
+    stats->consumer_batches    = __atomic_load_n(&g_stats.consumer_batches, __ATOMIC_RELAXED);
+}
+
 // -----------------  MCCDAQ EXIT HANDLER -------------------------------
 
 static void mccdaq_exit(void)
@@ -270,28 +423,48 @@ static void mccdaq_exit(void)
 
 // -----------------  MCCDAQ PRODUCER THREAD-----------------------------
 
+// The producer keeps MAX_XFER asynchronous bulk transfers in flight, each
+// landing directly in the g_data circular buffer at the position following 
+// the previously submitted transfer. Bulk transfers on an endpoint complete
+// in the order they were submitted, so the oldest transfer (g_xfer_head) is
+// always the next to complete; it is processed and then resubmitted at the
+// end of the queue. This ensures the device always has a transfer to fill
+// while the host is processing a completed one.
+//
+// The device status (a control transfer) is read only on STATUS_POLL_INTERVAL_US,
+// or when a transfer does not complete normally.
+
+#define OPTIONS     0
+#define TOUT_MS     2000
+
 static void * mccdaq_producer_thread(void * cx) 
 {
-    #define OPTIONS     0
-    #define MAX_LENGTH  20000
-    #define TOUT_MS     2000
-
-    int32_t    ret, status;
-    int32_t    length_avail, length, transferred_bytes;
-    uint16_t * data = g_data;
+    int32_t    x, ret, status, transferred_bytes;
+    uint64_t   status_poll_us;
+    struct timeval tv;
 
     g_producer_thread_running = true;
 
-    // start the analog input scan
-    usbAInScanStart_USB20X(g_udev, 0, FREQUENCY, 1<<CHANNEL, OPTIONS, 0, 0);
+    // allocate the transfers
+    for (x = 0; x < MAX_XFER; x++) {
+        g_xfer[x] = libusb_alloc_transfer(0);
+        if (g_xfer[x] == NULL) {
+            FATAL("libusb_alloc_transfer failed\n");
+        }
+    }
 
-    // note that the code in the following loop is copied from the
-    // usbAInScanRead_USB20X routine in mccdaq/mcc-libusb/usb-20X.c;
-    // this is done because the usbAInScanRead_USB20X routine does not
-    // return error status; also the usbAInScanRead_USB20X routine does
-    // not return the actual number of scans transferred
+    // start the analog input scan, and submit all transfers
+    usbAInScanStart_USB20X(g_udev, 0, SCAN_FREQUENCY, g_chan_mask, OPTIONS, 0, 0);
+    g_scan_start_us = microsec_timer();
+    g_scan_start_produced = g_produced;
+    g_submitted = g_produced;
+    g_xfer_head = 0;
+    for (x = 0; x < MAX_XFER; x++) {
+        mccdaq_xfer_submit(x);
+    }
+    status_poll_us = microsec_timer() + STATUS_POLL_INTERVAL_US;
 
-    // loop, performing usb buld transfers
+    // loop, processing completed transfers in the order they were submitted
     while (true) {
         // if state is STOPPING then
         //   exit thread
@@ -300,72 +473,76 @@ static void * mccdaq_producer_thread(void * cx)
             break;
         }
 
-        // determine number of bytes to request in call to libusb_bulk_transfer;
-        // this is normally MAX_LENGTH, but will be less when the data pointer nears
-        // the end of the g_data buffer
-        length_avail = (g_data + MAX_DATA - data) * sizeof(uint16_t);
-        length = (length_avail >= MAX_LENGTH ? MAX_LENGTH : length_avail);
-
-        // transfer analog data from mcc usb 204 device to data buffer
-        ret = libusb_bulk_transfer(g_udev, 
-                                   LIBUSB_ENDPOINT_IN|1, 
-                                   (uint8_t*)data,
-                                   length, 
-                                   &transferred_bytes, 
-                                   TOUT_MS);
-        status = usbStatus_USB20X(g_udev);
-        DEBUG("ret=%d length=%d transferred_byts=%d status=%d\n", 
-              ret, length, transferred_bytes, status);
-
-        // print warning if transferred_bytes is odd
-        if (transferred_bytes & 1) {
-            WARN("transferred_bytes = %d\n", transferred_bytes);    
-        }
-
-        // if length is a multiple of usb_max_packet_size the device will send a zero byte packet.
-        // refer to usbAInScanRead_USB20X routine in mccdaq/mcc-libusb/usb-20X.c
-        if (((length % g_usb_max_packet_size) == 0) && !(status & AIN_SCAN_RUNNING)) {
-            uint8_t value[64];
-            int32_t xfered;
-            libusb_bulk_transfer(g_udev, 
-                                 LIBUSB_ENDPOINT_IN|1, 
-                                 value, 
-                                 2, 
-                                 &xfered, 
-                                 100);
-        }
-
-        // if error has occurred then
-        //   restart the analog input scan, and
-        //   keep track of number of resets
-        // endif
-        if ((ret == LIBUSB_ERROR_PIPE) || !(status & AIN_SCAN_RUNNING) || ret != 0) {
-            if (ret != LIBUSB_ERROR_PIPE && ret != 0) {
-                WARN("restarting, ret==%d status=0x%x\n", ret, status);
-            } else {
-                DEBUG("restarting, ret==%d status=0x%x\n", ret, status); 
-            }
+        // wait for transfer completion, the timeout allows the STOPPING state
+        // and the status poll interval to be checked
+        tv.tv_sec  = 0;
+        tv.tv_usec = 100000;
+        ret = libusb_handle_events_timeout(NULL, &tv);
+        if (ret != LIBUSB_SUCCESS && ret != LIBUSB_ERROR_INTERRUPTED) {
+            WARN("libusb_handle_events_timeout ret %d\n", ret);
+        }
 
-            libusb_clear_halt(g_udev, LIBUSB_ENDPOINT_IN|1);
-            usbAInScanStart_USB20X(g_udev, 0, FREQUENCY, 1<<CHANNEL, OPTIONS, 0, 0);
+        // process the completed transfers
+        while (g_xfer_done[g_xfer_head]) {
+            struct libusb_transfer * t = g_xfer[g_xfer_head];
 
-            __sync_fetch_and_add(&g_restart_count, 1);
-        }
+            transferred_bytes = t->actual_length;
+            DEBUG("xfer=%d status=%d length=%d transferred_bytes=%d\n", 
+                  g_xfer_head, t->status, t->length, transferred_bytes);
 
-        // make data available to consumer thread
-        g_produced += transferred_bytes / 2;
+            // print warning if transferred_bytes is odd
+            if (transferred_bytes & 1) {
+                WARN("transferred_bytes = %d\n", transferred_bytes);    
+                transferred_bytes &= ~1;
+            }
+
+            // make data available to consumer thread
+            mccdaq_produced_add(transferred_bytes / 2);
+
+            // if the transfer did not complete normally then
+            //   the transfers that follow this one are no longer contiguous 
+            //   with the data in g_data, so restart the scan and all transfers
+            // endif
+            if (t->status != LIBUSB_TRANSFER_COMPLETED || transferred_bytes != t->length) {
+                status = usbStatus_USB20X(g_udev);
+                if (t->status == LIBUSB_TRANSFER_STALL || !(status & AIN_SCAN_RUNNING)) {
+                    DEBUG("restarting, xfer_status=%d status=0x%x\n", t->status, status);
+                } else {
+                    WARN("restarting, xfer_status=%d transferred_bytes=%d status=0x%x\n",
+                         t->status, transferred_bytes, status);
+                }
+                mccdaq_scan_restart(status);
+                status_poll_us = microsec_timer() + STATUS_POLL_INTERVAL_US;
+                break;
+            }
 
-        // update data pointer to prepare for next call to libusb_bulk_transfer
-        data += transferred_bytes / 2;
-        if (data > g_data + MAX_DATA) {
-            FATAL("data out of range, %zd\n", data-g_data);
+            // resubmit this transfer at the end of the queue
+            g_xfer_done[g_xfer_head] = false;
+            mccdaq_xfer_submit(g_xfer_head);
+            g_xfer_head = (g_xfer_head + 1) % MAX_XFER;
         }
-        if (data == g_data + MAX_DATA) {
-            DEBUG("resetting data to begining of circular buffer\n");
-            data = g_data;
+
+        // on the status poll interval, verify the scan is running
+        if (microsec_timer() > status_poll_us) {
+            status = usbStatus_USB20X(g_udev);
+            if (!(status & AIN_SCAN_RUNNING) || (status & AIN_SCAN_OVERRUN)) {
+                DEBUG("restarting, status=0x%x\n", status);
+                mccdaq_scan_restart(status);
+            }
+#ifdef MCCDAQ_TEST
+            mccdaq_sim_report();
+#endif
+            status_poll_us = microsec_timer() + STATUS_POLL_INTERVAL_US;
         }
     }
 
+    // cancel the transfers, and free them
+    mccdaq_xfer_cancel_all();
+    for (x = 0; x < MAX_XFER; x++) {
+        libusb_free_transfer(g_xfer[x]);
+        g_xfer[x] = NULL;
+    }
+
     // stop the scan
     usbAInScanStop_USB20X(g_udev);
     usbAInScanClearFIFO_USB20X(g_udev);
@@ -374,6 +551,151 @@ static void * mccdaq_producer_thread(void * cx)
     return NULL;
 }
 
+static void mccdaq_xfer_callback(struct libusb_transfer * transfer)
+{
+    // called from libusb_handle_events_timeout, in the producer thread
+    g_xfer_done[(intptr_t)transfer->user_data] = true;
+}
+
+static void mccdaq_produced_add(uint64_t count)
+{
+    // publish the new data with release ordering, so that the consumer's 
+    // acquire load of g_produced also makes the data in g_data visible; 
+    // and wake the consumer
+    if ((g_produced + count) / MAX_DATA != g_produced / MAX_DATA) {
+        STATS_ADD(producer_wraps, 1);
+    }
+    STATS_ADD(produced, count);
+    __atomic_store_n(&g_produced, g_produced + count, __ATOMIC_RELEASE);
+    mccdaq_consumer_wake();
+}
+
+static int32_t mccdaq_xfer_submit(int32_t x)
+{
+    uint16_t * data;
+    int32_t    length_avail, length, ret;
+
+    // the transfer lands at the position following the previously submitted 
+    // transfer; the length is normally XFER_LENGTH, but will be less when the 
+    // position nears the end of the g_data buffer
+    data = g_data + (g_submitted % MAX_DATA);
+    length_avail = (g_data + MAX_DATA - data) * sizeof(uint16_t);
+    length = (length_avail >= XFER_LENGTH ? XFER_LENGTH : length_avail);
+
+    libusb_fill_bulk_transfer(g_xfer[x], 
+                              g_udev, 
+                              LIBUSB_ENDPOINT_IN|1, 
+                              (uint8_t*)data, 
+                              length, 
+                              mccdaq_xfer_callback, 
+                              (void*)(intptr_t)x, 
+                              TOUT_MS);
+    g_xfer_done[x] = false;
+
+    ret = libusb_submit_transfer(g_xfer[x]);
+    if (ret != LIBUSB_SUCCESS) {
+        ERROR("libusb_submit_transfer xfer=%d ret=%d\n", x, ret);
+        g_xfer[x]->status = LIBUSB_TRANSFER_ERROR;
+        g_xfer[x]->actual_length = 0;
+        g_xfer_done[x] = true;
+        return -1;
+    }
+
+    g_submitted += length / 2;
+    return 0;
+}
+
+static void mccdaq_xfer_cancel_all(void)
+{
+    int32_t x, i;
+    struct timeval tv;
+
+    // cancel the transfers that have not completed
+    for (x = 0; x < MAX_XFER; x++) {
+        if (!g_xfer_done[x]) {
+            libusb_cancel_transfer(g_xfer[x]);
+        }
+    }
+
+    // wait for the cancelled transfers to complete
+    for (i = 0; i < 50; i++) {
+        for (x = 0; x < MAX_XFER; x++) {
+            if (!g_xfer_done[x]) {
+                break;
+            }
+        }
+        if (x == MAX_XFER) {
+            break;
+        }
+        tv.tv_sec  = 0;
+        tv.tv_usec = 100000;
+        libusb_handle_events_timeout(NULL, &tv);
+    }
+    if (i == 50) {
+        ERROR("transfers did not complete after cancel\n");
+    }
+
+}
+
+static void mccdaq_scan_restart(int32_t status)
+{
+    int32_t x, i, pad;
+    int64_t expected, gap;
+
+    // cancel the transfers that are still in flight; 
+    // the data they contain is discarded
+    mccdaq_xfer_cancel_all();
+
+    // if length is a multiple of usb_max_packet_size the device will send a zero byte packet.
+    // refer to usbAInScanRead_USB20X routine in mccdaq/mcc-libusb/usb-20X.c
+    if (((XFER_LENGTH % g_usb_max_packet_size) == 0) && !(status & AIN_SCAN_RUNNING)) {
+        uint8_t value[64];
+        int32_t xfered;
+        libusb_bulk_transfer(g_udev, 
+                             LIBUSB_ENDPOINT_IN|1, 
+                             value, 
+                             2, 
+                             &xfered, 
+                             100);
+    }
+
+    // restart the analog input scan, and
+    // keep track of number of resets
+    libusb_clear_halt(g_udev, LIBUSB_ENDPOINT_IN|1);
+    usbAInScanStart_USB20X(g_udev, 0, SCAN_FREQUENCY, g_chan_mask, OPTIONS, 0, 0);
+    __sync_fetch_and_add(&g_restart_count, 1);
+    STATS_ADD(restarts, 1);
+
+    // estimate the number of samples lost because of the restart; this is the number
+    // the device should have produced since the prior scan start, less the number received
+    expected = (microsec_timer() - g_scan_start_us) * FREQUENCY / 1000000;
+    gap = expected - (int64_t)(g_produced - g_scan_start_produced);
+    if (gap > 0) {
+        STATS_ADD(restart_gap_samples, gap);
+    }
+
+    // the new scan begins with the first channel; if the samples received did not 
+    // end on a complete scan then pad with each channel's prior sample, so that the 
+    // stream position of a sample continues to identify its channel
+    pad = (g_max_chan - g_produced % g_max_chan) % g_max_chan;
+    for (i = 0; i < pad; i++) {
+        uint64_t pos = g_produced + i;
+        g_data[pos % MAX_DATA] = (pos >= g_max_chan ? g_data[(pos - g_max_chan) % MAX_DATA] : 2048);
+    }
+    if (pad > 0) {
+        mccdaq_produced_add(pad);
+    }
+    g_scan_start_us = microsec_timer();
+    g_scan_start_produced = g_produced;
+
+    // resubmit all transfers, starting at the end of the data produced
+    g_submitted = g_produced;
+    g_xfer_head = 0;
+    for (x = 0; x < MAX_XFER; x++) {
+        mccdaq_xfer_submit(x);
+    }
+}
+
 // -----------------  MCCDAQ CONSUMER THREAD-----------------------------
 
 static void * mccdaq_consumer_thread(void * cx) 
@@ -382,9 +704,26 @@ static void * mccdaq_consumer_thread(void * cx)
     int64_t    produced;
     int64_t    count, max_count;
     uint16_t * data;
+    uint64_t   stats_us, wakeups, batches, batch_samples, max_batch_samples;
+    uint64_t   dropped;
+    int32_t    i, ret;
 
     g_consumer_thread_running = true;
 
+    // when more than one channel, create the channel threads
+    if (g_max_chan > 1) {
+        g_batch_seq = 0;
+        g_batch_exit = false;
+        for (i = 0; i < g_max_chan; i++) {
+            if (pthread_create(&g_chan[i].thread, NULL, mccdaq_chan_thread, &g_chan[i]) != 0) {
+                FATAL("pthread_create mccdaq_chan_thread, %s\n", strerror(errno));
+            }
+        }
+    }
+
+    stats_us = microsec_timer();
+    wakeups = batches = batch_samples = max_batch_samples = 0;
+
     while (true) {
         // if state is STOPPING then
         //   exit thread
@@ -393,39 +732,89 @@ static void * mccdaq_consumer_thread(void * cx)
             break;
         }
 
-        // if no data then delay 
-        produced = g_produced;
+        // periodically print the consumer wakeup and batch statistics
+        if (microsec_timer() - stats_us >= CONSUMER_STATS_SECS * 1000000) {
+            INFO("wakeups=%"PRId64"/sec  batches=%"PRId64"/sec  avg_batch=%"PRId64"  max_batch=%"PRId64" samples\n",
+                 wakeups / CONSUMER_STATS_SECS, 
+                 batches / CONSUMER_STATS_SECS,
+                 batches ? batch_samples / batches : 0,
+                 max_batch_samples);
+            stats_us = microsec_timer();
+            wakeups = batches = batch_samples = max_batch_samples = 0;
+        }
+
+        // if no data then wait for the producer 
+        produced = __atomic_load_n(&g_produced, __ATOMIC_ACQUIRE);
         if (produced == consumed) {
+#ifdef CONSUMER_POLL_WAIT
             usleep(1000);
+#else
+            struct pollfd pfd = { .fd = g_event_fd, .events = POLLIN };
+            uint64_t      val;
+            if (poll(&pfd, 1, CONSUMER_WAIT_TOUT_MS) > 0) {
+                if (read(g_event_fd, &val, sizeof(val)) != sizeof(val)) {
+                    WARN("read eventfd, %s\n", strerror(errno));
+                }
+            }
+#endif
+            wakeups++;
+            STATS_ADD(consumer_wakeups, 1);
             continue;
         }
 
-        // if too far behind then discard data
-        if (produced - consumed > 500000) {
-            INFO("falling behind, discarding %"PRId64" samples\n", produced-consumed);
+        // if too far behind then discard data, and account for the discarded samples
+        if (produced - consumed > MAX_BATCH) {
+            dropped = produced - consumed;
+            WARN("falling behind, discarding %"PRId64" samples\n", dropped);
+            STATS_ADD(dropped, dropped);
             consumed = produced;
             continue;
         }
 
-        // call callback to process the data;
-        // if callback requests stop then enter stopping state and exit thread
+        // call callback to process the data, when there is a single channel the
+        // callback is passed the data in g_data, otherwise the channel threads 
+        // demultiplex the data and call the callback; then call the batch callback;
+        // if a callback requests stop then enter stopping state and exit thread
         count = produced - consumed;
-        data = g_data + (consumed % MAX_DATA);
-        max_count = g_data + MAX_DATA - data;
-        if (count <= max_count) {
-            if (g_cb(data, count)) {
-                STATE_CHANGE(STOPPING);
-                break;
+        if (g_max_chan == 1) {
+            data = g_data + (consumed % MAX_DATA);
+            max_count = g_data + MAX_DATA - data;
+            if (count <= max_count) {
+                ret = g_cb(g_chan[0].chan, data, count);
+            } else {
+                ret = g_cb(g_chan[0].chan, data, max_count) || 
+                      g_cb(g_chan[0].chan, g_data, count-max_count);
             }
         } else {
-            if (g_cb(data, max_count) || g_cb(g_data, count-max_count)) {
-                STATE_CHANGE(STOPPING);
-                break;
-            }
+            ret = mccdaq_chan_batch(consumed, count);
+        }
+        if (ret || (g_batch_cb && g_batch_cb())) {
+            STATE_CHANGE(STOPPING);
+            break;
         }
 
         // increase the amount consumed
         consumed += count;
+        STATS_ADD(consumed, count);
+        STATS_ADD(consumer_batches, 1);
+
+        // update batch statistics
+        batches++;
+        batch_samples += count;
+        if (count > max_batch_samples) {
+            max_batch_samples = count;
+        }
+    }
+
+    // terminate the channel threads
+    if (g_max_chan > 1) {
+        pthread_mutex_lock(&g_batch_mutex);
+        g_batch_exit = true;
+        pthread_cond_broadcast(&g_batch_cond);
+        pthread_mutex_unlock(&g_batch_mutex);
+        for (i = 0; i < g_max_chan; i++) {
+            pthread_join(g_chan[i].thread, NULL);
+        }
     }
 
     g_consumer_thread_running = false;
@@ -433,17 +822,194 @@ static void * mccdaq_consumer_thread(void * cx)
     return NULL;
 }
 
+static void mccdaq_consumer_wake(void)
+{
+    static const uint64_t one = 1;
+
+    if (write(g_event_fd, &one, sizeof(one)) != sizeof(one)) {
+        WARN("write eventfd, %s\n", strerror(errno));
+    }
+}
+
+// -----------------  MCCDAQ CHANNEL THREADS  ---------------------------
+
+static void * mccdaq_chan_thread(void * cx) 
+{
+    chan_t * c   = cx;
+    uint64_t seq = 0;
+    int32_t  n, ret;
+
+    while (true) {
+        // wait for the next batch; if exit requested then exit thread
+        pthread_mutex_lock(&g_batch_mutex);
+        while (g_batch_seq == seq && !g_batch_exit) {
+            pthread_cond_wait(&g_batch_cond, &g_batch_mutex);
+        }
+        if (g_batch_exit) {
+            pthread_mutex_unlock(&g_batch_mutex);
+            break;
+        }
+        seq = g_batch_seq;
+        pthread_mutex_unlock(&g_batch_mutex);
+
+        // demultiplex this channel's samples from the batch, and process them
+        n = mccdaq_demux(c, g_batch_pos, g_batch_count);
+        ret = (n > 0 ? g_cb(c->chan, c->buff, n) : 0);
+
+        // this channel has completed the batch
+        pthread_mutex_lock(&g_batch_mutex);
+        if (ret) {
+            g_batch_ret = ret;
+        }
+        if (--g_batch_pending == 0) {
+            pthread_cond_signal(&g_batch_done_cond);
+        }
+        pthread_mutex_unlock(&g_batch_mutex);
+    }
+
+    return NULL;
+}
+
+static int32_t mccdaq_chan_batch(uint64_t pos, int64_t count)
+{
+    int32_t ret;
+
+    // post the batch to the channel threads, and wait for them to complete it
+    pthread_mutex_lock(&g_batch_mutex);
+    g_batch_pos = pos;
+    g_batch_count = count;
+    g_batch_pending = g_max_chan;
+    g_batch_ret = 0;
+    g_batch_seq++;
+    pthread_cond_broadcast(&g_batch_cond);
+    while (g_batch_pending > 0) {
+        pthread_cond_wait(&g_batch_done_cond, &g_batch_mutex);
+    }
+    ret = g_batch_ret;
+    pthread_mutex_unlock(&g_batch_mutex);
+
+    return ret;
+}
+
+static int32_t mccdaq_demux(chan_t * c, uint64_t pos, int64_t count)
+{
+    uint64_t   p, end, seg_end;
+    uint16_t * src;
+    int32_t    n = 0;
+
+    // the scan restarts with the first channel on a multiple of g_max_chan,
+    // so the channel of the sample at stream position p is p % g_max_chan;
+    // copy every g_max_chan'th sample starting at this channel's first, 
+    // handling the wrap at the end of g_data
+    p = pos + (c->idx - (int32_t)(pos % g_max_chan) + g_max_chan) % g_max_chan;
+    end = pos + count;
+    while (p < end) {
+        src = g_data + (p % MAX_DATA);
+        seg_end = p - (p % MAX_DATA) + MAX_DATA;
+        if (seg_end > end) {
+            seg_end = end;
+        }
+        for (; p < seg_end; p += g_max_chan) {
+            c->buff[n++] = *src;
+            src += g_max_chan;
+        }
+    }
+
+    return n;
+}
+
 // -----------------  MCCDAQ TEST ---------------------------------------
 
 // unit test - simple simulation of the MCCDAQ ADC device
+//
+// The simulated device generates FREQUENCY samples per second from the time 
+// the scan is started. Samples are moved from the device fifo into the submitted
+// transfers; if the host does not keep transfers queued, and the backlog
+// exceeds SIM_FIFO_SAMPLES, then the scan stops with AIN_SCAN_OVERRUN, just
+// like the real device.
+//
+// To measure the producer's tolerance to host scheduling latency, the simulated
+// libusb_handle_events_timeout stalls for SIM_HICCUP_US every SIM_HICCUP_INTERVAL_US.
+// The sustained throughput and restart rate are printed every SIM_REPORT_SECS.
+// For example, compare 'make MCCDAQ_TEST=1 MAX_XFER=1' with the default.
 
 #ifdef MCCDAQ_TEST
 
-#define MAX_SIM_DATA 10000
+#define MAX_SIM_DATA             10000
+#define MAX_SIM_QUEUE            64
+#define SIM_FIFO_SAMPLES         4096
+#ifndef SIM_HICCUP_US
+#define SIM_HICCUP_US            50000
+#endif
+#ifndef SIM_HICCUP_INTERVAL_US
+#define SIM_HICCUP_INTERVAL_US   5000000
+#endif
+#define SIM_REPORT_SECS          10
 
 static uint16_t g_sim_data[MAX_SIM_DATA];
 
-int libusb_init (void ** cx)
+static pthread_mutex_t          g_sim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct libusb_transfer * g_sim_queue[MAX_SIM_QUEUE];
+static int32_t                  g_sim_queue_len;
+static struct libusb_transfer * g_sim_cancelled[MAX_SIM_QUEUE];
+static int32_t                  g_sim_cancelled_len;
+static bool                     g_sim_running;
+static uint16_t                 g_sim_status;
+static uint64_t                 g_sim_scan_start_us;
+static uint64_t                 g_sim_transferred;
+static uint64_t                 g_sim_hiccup_us;
+static int32_t                  g_sim_scan_starts;
+
+static void mccdaq_sim_fill(uint16_t * data, int32_t max_data)
+{
+    static uint64_t count;
+
+    // init the simulated return data
+    memcpy(data, g_sim_data, max_data*sizeof(uint16_t));
+    if (((count % 25) == 0) && (max_data > 20)) {
+        if ((count/25) & 1) {
+            data[0] = 3000;
+            data[1] = 2600;
+            data[2] = 2150;
+            data[3] = 2300;
+        } else {
+            data[max_data/2+0] = 3000;
+            data[max_data/2+1] = 2600;
+            data[max_data/2+2] = 2150;
+            data[max_data/2+3] = 2300;
+        }
+    }
+    count++;
+}
+
+static void mccdaq_sim_report(void)
+{
+    static uint64_t report_us, report_produced;
+    static int32_t  report_scan_starts;
+    uint64_t        now = microsec_timer();
+
+    if (report_us == 0) {
+        report_us = now;
+        report_produced = g_produced;
+        report_scan_starts = g_sim_scan_starts;
+        return;
+    }
+    if (now - report_us < SIM_REPORT_SECS * 1000000) {
+        return;
+    }
+
+    INFO("SIM: max_xfer=%d  throughput=%.0f samples/sec  restarts=%d in %.1f secs\n",
+         MAX_XFER,
+         (double)(g_produced - report_produced) * 1000000 / (now - report_us),
+         g_sim_scan_starts - report_scan_starts,
+         (now - report_us) / 1000000.);
+
+    report_us = now;
+    report_produced = g_produced;
+    report_scan_starts = g_sim_scan_starts;
+}
+
+int libusb_init (libusb_context ** cx)
 {
     uint16_t value = 2400;
     int32_t i;
@@ -461,12 +1027,8 @@ int libusb_init (void ** cx)
 int libusb_bulk_transfer (struct libusb_device_handle *dev_handle, unsigned char endpoint,
        unsigned char *data_arg, int length, int *transferred, unsigned int timeout)
 {
-    uint64_t us;
-    uint16_t *data = (uint16_t*)data_arg;
     uint32_t max_data = length / 2;
 
-    static uint64_t count;
-
     // validate length and max_data
     if (length <= 0 || (length & 1) || max_data > MAX_SIM_DATA) {
         FATAL("invalid length %d, max_data %d\n", length, max_data);
@@ -478,33 +1040,148 @@ int libusb_bulk_transfer (struct libusb_device_handle *dev_handle, unsigned char
         return LIBUSB_SUCCESS;
     }
 
-    // init the simulated return data
-    memcpy(data, g_sim_data, length);
-    if (((count % 25) == 0) && (max_data > 20)) {
-        if ((count/25) & 1) {
-            data[0] = 3000;
-            data[1] = 2600;
-            data[2] = 2150;
-            data[3] = 2300;
-        } else {
-            data[max_data/2+0] = 3000;
-            data[max_data/2+1] = 2600;
-            data[max_data/2+2] = 2150;
-            data[max_data/2+3] = 2300;
+    // init the simulated return data, and delay
+    mccdaq_sim_fill((uint16_t*)data_arg, max_data);
+    *transferred = length;
+    usleep(max_data * 1000000L / FREQUENCY);
+    return 0;
+}
+
+struct libusb_transfer * libusb_alloc_transfer (int iso_packets)
+{
+    return calloc(1, sizeof(struct libusb_transfer));
+}
+
+void libusb_free_transfer (struct libusb_transfer *transfer)
+{
+    free(transfer);
+}
+
+int libusb_submit_transfer (struct libusb_transfer *transfer)
+{
+    // validate length
+    if (transfer->length <= 0 || (transfer->length & 1) || transfer->length/2 > MAX_SIM_DATA) {
+        FATAL("invalid length %d\n", transfer->length);
+    }
+
+    // add transfer to the end of the queue
+    pthread_mutex_lock(&g_sim_mutex);
+    if (g_sim_queue_len == MAX_SIM_QUEUE) {
+        pthread_mutex_unlock(&g_sim_mutex);
+        return LIBUSB_ERROR_BUSY;
+    }
+    transfer->actual_length = 0;
+    g_sim_queue[g_sim_queue_len++] = transfer;
+    pthread_mutex_unlock(&g_sim_mutex);
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_cancel_transfer (struct libusb_transfer *transfer)
+{
+    int32_t i;
+
+    // move the transfer from the queue to the cancelled list,
+    // it is completed by the next call to libusb_handle_events_timeout
+    pthread_mutex_lock(&g_sim_mutex);
+    for (i = 0; i < g_sim_queue_len; i++) {
+        if (g_sim_queue[i] == transfer) {
+            break;
         }
     }
-    count++;
+    if (i == g_sim_queue_len) {
+        pthread_mutex_unlock(&g_sim_mutex);
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+    memmove(&g_sim_queue[i], &g_sim_queue[i+1], (g_sim_queue_len-i-1)*sizeof(g_sim_queue[0]));
+    g_sim_queue_len--;
+    g_sim_cancelled[g_sim_cancelled_len++] = transfer;
+    pthread_mutex_unlock(&g_sim_mutex);
+    return LIBUSB_SUCCESS;
+}
 
-    // set transferred length 
-    *transferred = length;
+int libusb_handle_events_timeout (libusb_context *ctx, struct timeval *tv)
+{
+    uint64_t start_us, timeout_us, now, generated, capacity, wait_us;
+    struct libusb_transfer * done[MAX_SIM_QUEUE];
+    int32_t  max_done, i, n;
+
+    start_us = microsec_timer();
+    timeout_us = tv->tv_sec * 1000000 + tv->tv_usec;
+
+    // simulate host scheduling latency
+    if (SIM_HICCUP_US > 0) {
+        if (g_sim_hiccup_us == 0) {
+            g_sim_hiccup_us = start_us + SIM_HICCUP_INTERVAL_US;
+        } else if (start_us > g_sim_hiccup_us) {
+            usleep(SIM_HICCUP_US);
+            g_sim_hiccup_us = start_us + SIM_HICCUP_INTERVAL_US;
+        }
+    }
 
-    // delay 
-    us = max_data * 1000000L / FREQUENCY;
-    DEBUG("SLEEP %ld, MAX_DATA = %d\n", us, max_data);
-    usleep(us);
+    while (true) {
+        max_done = 0;
+        wait_us = timeout_us;
 
-    // return success
-    return 0;
+        pthread_mutex_lock(&g_sim_mutex);
+
+        // complete the cancelled transfers
+        for (i = 0; i < g_sim_cancelled_len; i++) {
+            g_sim_cancelled[i]->status = LIBUSB_TRANSFER_CANCELLED;
+            done[max_done++] = g_sim_cancelled[i];
+        }
+        g_sim_cancelled_len = 0;
+
+        // if the backlog of samples generated by the device exceeds the capacity 
+        // of the device fifo plus the queued transfers then the scan is overrun
+        now = microsec_timer();
+        generated = g_sim_running ? (now - g_sim_scan_start_us) * FREQUENCY / 1000000 : 0;
+        for (capacity = 0, i = 0; i < g_sim_queue_len; i++) {
+            capacity += g_sim_queue[i]->length / 2;
+        }
+        if (g_sim_running && generated - g_sim_transferred > SIM_FIFO_SAMPLES + capacity) {
+            g_sim_running = false;
+            g_sim_status = AIN_SCAN_OVERRUN;
+        }
+
+        // complete the queued transfers for which data is available;
+        // if the scan is not running the transfers fail with stall
+        while (g_sim_queue_len > 0) {
+            struct libusb_transfer * t = g_sim_queue[0];
+            n = t->length / 2;
+            if (!g_sim_running) {
+                t->status = LIBUSB_TRANSFER_STALL;
+                t->actual_length = 0;
+            } else if (generated - g_sim_transferred >= n) {
+                mccdaq_sim_fill((uint16_t*)t->buffer, n);
+                g_sim_transferred += n;
+                t->status = LIBUSB_TRANSFER_COMPLETED;
+                t->actual_length = t->length;
+            } else {
+                wait_us = (n - (generated - g_sim_transferred)) * 1000000 / FREQUENCY + 1;
+                break;
+            }
+            done[max_done++] = t;
+            memmove(&g_sim_queue[0], &g_sim_queue[1], (g_sim_queue_len-1)*sizeof(g_sim_queue[0]));
+            g_sim_queue_len--;
+        }
+
+        pthread_mutex_unlock(&g_sim_mutex);
+
+        // call the callbacks for the completed transfers
+        for (i = 0; i < max_done; i++) {
+            done[i]->callback(done[i]);
+        }
+
+        // return when transfers have been completed, or on timeout 
+        now = microsec_timer();
+        if (max_done > 0 || now - start_us >= timeout_us) {
+            return LIBUSB_SUCCESS;
+        }
+        if (wait_us > timeout_us - (now - start_us)) {
+            wait_us = timeout_us - (now - start_us);
+        }
+        usleep(wait_us);
+    }
 }
 
 int libusb_clear_halt (libusb_device_handle *dev, unsigned char endpoint)
@@ -541,15 +1218,26 @@ void cleanup_USB20X(libusb_device_handle *udev)
 void usbAInScanStart_USB20X(libusb_device_handle *udev, uint32_t count, double frequency,
         uint8_t channels, uint8_t options, uint8_t trigger_source, uint8_t trigger_mode)
 {
+    pthread_mutex_lock(&g_sim_mutex);
+    g_sim_running = true;
+    g_sim_status = AIN_SCAN_RUNNING;
+    g_sim_scan_start_us = microsec_timer();
+    g_sim_transferred = 0;
+    g_sim_scan_starts++;
+    pthread_mutex_unlock(&g_sim_mutex);
 }
 
 uint16_t usbStatus_USB20X(libusb_device_handle *udev)
 {
-    return AIN_SCAN_RUNNING;
+    return g_sim_status;
 }
 
 void usbAInScanStop_USB20X(libusb_device_handle *udev)
 {
+    pthread_mutex_lock(&g_sim_mutex);
+    g_sim_running = false;
+    g_sim_status = 0;
+    pthread_mutex_unlock(&g_sim_mutex);
 }
 
 void usbAInScanClearFIFO_USB20X(libusb_device_handle *udev)
@@ -23,11 +23,37 @@ SOFTWARE.
 #ifndef __UTIL_MCCDAQ_H__
 #define __UTIL_MCCDAQ_H__
 
-typedef int32_t (*mccdaq_callback_t)(uint16_t * data, int32_t max_data);
+#define MCCDAQ_MAX_CHAN  8   // analog input channels of the USB-204
+
+// The device scans the channels in chan_mask in ascending order, and the samples
+// are interleaved; the consumer demultiplexes them. The total sample rate is 
+// 500000 per second, shared evenly by the scanned channels.
+//
+// mccdaq_callback_t is called with the samples of one channel. When more than one
+// channel is scanned the channels are processed concurrently, each on its own
+// thread, so a callback must only access the state of its channel. After all the 
+// channels have processed a batch of samples, the consumer thread calls the 
+// mccdaq_batch_callback_t. Either callback returning non zero stops the scan.
+typedef int32_t (*mccdaq_callback_t)(int32_t chan, uint16_t * data, int32_t max_data);
+typedef int32_t (*mccdaq_batch_callback_t)(void);
+
+// cumulative counts, since mccdaq_init, in samples of all channels
+typedef struct {
+    uint64_t produced;             // samples transferred from the device into the ring
+    uint64_t consumed;             // samples passed to the callback
+    uint64_t dropped;              // samples discarded because the consumer fell too far behind
+    uint64_t producer_wraps;       // times the producer wrapped around the end of the ring
+    uint64_t restarts;             // scan restarts
+    uint64_t restart_gap_samples;  // samples the device did not deliver because of restarts (estimated)
+    uint64_t consumer_wakeups;     // times the consumer waited for data
+    uint64_t consumer_batches;     // calls to the callback 
+} mccdaq_stats_t;
 
 int32_t mccdaq_init(void);
-int32_t  mccdaq_start(mccdaq_callback_t cb);
+int32_t  mccdaq_start(uint32_t chan_mask, mccdaq_callback_t cb, mccdaq_batch_callback_t batch_cb);
+int32_t mccdaq_get_sample_rate(void);
 int32_t  mccdaq_stop(void);
 int32_t mccdaq_get_restart_count(void);
+void mccdaq_get_stats(mccdaq_stats_t * stats);
 
 #endif
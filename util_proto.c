@@ -0,0 +1,848 @@
+/*
+Copyright (c) 2016 Steven Haid
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "common.h"
+#include "util_proto.h"
+#include "util_misc.h"
+
+//
+// defines
+//
+
+#define MAX_SECTION  (16 + MAX_AUX_CHAN)   // sections of a frame that are decoded
+#define PACK_BLOCK   64                    // adc data values per bit-pack block
+
+#define ZIGZAG(x)    (((uint32_t)(x) << 1) ^ (uint32_t)((x) >> 31))
+#define UNZIGZAG(x)  ((int32_t)((x) >> 1) ^ -(int32_t)((x) & 1))
+
+//
+// typedefs
+//
+
+typedef struct {
+    uint8_t * p;
+    uint8_t * end;
+    bool      err;          // set when a value extends beyond end
+} cursor_t;
+
+typedef struct {
+    uint16_t  id;
+    uint32_t  len;
+    uint8_t * data;
+} section_t;
+
+//
+// prototypes
+//
+
+static uint8_t * put_varint(uint8_t * p, uint32_t v);
+static uint8_t * put_svarint(uint8_t * p, int32_t v);
+static uint8_t * put_u32(uint8_t * p, uint32_t v);
+static uint8_t * put_u64(uint8_t * p, uint64_t v);
+static uint8_t * put_float(uint8_t * p, float v);
+static uint8_t * put_section_hdr(uint8_t * p, uint16_t id, uint32_t len);
+static uint8_t * put_spectrum(uint8_t * p, uint16_t (*spectrum)[2], int32_t max_spectrum);
+static uint8_t * put_packed(uint8_t * p, int16_t * d, int32_t n);
+static uint32_t get_varint(cursor_t * c);
+static int32_t get_svarint(cursor_t * c);
+static uint32_t get_u32(cursor_t * c);
+static uint64_t get_u64(cursor_t * c);
+static float get_float(cursor_t * c);
+static int32_t get_spectrum(cursor_t * c, uint16_t (*spectrum)[2]);
+static void get_packed(cursor_t * c, int16_t * d, int32_t n);
+static section_t * find_section(section_t * section, int32_t max_section, uint16_t id, int32_t * idx);
+
+// -----------------  ENCODE  --------------------------------------------------------
+
+// Encodes data as a version 2 frame, returns the frame length, which is at most
+// PROTO_MAX_FRAME_LEN.
+
+int32_t proto_encode(data_t * data, uint8_t * frame)
+{
+    struct data_part1_s * dp1 = &data->part1;
+    struct data_part2_s * dp2 = &data->part2;
+    proto_frame_hdr_t   * hdr = (proto_frame_hdr_t *)frame;
+    uint8_t             * p, * sect;
+    int32_t               n, i, j, prior;
+    aux_chan_t          * ac;
+
+    // the sections follow the frame header; each section's header is written 
+    // when its length is known
+    p = frame + sizeof(proto_frame_hdr_t);
+    n = dp1->max_neutron_pulse;
+
+    #define SECTION_BEGIN() \
+        do { sect = p; p += sizeof(proto_section_hdr_t); } while (0)
+    #define SECTION_END(id) \
+        do { put_section_hdr(sect, id, p - sect - sizeof(proto_section_hdr_t)); } while (0)
+
+    // summary section
+    SECTION_BEGIN();
+    p = put_u64(p, dp1->time);
+    p = put_float(p, dp1->voltage_kv);
+    p = put_float(p, dp1->current_ma);
+    p = put_float(p, dp1->d2_pressure_mtorr);
+    p = put_float(p, dp1->n2_pressure_mtorr);
+    p = put_varint(p, n);
+    p = put_varint(p, dp1->neutron_live_permyriad);
+    p = put_varint(p, dp1->neutron_mccdaq_restarts);
+    p = put_varint(p, dp1->neutron_pulse_overflow);
+    p = put_varint(p, dp2->neutron_sample_rate);
+    p = put_float(p, dp2->neutron_baseline_mv);
+    p = put_float(p, dp2->neutron_noise_mv);
+    SECTION_END(PROTO_SECTION_SUMMARY);
+
+    // voltage, current, and pressure adc data sections, delta encoded and bit-packed
+    struct {
+        bool      valid;
+        int16_t * adc_data;
+        uint16_t  id;
+    } adc[3] = { { dp1->data_part2_voltage_adc_data_valid,  dp2->voltage_adc_data,  PROTO_SECTION_VOLTAGE_ADC  },
+                 { dp1->data_part2_current_adc_data_valid,  dp2->current_adc_data,  PROTO_SECTION_CURRENT_ADC  },
+                 { dp1->data_part2_pressure_adc_data_valid, dp2->pressure_adc_data, PROTO_SECTION_PRESSURE_ADC } };
+    for (i = 0; i < 3; i++) {
+        if (!adc[i].valid) {
+            continue;
+        }
+        SECTION_BEGIN();
+        p = put_varint(p, MAX_ADC_DATA);
+        p = put_packed(p, adc[i].adc_data, MAX_ADC_DATA);
+        SECTION_END(adc[i].id);
+    }
+
+    // neutron pulse heights section, just the pulses that occurred;  
+    // part1 neutron_pulse_mv is the first MAX_NEUTRON_PULSE of these
+    if (n > 0) {
+        int16_t * pulse_mv = NEUTRON_SECTION_PULSE_MV(dp2);
+        SECTION_BEGIN();
+        p = put_varint(p, n);
+        for (i = 0; i < n; i++) {
+            p = put_svarint(p, pulse_mv[i]);
+        }
+        SECTION_END(PROTO_SECTION_PULSE_MV);
+    }
+
+    // neutron snippet section, the snippet_idx and the adc_pulse_data are delta encoded
+    if (dp2->max_neutron_snippet > 0) {
+        uint16_t * snippet_idx = NEUTRON_SECTION_SNIPPET_IDX(dp2,n);
+        int16_t (*adc_pulse_data)[MAX_NEUTRON_ADC_PULSE_DATA] = NEUTRON_SECTION_ADC_PULSE_DATA(dp2,n);
+        SECTION_BEGIN();
+        p = put_varint(p, dp2->max_neutron_snippet);
+        for (i = 0, prior = 0; i < dp2->max_neutron_snippet; i++) {
+            p = put_svarint(p, snippet_idx[i] - prior);
+            prior = snippet_idx[i];
+        }
+        for (i = 0; i < dp2->max_neutron_snippet; i++) {
+            for (j = 0, prior = 0; j < MAX_NEUTRON_ADC_PULSE_DATA; j++) {
+                p = put_svarint(p, adc_pulse_data[i][j] - prior);
+                prior = adc_pulse_data[i][j];
+            }
+        }
+        SECTION_END(PROTO_SECTION_SNIPPET);
+    }
+
+    // neutron spectrum section
+    if (dp2->max_neutron_spectrum > 0) {
+        SECTION_BEGIN();
+        p = put_spectrum(p, NEUTRON_SECTION_SPECTRUM(dp2,n), dp2->max_neutron_spectrum);
+        SECTION_END(PROTO_SECTION_SPECTRUM);
+    }
+
+    // a section for each aux chan
+    ac = AUX_CHAN_FIRST(dp2);
+    for (i = 0; i < dp2->max_aux_chan; i++) {
+        SECTION_BEGIN();
+        p = put_varint(p, ac->chan);
+        p = put_varint(p, ac->pulses);
+        p = put_varint(p, ac->samples);
+        p = put_spectrum(p, ac->spectrum, ac->max_spectrum);
+        SECTION_END(PROTO_SECTION_AUX_CHAN);
+        ac = AUX_CHAN_NEXT(ac);
+    }
+
+    // pulse time section
+    if (dp2->pulse_time_len > 0) {
+        SECTION_BEGIN();
+        memcpy(p, PULSE_TIME_SECTION(dp2), dp2->pulse_time_len);
+        p += dp2->pulse_time_len;
+        SECTION_END(PROTO_SECTION_PULSE_TIME);
+    }
+
+    // jpeg section
+    if (dp1->data_part2_jpeg_buff_len > 0) {
+        SECTION_BEGIN();
+        memcpy(p, DATA_PART2_JPEG_BUFF(dp2), dp1->data_part2_jpeg_buff_len);
+        p += dp1->data_part2_jpeg_buff_len;
+        SECTION_END(PROTO_SECTION_JPEG);
+    }
+
+    #undef SECTION_BEGIN
+    #undef SECTION_END
+
+    // frame header
+    hdr->magic   = MAGIC_PROTO_FRAME;
+    hdr->version = PROTO_VERSION;
+    hdr->len     = p - frame - sizeof(proto_frame_hdr_t);
+    return p - frame;
+}
+
+// Encodes data as a version 1 record, which is the data_t in the layout of older
+// versions of get_data: data part1, followed by a MAGIC_DATA_PART2_V1 data part2.
+// The V1 data part2 has the pulse data of only the first MAX_NEUTRON_PULSE pulses; 
+// the pulse data of those that have no snippet is zero. Returns the record length, 
+// which is at most PROTO_MAX_V1_LEN.
+
+int32_t proto_encode_v1(data_t * data, uint8_t * buff)
+{
+    struct data_part1_s * dp1 = (struct data_part1_s *)buff;
+    struct data_part2_s * dp2 = (struct data_part2_s *)(dp1 + 1);
+    int16_t (*adc_pulse_data)[MAX_NEUTRON_ADC_PULSE_DATA];
+    uint16_t * snippet_idx;
+    int32_t    n, i;
+
+    n = (data->part1.max_neutron_pulse < MAX_NEUTRON_PULSE ? data->part1.max_neutron_pulse : MAX_NEUTRON_PULSE);
+
+    // data part1, with only the pulses whose heights it contains
+    *dp1 = data->part1;
+    dp1->max_neutron_pulse = n;
+    dp1->data_part2_offset = 0;
+    dp1->data_part2_length = DATA_PART2_V1_HDR_LEN + DATA_PART2_V1_PULSE_DATA_LEN + 
+                             dp1->data_part2_jpeg_buff_len;
+
+    // data part2 header and adc data, which are unchanged
+    memcpy(dp2, &data->part2, DATA_PART2_V1_HDR_LEN);
+    dp2->magic = MAGIC_DATA_PART2_V1;
+
+    // the pulse data of the pulses in data part1
+    adc_pulse_data = (void*)((uint8_t*)dp2 + DATA_PART2_V1_HDR_LEN);
+    memset(adc_pulse_data, 0, DATA_PART2_V1_PULSE_DATA_LEN);
+    snippet_idx = NEUTRON_SECTION_SNIPPET_IDX(&data->part2, data->part1.max_neutron_pulse);
+    for (i = 0; i < data->part2.max_neutron_snippet; i++) {
+        if (snippet_idx[i] < n) {
+            memcpy(adc_pulse_data[snippet_idx[i]], 
+                   NEUTRON_SECTION_ADC_PULSE_DATA(&data->part2,data->part1.max_neutron_pulse)[i],
+                   MAX_NEUTRON_ADC_PULSE_DATA * sizeof(int16_t));
+        }
+    }
+
+    // jpeg buff
+    memcpy((uint8_t*)adc_pulse_data + DATA_PART2_V1_PULSE_DATA_LEN, 
+           DATA_PART2_JPEG_BUFF(&data->part2), 
+           dp1->data_part2_jpeg_buff_len);
+
+    return sizeof(struct data_part1_s) + dp1->data_part2_length;
+}
+
+static uint8_t * put_varint(uint8_t * p, uint32_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static uint8_t * put_svarint(uint8_t * p, int32_t v)
+{
+    return put_varint(p, ZIGZAG(v));
+}
+
+static uint8_t * put_u32(uint8_t * p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+    return p + 4;
+}
+
+static uint8_t * put_u64(uint8_t * p, uint64_t v)
+{
+    p = put_u32(p, v);
+    return put_u32(p, v >> 32);
+}
+
+static uint8_t * put_float(uint8_t * p, float v)
+{
+    uint32_t u;
+
+    memcpy(&u, &v, sizeof(u));
+    return put_u32(p, u);
+}
+
+static uint8_t * put_section_hdr(uint8_t * p, uint16_t id, uint32_t len)
+{
+    proto_section_hdr_t hdr = { id, 0, len };
+
+    memcpy(p, &hdr, sizeof(hdr));
+    return p + sizeof(hdr);
+}
+
+static uint8_t * put_spectrum(uint8_t * p, uint16_t (*spectrum)[2], int32_t max_spectrum)
+{
+    int32_t i, prior_bin = 0;
+
+    // the bins are ascending, so each is encoded as the difference from the prior
+    p = put_varint(p, max_spectrum);
+    for (i = 0; i < max_spectrum; i++) {
+        p = put_svarint(p, spectrum[i][0] - prior_bin);
+        p = put_varint(p, spectrum[i][1]);
+        prior_bin = spectrum[i][0];
+    }
+    return p;
+}
+
+// Encodes the update as an update frame, returns the frame length, which is at
+// most PROTO_MAX_UPDATE_FRAME_LEN.
+
+int32_t proto_encode_update(proto_update_t * u, uint8_t * frame)
+{
+    proto_frame_hdr_t * hdr = (proto_frame_hdr_t *)frame;
+    uint8_t           * p, * sect;
+    int32_t             i;
+
+    p = frame + sizeof(proto_frame_hdr_t);
+
+    // summary section
+    sect = p;
+    p += sizeof(proto_section_hdr_t);
+    p = put_u64(p, u->time);
+    p = put_varint(p, u->elapsed_ms);
+    p = put_float(p, u->voltage_kv);
+    p = put_float(p, u->current_ma);
+    p = put_float(p, u->d2_pressure_mtorr);
+    p = put_float(p, u->n2_pressure_mtorr);
+    p = put_varint(p, u->neutron_pulses);
+    p = put_varint(p, u->neutron_samples);
+    put_section_hdr(sect, PROTO_SECTION_UPDATE_SUMMARY, p - sect - sizeof(proto_section_hdr_t));
+
+    // a section for each adc chan that has new values
+    for (i = 0; i < PROTO_MAX_UPDATE_ADC; i++) {
+        if (u->adc[i].max_adc_data == 0) {
+            continue;
+        }
+        sect = p;
+        p += sizeof(proto_section_hdr_t);
+        p = put_varint(p, i);
+        p = put_u64(p, u->adc[i].first_seq);
+        p = put_varint(p, u->adc[i].max_adc_data);
+        p = put_packed(p, u->adc[i].adc_data, u->adc[i].max_adc_data);
+        put_section_hdr(sect, PROTO_SECTION_UPDATE_ADC, p - sect - sizeof(proto_section_hdr_t));
+    }
+
+    // frame header
+    hdr->magic   = MAGIC_PROTO_UPDATE;
+    hdr->version = PROTO_VERSION;
+    hdr->len     = p - frame - sizeof(proto_frame_hdr_t);
+    return p - frame;
+}
+
+// The values are delta encoded, and the zigzag encoded deltas are bit-packed in 
+// blocks of PACK_BLOCK values, as in the capture file (see util_capture.c). Each
+// block starts with a byte containing the bit width of the largest zigzag delta
+// in the block. This packs the adc noise to a few bits per value, where a varint
+// needs at least a byte.
+
+static uint8_t * put_packed(uint8_t * p, int16_t * d, int32_t n)
+{
+    uint32_t zz[PACK_BLOCK], or;
+    uint64_t acc;
+    int32_t  i, j, cnt, bits, acc_bits, prev = 0;
+
+    for (i = 0; i < n; i += PACK_BLOCK) {
+        // zigzag encode the deltas of this block, and determine the bit width
+        cnt = (n - i < PACK_BLOCK ? n - i : PACK_BLOCK);
+        or = 0;
+        for (j = 0; j < cnt; j++) {
+            zz[j] = ZIGZAG((int32_t)d[i+j] - prev);
+            prev = d[i+j];
+            or |= zz[j];
+        }
+        bits = (or == 0 ? 0 : 32 - __builtin_clz(or));
+        *p++ = bits;
+
+        // pack
+        acc = 0;
+        acc_bits = 0;
+        for (j = 0; j < cnt; j++) {
+            acc |= (uint64_t)zz[j] << acc_bits;
+            acc_bits += bits;
+            while (acc_bits >= 8) {
+                *p++ = acc;
+                acc >>= 8;
+                acc_bits -= 8;
+            }
+        }
+        if (acc_bits > 0) {
+            *p++ = acc;
+        }
+    }
+    return p;
+}
+
+// -----------------  DECODE  --------------------------------------------------------
+
+// Decodes the frame payload into data, which must have room for MAX_DATA_PART2_LENGTH
+// of part2. The data_t is in the current format, as though it had been sent using 
+// version 1. Returns -1 if the frame is invalid.
+
+int32_t proto_decode(proto_frame_hdr_t * hdr, uint8_t * payload, data_t * data)
+{
+    struct data_part1_s * dp1 = &data->part1;
+    struct data_part2_s * dp2 = &data->part2;
+    section_t             section[MAX_SECTION];
+    section_t           * s;
+    cursor_t              c;
+    int32_t               max_section, n, m, i, j, idx, prior;
+    uint8_t             * end;
+    aux_chan_t          * ac;
+
+    // verify the frame header
+    if (hdr->magic != MAGIC_PROTO_FRAME || hdr->version < 2) {
+        ERROR("invalid frame, magic=0x%"PRIx64" version=%d\n", hdr->magic, hdr->version);
+        return -1;
+    }
+
+    // locate the sections, ignoring those that are not known
+    max_section = 0;
+    c.p   = payload;
+    c.end = payload + hdr->len;
+    while (c.p < c.end) {
+        proto_section_hdr_t sh;
+        if (c.end - c.p < sizeof(sh)) {
+            ERROR("invalid frame, truncated section header\n");
+            return -1;
+        }
+        memcpy(&sh, c.p, sizeof(sh));
+        c.p += sizeof(sh);
+        if (sh.len > c.end - c.p) {
+            ERROR("invalid frame, section %d len %d\n", sh.id, sh.len);
+            return -1;
+        }
+        if (sh.id >= PROTO_SECTION_SUMMARY && sh.id <= PROTO_SECTION_JPEG) {
+            if (max_section == MAX_SECTION) {
+                ERROR("invalid frame, too many sections\n");
+                return -1;
+            }
+            section[max_section].id   = sh.id;
+            section[max_section].len  = sh.len;
+            section[max_section].data = c.p;
+            max_section++;
+        }
+        c.p += sh.len;
+    }
+
+    #define CURSOR_INIT(s) \
+        do { c.p = (s)->data; c.end = (s)->data + (s)->len; c.err = false; } while (0)
+
+    // init part1 and part2 header
+    bzero(data, sizeof(data_t));
+    dp1->magic = MAGIC_DATA_PART1;
+    dp2->magic = MAGIC_DATA_PART2;
+
+    // summary section, this is required
+    idx = 0;
+    if ((s = find_section(section, max_section, PROTO_SECTION_SUMMARY, &idx)) == NULL) {
+        ERROR("invalid frame, no summary\n");
+        return -1;
+    }
+    CURSOR_INIT(s);
+    dp1->time                    = get_u64(&c);
+    dp1->voltage_kv              = get_float(&c);
+    dp1->current_ma              = get_float(&c);
+    dp1->d2_pressure_mtorr       = get_float(&c);
+    dp1->n2_pressure_mtorr       = get_float(&c);
+    dp1->max_neutron_pulse       = get_varint(&c);
+    dp1->neutron_live_permyriad  = get_varint(&c);
+    dp1->neutron_mccdaq_restarts = get_varint(&c);
+    dp1->neutron_pulse_overflow  = get_varint(&c);
+    dp2->neutron_sample_rate     = get_varint(&c);
+    dp2->neutron_baseline_mv     = get_float(&c);
+    dp2->neutron_noise_mv        = get_float(&c);
+    n = dp1->max_neutron_pulse;
+    if (c.err || n < 0 || n > MAX_NEUTRON_PULSE_PER_SEC) {
+        ERROR("invalid frame, summary\n");
+        return -1;
+    }
+
+    // voltage, current, and pressure adc data sections; the data is valid if present
+    struct {
+        bool    * valid;
+        int16_t * adc_data;
+        uint16_t  id;
+    } adc[3] = { { &dp1->data_part2_voltage_adc_data_valid,  dp2->voltage_adc_data,  PROTO_SECTION_VOLTAGE_ADC  },
+                 { &dp1->data_part2_current_adc_data_valid,  dp2->current_adc_data,  PROTO_SECTION_CURRENT_ADC  },
+                 { &dp1->data_part2_pressure_adc_data_valid, dp2->pressure_adc_data, PROTO_SECTION_PRESSURE_ADC } };
+    for (i = 0; i < 3; i++) {
+        idx = 0;
+        if ((s = find_section(section, max_section, adc[i].id, &idx)) == NULL) {
+            continue;
+        }
+        CURSOR_INIT(s);
+        if (get_varint(&c) != MAX_ADC_DATA) {
+            ERROR("invalid frame, adc data section %d count\n", adc[i].id);
+            return -1;
+        }
+        get_packed(&c, adc[i].adc_data, MAX_ADC_DATA);
+        if (c.err) {
+            ERROR("invalid frame, adc data section %d\n", adc[i].id);
+            return -1;
+        }
+        *adc[i].valid = true;
+    }
+
+    // neutron pulse heights section, which must contain max_neutron_pulse values
+    if (n > 0) {
+        int16_t * pulse_mv = NEUTRON_SECTION_PULSE_MV(dp2);
+        idx = 0;
+        if ((s = find_section(section, max_section, PROTO_SECTION_PULSE_MV, &idx)) == NULL) {
+            ERROR("invalid frame, no pulse_mv\n");
+            return -1;
+        }
+        CURSOR_INIT(s);
+        if (get_varint(&c) != n) {
+            ERROR("invalid frame, pulse_mv count\n");
+            return -1;
+        }
+        for (i = 0; i < n; i++) {
+            pulse_mv[i] = get_svarint(&c);
+        }
+        if (c.err) {
+            ERROR("invalid frame, pulse_mv\n");
+            return -1;
+        }
+        memcpy(dp1->neutron_pulse_mv, pulse_mv, 
+               (n < MAX_NEUTRON_PULSE ? n : MAX_NEUTRON_PULSE) * sizeof(int16_t));
+    }
+
+    // neutron snippet section; each snippet_idx must index a pulse
+    idx = 0;
+    if ((s = find_section(section, max_section, PROTO_SECTION_SNIPPET, &idx)) != NULL) {
+        CURSOR_INIT(s);
+        m = get_varint(&c);
+        if (m < 0 || m > MAX_NEUTRON_SNIPPET || m > n) {
+            ERROR("invalid frame, snippet count %d\n", m);
+            return -1;
+        }
+        dp2->max_neutron_snippet = m;
+        uint16_t * snippet_idx = NEUTRON_SECTION_SNIPPET_IDX(dp2,n);
+        int16_t (*adc_pulse_data)[MAX_NEUTRON_ADC_PULSE_DATA] = NEUTRON_SECTION_ADC_PULSE_DATA(dp2,n);
+        for (i = 0, prior = 0; i < m; i++) {
+            prior += get_svarint(&c);
+            if (prior < 0 || prior >= n) {
+                ERROR("invalid frame, snippet_idx %d\n", prior);
+                return -1;
+            }
+            snippet_idx[i] = prior;
+        }
+        for (i = 0; i < m; i++) {
+            for (j = 0, prior = 0; j < MAX_NEUTRON_ADC_PULSE_DATA; j++) {
+                prior += get_svarint(&c);
+                adc_pulse_data[i][j] = prior;
+            }
+        }
+        if (c.err) {
+            ERROR("invalid frame, snippet\n");
+            return -1;
+        }
+    }
+
+    // neutron spectrum section
+    idx = 0;
+    if ((s = find_section(section, max_section, PROTO_SECTION_SPECTRUM, &idx)) != NULL) {
+        CURSOR_INIT(s);
+        i = get_spectrum(&c, NEUTRON_SECTION_SPECTRUM(dp2,n));
+        if (i < 0) {
+            ERROR("invalid frame, spectrum\n");
+            return -1;
+        }
+        dp2->max_neutron_spectrum = i;
+    }
+
+    // the neutron section is padded to a multiple of 8 bytes
+    dp2->neutron_section_len = NEUTRON_SECTION_LEN(n, dp2->max_neutron_snippet, dp2->max_neutron_spectrum);
+    end = (uint8_t*)(NEUTRON_SECTION_SPECTRUM(dp2,n) + dp2->max_neutron_spectrum);
+    memset(end, 0, dp2->var + dp2->neutron_section_len - end);
+
+    // aux chan sections, padded to a multiple of 8 bytes
+    ac = AUX_CHAN_FIRST(dp2);
+    idx = 0;
+    while ((s = find_section(section, max_section, PROTO_SECTION_AUX_CHAN, &idx)) != NULL) {
+        if (dp2->max_aux_chan == MAX_AUX_CHAN) {
+            ERROR("invalid frame, too many aux chan\n");
+            return -1;
+        }
+        CURSOR_INIT(s);
+        ac->chan    = get_varint(&c);
+        ac->pulses  = get_varint(&c);
+        ac->samples = get_varint(&c);
+        i = get_spectrum(&c, ac->spectrum);
+        if (c.err || i < 0) {
+            ERROR("invalid frame, aux chan\n");
+            return -1;
+        }
+        ac->max_spectrum = i;
+        ac = AUX_CHAN_NEXT(ac);
+        dp2->max_aux_chan++;
+    }
+    dp2->aux_chan_section_len = ((uint8_t*)ac - (uint8_t*)AUX_CHAN_FIRST(dp2) + 7) & ~7;
+    memset(ac, 0, (uint8_t*)AUX_CHAN_FIRST(dp2) + dp2->aux_chan_section_len - (uint8_t*)ac);
+
+    // pulse time section, padded to a multiple of 8 bytes
+    idx = 0;
+    if ((s = find_section(section, max_section, PROTO_SECTION_PULSE_TIME, &idx)) != NULL) {
+        if (s->len > MAX_PULSE_TIME_LEN - 8) {
+            ERROR("invalid frame, pulse time len %d\n", s->len);
+            return -1;
+        }
+        dp2->pulse_time_len = (s->len + 7) & ~7;
+        memcpy(PULSE_TIME_SECTION(dp2), s->data, s->len);
+        memset(PULSE_TIME_SECTION(dp2) + s->len, 0, dp2->pulse_time_len - s->len);
+    }
+
+    // jpeg section
+    idx = 0;
+    if ((s = find_section(section, max_section, PROTO_SECTION_JPEG, &idx)) != NULL) {
+        if (s->len > MAX_JPEG_BUFF_LEN) {
+            ERROR("invalid frame, jpeg len %d\n", s->len);
+            return -1;
+        }
+        memcpy(DATA_PART2_JPEG_BUFF(dp2), s->data, s->len);
+        dp1->data_part2_jpeg_buff_len = s->len;
+    }
+
+    #undef CURSOR_INIT
+
+    // data part1: data_part_offset, and data_part2_length
+    dp1->data_part2_offset = 0;
+    dp1->data_part2_length = DATA_PART2_LENGTH(dp2, dp1->data_part2_jpeg_buff_len);
+    return 0;
+}
+
+// Decodes the update frame payload into u. Returns -1 if the frame is invalid.
+
+int32_t proto_decode_update(proto_frame_hdr_t * hdr, uint8_t * payload, proto_update_t * u)
+{
+    proto_section_hdr_t sh;
+    cursor_t            c, sc;
+    uint32_t            chan, n;
+    bool                have_summary = false;
+
+    // verify the frame header
+    if (hdr->magic != MAGIC_PROTO_UPDATE || hdr->version < 3) {
+        ERROR("invalid update, magic=0x%"PRIx64" version=%d\n", hdr->magic, hdr->version);
+        return -1;
+    }
+
+    // decode the sections, ignoring those that are not known
+    bzero(u, offsetof(proto_update_t, adc));
+    for (chan = 0; chan < PROTO_MAX_UPDATE_ADC; chan++) {
+        u->adc[chan].max_adc_data = 0;
+    }
+    c.p   = payload;
+    c.end = payload + hdr->len;
+    while (c.p < c.end) {
+        if (c.end - c.p < sizeof(sh)) {
+            ERROR("invalid update, truncated section header\n");
+            return -1;
+        }
+        memcpy(&sh, c.p, sizeof(sh));
+        c.p += sizeof(sh);
+        if (sh.len > c.end - c.p) {
+            ERROR("invalid update, section %d len %d\n", sh.id, sh.len);
+            return -1;
+        }
+        sc.p   = c.p;
+        sc.end = c.p + sh.len;
+        sc.err = false;
+        c.p += sh.len;
+
+        if (sh.id == PROTO_SECTION_UPDATE_SUMMARY) {
+            u->time              = get_u64(&sc);
+            u->elapsed_ms        = get_varint(&sc);
+            u->voltage_kv        = get_float(&sc);
+            u->current_ma        = get_float(&sc);
+            u->d2_pressure_mtorr = get_float(&sc);
+            u->n2_pressure_mtorr = get_float(&sc);
+            u->neutron_pulses    = get_varint(&sc);
+            u->neutron_samples   = get_varint(&sc);
+            have_summary = true;
+        } else if (sh.id == PROTO_SECTION_UPDATE_ADC) {
+            chan = get_varint(&sc);
+            if (chan >= PROTO_MAX_UPDATE_ADC) {
+                continue;
+            }
+            u->adc[chan].first_seq = get_u64(&sc);
+            n = get_varint(&sc);
+            if (n > MAX_ADC_DATA) {
+                ERROR("invalid update, adc count %d\n", n);
+                return -1;
+            }
+            get_packed(&sc, u->adc[chan].adc_data, n);
+            u->adc[chan].max_adc_data = (sc.err ? 0 : n);
+        }
+        if (sc.err) {
+            ERROR("invalid update, section %d\n", sh.id);
+            return -1;
+        }
+    }
+
+    if (!have_summary) {
+        ERROR("invalid update, no summary\n");
+        return -1;
+    }
+    return 0;
+}
+
+static uint32_t get_varint(cursor_t * c)
+{
+    uint32_t v = 0;
+    int32_t  shift = 0;
+
+    do {
+        if (c->p == c->end || shift > 28) {
+            c->err = true;
+            return 0;
+        }
+        v |= (uint32_t)(*c->p & 0x7f) << shift;
+        shift += 7;
+    } while (*c->p++ & 0x80);
+    return v;
+}
+
+static int32_t get_svarint(cursor_t * c)
+{
+    uint32_t zz = get_varint(c);
+
+    return UNZIGZAG(zz);
+}
+
+static uint32_t get_u32(cursor_t * c)
+{
+    uint32_t v;
+
+    if (c->end - c->p < 4) {
+        c->err = true;
+        return 0;
+    }
+    v = c->p[0] | (c->p[1] << 8) | (c->p[2] << 16) | ((uint32_t)c->p[3] << 24);
+    c->p += 4;
+    return v;
+}
+
+static uint64_t get_u64(cursor_t * c)
+{
+    uint64_t lo = get_u32(c);
+
+    return lo | ((uint64_t)get_u32(c) << 32);
+}
+
+static float get_float(cursor_t * c)
+{
+    uint32_t u = get_u32(c);
+    float    v;
+
+    memcpy(&v, &u, sizeof(v));
+    return v;
+}
+
+static int32_t get_spectrum(cursor_t * c, uint16_t (*spectrum)[2])
+{
+    int32_t  i, max_spectrum, bin = 0;
+    uint32_t count;
+
+    // returns the number of entries, or -1 if they are invalid
+    max_spectrum = get_varint(c);
+    if (max_spectrum < 0 || max_spectrum > MAX_NEUTRON_SPECTRUM_ENTRY) {
+        return -1;
+    }
+    for (i = 0; i < max_spectrum; i++) {
+        bin += get_svarint(c);
+        count = get_varint(c);
+        if (bin < 0 || bin >= MAX_NEUTRON_SPECTRUM_BIN || count > 65535) {
+            return -1;
+        }
+        spectrum[i][0] = bin;
+        spectrum[i][1] = count;
+    }
+    return c->err ? -1 : max_spectrum;
+}
+
+static void get_packed(cursor_t * c, int16_t * d, int32_t n)
+{
+    uint64_t acc;
+    uint32_t mask;
+    int32_t  i, j, cnt, bits, acc_bits, prev = 0;
+
+    for (i = 0; i < n; i += PACK_BLOCK) {
+        // get the bit width of this block, and check the block is complete
+        cnt = (n - i < PACK_BLOCK ? n - i : PACK_BLOCK);
+        if (c->p == c->end) {
+            c->err = true;
+            return;
+        }
+        bits = *c->p++;
+        if (bits > 17 || (cnt * bits + 7) / 8 > c->end - c->p) {
+            c->err = true;
+            return;
+        }
+        mask = (1u << bits) - 1;
+
+        // unpack
+        acc = 0;
+        acc_bits = 0;
+        for (j = 0; j < cnt; j++) {
+            while (acc_bits < bits) {
+                acc |= (uint64_t)*c->p++ << acc_bits;
+                acc_bits += 8;
+            }
+            prev += UNZIGZAG((uint32_t)acc & mask);
+            d[i+j] = prev;
+            acc >>= bits;
+            acc_bits -= bits;
+        }
+    }
+}
+
+static section_t * find_section(section_t * section, int32_t max_section, uint16_t id, int32_t * idx)
+{
+    // returns the next section with id, starting at section[*idx]
+    for (; *idx < max_section; (*idx)++) {
+        if (section[*idx].id == id) {
+            return &section[(*idx)++];
+        }
+    }
+    return NULL;
+}
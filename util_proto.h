@@ -0,0 +1,151 @@
+/*
+Copyright (c) 2016 Steven Haid
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef __UTIL_PROTO_H__
+#define __UTIL_PROTO_H__
+
+// Wire protocol between get_data and the display program.
+//
+// Version 1 is the data_t in the layout of older versions of get_data, part1 followed
+// by data_part2_length bytes of a MAGIC_DATA_PART2_V1 part2, see proto_encode_v1.
+// Version 2 sends each data_t as a frame: a proto_frame_hdr_t followed by len bytes of
+// sections, each a proto_section_hdr_t followed by len bytes; the headers are in host 
+// byte order, as is data_t. Only the data that is present is sent: the adc arrays 
+// when valid, and the pulses that occurred. The adc arrays are delta encoded and 
+// bit-packed; the snippets are delta encoded; and the other integers in the sections
+// are varints (as in the pulse time section, see common.h) or little endian. A decoder
+// skips sections whose id it does not know, so sections can be added without changing
+// the version.
+//
+// A display that supports version 2 sends a proto_hello_t after connecting. get_data
+// sends version 1 until it receives the hello, and then switches to the lower of the
+// two versions at the next record boundary. An older get_data ignores the hello. So 
+// the receiver must check the magic at the start of each record: MAGIC_DATA_PART1 
+// is a version 1 record, MAGIC_PROTO_FRAME is a version 2 frame.
+//
+// Version 3 adds update frames, MAGIC_PROTO_UPDATE, which are sent several times a 
+// second between the records. An update contains the values of the second that is in
+// progress: the recent means, the pulses so far, and the adc values since the prior
+// update. Updates are for display only; the record for the second follows as usual.
+//
+// Version 4 adds backfill. get_data keeps the frames of the recent seconds, and a 
+// display that reconnects sends a proto_backfill_t, after its hello, containing the 
+// time of the last second it received. get_data then sends the frames it has for the
+// seconds after that time, as fast as the connection allows, followed by a 
+// proto_frame_hdr_t with magic MAGIC_PROTO_BACKFILL and len 0; and then resumes 
+// sending the records and updates. The records published during the backfill are
+// sent by the backfill, so the seconds arrive in order and none are sent twice.
+
+#define PROTO_VERSION      4
+
+#define MAGIC_PROTO_HELLO    0x5aa5c33c0f0f4801
+#define MAGIC_PROTO_FRAME    0x5aa5c33c0f0f4602
+#define MAGIC_PROTO_UPDATE   0x5aa5c33c0f0f5503
+#define MAGIC_PROTO_BACKFILL 0x5aa5c33c0f0f4204
+
+#define PROTO_SECTION_SUMMARY          1   // part1 values, and the part2 neutron values
+#define PROTO_SECTION_VOLTAGE_ADC      2   // present only if the adc data is valid
+#define PROTO_SECTION_CURRENT_ADC      3
+#define PROTO_SECTION_PRESSURE_ADC     4
+#define PROTO_SECTION_PULSE_MV         5   // max_neutron_pulse pulse heights
+#define PROTO_SECTION_SNIPPET          6
+#define PROTO_SECTION_SPECTRUM         7
+#define PROTO_SECTION_AUX_CHAN         8   // one for each aux chan
+#define PROTO_SECTION_PULSE_TIME       9   // the pulse time section, already varint encoded
+#define PROTO_SECTION_JPEG             10
+#define PROTO_SECTION_UPDATE_SUMMARY   11  // update frame sections
+#define PROTO_SECTION_UPDATE_ADC       12  // one for each adc chan that has new values
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t reserved;
+} proto_hello_t;
+
+// the messages sent by the display are all the same length
+typedef struct {
+    uint64_t magic;
+    uint64_t time;      // the last second the display has, the seconds after it are sent
+} proto_backfill_t;
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t len;
+} proto_frame_hdr_t;
+
+typedef struct {
+    uint16_t id;
+    uint16_t reserved;
+    uint32_t len;
+} proto_section_hdr_t;
+
+// an encoded value is at most one byte longer than its int16_t or uint16_t data_t
+// representation, so this bounds the frame length
+#define PROTO_MAX_FRAME_LEN \
+    (sizeof(proto_frame_hdr_t) + 64 * sizeof(proto_section_hdr_t) + \
+     sizeof(struct data_part1_s) + MAX_DATA_PART2_LENGTH + \
+     3 * MAX_ADC_DATA + MAX_NEUTRON_PULSE_PER_SEC + \
+     MAX_NEUTRON_SNIPPET * (1 + MAX_NEUTRON_ADC_PULSE_DATA) + \
+     (1 + MAX_AUX_CHAN) * MAX_NEUTRON_SPECTRUM_ENTRY * 2)
+
+int32_t proto_encode(data_t * data, uint8_t * frame);
+int32_t proto_decode(proto_frame_hdr_t * hdr, uint8_t * payload, data_t * data);
+
+// version 1 records
+#define PROTO_MAX_V1_LEN \
+    (sizeof(struct data_part1_s) + DATA_PART2_V1_HDR_LEN + DATA_PART2_V1_PULSE_DATA_LEN + \
+     MAX_JPEG_BUFF_LEN)
+
+int32_t proto_encode_v1(data_t * data, uint8_t * buff);
+
+// update frames; adc[] is voltage, current, and pressure
+#define PROTO_UPDATE_ADC_VOLTAGE   0
+#define PROTO_UPDATE_ADC_CURRENT   1
+#define PROTO_UPDATE_ADC_PRESSURE  2
+#define PROTO_MAX_UPDATE_ADC       3
+
+typedef struct {
+    uint64_t time;                // the record with this time completes the second
+    int32_t  elapsed_ms;          // ms of the second that have elapsed
+    float    voltage_kv;          // means of the last 100 ms, or ERROR_NO_VALUE
+    float    current_ma;
+    float    d2_pressure_mtorr;
+    float    n2_pressure_mtorr;
+    int32_t  neutron_pulses;      // pulses detected so far during the second
+    int32_t  neutron_samples;     // samples analyzed so far during the second
+    struct {
+        uint64_t first_seq;       // sequence number of adc_data[0], see util_dataq.h
+        int32_t  max_adc_data;    // new values since the prior update, 0 if none
+        int16_t  adc_data[MAX_ADC_DATA];
+    } adc[PROTO_MAX_UPDATE_ADC];
+} proto_update_t;
+
+#define PROTO_MAX_UPDATE_FRAME_LEN \
+    (sizeof(proto_frame_hdr_t) + (1 + PROTO_MAX_UPDATE_ADC) * sizeof(proto_section_hdr_t) + \
+     64 + PROTO_MAX_UPDATE_ADC * (32 + 3 * MAX_ADC_DATA))
+
+int32_t proto_encode_update(proto_update_t * u, uint8_t * frame);
+int32_t proto_decode_update(proto_frame_hdr_t * hdr, uint8_t * payload, proto_update_t * u);
+
+#endif
@@ -0,0 +1,553 @@
+/*
+Copyright (c) 2016 Steven Haid
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+//#define DEBUG_PRINT_PULSE_GRAPH
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "util_pulse.h"
+#include "util_misc.h"
+
+//
+// defines 
+//
+
+#define SAMPLE(p) ((p) >= span_start ? d[(p)-span_start] : pd->halo[(p)-(span_start-PULSE_HALO)])
+
+// update the baseline estimate with the block at pd->baseline_pos, which is copied
+// from the halo and d if it straddles calls
+#define BASELINE_UPDATE() \
+    do { \
+        if (pd->baseline_pos >= span_start) { \
+            baseline_update(pd, &d[pd->baseline_pos-span_start]); \
+        } else { \
+            uint16_t _block[PULSE_BLOCK]; \
+            int32_t  _i; \
+            for (_i = 0; _i < PULSE_BLOCK; _i++) { \
+                _block[_i] = SAMPLE(pd->baseline_pos+_i); \
+            } \
+            baseline_update(pd, _block); \
+        } \
+        pd->baseline_pos += PULSE_BLOCK; \
+    } while (0)
+
+//
+// prototypes
+//
+
+static inline bool block_has_candidate(uint16_t * p, int32_t threshold);
+static void baseline_update(pulse_detector_t * pd, uint16_t * p);
+static inline int32_t block_baseline_sums(uint16_t * p, int32_t baseline, int32_t clip, 
+                                          int32_t * sum, int32_t * sumsq);
+static float block_median(uint16_t * p);
+static int compare_uint16(const void * a, const void * b);
+#ifdef DEBUG_PRINT_PULSE_GRAPH
+static void print_plot_str(int32_t value, int32_t baseline);
+#endif
+
+// -----------------  API  -----------------------------------------------------------
+
+void pulse_detector_init(pulse_detector_t * pd, int32_t threshold, int32_t max_width,
+                         pulse_callback_t cb, void * cx)
+{
+    if (max_width < 1 || max_width > PULSE_MAX_MAX_WIDTH) {
+        FATAL("invalid max_width %d, range 1 - %d\n", max_width, PULSE_MAX_MAX_WIDTH);
+    }
+
+    bzero(pd, sizeof(pulse_detector_t));
+    pd->threshold          = threshold;
+    pd->max_width          = max_width;
+    pd->baseline_clip      = PULSE_DEFAULT_BASELINE_CLIP;
+    pd->prefilter          = true;
+    pd->log_warnings       = true;
+    pd->cb                 = cb;
+    pd->cx                 = cx;
+    pd->pulse_start_pos    = -1;
+}
+
+// The samples (d) are processed as a continuous stream. Each sample is identified 
+// by its stream position; the d[0] sample is at stream position span_start.
+// The samples may be passed directly from the mccdaq circular buffer.
+//
+// A sample is examined only when PULSE_LOOKAHEAD samples following it are available,
+// so up to PULSE_LOOKAHEAD samples are left pending at the end of each call. The 
+// PULSE_HALO samples preceding span_start are saved from the prior call; these 
+// provide the pending samples, and the samples preceding a pulse that are saved in 
+// pulse_t data_mv. Pulses that straddle calls are therefore detected.
+//
+// The baseline is estimated from each block of PULSE_BLOCK samples, ahead of the 
+// samples being examined, see baseline_update. Samples are not examined until the 
+// baseline has been acquired.
+//
+// Almost all samples are baseline noise. When not in a pulse, each block of 
+// PULSE_BLOCK samples is first checked, using SIMD instructions where available, 
+// for any sample at or above the pulse threshold. Blocks without a candidate are 
+// skipped. The full state machine runs only on blocks that contain a candidate.
+//
+// The callback is called for each pulse detected. The number of pulses detected
+// is returned.
+
+int32_t pulse_detector_process(pulse_detector_t * pd, uint16_t * d, int32_t max_d)
+{
+    int64_t span_start = pd->end;
+    int64_t span_end   = pd->end + max_d;
+    int64_t pos        = pd->pos;
+    int64_t pulse_start_pos = pd->pulse_start_pos;
+    int32_t baseline   = pd->baseline;
+    int32_t threshold  = pd->threshold;
+    int64_t scalar_end = 0;
+    int64_t pulse_end_pos;
+    int32_t value, pulses = 0;
+
+    while (pos + PULSE_LOOKAHEAD < span_end) {
+        // update the baseline estimate with the blocks that start before the 
+        // lookahead, when they have been received
+        while (pd->baseline_pos <= pos + PULSE_LOOKAHEAD && pd->baseline_pos + PULSE_BLOCK <= span_end) {
+            BASELINE_UPDATE();
+            baseline = pd->baseline;
+        }
+
+        // if not in a pulse then
+        //   if the block starting at pos contains no sample at or above the 
+        //    pulse threshold then
+        //     skip the block
+        //   else
+        //     examine the samples of this block individually
+        //   endif
+        // endif
+        if (pd->prefilter &&
+            pos >= scalar_end &&
+            pulse_start_pos == -1 && 
+            baseline != 0 &&
+            pos >= span_start && 
+            pos + PULSE_BLOCK + PULSE_LOOKAHEAD < span_end)
+        {
+            if (!block_has_candidate(&d[pos-span_start], baseline + threshold)) {
+                pos += PULSE_BLOCK;
+                continue;
+            }
+            scalar_end = pos + PULSE_BLOCK;
+        }
+
+        // print warning if data out of range
+        value = SAMPLE(pos);
+        if (value > 4095) {
+            if (pd->log_warnings) {
+                WARN("sample at %"PRId64" = %u, is out of range\n", pos, value);
+            }
+            pd->out_of_range++;
+            value = 2048;
+        }
+
+        // if baseline has not yet determined then continue
+        if (baseline == 0) {
+            pos++;
+            continue;
+        }
+
+        // determine the pulse_start_pos and pulse_end_pos
+        pulse_end_pos = -1;
+        if (value >= (baseline + threshold) && pulse_start_pos == -1) {
+            pulse_start_pos = pos;
+        } else if (pulse_start_pos != -1) {
+            if (value < (baseline + threshold)) {
+                pulse_end_pos = pos - 1;
+            } else if (pos - pulse_start_pos >= pd->max_width) {
+                if (pd->log_warnings) {
+                    WARN("discarding a possible pulse because it's too long, pulse_start_pos=%"PRId64"\n",
+                         pulse_start_pos);
+                }
+                pd->discarded++;
+                pulse_start_pos = -1;
+            }
+        }
+
+        // if a pulse has been located ...
+        // - determine the pulse height, in mv
+        // - save the samples surrounding the pulse
+        // - call the callback
+        // endif
+        if (pulse_end_pos != -1) {
+            pulse_t pulse;
+            int32_t pulse_height, k;
+            int64_t i, pulse_start_pos_extended, pulse_end_pos_extended;
+
+            // scan from start to end of pulse to determine pulse_height,
+            // where pulse_height is the height above the baseline
+            pulse_height = -1;
+            for (i = pulse_start_pos; i <= pulse_end_pos; i++) {
+                if (SAMPLE(i) - baseline > pulse_height) {
+                    pulse_height = SAMPLE(i) - baseline;
+                }
+            }
+
+            // save the pulse data; the PULSE_LOOKAHEAD and PULSE_HALO ensure these 
+            // samples are available
+            pulse_start_pos_extended = pulse_start_pos - (PULSE_MAX_DATA/2);
+            if (pulse_start_pos_extended < 0) {
+                pulse_start_pos_extended = 0;
+            }
+            pulse_end_pos_extended = pulse_start_pos_extended + (PULSE_MAX_DATA-1);
+            for (k = 0, i = pulse_start_pos_extended; i <= pulse_end_pos_extended; i++) {
+                pulse.data_mv[k++] = PULSE_ADC_TO_MV(SAMPLE(i) - baseline);
+            }
+
+            // call the callback
+            pulse.start_pos = pulse_start_pos;
+            pulse.end_pos   = pulse_end_pos;
+            pulse.height_mv = PULSE_ADC_TO_MV(pulse_height);
+            pulse.baseline  = baseline;
+            if (pd->cb) {
+                pd->cb(pd->cx, &pulse);
+            }
+            pulses++;
+
+#ifdef DEBUG_PRINT_PULSE_GRAPH
+            // plot the pulse 
+            pulse_start_pos_extended = pulse_start_pos - 1;
+            pulse_end_pos_extended = pulse_end_pos + 4;
+            if (pulse_start_pos_extended < 0) {
+                pulse_start_pos_extended = 0;
+            }
+            printf("PULSE:  height_mv = %d   baseline_mv = %d   (%"PRId64",%"PRId64")\n",
+                   pulse.height_mv, PULSE_ADC_TO_MV(baseline-2048),
+                   pulse_start_pos_extended, pulse_end_pos_extended);
+            for (i = pulse_start_pos_extended; i <= pulse_end_pos_extended; i++) {
+                print_plot_str(PULSE_ADC_TO_MV(SAMPLE(i)-2048), PULSE_ADC_TO_MV(baseline-2048)); 
+            }
+            printf("\n");
+#endif
+
+            // done with this pulse
+            pulse_start_pos = -1;
+        }
+
+        // move to next data 
+        pos++;
+    }
+
+    // update the baseline estimate with the remaining blocks received; this ensures
+    // that a block which straddles calls starts within the halo
+    while (pd->baseline_pos + PULSE_BLOCK <= span_end) {
+        BASELINE_UPDATE();
+    }
+
+    // save the last PULSE_HALO samples for the next call
+    if (max_d >= PULSE_HALO) {
+        memcpy(pd->halo, d+max_d-PULSE_HALO, PULSE_HALO*sizeof(uint16_t));
+    } else {
+        memmove(pd->halo, pd->halo+max_d, (PULSE_HALO-max_d)*sizeof(uint16_t));
+        memcpy(pd->halo+PULSE_HALO-max_d, d, max_d*sizeof(uint16_t));
+    }
+
+    // save state for the next call
+    pd->end = span_end;
+    pd->pos = pos;
+    pd->pulse_start_pos = pulse_start_pos;
+    pd->samples += max_d;
+    pd->pulses += pulses;
+
+    // return the number of pulses detected
+    return pulses;
+}
+
+void pulse_detector_get_baseline(pulse_detector_t * pd, float * baseline, float * sigma)
+{
+    // return the current baseline estimate and noise sigma, in adc units;
+    // both are 0 until the baseline has been acquired
+    *baseline = pd->baseline_est;
+    *sigma    = sqrtf(pd->noise_var);
+}
+
+// -----------------  BASELINE ESTIMATOR  --------------------------------------------
+
+// The baseline is acquired as the median of a block. It is then tracked by an 
+// exponential moving average of each block's mean, where the samples further from 
+// the baseline than the clip distance, such as those in pulses, are excluded from 
+// the mean. The clip distance is PULSE_BASELINE_CLIP_SIGMA times the noise sigma, 
+// but not less than baseline_clip nor more than the pulse threshold. So the 
+// baseline is not pulled up by pulses, at any pulse rate. If most of the samples 
+// of PULSE_BASELINE_REACQUIRE consecutive blocks are excluded, the baseline has 
+// moved abruptly and is reacquired.
+
+static void baseline_update(pulse_detector_t * pd, uint16_t * p)
+{
+    int32_t  baseline, clip, n, sum, sumsq;
+    float    mean, var;
+
+    // if the baseline has not been acquired, or must be reacquired, then
+    //   set the baseline to the median of the block
+    //   return
+    // endif
+    if (pd->baseline == 0 || pd->baseline_excluded >= PULSE_BASELINE_REACQUIRE) {
+        pd->baseline_est      = block_median(p);
+        pd->baseline          = lrintf(pd->baseline_est);
+        pd->baseline_excluded = 0;
+        pd->baseline_acquired++;
+        return;
+    }
+
+    // sum the samples within the clip distance of the baseline
+    baseline = pd->baseline;
+    clip = PULSE_BASELINE_CLIP_SIGMA * sqrtf(pd->noise_var) + 0.5;
+    if (clip < pd->baseline_clip) {
+        clip = pd->baseline_clip;
+    }
+    if (clip >= pd->threshold) {
+        clip = pd->threshold - 1;
+    }
+    n = block_baseline_sums(p, baseline, clip, &sum, &sumsq);
+
+    // if most of the block is excluded then
+    //   the block is mostly pulses, or the baseline has moved; the block is ignored, 
+    //   and if this continues for PULSE_BASELINE_REACQUIRE blocks then the baseline 
+    //   is reacquired
+    //   return
+    // endif
+    if (n < PULSE_BLOCK/2) {
+        pd->baseline_excluded++;
+        return;
+    }
+    pd->baseline_excluded = 0;
+
+    // update the moving averages of the baseline and the noise variance
+    mean = (float)sum / n;
+    var  = (float)sumsq / n - mean * mean;
+    pd->baseline_est += (baseline + mean - pd->baseline_est) / (1 << PULSE_BASELINE_EMA_SHIFT);
+    pd->noise_var    += (var - pd->noise_var) / (1 << PULSE_BASELINE_EMA_SHIFT);
+    pd->baseline      = lrintf(pd->baseline_est);
+}
+
+static float block_median(uint16_t * p)
+{
+    uint16_t sorted[PULSE_BLOCK];
+
+    memcpy(sorted, p, sizeof(sorted));
+    qsort(sorted, PULSE_BLOCK, sizeof(uint16_t), compare_uint16);
+    return (sorted[PULSE_BLOCK/2-1] + sorted[PULSE_BLOCK/2]) / 2.0;
+}
+
+// sums, for the PULSE_BLOCK samples at p that are within clip of the baseline, the 
+// differences from the baseline and their squares; returns the number of samples summed
+static inline int32_t block_baseline_sums(uint16_t * p, int32_t baseline, int32_t clip, 
+                                          int32_t * sum, int32_t * sumsq)
+{
+    // samples above 32767, which are out of range, have a large negative difference 
+    // and so are excluded
+#if defined(__AVX2__)
+    __m256i b = _mm256_set1_epi16(baseline);
+    __m256i lo = _mm256_set1_epi16(-clip-1);
+    __m256i hi = _mm256_set1_epi16(clip+1);
+    __m256i ones = _mm256_set1_epi16(1);
+    __m256i s = _mm256_setzero_si256(), sq = _mm256_setzero_si256(), cnt = _mm256_setzero_si256();
+    __m128i s4, sq4, cnt4;
+    int32_t i;
+    for (i = 0; i < PULSE_BLOCK; i += 16) {
+        __m256i x = _mm256_sub_epi16(_mm256_loadu_si256((__m256i*)(p+i)), b);
+        __m256i m = _mm256_and_si256(_mm256_cmpgt_epi16(x, lo), _mm256_cmpgt_epi16(hi, x));
+        x = _mm256_and_si256(x, m);
+        s   = _mm256_add_epi32(s, _mm256_madd_epi16(x, ones));
+        sq  = _mm256_add_epi32(sq, _mm256_madd_epi16(x, x));
+        cnt = _mm256_sub_epi16(cnt, m);
+    }
+    s4   = _mm_add_epi32(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+    sq4  = _mm_add_epi32(_mm256_castsi256_si128(sq), _mm256_extracti128_si256(sq, 1));
+    cnt4 = _mm_madd_epi16(_mm_add_epi16(_mm256_castsi256_si128(cnt), _mm256_extracti128_si256(cnt, 1)),
+                          _mm_set1_epi16(1));
+    s4   = _mm_add_epi32(s4, _mm_shuffle_epi32(s4, 0x4e));
+    sq4  = _mm_add_epi32(sq4, _mm_shuffle_epi32(sq4, 0x4e));
+    cnt4 = _mm_add_epi32(cnt4, _mm_shuffle_epi32(cnt4, 0x4e));
+    *sum   = _mm_cvtsi128_si32(s4) + _mm_cvtsi128_si32(_mm_shuffle_epi32(s4, 0xb1));
+    *sumsq = _mm_cvtsi128_si32(sq4) + _mm_cvtsi128_si32(_mm_shuffle_epi32(sq4, 0xb1));
+    return _mm_cvtsi128_si32(cnt4) + _mm_cvtsi128_si32(_mm_shuffle_epi32(cnt4, 0xb1));
+#elif defined(__SSE2__)
+    __m128i b = _mm_set1_epi16(baseline);
+    __m128i lo = _mm_set1_epi16(-clip-1);
+    __m128i hi = _mm_set1_epi16(clip+1);
+    __m128i ones = _mm_set1_epi16(1);
+    __m128i s = _mm_setzero_si128(), sq = _mm_setzero_si128(), cnt = _mm_setzero_si128();
+    int32_t i;
+    for (i = 0; i < PULSE_BLOCK; i += 8) {
+        __m128i x = _mm_sub_epi16(_mm_loadu_si128((__m128i*)(p+i)), b);
+        __m128i m = _mm_and_si128(_mm_cmpgt_epi16(x, lo), _mm_cmpgt_epi16(hi, x));
+        x = _mm_and_si128(x, m);
+        s   = _mm_add_epi32(s, _mm_madd_epi16(x, ones));
+        sq  = _mm_add_epi32(sq, _mm_madd_epi16(x, x));
+        cnt = _mm_sub_epi16(cnt, m);
+    }
+    cnt = _mm_madd_epi16(cnt, ones);
+    s   = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+    sq  = _mm_add_epi32(sq, _mm_shuffle_epi32(sq, 0x4e));
+    cnt = _mm_add_epi32(cnt, _mm_shuffle_epi32(cnt, 0x4e));
+    *sum   = _mm_cvtsi128_si32(s) + _mm_cvtsi128_si32(_mm_shuffle_epi32(s, 0xb1));
+    *sumsq = _mm_cvtsi128_si32(sq) + _mm_cvtsi128_si32(_mm_shuffle_epi32(sq, 0xb1));
+    return _mm_cvtsi128_si32(cnt) + _mm_cvtsi128_si32(_mm_shuffle_epi32(cnt, 0xb1));
+#elif defined(__ARM_NEON)
+    int16x8_t b = vdupq_n_s16(baseline);
+    int16x8_t c = vdupq_n_s16(clip);
+    int32x4_t s = vdupq_n_s32(0), sq = vdupq_n_s32(0);
+    uint16x8_t cnt = vdupq_n_u16(0);
+    int32_t i;
+    for (i = 0; i < PULSE_BLOCK; i += 8) {
+        int16x8_t  x = vsubq_s16(vreinterpretq_s16_u16(vld1q_u16(p+i)), b);
+        uint16x8_t m = vcleq_s16(vabsq_s16(x), c);
+        x   = vandq_s16(x, vreinterpretq_s16_u16(m));
+        s   = vpadalq_s16(s, x);
+        sq  = vmlal_s16(sq, vget_low_s16(x), vget_low_s16(x));
+        sq  = vmlal_s16(sq, vget_high_s16(x), vget_high_s16(x));
+        cnt = vsubq_u16(cnt, m);
+    }
+    uint32x4_t n = vpaddlq_u16(cnt);
+    *sum   = vgetq_lane_s32(s, 0) + vgetq_lane_s32(s, 1) + vgetq_lane_s32(s, 2) + vgetq_lane_s32(s, 3);
+    *sumsq = vgetq_lane_s32(sq, 0) + vgetq_lane_s32(sq, 1) + vgetq_lane_s32(sq, 2) + vgetq_lane_s32(sq, 3);
+    return vgetq_lane_u32(n, 0) + vgetq_lane_u32(n, 1) + vgetq_lane_u32(n, 2) + vgetq_lane_u32(n, 3);
+#else
+    int32_t i, x, n = 0;
+    *sum = 0;
+    *sumsq = 0;
+    for (i = 0; i < PULSE_BLOCK; i++) {
+        x = (int16_t)(p[i] - baseline);
+        if (x >= -clip && x <= clip) {
+            *sum += x;
+            *sumsq += x * x;
+            n++;
+        }
+    }
+    return n;
+#endif
+}
+
+static int compare_uint16(const void * a, const void * b)
+{
+    return *(uint16_t*)a - *(uint16_t*)b;
+}
+
+// -----------------  PREFILTER  -----------------------------------------------------
+
+// returns true if any of the PULSE_BLOCK samples at p is >= threshold
+static inline bool block_has_candidate(uint16_t * p, int32_t threshold)
+{
+    // the unsigned saturating subtract of (threshold-1) is non-zero only for
+    // samples >= threshold, which includes out of range samples
+#if defined(__AVX2__)
+    __m256i t = _mm256_set1_epi16(threshold-1);
+    __m256i x = _mm256_or_si256(
+                    _mm256_or_si256(_mm256_subs_epu16(_mm256_loadu_si256((__m256i*)(p+0)), t),
+                                    _mm256_subs_epu16(_mm256_loadu_si256((__m256i*)(p+16)), t)),
+                    _mm256_or_si256(_mm256_subs_epu16(_mm256_loadu_si256((__m256i*)(p+32)), t),
+                                    _mm256_subs_epu16(_mm256_loadu_si256((__m256i*)(p+48)), t)));
+    return !_mm256_testz_si256(x, x);
+#elif defined(__SSE2__)
+    __m128i t = _mm_set1_epi16(threshold-1);
+    __m128i x = _mm_setzero_si128();
+    int32_t i;
+    for (i = 0; i < PULSE_BLOCK; i += 8) {
+        x = _mm_or_si128(x, _mm_subs_epu16(_mm_loadu_si128((__m128i*)(p+i)), t));
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi16(x, _mm_setzero_si128())) != 0xffff;
+#elif defined(__ARM_NEON)
+    uint16x8_t t = vdupq_n_u16(threshold-1);
+    uint16x8_t x = vdupq_n_u16(0);
+    uint64x2_t y;
+    int32_t i;
+    for (i = 0; i < PULSE_BLOCK; i += 8) {
+        x = vorrq_u16(x, vqsubq_u16(vld1q_u16(p+i), t));
+    }
+    y = vreinterpretq_u64_u16(x);
+    return (vgetq_lane_u64(y, 0) | vgetq_lane_u64(y, 1)) != 0;
+#else
+    uint16_t max = 0;
+    int32_t i;
+    for (i = 0; i < PULSE_BLOCK; i++) {
+        if (p[i] > max) max = p[i];
+    }
+    return max >= threshold;
+#endif
+}
+
+// -----------------  DEBUG  -------------------------------------------------------
+
+#ifdef DEBUG_PRINT_PULSE_GRAPH
+static void print_plot_str(int32_t value, int32_t baseline)
+{
+    char    str[110];
+    int32_t idx, i;
+
+    // args are in mv units
+
+    // value               : expected range 0 - 9995 mv
+    // baseline            : expected range 0 - 9995 mv
+    // idx = value / 100   : range  0 - 99            
+
+    if (value > 9995) {
+        printf("%5d: value is out of range\n", value);
+        return;
+    }
+    if (baseline < 0 || baseline > 9995) {
+        printf("%5d: baseline is out of range\n", baseline);
+        return;
+    }
+
+    if (value < 0) {
+        value = 0;
+    }
+
+    bzero(str, sizeof(str));
+
+    idx = value / 100;
+    for (i = 0; i <= idx; i++) {
+        str[i] = '*';
+    }
+
+    idx = baseline / 100;
+    if (str[idx] == '*') {
+        str[idx] = '+';
+    } else {
+        str[idx] = '|';
+        for (i = 0; i < idx; i++) {
+            if (str[i] == '\0') {
+                str[i] = ' ';
+            }
+        }
+    }
+
+    printf("%5d: %s\n", value, str);
+}
+#endif
@@ -0,0 +1,92 @@
+/*
+Copyright (c) 2016 Steven Haid
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef __UTIL_PULSE_H__
+#define __UTIL_PULSE_H__
+
+// detector defaults, in adc units and samples
+#define PULSE_DEFAULT_THRESHOLD   10    // pulse threshold, above the baseline
+#define PULSE_DEFAULT_MAX_WIDTH   10    // possible pulses this long are discarded
+#define PULSE_DEFAULT_BASELINE_CLIP  3   // min distance from the baseline of samples excluded from it
+
+#define PULSE_MAX_DATA     20    // samples saved for each pulse, starting PULSE_MAX_DATA/2 before the pulse
+#define PULSE_HALO         64    // samples retained from the prior call
+#define PULSE_LOOKAHEAD    20    // samples that must follow a sample before it is examined
+#define PULSE_BLOCK        64    // prefilter and baseline estimator block size
+
+// the largest max_width for which the samples saved for a pulse, which extend 
+// PULSE_MAX_DATA/2 before the pulse, are still within the halo
+#define PULSE_MAX_MAX_WIDTH  (PULSE_HALO - PULSE_LOOKAHEAD - PULSE_MAX_DATA/2)
+
+#define PULSE_BASELINE_CLIP_SIGMA     4     // samples beyond this many sigma are excluded from the baseline
+#define PULSE_BASELINE_EMA_SHIFT      4     // baseline time constant is 2^shift blocks
+#define PULSE_BASELINE_REACQUIRE      2     // blocks mostly excluded before the baseline is reacquired
+
+#define PULSE_ADC_TO_MV(adc)  ((adc) * 10000 / 2048)
+
+typedef struct {
+    int64_t start_pos;                // stream position of the first sample above threshold
+    int64_t end_pos;                  // stream position of the last sample above threshold
+    int32_t height_mv;                // peak height above the baseline
+    int32_t baseline;                 // baseline, adc units
+    int16_t data_mv[PULSE_MAX_DATA];  // samples surrounding the pulse, mv above baseline
+} pulse_t;
+
+typedef void (*pulse_callback_t)(void * cx, pulse_t * pulse);
+
+// Detector state. The caller owns this struct; it is initialized by 
+// pulse_detector_init and must not be shared between threads.
+typedef struct {
+    // parameters
+    int32_t          threshold;
+    int32_t          max_width;
+    int32_t          baseline_clip;
+    bool             prefilter;
+    bool             log_warnings;
+    pulse_callback_t cb;
+    void           * cx;
+
+    // state
+    uint16_t         halo[PULSE_HALO];
+    int64_t          end;               // stream position following the last sample received
+    int64_t          pos;               // stream position of the next sample to examine
+    int64_t          pulse_start_pos;   // -1 when not in a pulse
+    int32_t          baseline;          // 0 until determined
+    float            baseline_est;      // baseline estimate, adc units
+    float            noise_var;         // baseline noise variance, adc units squared
+    int64_t          baseline_pos;      // stream position of the next baseline estimator block
+    int32_t          baseline_excluded; // consecutive blocks mostly excluded from the baseline
+
+    // cumulative counts
+    uint64_t         samples;
+    uint64_t         pulses;
+    uint64_t         discarded;         // possible pulses discarded because they were too long
+    uint64_t         out_of_range;      // samples above 4095
+    uint64_t         baseline_acquired; // times the baseline was acquired, or reacquired
+} pulse_detector_t;
+
+void pulse_detector_init(pulse_detector_t * pd, int32_t threshold, int32_t max_width,
+                         pulse_callback_t cb, void * cx);
+int32_t pulse_detector_process(pulse_detector_t * pd, uint16_t * d, int32_t max_d);
+void pulse_detector_get_baseline(pulse_detector_t * pd, float * baseline, float * sigma);
+
+#endif
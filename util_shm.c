@@ -0,0 +1,453 @@
+/*
+Copyright (c) 2016 Steven Haid
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "common.h"
+#include "util_proto.h"
+#include "util_shm.h"
+#include "util_misc.h"
+
+//
+// defines
+//
+
+#define SHM_MAGIC      0x5aa5c33c0f0f5305
+#define SHM_VERSION    1
+
+#define STALE_US       5000000   // get_data is not publishing, or the reader is not reading
+#define WAIT_MS        1000      // max futex wait, between checks that get_data is publishing
+
+#define SLOT_DATA_SIZE (sizeof(struct data_part1_s) + MAX_DATA_PART2_LENGTH)
+#define ROUND_UP(x)    (((x) + 0xfff) & ~0xfffL)
+#define HDR_SIZE       ROUND_UP(sizeof(shm_hdr_t))
+#define SLOT_SIZE      ROUND_UP(sizeof(slot_hdr_t) + SLOT_DATA_SIZE)
+#define SHM_SIZE       (HDR_SIZE + SHM_MAX_SLOT * SLOT_SIZE)
+
+#define SLOT(hdr,n)    ((slot_hdr_t*)((uint8_t*)(hdr) + HDR_SIZE + ((n) % SHM_MAX_SLOT) * SLOT_SIZE))
+
+#define READER_SIZE    ROUND_UP(sizeof(shm_reader_hdr_t))
+
+//
+// typedefs
+//
+
+typedef struct {
+    uint64_t       magic;           // set last by get_data, when the header is initialized
+    uint32_t       version;
+    int32_t        pid;             // of get_data, 0 when it has stopped
+    uint64_t       size;            // of the shared memory, which depends on the build
+    uint32_t       futex;           // incremented when a record or update is published
+    uint32_t       reserved;
+    uint64_t       head;            // records published, record n is in slot n % SHM_MAX_SLOT
+    uint64_t       publish_us;      // real time of the last publish
+    uint32_t       update_lock;     // seqlock for update, odd while it is written
+    uint32_t       reserved2;
+    uint64_t       update_count;
+    proto_update_t update;
+} shm_hdr_t;
+
+// the readers map shm_hdr_t and the slots read-only; this, in the separate object 
+// SHM_READER_NAME, is the only memory they write
+typedef struct {
+    uint64_t       reader_us;       // real time of the last read
+} shm_reader_hdr_t;
+
+typedef struct {
+    uint32_t       lock;            // seqlock, odd while the slot is written
+    uint32_t       len;             // of data
+    uint64_t       record;          // record number
+    uint64_t       time;
+    uint64_t       reserved;
+    data_t         data;            // part2 is variable length
+} slot_hdr_t;
+
+struct shm_reader_s {
+    shm_hdr_t    * hdr;
+    shm_reader_hdr_t * reader_hdr;  // NULL if SHM_READER_NAME could not be mapped
+    uint64_t       next;            // the next record to read
+    uint64_t       update_count;    // of the last update read
+    bool           backfill;        // report when the reader catches up
+};
+
+//
+// variables
+//
+
+static shm_hdr_t        * g_hdr;
+static shm_reader_hdr_t * g_reader_hdr;
+
+//
+// prototypes
+//
+
+static void shm_wake(shm_hdr_t * hdr);
+static bool shm_writer_alive(shm_hdr_t * hdr);
+
+// -----------------  WRITING  -------------------------------------------------------
+
+int32_t shm_start(void)
+{
+    shm_hdr_t        * hdr;
+    shm_reader_hdr_t * reader_hdr;
+    int32_t            fd;
+
+    // create the shared memory objects, replacing those left by a prior get_data
+    // that did not exit cleanly; readers of the old object see that it is stale;
+    // only get_data writes the records, the readers write only the reader object
+    shm_unlink(SHM_NAME);
+    shm_unlink(SHM_READER_NAME);
+    fd = shm_open(SHM_NAME, O_CREAT|O_EXCL|O_RDWR, 0644);
+    if (fd < 0) {
+        ERROR("shm_open %s, %s\n", SHM_NAME, strerror(errno));
+        return -1;
+    }
+    if (ftruncate(fd, SHM_SIZE) < 0) {
+        ERROR("ftruncate %s, %s\n", SHM_NAME, strerror(errno));
+        close(fd);
+        shm_unlink(SHM_NAME);
+        return -1;
+    }
+    hdr = mmap(NULL, SHM_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        ERROR("mmap %s, %s\n", SHM_NAME, strerror(errno));
+        shm_unlink(SHM_NAME);
+        return -1;
+    }
+
+    // the reader object is writeable by all, so that a display program run by
+    // any user can tell get_data that it is reading
+    reader_hdr = MAP_FAILED;
+    fd = shm_open(SHM_READER_NAME, O_CREAT|O_EXCL|O_RDWR, 0666);
+    if (fd >= 0) {
+        fchmod(fd, 0666);
+        if (ftruncate(fd, READER_SIZE) == 0) {
+            reader_hdr = mmap(NULL, READER_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+    }
+    if (reader_hdr == MAP_FAILED) {
+        ERROR("create %s, %s\n", SHM_READER_NAME, strerror(errno));
+        shm_unlink(SHM_READER_NAME);
+        munmap(hdr, SHM_SIZE);
+        shm_unlink(SHM_NAME);
+        return -1;
+    }
+
+    // init the header, the magic is set last
+    hdr->version = SHM_VERSION;
+    hdr->pid = getpid();
+    hdr->size = SHM_SIZE;
+    hdr->publish_us = get_real_time_us();
+    __atomic_store_n(&hdr->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+    INFO("publishing to shared memory %s, %d slots, %"PRId64" MB\n", 
+         SHM_NAME, SHM_MAX_SLOT, (int64_t)SHM_SIZE/(1024*1024));
+    g_hdr = hdr;
+    g_reader_hdr = reader_hdr;
+    return 0;
+}
+
+// called once per second by get_data's aggregate_thread
+void shm_publish_record(data_t * data, int32_t len)
+{
+    slot_hdr_t * slot;
+    uint64_t     n;
+
+    if (g_hdr == NULL) {
+        return;
+    }
+
+    // write the record to the next slot while its lock is odd, readers retry
+    // or skip the slot when they see it odd, or changed
+    n = g_hdr->head;
+    slot = SLOT(g_hdr, n);
+    __atomic_store_n(&slot->lock, slot->lock+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->len = len;
+    slot->record = n;
+    slot->time = data->part1.time;
+    memcpy(&slot->data, data, len);
+    __atomic_store_n(&slot->lock, slot->lock+1, __ATOMIC_RELEASE);
+
+    // publish it, and wake the readers
+    __atomic_store_n(&g_hdr->head, n+1, __ATOMIC_RELEASE);
+    __atomic_store_n(&g_hdr->publish_us, get_real_time_us(), __ATOMIC_RELAXED);
+    shm_wake(g_hdr);
+}
+
+// called by get_data's event loop
+void shm_publish_update(proto_update_t * u)
+{
+    if (g_hdr == NULL) {
+        return;
+    }
+
+    // replace the update while update_lock is odd
+    __atomic_store_n(&g_hdr->update_lock, g_hdr->update_lock+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    g_hdr->update = *u;
+    g_hdr->update_count++;
+    __atomic_store_n(&g_hdr->update_lock, g_hdr->update_lock+1, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&g_hdr->publish_us, get_real_time_us(), __ATOMIC_RELAXED);
+    shm_wake(g_hdr);
+}
+
+// returns true if a reader has read recently, so get_data builds the updates
+bool shm_reader_active(void)
+{
+    return g_reader_hdr != NULL && 
+           get_real_time_us() - __atomic_load_n(&g_reader_hdr->reader_us, __ATOMIC_RELAXED) < STALE_US;
+}
+
+void shm_stop(void)
+{
+    if (g_hdr == NULL) {
+        return;
+    }
+
+    // tell the readers that get_data has stopped, and remove the name; the
+    // memory is freed when the readers unmap it
+    __atomic_store_n(&g_hdr->pid, 0, __ATOMIC_RELEASE);
+    shm_wake(g_hdr);
+    shm_unlink(SHM_NAME);
+    shm_unlink(SHM_READER_NAME);
+    munmap(g_hdr, SHM_SIZE);
+    munmap(g_reader_hdr, READER_SIZE);
+    g_hdr = NULL;
+    g_reader_hdr = NULL;
+}
+
+static void shm_wake(shm_hdr_t * hdr)
+{
+    __atomic_fetch_add(&hdr->futex, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &hdr->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// -----------------  READING  -------------------------------------------------------
+
+// returns NULL if get_data's shared memory does not exist, is from a different 
+// build, or is not current
+shm_reader_t * shm_open_reader(void)
+{
+    shm_reader_t * r;
+    shm_hdr_t    * hdr;
+    struct stat    statbuf;
+    int32_t        fd;
+
+    // open and map the shared memory object read-only, and verify it
+    fd = shm_open(SHM_NAME, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &statbuf) < 0 || statbuf.st_size != SHM_SIZE) {
+        close(fd);
+        return NULL;
+    }
+    hdr = mmap(NULL, SHM_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        return NULL;
+    }
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+        hdr->version != SHM_VERSION ||
+        hdr->size != SHM_SIZE ||
+        !shm_writer_alive(hdr))
+    {
+        munmap(hdr, SHM_SIZE);
+        return NULL;
+    }
+
+    // start with the latest record
+    r = calloc(1, sizeof(shm_reader_t));
+    if (r == NULL) {
+        FATAL("calloc failed\n");
+    }
+    r->hdr = hdr;
+    r->update_count = hdr->update_count;
+    shm_seek(r, 0);
+
+    // map the reader object, which tells get_data that there is a reader; 
+    // without it the records are still read, but not the updates
+    r->reader_hdr = MAP_FAILED;
+    fd = shm_open(SHM_READER_NAME, O_RDWR, 0);
+    if (fd >= 0) {
+        if (fstat(fd, &statbuf) == 0 && statbuf.st_size == READER_SIZE) {
+            r->reader_hdr = mmap(NULL, READER_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+    }
+    if (r->reader_hdr == MAP_FAILED) {
+        WARN("map %s failed, updates will not be received\n", SHM_READER_NAME);
+        r->reader_hdr = NULL;
+    }
+    return r;
+}
+
+// positions the reader at the oldest record in the ring after last_time, 
+// or if last_time is 0 at the latest record; returns -1 if the ring no longer 
+// has the record for the second after last_time, the reader is then positioned
+// at the oldest record in the ring
+int32_t shm_seek(shm_reader_t * r, uint64_t last_time)
+{
+    uint64_t head, n;
+
+    head = __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+    if (last_time == 0) {
+        r->next = (head > 0 ? head - 1 : 0);
+        r->backfill = false;
+        return 0;
+    }
+
+    // the slot of record head-SHM_MAX_SLOT may be being written, so it is not used;
+    // the times read here are only used to choose the starting record, the 
+    // records are verified when they are read
+    n = (head > SHM_MAX_SLOT - 1 ? head - (SHM_MAX_SLOT - 1) : 0);
+    r->next = n;
+    r->backfill = true;
+    if (n > 0 && n < head && SLOT(r->hdr, n)->time > last_time + 1) {
+        return -1;
+    }
+    for (; n < head; n++) {
+        if (SLOT(r->hdr, n)->time > last_time) {
+            break;
+        }
+    }
+    r->next = n;
+    return 0;
+}
+
+// waits for the next record or update; returns SHM_READ_xxx, or -1 if get_data
+// has stopped publishing
+int32_t shm_read(shm_reader_t * r, data_t * data, proto_update_t * u)
+{
+    shm_hdr_t      * hdr = r->hdr;
+    slot_hdr_t     * slot;
+    struct timespec  ts;
+    uint32_t         futex, lock, len;
+    uint64_t         head, update_count;
+
+    while (true) {
+        // tell get_data that there is a reader
+        futex = __atomic_load_n(&hdr->futex, __ATOMIC_ACQUIRE);
+        if (r->reader_hdr) {
+            __atomic_store_n(&r->reader_hdr->reader_us, get_real_time_us(), __ATOMIC_RELAXED);
+        }
+
+        // if there is a record to read then copy it from its slot; if this reader 
+        // has fallen behind by more than the ring, or get_data overwrote the slot 
+        // while it was copied, then skip ahead
+        head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+        if (r->next < head) {
+            if (head - r->next > SHM_MAX_SLOT - 1) {
+                WARN("shared memory reader skipped %"PRId64" records\n", head - (SHM_MAX_SLOT - 1) - r->next);
+                r->next = head - (SHM_MAX_SLOT - 1);
+            }
+            slot = SLOT(hdr, r->next);
+            lock = __atomic_load_n(&slot->lock, __ATOMIC_ACQUIRE);
+            len = slot->len;
+            if ((lock & 1) || slot->record != r->next || len < sizeof(struct data_part1_s) || len > SLOT_DATA_SIZE) {
+                continue;
+            }
+            memcpy(data, &slot->data, len);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot->lock, __ATOMIC_RELAXED) != lock) {
+                continue;
+            }
+            r->next++;
+            return SHM_READ_RECORD;
+        }
+
+        // if this reader was backfilling then it has caught up
+        if (r->backfill) {
+            r->backfill = false;
+            return SHM_READ_BACKFILL_DONE;
+        }
+
+        // if there is a new update then copy it
+        update_count = __atomic_load_n(&hdr->update_count, __ATOMIC_RELAXED);
+        if (update_count != r->update_count) {
+            do {
+                while ((lock = __atomic_load_n(&hdr->update_lock, __ATOMIC_ACQUIRE)) & 1) {
+                    sched_yield();
+                }
+                update_count = hdr->update_count;
+                *u = hdr->update;
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            } while (__atomic_load_n(&hdr->update_lock, __ATOMIC_RELAXED) != lock);
+            r->update_count = update_count;
+            return SHM_READ_UPDATE;
+        }
+
+        // if get_data has stopped publishing then return error
+        if (!shm_writer_alive(hdr)) {
+            ERROR("get_data has stopped publishing to shared memory\n");
+            return -1;
+        }
+
+        // wait for get_data to publish
+        ts.tv_sec  = WAIT_MS / 1000;
+        ts.tv_nsec = (WAIT_MS % 1000) * 1000000;
+        syscall(SYS_futex, &hdr->futex, FUTEX_WAIT, futex, &ts, NULL, 0);
+    }
+}
+
+void shm_close_reader(shm_reader_t * r)
+{
+    munmap(r->hdr, SHM_SIZE);
+    if (r->reader_hdr) {
+        munmap(r->reader_hdr, READER_SIZE);
+    }
+    free(r);
+}
+
+static bool shm_writer_alive(shm_hdr_t * hdr)
+{
+    int32_t pid = __atomic_load_n(&hdr->pid, __ATOMIC_ACQUIRE);
+
+    return pid != 0 &&
+           (kill(pid, 0) == 0 || errno == EPERM) &&
+           get_real_time_us() - __atomic_load_n(&hdr->publish_us, __ATOMIC_RELAXED) < STALE_US;
+}
@@ -0,0 +1,75 @@
+/*
+Copyright (c) 2016 Steven Haid
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef __UTIL_SHM_H__
+#define __UTIL_SHM_H__
+
+// Shared memory transport, used instead of the TCP connection when get_data and 
+// the display program run on the same computer.
+//
+// get_data creates the POSIX shared memory object SHM_NAME, which contains a 
+// header and a ring of SHM_MAX_SLOT slots. Each second's data_t is written to
+// the next slot, and the latest partial update (see util_proto.h) to the header.
+// The slots and the update are each protected by a seqlock, so get_data never
+// waits for a reader; a reader that is overtaken while reading a slot sees the
+// seqlock change, and retries or skips ahead. Readers wait on a futex in the 
+// header, which get_data increments and wakes on each publish.
+//
+// The display program uses shared memory when the get_data server's address 
+// is local, and get_data's shared memory object exists and is current; 
+// otherwise, and if get_data stops publishing, it uses TCP. The ring also 
+// serves as the backfill after the display program reconnects, for up to 
+// SHM_MAX_SLOT-1 seconds; a longer backfill is over TCP, from get_data's
+// history, after which the display program switches to shared memory.
+//
+// Only get_data writes SHM_NAME, the readers map it read-only. The readers 
+// record that they are reading in the small SHM_READER_NAME object, which 
+// get_data checks to decide whether to build the partial updates.
+
+#define SHM_NAME         "/fusor_get_data"
+#define SHM_READER_NAME  "/fusor_get_data_reader"
+#define SHM_MAX_SLOT     16
+
+// shm_read return values; the display program's tcp_read returns the same values
+#define SHM_READ_RECORD         1
+#define SHM_READ_UPDATE         2
+#define SHM_READ_BACKFILL_DONE  3
+
+// -----------------  WRITING  -------------------------------------------------------
+
+int32_t shm_start(void);
+void shm_publish_record(data_t * data, int32_t len);
+void shm_publish_update(proto_update_t * u);
+bool shm_reader_active(void);
+void shm_stop(void);
+
+// -----------------  READING  -------------------------------------------------------
+
+typedef struct shm_reader_s shm_reader_t;
+
+shm_reader_t * shm_open_reader(void);
+int32_t shm_seek(shm_reader_t * r, uint64_t last_time);
+int32_t shm_read(shm_reader_t * r, data_t * data, proto_update_t * u);
+void shm_close_reader(shm_reader_t * r);
+
+#endif